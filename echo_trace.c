@@ -0,0 +1,154 @@
+/**
+ * @file echo_trace.c
+ * @brief Keystroke-to-echo latency tracing, shared by the server's relay and the client
+ *
+ * With tracing off every call is a single test of the enabled flag; with it
+ * on a probe costs one clock_gettime() per stage.
+ */
+
+#include "echo_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+static const char *stage_names[ECHO_STAGES] = { "inbound", "turnaround", "outbound", "total" };
+
+static uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static void drop_probe(EchoTrace *trace) {
+    trace->arrived = trace->forwarded = trace->answered = 0;
+}
+
+void echo_trace_start(EchoTrace *trace, const int enabled) {
+    memset(trace, 0, sizeof(*trace));
+    trace->enabled = enabled;
+}
+
+void echo_trace_input(EchoTrace *trace) {
+    if (!trace->enabled) {
+        return;
+    }
+    const uint64_t now = now_ns();
+    if (trace->arrived != 0 && trace->answered == 0 && now - trace->arrived > ECHO_TRACE_TIMEOUT) {
+        trace->unanswered++;    // the shell did not echo, e.g. a password prompt
+        drop_probe(trace);
+    }
+    if (trace->arrived == 0) {
+        trace->arrived = now;
+    }
+}
+
+void echo_trace_forwarded(EchoTrace *trace) {
+    if (trace->enabled && trace->arrived != 0 && trace->forwarded == 0) {
+        trace->forwarded = now_ns();
+    }
+}
+
+void echo_trace_answered(EchoTrace *trace) {
+    if (!trace->enabled || trace->forwarded == 0 || trace->answered != 0) {
+        return;
+    }
+    const uint64_t now = now_ns();
+    if (now - trace->forwarded > ECHO_TRACE_TIMEOUT) {
+        trace->unanswered++;    // output of something else, long after
+        drop_probe(trace);
+        return;
+    }
+    trace->answered = now;
+}
+
+static int bucket_of(const uint64_t nanoseconds) {
+    const uint64_t microseconds = nanoseconds / 1000;
+    int bucket = 0;
+    while (bucket < ECHO_TRACE_BUCKETS - 1 && microseconds > (1ull << bucket)) {
+        bucket++;
+    }
+    return bucket;
+}
+
+int echo_trace_delivered(EchoTrace *trace, uint64_t *stages) {
+    if (!trace->enabled || trace->answered == 0) {
+        return 0;
+    }
+    const uint64_t now = now_ns();
+    const uint64_t durations[ECHO_STAGES] = {
+        [ECHO_STAGE_INBOUND] = trace->forwarded - trace->arrived,
+        [ECHO_STAGE_TURNAROUND] = trace->answered - trace->forwarded,
+        [ECHO_STAGE_OUTBOUND] = now - trace->answered,
+        [ECHO_STAGE_TOTAL] = now - trace->arrived,
+    };
+    for (int stage = 0; stage < ECHO_STAGES; stage++) {
+        trace->sums[stage] += durations[stage];
+        trace->buckets[stage][bucket_of(durations[stage])]++;
+        if (stages != NULL) {
+            stages[stage] = durations[stage];
+        }
+    }
+    trace->echoes++;
+    drop_probe(trace);
+    return 1;
+}
+
+uint64_t echo_trace_percentile(const EchoTrace *trace, const EchoStage stage, const double fraction) {
+    if (trace->echoes == 0) {
+        return 0;
+    }
+    const double wanted = fraction * (double)trace->echoes;
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < ECHO_TRACE_BUCKETS; bucket++) {
+        seen += trace->buckets[stage][bucket];
+        if ((double)seen >= wanted) {
+            return 1ull << bucket;
+        }
+    }
+    return 1ull << (ECHO_TRACE_BUCKETS - 1);
+}
+
+int echo_trace_export(const EchoTrace *trace, const char *path, const char *side, const char *session) {
+    char *line = NULL;
+    size_t length;
+    FILE *out = open_memstream(&line, &length);
+    if (out == NULL) {
+        return -1;
+    }
+
+    fprintf(out, "{\"side\":\"%s\",\"pid\":%d,\"session\":\"%.16s\",\"time\":%ld,\"echoes\":%llu,\"unanswered\":%llu,\"bucket_us\":[",
+            side, (int)getpid(), session, (long)time(NULL),
+            (unsigned long long)trace->echoes, (unsigned long long)trace->unanswered);
+    for (int bucket = 0; bucket < ECHO_TRACE_BUCKETS - 1; bucket++) {
+        fprintf(out, "%llu,", 1ull << bucket);
+    }
+    fprintf(out, "null]");  // the last bucket has no upper bound
+    for (int stage = 0; stage < ECHO_STAGES; stage++) {
+        fprintf(out, ",\"%s\":{\"sum_us\":%llu,\"buckets\":[", stage_names[stage], (unsigned long long)(trace->sums[stage] / 1000));
+        for (int bucket = 0; bucket < ECHO_TRACE_BUCKETS; bucket++) {
+            fprintf(out, "%s%u", bucket > 0 ? "," : "", trace->buckets[stage][bucket]);
+        }
+        fprintf(out, "]}");
+    }
+    fprintf(out, "}\n");
+    if (fclose(out) != 0) {
+        free(line);
+        return -1;
+    }
+
+    /* one write to an O_APPEND file, so lines from several processes do not interleave */
+    const int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror(path);
+        free(line);
+        return -1;
+    }
+    const ssize_t written = write(fd, line, length);
+    close(fd);
+    free(line);
+    return written == (ssize_t)length ? 0 : -1;
+}
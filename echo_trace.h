@@ -0,0 +1,97 @@
+/**
+ * @file echo_trace.h
+ * @brief Keystroke-to-echo latency tracing, shared by the server's relay and the client
+ *
+ * A probe follows one chunk of keystrokes along a relay: when it arrives,
+ * when it has been passed on, when the first output comes back, and when
+ * that output has been passed back. Only one probe is in flight at a time;
+ * keys typed while it is waiting are relayed untraced. Each probe adds its
+ * stages to a histogram of log2 microsecond buckets.
+ *
+ * The stages mean different things on each side:
+ *
+ * - server: inbound is the keystroke waiting in the relay before the PTY
+ *   write, turnaround is the shell (and its scheduling) producing output,
+ *   outbound is that output queued, encoded and written to the socket.
+ * - client: inbound is the keystroke going from the terminal to the socket,
+ *   turnaround is the network both ways plus the whole server, outbound is
+ *   the output reaching the terminal.
+ *
+ * The client's turnaround less the server's total is the network's share.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef ECHO_TRACE_H
+#define ECHO_TRACE_H
+
+#include <stdint.h>
+
+#define ECHO_TRACE_BUCKETS 24                   // bucket i counts latencies up to 2^i microseconds, the last one the rest
+#define ECHO_TRACE_TIMEOUT 1000000000ull        // nanoseconds without an answer before a probe counts as unanswered
+
+typedef enum {
+    ECHO_STAGE_INBOUND,     // keystroke arrived -> passed on
+    ECHO_STAGE_TURNAROUND,  // passed on -> first output back
+    ECHO_STAGE_OUTBOUND,    // first output back -> passed back
+    ECHO_STAGE_TOTAL,       // keystroke arrived -> output passed back
+    ECHO_STAGES
+} EchoStage;
+
+/* The probe in flight and the histograms of one session; all zero when tracing is off */
+typedef struct {
+    int enabled;
+    uint64_t arrived;       // times of the probe in flight, 0 for a stage not reached
+    uint64_t forwarded;
+    uint64_t answered;
+    uint64_t echoes;        // probes completed
+    uint64_t unanswered;    // probes dropped after ECHO_TRACE_TIMEOUT without output
+    uint64_t sums[ECHO_STAGES];     // nanoseconds
+    uint32_t buckets[ECHO_STAGES][ECHO_TRACE_BUCKETS];
+} EchoTrace;
+
+/**
+ * @brief Clears a trace and turns it on or off.
+ */
+void echo_trace_start(EchoTrace *trace, int enabled);
+
+/**
+ * @brief Keystrokes arrived; starts a probe unless one is waiting for its answer.
+ */
+void echo_trace_input(EchoTrace *trace);
+
+/**
+ * @brief The probe's keystrokes have been passed on in full.
+ */
+void echo_trace_forwarded(EchoTrace *trace);
+
+/**
+ * @brief Output came back; the first after the keystrokes were passed on answers the probe.
+ */
+void echo_trace_answered(EchoTrace *trace);
+
+/**
+ * @brief The output has been passed back; completes an answered probe.
+ * @param stages Receives the nanoseconds of each stage when a probe completes; may be NULL.
+ * @return 1 if a probe completed, 0 otherwise.
+ */
+int echo_trace_delivered(EchoTrace *trace, uint64_t *stages);
+
+/**
+ * @brief The upper bound of the histogram bucket holding a percentile of a stage.
+ * @param fraction 0.5 for the median, 0.99 for p99.
+ * @return Microseconds, 0 if nothing was recorded.
+ */
+uint64_t echo_trace_percentile(const EchoTrace *trace, EchoStage stage, double fraction);
+
+/**
+ * @brief Appends a trace as one JSON line to a file, in a single write so several processes can share it.
+ * @param side "server" or "client".
+ * @param session The session's token, for matching up the two sides, or empty. Only its first 16 characters
+ *                are written: the owner's pid and enough of the random part to tell sessions apart.
+ * @return 0 on success, -1 if the file could not be written.
+ */
+int echo_trace_export(const EchoTrace *trace, const char *path, const char *side, const char *session);
+
+#endif // ECHO_TRACE_H
@@ -4,21 +4,71 @@
 #include "protocol.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <arpa/inet.h>  // For hton/ntoh functions
 
 
+// Encode a message into its wire format, returns the number of bytes written or -1
+int encode_message(const Message *msg, char *buffer, size_t buffer_size) {
+    const size_t total_size = MESSAGE_HEADER_SIZE + msg->content_length;
+    if (msg->content_length > MESSAGE_MAX_CONTENT || total_size > buffer_size) {
+        return -1;
+    }
+
+    const uint16_t length = htons(msg->content_length);
+    buffer[0] = (char)msg->status_code;
+    buffer[1] = (char)msg->control_code;
+    memcpy(buffer + 2, &length, sizeof(length));
+    memcpy(buffer + MESSAGE_HEADER_SIZE, msg->content, msg->content_length);
+    return (int)total_size;
+}
+
+// Decode one message from a byte stream.
+// Returns the number of bytes consumed, 0 if the message is still incomplete, or -1 if it is malformed
+int decode_message(const char *buffer, size_t length, Message *msg) {
+    if (length < MESSAGE_HEADER_SIZE) return 0;
+
+    uint16_t content_length;
+    memcpy(&content_length, buffer + 2, sizeof(content_length));
+    content_length = ntohs(content_length);
+    if (content_length > MESSAGE_MAX_CONTENT) return -1;
+    if (length < MESSAGE_HEADER_SIZE + (size_t)content_length) return 0;
+
+    msg->status_code = (ResponseCode)(unsigned char)buffer[0];
+    msg->control_code = (ControlCode)(unsigned char)buffer[1];
+    msg->content_length = content_length;
+    memcpy(msg->content, buffer + MESSAGE_HEADER_SIZE, content_length);
+    msg->content[content_length] = '\0';
+    return MESSAGE_HEADER_SIZE + content_length;
+}
+
+// Read exactly size bytes, returns 0 on success or -1 on error/EOF
+static int read_fully(int socket_fd, char *buffer, size_t size) {
+    size_t bytes_read = 0;
+
+    while (bytes_read < size) {
+        ssize_t result = read(socket_fd, buffer + bytes_read, size - bytes_read);
+        if (result < 0 && errno == EINTR) continue;
+        if (result <= 0) return -1;
+        bytes_read += result;
+    }
+    return 0;
+}
+
 // Send a message over a socket
 int send_message(int client_fd, const Message *msg) {
-    // Calculate the total size of the message
-    size_t total_size = sizeof(ResponseCode) + sizeof(uint16_t) + msg->content_length;
-    const char *data_ptr = (const char *)msg;
-    size_t bytes_sent = 0;
+    char wire[MESSAGE_MAX_WIRE_SIZE];
+    const int total_size = encode_message(msg, wire, sizeof(wire));
+    if (total_size < 0) return -1;
 
-    while (bytes_sent < total_size) {
-        ssize_t result = write(client_fd, data_ptr + bytes_sent, total_size - bytes_sent);
+    size_t bytes_sent = 0;
+    while (bytes_sent < (size_t)total_size) {
+        ssize_t result = write(client_fd, wire + bytes_sent, total_size - bytes_sent);
         if (result < 0) {
+            if (errno == EINTR) continue;
             perror("write to client_fd");
             return -1;  // Error occurred
         }
@@ -29,19 +79,138 @@ int send_message(int client_fd, const Message *msg) {
 
 // Receive a message from a socket
 int receive_message(int socket_fd, Message *msg) {
-    // Read the fixed-size part first (ResponseCode + content_length)
-    int header_size = sizeof(ResponseCode) + sizeof(uint16_t);
-    int nbytes = read(socket_fd, msg, header_size);
-    if (nbytes <= 0) return -1;  // Connection closed or error
+    char wire[MESSAGE_MAX_WIRE_SIZE];
+
+    // Read the fixed-size header first, it carries the content length
+    if (read_fully(socket_fd, wire, MESSAGE_HEADER_SIZE) < 0) return -1;  // Connection closed or error
+
+    uint16_t content_length;
+    memcpy(&content_length, wire + 2, sizeof(content_length));
+    content_length = ntohs(content_length);
+    if (content_length > MESSAGE_MAX_CONTENT) return -1;
 
     // Read the actual content if content_length is greater than 0
-    if (msg->content_length > 0 && msg->content_length <= sizeof(msg->content)) {
-        int content_bytes = read(socket_fd, msg->content, msg->content_length);
-        if (content_bytes <= 0) return -1;  // Connection closed or error
-        msg->content[content_bytes] = '\0'; // Null-terminate the content
-    } else {
-        msg->content[0] = '\0';  // Ensure content is null-terminated if no content
+    if (read_fully(socket_fd, wire + MESSAGE_HEADER_SIZE, content_length) < 0) return -1;
+
+    return decode_message(wire, MESSAGE_HEADER_SIZE + content_length, msg);  // Total bytes read
+}
+
+// Write a frame header for a payload of length bytes (at most FRAME_MAX_PAYLOAD)
+void encode_frame_header(char *header, ResponseCode type, ControlCode control_code, size_t length) {
+    const uint16_t wire_length = htons((uint16_t)length);
+    header[0] = (char)type;
+    header[1] = (char)control_code;
+    memcpy(header + 2, &wire_length, sizeof(wire_length));
+}
+
+// Decode one relay frame from a byte stream, without copying its payload.
+// Returns the number of bytes consumed, 0 if the frame is still incomplete, or -1 if it is too long
+int decode_frame(const char *buffer, size_t length, Frame *frame) {
+    if (length < MESSAGE_HEADER_SIZE) return 0;
+
+    uint16_t payload_length;
+    memcpy(&payload_length, buffer + 2, sizeof(payload_length));
+    payload_length = ntohs(payload_length);
+    if (payload_length > FRAME_MAX_PAYLOAD) return -1;
+    if (length < MESSAGE_HEADER_SIZE + (size_t)payload_length) return 0;
+
+    frame->type = (ResponseCode)(unsigned char)buffer[0];
+    frame->control_code = (ControlCode)(unsigned char)buffer[1];
+    frame->length = payload_length;
+    frame->payload = buffer + MESSAGE_HEADER_SIZE;
+    return MESSAGE_HEADER_SIZE + payload_length;
+}
+
+// Content of an ESCAPE_CODE_WINDOW_SIZE control frame (WINDOW_SIZE_LENGTH bytes)
+void encode_window_size(char *content, unsigned short rows, unsigned short columns) {
+    const uint16_t wire[2] = { htons(rows), htons(columns) };
+    memcpy(content, wire, sizeof(wire));
+}
+
+// Returns 0 and the size from an ESCAPE_CODE_WINDOW_SIZE frame, -1 if its content is malformed
+int decode_window_size(const Frame *frame, unsigned short *rows, unsigned short *columns) {
+    uint16_t wire[2];
+    if (frame->length != WINDOW_SIZE_LENGTH) return -1;
+    memcpy(wire, frame->payload, sizeof(wire));
+    *rows = ntohs(wire[0]);
+    *columns = ntohs(wire[1]);
+    return 0;
+}
+
+// Content of a CHANNEL_WINDOW frame (CHANNEL_CREDIT_LENGTH bytes)
+void encode_channel_credit(char *content, uint32_t credit) {
+    const uint32_t wire = htonl(credit);
+    memcpy(content, &wire, sizeof(wire));
+}
+
+// Returns 0 and the credit from a CHANNEL_WINDOW frame, -1 if its content is malformed
+int decode_channel_credit(const Frame *frame, uint32_t *credit) {
+    uint32_t wire;
+    if (frame->length != CHANNEL_CREDIT_LENGTH) return -1;
+    memcpy(&wire, frame->payload, sizeof(wire));
+    *credit = ntohl(wire);
+    return 0;
+}
+
+// Fills msg with an AUTH_REQUEST, returns 0 or -1 if the request does not fit
+int encode_auth_request(const AuthRequest *request, Message *msg) {
+    char settings[MESSAGE_MAX_CONTENT + 1];
+    int length = 0;
+
+    if (request->rows > 0 && request->columns > 0) {
+        length += snprintf(settings + length, sizeof(settings) - length, "rows=%hu", request->rows) + 1;
+        length += snprintf(settings + length, sizeof(settings) - length, "cols=%hu", request->columns) + 1;
     }
+    if (request->term[0] != '\0') {
+        length += snprintf(settings + length, sizeof(settings) - length, "term=%s", request->term) + 1;
+    }
+
+    const size_t username_length = strlen(request->username) + 1;
+    const size_t password_length = strlen(request->password) + 1;
+    if (username_length > AUTH_FIELD_MAX || password_length > AUTH_FIELD_MAX ||
+        username_length + password_length + length > MESSAGE_MAX_CONTENT) {
+        return -1;
+    }
+    msg->status_code = AUTH_REQUEST;
+    msg->control_code = ESCAPE_CODE_NONE;
+    memcpy(msg->content, request->username, username_length);
+    memcpy(msg->content + username_length, request->password, password_length);
+    memcpy(msg->content + username_length + password_length, settings, length);
+    msg->content_length = username_length + password_length + length;
+    msg->content[msg->content_length] = '\0';
+    return 0;
+}
+
+// Copies the NUL-terminated field at content[*offset] and moves past it, returns 0 or -1 if it is missing or too long
+static int next_auth_field(const Message *msg, size_t *offset, char *field, size_t field_size) {
+    if (*offset >= msg->content_length) return -1;
+    const char *start = msg->content + *offset;
+    const char *end = memchr(start, '\0', msg->content_length - *offset);
+    if (end == NULL || (size_t)(end - start) >= field_size) return -1;
+    memcpy(field, start, end - start + 1);
+    *offset += end - start + 1;
+    return 0;
+}
 
-    return nbytes + msg->content_length;  // Total bytes read
-}
\ No newline at end of file
+// Returns 0 and the login from an AUTH_REQUEST, -1 if its content is malformed; unknown settings are skipped
+int decode_auth_request(const Message *msg, AuthRequest *request) {
+    size_t offset = 0;
+    char setting[sizeof("term=") - 1 + AUTH_FIELD_MAX];    // the longest setting there is: a full term
+
+    memset(request, 0, sizeof(*request));
+    if (next_auth_field(msg, &offset, request->username, sizeof(request->username)) == -1 ||
+        next_auth_field(msg, &offset, request->password, sizeof(request->password)) == -1) {
+        return -1;
+    }
+    while (offset < msg->content_length) {
+        if (next_auth_field(msg, &offset, setting, sizeof(setting)) == -1) return -1;
+        if (strncmp(setting, "rows=", 5) == 0) {
+            request->rows = (unsigned short)atoi(setting + 5);
+        } else if (strncmp(setting, "cols=", 5) == 0) {
+            request->columns = (unsigned short)atoi(setting + 5);
+        } else if (strncmp(setting, "term=", 5) == 0) {
+            snprintf(request->term, sizeof(request->term), "%s", setting + 5);
+        }
+    }
+    return 0;
+}
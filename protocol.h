@@ -18,6 +18,21 @@ typedef enum {
     COMMAND_SUCCESS,            // Command executed successfully
     COMMAND_FAIL,               // Command execution failed
     MESSAGE_TOO_LONG,           // Message content too long
+    SESSION_TOKEN,              // Token for resuming this session, empty if it cannot be resumed
+    SESSION_RESUME,             // Sent instead of a username: resume the session with this token
+    SESSION_RESUMED,            // Reattached to the session, data relay continues
+    SESSION_RESUME_FAIL,        // No detached session has that token
+    COMPRESS_REQUEST,           // Sent before the username or SESSION_RESUME: codecs the client can decode
+    COMPRESS_START,             // The codec the server's output uses from here on, empty for none
+    RELAY_FRAMED,               // Sent before the username or SESSION_RESUME, and confirmed: the relay uses frames
+    RELAY_DATA,                 // Framed relay: terminal bytes
+    RELAY_CONTROL,              // Framed relay: the control code says what, see protocol.md
+    CHANNEL_OPEN,               // Channels: open the channel in the control byte; confirmed by the server
+    CHANNEL_SELECT,             // Channels: the frames that follow belong to the channel in the control byte
+    CHANNEL_WINDOW,             // Channels: the client takes this many more bytes of the channel's output
+    CHANNEL_CLOSE,              // Channels: the channel has ended, or the client asks to end it
+    AUTH_REQUEST,               // Sent instead of the username: username, password and terminal in one message
+    SCROLLBACK_REQUEST,         // Sent before SESSION_RESUME: replay the session's recent output first
 } ResponseCode;
 
 typedef enum {
@@ -28,7 +43,10 @@ typedef enum {
     ESCAPE_CODE_RIGHT_ARROW,
     ESCAPE_CODE_CTRL_C,
     ESCAPE_CODE_CTRL_D,
-    ESCAPE_CODE_CTRL_Z
+    ESCAPE_CODE_CTRL_Z,
+    ESCAPE_CODE_WINDOW_SIZE,    // content: rows and columns, 2 bytes each, big-endian
+    ESCAPE_CODE_KEEPALIVE,      // answered with a keepalive
+    ESCAPE_CODE_NOTICE          // server to client: content is a line for the user, such as a timeout warning
 } ControlCode;
 
 // Message structure for encapsulating message details
@@ -45,9 +63,55 @@ typedef struct {
     char content[512];          // Message content
 } Message;
 
+// Wire header: status code (1 byte), control code (1 byte), content length (2 bytes, big-endian)
+#define MESSAGE_HEADER_SIZE 4
+#define MESSAGE_MAX_CONTENT (sizeof(((Message *)0)->content) - 1)
+#define MESSAGE_MAX_WIRE_SIZE (MESSAGE_HEADER_SIZE + MESSAGE_MAX_CONTENT)
+
+// Relay frames share the message header; a data frame's payload may be longer than a message's content
+#define FRAME_MAX_PAYLOAD 4096
+#define FRAME_MAX_WIRE_SIZE (MESSAGE_HEADER_SIZE + FRAME_MAX_PAYLOAD)
+#define WINDOW_SIZE_LENGTH 4
+
+// Channels: several shells over one framed connection, numbered in the control byte; 0 is the login shell
+#define RELAY_CHANNELS "channels"       // RELAY_FRAMED content that asks for, and confirms, channels
+#define CHANNEL_MAX 8
+#define CHANNEL_WINDOW_SIZE 65536       // output of a channel the server sends before the client grants more
+#define CHANNEL_CREDIT_LENGTH 4
+
+// AUTH_REQUEST content: the username, the password, then optional key=value settings, each ending in a NUL
+#define AUTH_FIELD_MAX 64
+
+// The login a client sends in one message, so the server need not prompt for it
+typedef struct {
+    char username[AUTH_FIELD_MAX];
+    char password[AUTH_FIELD_MAX];
+    unsigned short rows;        // terminal size, both 0 if not given
+    unsigned short columns;
+    char term[AUTH_FIELD_MAX];  // the client's TERM, empty if not given
+} AuthRequest;
+
+// A relay frame decoded in place, its payload points into the decoded buffer
+typedef struct {
+    ResponseCode type;          // RELAY_DATA, RELAY_CONTROL, or a message such as the server's last words
+    ControlCode control_code;
+    uint16_t length;
+    const char *payload;
+} Frame;
+
 
 // Function prototypes for encoding, decoding, sending, and receiving messages
+int encode_message(const Message *msg, char *buffer, size_t buffer_size);
+int decode_message(const char *buffer, size_t length, Message *msg);
 int send_message(int client_fd, const Message *msg);
 int receive_message(int socket_fd, Message *msg);
+void encode_frame_header(char *header, ResponseCode type, ControlCode control_code, size_t length);
+int decode_frame(const char *buffer, size_t length, Frame *frame);
+void encode_window_size(char *content, unsigned short rows, unsigned short columns);
+int decode_window_size(const Frame *frame, unsigned short *rows, unsigned short *columns);
+void encode_channel_credit(char *content, uint32_t credit);
+int decode_channel_credit(const Frame *frame, uint32_t *credit);
+int encode_auth_request(const AuthRequest *request, Message *msg);
+int decode_auth_request(const Message *msg, AuthRequest *request);
 
-#endif // PROTOCOL_H
\ No newline at end of file
+#endif // PROTOCOL_H
@@ -0,0 +1,262 @@
+/**
+ * @file admission.c
+ * @brief Admission control: connection rates per source and per user, caps on connections and sessions
+ *
+ * The caps are atomic counters. The token buckets sit in two small hash
+ * tables behind a spinlock that is held for a few dozen instructions per
+ * check. A key is looked up in a short run of slots; when it is not there
+ * it takes the slot of the run refilled longest ago, which is normally one
+ * whose bucket is full again anyway, so forgetting it changes nothing.
+ *
+ * A connection's slot holds what it is counted as and a use number, which
+ * goes up each time the slot is taken. Changes are compare-and-swaps that
+ * check the use number, so a late release of a slot already taken again
+ * by another connection does nothing.
+ */
+
+#include "admission.h"
+#include "server.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#define SOURCE_SLOTS 1024
+#define USER_SLOTS 256
+#define PROBE_LENGTH 8      // slots a key may occupy, from its hash on
+
+#define HELD_PREAUTH 1u     // a connection slot's bits: counted as not logged in yet,
+#define HELD_SESSION 2u     // counted as a session,
+#define HELD_TAKEN   4u     // and in use; the bits above are its use number
+#define HELD_USE_SHIFT 3
+
+typedef struct {
+    uint64_t key;       // 0 for a slot never used
+    double tokens;
+    uint64_t refilled;  // metrics_now() when tokens was last brought up to date
+} Bucket;
+
+typedef struct {
+    atomic_int preauth;
+    atomic_int sessions;
+    atomic_flag lock;   // guards the buckets
+    Bucket sources[SOURCE_SLOTS];
+    Bucket users[USER_SLOTS];
+    atomic_uint next_slot;              // where the search for a free connection slot starts
+    atomic_uint held[ADMISSION_SLOTS];  // what each connection holds
+} SharedAdmission;
+
+static SharedAdmission *admission = NULL;
+
+int admission_init() {
+    void *shared = mmap(NULL, sizeof(SharedAdmission), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap admission");
+        return -1;
+    }
+    admission = shared;     // zeroed: no claims, lock clear, empty tables
+    return 0;
+}
+
+int admission_parse_rate(const char *text, RateLimit *limit) {
+    char *end;
+    limit->rate = strtod(text, &end);
+    limit->burst = 2 * limit->rate;
+    if (*end == ':') {
+        limit->burst = strtod(end + 1, &end);
+    }
+    if (end == text || *end != '\0' || limit->rate < 0 || limit->burst < 0 ||
+        (limit->rate > 0 && limit->burst < 1)) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Checks that the bucket of a key has a token, and takes it if asked to.
+ * @param take Nonzero to take the token, 0 to only look.
+ * @return 0 if there was one, -1 if the key is over its rate.
+ */
+static int take_token(Bucket *table, const size_t slots, const uint64_t key, const RateLimit *limit, const int take) {
+    if (limit->rate <= 0) {
+        return 0;
+    }
+
+    const uint64_t now = metrics_now();
+    const size_t start = (key * 11400714819323198485ull) % slots;
+    while (atomic_flag_test_and_set_explicit(&admission->lock, memory_order_acquire)) {}
+
+    Bucket *bucket = NULL;
+    Bucket *oldest = &table[start];
+    for (size_t i = 0; i < PROBE_LENGTH && bucket == NULL; i++) {
+        Bucket *slot = &table[(start + i) % slots];
+        if (slot->key == key) {
+            bucket = slot;
+        } else if (slot->refilled < oldest->refilled) {
+            oldest = slot;
+        }
+    }
+    if (bucket == NULL) {
+        bucket = oldest;
+        bucket->key = key;
+        bucket->tokens = limit->burst;
+        bucket->refilled = now;
+    }
+
+    bucket->tokens += (double)(now - bucket->refilled) / 1e9 * limit->rate;
+    if (bucket->tokens > limit->burst) {
+        bucket->tokens = limit->burst;
+    }
+    bucket->refilled = now;
+    const int allowed = bucket->tokens >= 1;
+    if (allowed && take) {
+        bucket->tokens -= 1;
+    }
+
+    atomic_flag_clear_explicit(&admission->lock, memory_order_release);
+    return allowed ? 0 : -1;
+}
+
+/**
+ * @brief Counts one more against a cap.
+ * @return 0 if it was under the cap (0 for no cap), -1 if it is reached.
+ */
+static int claim(atomic_int *count, const int cap) {
+    int current = atomic_load(count);
+    while (cap <= 0 || current < cap) {
+        if (atomic_compare_exchange_weak(count, &current, current + 1)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Takes a free connection slot for a new connection.
+ * @return 0 on success, -1 if every slot is in use.
+ */
+static int take_slot(Admission *claims) {
+    for (unsigned tries = 0; tries < ADMISSION_SLOTS; tries++) {
+        const unsigned slot = atomic_fetch_add(&admission->next_slot, 1) % ADMISSION_SLOTS;
+        unsigned held = atomic_load(&admission->held[slot]);
+        if (held & HELD_TAKEN) {
+            continue;
+        }
+        const unsigned use = (held >> HELD_USE_SHIFT) + 1;
+        if (atomic_compare_exchange_strong(&admission->held[slot], &held, use << HELD_USE_SHIFT | HELD_TAKEN)) {
+            claims->slot = (int)slot;
+            claims->use = use;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Sets or clears what a connection's slot says it holds.
+ * @return What the slot held before, 0 if it is no longer this connection's.
+ */
+static unsigned change_slot(const Admission *claims, const unsigned set, const unsigned clear) {
+    atomic_uint *slot = &admission->held[claims->slot];
+    unsigned held = atomic_load(slot);
+    do {
+        if (!(held & HELD_TAKEN) || held >> HELD_USE_SHIFT != claims->use) {
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak(slot, &held, (held | set) & ~clear));
+    return held;
+}
+
+const char *admission_accept(Admission *claims, const uint32_t address) {
+    claims->slot = -1;
+    if (admission == NULL) {
+        return NULL;
+    }
+    /* the high bit keeps address 0.0.0.0 from looking like an empty slot */
+    if (take_token(admission->sources, SOURCE_SLOTS, (1ull << 32) | address, &server_config.source_limit, 1) == -1) {
+        metrics_add(METRIC_REJECTED_SOURCE_RATE, 1);
+        return "Too many connections from your address, try again later.";
+    }
+    if (take_slot(claims) == -1 || claim(&admission->preauth, server_config.max_preauth) == -1) {
+        admission_release(claims);
+        metrics_add(METRIC_REJECTED_PREAUTH, 1);
+        return "Too many connections are logging in, try again later.";
+    }
+    change_slot(claims, HELD_PREAUTH, 0);
+    return NULL;
+}
+
+/**
+ * @brief Returns the key of a username's bucket.
+ */
+static uint64_t user_key(const char *username) {
+    /* FNV-1a */
+    uint64_t key = 14695981039346656037ull;
+    for (const char *c = username; *c != '\0'; c++) {
+        key = (key ^ (unsigned char)*c) * 1099511628211ull;
+    }
+    return key | 1;
+}
+
+const char *admission_user(const char *username) {
+    if (admission == NULL) {
+        return NULL;
+    }
+    if (take_token(admission->users, USER_SLOTS, user_key(username), &server_config.user_limit, 0) == -1) {
+        metrics_add(METRIC_REJECTED_USER_RATE, 1);
+        return "Too many failed logins for this user, try again later.";
+    }
+    return NULL;
+}
+
+void admission_login_failed(const char *username) {
+    if (admission != NULL) {
+        take_token(admission->users, USER_SLOTS, user_key(username), &server_config.user_limit, 1);
+    }
+}
+
+const char *admission_start_session(Admission *claims) {
+    if (admission == NULL || claims->slot == -1) {
+        return NULL;
+    }
+    if (change_slot(claims, 0, HELD_PREAUTH) & HELD_PREAUTH) {
+        atomic_fetch_sub(&admission->preauth, 1);
+    }
+    if (claim(&admission->sessions, server_config.max_sessions) == -1) {
+        metrics_add(METRIC_REJECTED_SESSIONS, 1);
+        return "The server is full, try again later.";
+    }
+    if (!(change_slot(claims, HELD_SESSION, 0) & HELD_TAKEN)) {
+        atomic_fetch_sub(&admission->sessions, 1);  // released meanwhile, by the listener after a reap
+    }
+    return NULL;
+}
+
+void admission_adopt_session(Admission *claims) {
+    claims->slot = -1;
+    if (admission == NULL) {
+        return;
+    }
+    atomic_fetch_add(&admission->sessions, 1);
+    if (take_slot(claims) == -1) {
+        atomic_fetch_sub(&admission->sessions, 1);  // uncounted rather than never given back
+        return;
+    }
+    change_slot(claims, HELD_SESSION, 0);
+}
+
+void admission_release(Admission *claims) {
+    if (admission == NULL || claims->slot == -1) {
+        return;
+    }
+    const unsigned held = change_slot(claims, 0, HELD_PREAUTH | HELD_SESSION | HELD_TAKEN);
+    if (held & HELD_PREAUTH) {
+        atomic_fetch_sub(&admission->preauth, 1);
+    }
+    if (held & HELD_SESSION) {
+        atomic_fetch_sub(&admission->sessions, 1);
+    }
+    claims->slot = -1;
+}
@@ -0,0 +1,99 @@
+/**
+ * @file admission.h
+ * @brief Admission control: connection rates per source and per user, caps on connections and sessions
+ *
+ * Every accepted connection is admitted or rejected before any process is
+ * forked or session allocated for it. A rejected client gets one
+ * CONNECTION_FAILURE message and is closed. The checks, in order:
+ *
+ * - A token bucket per source address, refilled at -I connections per second.
+ * - A cap on connections that have not logged in yet (-P).
+ * - A token bucket per username (-U), which a failed login takes from and
+ *   which must not be empty when the username arrives, so guessing a
+ *   user's password is slowed down but the user's own logins are not.
+ * - A cap on sessions with a shell, detached ones included (-S), once the
+ *   password is accepted.
+ *
+ * The counters and buckets live in one shared anonymous mapping created
+ * before the server forks, like the metrics, so fork-mode children and the
+ * workers all count against the same limits. What a connection holds is
+ * recorded in a slot of the mapping that its Admission names, and given
+ * back with admission_release(). Any process can release it that way, so
+ * the fork-mode listener gives back the claims of a connection child that
+ * died without doing so itself.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+
+#define ADMISSION_MAX_SESSIONS 256      // default cap on sessions with a shell
+#define ADMISSION_MAX_PREAUTH 32        // default cap on connections not logged in yet
+#define ADMISSION_SOURCE_RATE 10        // default connections per second from one address
+#define ADMISSION_USER_RATE 2           // default failed logins per second for one username
+#define ADMISSION_SLOTS 65536           // connections that can hold claims at once
+
+/* A rate limit: a bucket of burst tokens, refilled at rate tokens per second; rate 0 turns it off */
+typedef struct {
+    double rate;
+    double burst;
+} RateLimit;
+
+/* Names the shared slot recording what one connection holds against the limits */
+typedef struct {
+    int slot;           // -1 once released, or when nothing is limited
+    unsigned use;       // which use of the slot is this connection's
+} Admission;
+
+/**
+ * @brief Maps the shared admission state; must be called before the server forks.
+ * @return 0 on success, -1 if the mapping failed (nothing is then limited).
+ */
+int admission_init();
+
+/**
+ * @brief Parses "rate[:burst]"; the burst defaults to twice the rate.
+ * @return 0 on success, -1 if it is malformed.
+ */
+int admission_parse_rate(const char *text, RateLimit *limit);
+
+/**
+ * @brief Admits a freshly accepted connection from an IPv4 address.
+ * @param claims Receives the connection's claim.
+ * @param address The source address, in network byte order.
+ * @return NULL if admitted, else the reason to send with CONNECTION_FAILURE.
+ */
+const char *admission_accept(Admission *claims, uint32_t address);
+
+/**
+ * @brief Checks that a username has not run out of failed logins.
+ * @return NULL if the login may go on, else the reason to send with CONNECTION_FAILURE.
+ */
+const char *admission_user(const char *username);
+
+/**
+ * @brief Charges a failed login to the username's bucket.
+ */
+void admission_login_failed(const char *username);
+
+/**
+ * @brief Turns an authenticated connection into a session if the session cap allows.
+ * @return NULL on success, else the reason to send with CONNECTION_FAILURE.
+ */
+const char *admission_start_session(Admission *claims);
+
+/**
+ * @brief Counts a session passed on by an upgrade, over the cap if need be: it is running already.
+ */
+void admission_adopt_session(Admission *claims);
+
+/**
+ * @brief Gives back whatever the connection holds; safe to call more than once, from any process.
+ */
+void admission_release(Admission *claims);
+
+#endif // ADMISSION_H
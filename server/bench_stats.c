@@ -0,0 +1,67 @@
+/**
+ * @file bench_stats.c
+ * @brief Latency and throughput samples for eggbench, summarised as percentiles
+ */
+
+#include "bench_stats.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+int samples_add(Samples *samples, const double value) {
+    if (samples->count == samples->capacity) {
+        const size_t capacity = samples->capacity == 0 ? 1024 : samples->capacity * 2;
+        double *values = realloc(samples->values, capacity * sizeof(double));
+        if (values == NULL) {
+            return -1;
+        }
+        samples->values = values;
+        samples->capacity = capacity;
+    }
+    samples->values[samples->count++] = value;
+    return 0;
+}
+
+static int compare_values(const void *a, const void *b) {
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* The smallest value at least the fraction of all values are no greater than */
+static double percentile(const Samples *samples, const double fraction) {
+    size_t rank = (size_t)ceil(fraction * (double)samples->count);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return samples->values[rank - 1];
+}
+
+SampleSummary samples_summarise(Samples *samples) {
+    SampleSummary summary = { .count = samples->count };
+    if (samples->count == 0) {
+        return summary;
+    }
+
+    qsort(samples->values, samples->count, sizeof(double), compare_values);
+    double total = 0;
+    for (size_t i = 0; i < samples->count; i++) {
+        total += samples->values[i];
+    }
+    summary.mean = total / (double)samples->count;
+    summary.p50 = percentile(samples, 0.50);
+    summary.p99 = percentile(samples, 0.99);
+    summary.p999 = percentile(samples, 0.999);
+    summary.max = samples->values[samples->count - 1];
+    return summary;
+}
+
+void summary_write_json(FILE *out, const SampleSummary *summary) {
+    fprintf(out, "{\"count\":%zu,\"mean\":%.4f,\"p50\":%.4f,\"p99\":%.4f,\"p999\":%.4f,\"max\":%.4f}",
+            summary->count, summary->mean, summary->p50, summary->p99, summary->p999, summary->max);
+}
+
+void samples_free(Samples *samples) {
+    free(samples->values);
+    *samples = (Samples){ 0 };
+}
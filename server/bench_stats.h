@@ -0,0 +1,54 @@
+/**
+ * @file bench_stats.h
+ * @brief Latency and throughput samples for eggbench, summarised as percentiles
+ *
+ * Samples are kept whole rather than bucketed, so the percentiles are exact
+ * for the run: a run of a few hundred sessions keeps a few hundred thousand
+ * doubles at most.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef BENCH_STATS_H
+#define BENCH_STATS_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Every value recorded for one measurement */
+typedef struct {
+    double *values;
+    size_t count;
+    size_t capacity;
+} Samples;
+
+/* What the report shows of a measurement */
+typedef struct {
+    size_t count;
+    double mean;
+    double p50;
+    double p99;
+    double p999;
+    double max;
+} SampleSummary;
+
+/**
+ * @brief Records one value.
+ * @return 0 on success, -1 if out of memory (the value is dropped).
+ */
+int samples_add(Samples *samples, double value);
+
+/**
+ * @brief Sorts the values and computes nearest-rank percentiles; all zero when there are none.
+ */
+SampleSummary samples_summarise(Samples *samples);
+
+/**
+ * @brief Writes a summary as a JSON object, e.g. {"count":3,"mean":1.5,...}.
+ */
+void summary_write_json(FILE *out, const SampleSummary *summary);
+
+void samples_free(Samples *samples);
+
+#endif // BENCH_STATS_H
@@ -0,0 +1,41 @@
+/**
+ * @file binlog.c
+ * @brief Binary payload log record format
+ *
+ * Shared by the server, which writes the records, and logread, which reads them.
+ */
+
+#include "binlog.h"
+
+static void put_u32(unsigned char *out, const uint32_t value) {
+    out[0] = (unsigned char)(value >> 24);
+    out[1] = (unsigned char)(value >> 16);
+    out[2] = (unsigned char)(value >> 8);
+    out[3] = (unsigned char)value;
+}
+
+static uint32_t get_u32(const unsigned char *in) {
+    return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | in[3];
+}
+
+void binlog_encode_header(const BinlogRecord *record, unsigned char *out) {
+    put_u32(out, BINLOG_HEADER_SIZE - 4 + record->payload_length);
+    put_u32(out + 4, (uint32_t)(record->time_us >> 32));
+    put_u32(out + 8, (uint32_t)record->time_us);
+    put_u32(out + 12, record->pid);
+    put_u32(out + 16, (uint32_t)record->fd);
+    out[20] = record->direction;
+}
+
+int binlog_decode_header(const unsigned char *in, BinlogRecord *record) {
+    const uint32_t length = get_u32(in);
+    if (length < BINLOG_HEADER_SIZE - 4) {
+        return -1;
+    }
+    record->payload_length = length - (BINLOG_HEADER_SIZE - 4);
+    record->time_us = ((uint64_t)get_u32(in + 4) << 32) | get_u32(in + 8);
+    record->pid = get_u32(in + 12);
+    record->fd = (int32_t)get_u32(in + 16);
+    record->direction = in[20];
+    return 0;
+}
@@ -0,0 +1,58 @@
+/**
+ * @file binlog.h
+ * @brief Binary payload log record format
+ *
+ * At the payload log level every relayed chunk is stored as a
+ * length-prefixed binary record instead of "%s" text, so binary output and
+ * NUL bytes survive intact. The file starts with BINLOG_MAGIC, followed by
+ * records laid out as (all integers big-endian):
+ *
+ *   length     4 bytes  bytes that follow this field (header rest + payload)
+ *   time_us    8 bytes  wall clock time in microseconds
+ *   pid        4 bytes  process that relayed the chunk
+ *   fd         4 bytes  client socket of the session
+ *   direction  1 byte   0 = PTY to client, 1 = client to PTY
+ *   payload    length - 17 bytes
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BINLOG_FILE "server.bin"
+#define BINLOG_MAGIC "EGGBLOG1"
+#define BINLOG_MAGIC_LENGTH 8
+#define BINLOG_HEADER_SIZE 21   // length field plus the fixed fields after it
+
+#define BINLOG_TO_CLIENT   0
+#define BINLOG_FROM_CLIENT 1
+
+typedef struct {
+    uint64_t time_us;
+    uint32_t pid;
+    int32_t fd;
+    uint8_t direction;
+    uint32_t payload_length;
+} BinlogRecord;
+
+/**
+ * @brief Encodes a record header.
+ * @param record The header fields.
+ * @param out Receives BINLOG_HEADER_SIZE bytes.
+ */
+void binlog_encode_header(const BinlogRecord *record, unsigned char *out);
+
+/**
+ * @brief Decodes a record header.
+ * @param in BINLOG_HEADER_SIZE bytes read from the log.
+ * @param record Receives the header fields.
+ * @return 0 on success, -1 if the length field is too small to be a record.
+ */
+int binlog_decode_header(const unsigned char *in, BinlogRecord *record);
+
+#endif // BINLOG_H
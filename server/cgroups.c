@@ -0,0 +1,453 @@
+/**
+ * @file cgroups.c
+ * @brief Shells confined to cgroup v2 groups per user or per session, with CPU, memory and process limits
+ *
+ * The root is kept open and every group is reached relative to it, so a
+ * session only carries its leaf's name. Leaves that could not be removed
+ * at once wait in a list, with their cgroup.events in an epoll instance of
+ * their own, which the kernel marks when a leaf's "populated" changes.
+ */
+
+#define _GNU_SOURCE     // strtok_r
+
+#include "cgroups.h"
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/sched.h>
+
+#define CGROUP_SWEEP_SLICE_MS 50    // longest wait for a mark before the leaves are tried again anyway
+
+/* A leaf whose processes were killed but have not all exited yet */
+typedef struct Draining {
+    char name[CGROUP_NAME_LENGTH];
+    int events_fd;      // the leaf's cgroup.events, -1 if it could not be opened
+    struct Draining *next;
+} Draining;
+
+static int root_fd = -1;
+static const char *root_path = NULL;
+static CgroupScope scope = CGROUP_SCOPE_NONE;
+static CgroupLimits limits;
+static char delegated[32] = "";     // "+cpu +memory +pids", as far as the root has them
+static unsigned long leaves = 0;    // leaves this process has created, which name the next
+static Draining *draining = NULL;
+static int drain_fd = -1;
+
+int cgroups_parse_limits(const char *text, CgroupLimits *parsed) {
+    char copy[128];
+    char *saved;
+
+    if (strlen(text) >= sizeof(copy)) {
+        return -1;
+    }
+    strcpy(copy, text);
+    for (char *item = strtok_r(copy, ",", &saved); item != NULL; item = strtok_r(NULL, ",", &saved)) {
+        char *value = strchr(item, '=');
+        if (value == NULL || !isdigit((unsigned char)value[1])) {
+            return -1;
+        }
+        *value++ = '\0';
+
+        char *end;
+        uint64_t number = strtoull(value, &end, 10);
+        if (strcmp(item, "memory") == 0) {
+            switch (toupper((unsigned char)*end)) {
+            case 'K': number <<= 10; end++; break;
+            case 'M': number <<= 20; end++; break;
+            case 'G': number <<= 30; end++; break;
+            }
+            parsed->memory_max = number;
+        } else if (strcmp(item, "cpu") == 0) {
+            if (number > 10000) {
+                return -1;
+            }
+            parsed->cpu_weight = (unsigned)number;
+        } else if (strcmp(item, "pids") == 0) {
+            parsed->pids_max = number;
+        } else {
+            return -1;
+        }
+        if (*end != '\0' || number == 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes a value to a cgroup interface file.
+ * @return 0 on success, -1 on failure with errno set.
+ */
+static int write_file(const int dir_fd, const char *path, const char *value) {
+    const int fd = openat(dir_fd, path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    const ssize_t written = write(fd, value, strlen(value));
+    const int saved = errno;
+    close(fd);
+    errno = saved;
+    return written == (ssize_t)strlen(value) ? 0 : -1;
+}
+
+/**
+ * @brief Reads a cgroup interface file into a terminated string.
+ * @return The length read, or -1 on failure.
+ */
+static ssize_t read_file(const int dir_fd, const char *path, char *text, const size_t size) {
+    const int fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    const ssize_t length = read(fd, text, size - 1);
+    close(fd);
+    if (length < 0) {
+        return -1;
+    }
+    text[length] = '\0';
+    return length;
+}
+
+/**
+ * @brief Notes a controller for delegation to the root's groups if the root has it.
+ * @param available The root's cgroup.controllers, a list of names separated by spaces.
+ * @return 1 if the root has the controller, 0 if not.
+ */
+static int delegate(const char *available, const char *controller) {
+    const size_t length = strlen(controller);
+    for (const char *at = available; (at = strstr(at, controller)) != NULL; at += length) {
+        if ((at == available || at[-1] == ' ') && (at[length] == '\0' || isspace((unsigned char)at[length]))) {
+            snprintf(delegated + strlen(delegated), sizeof(delegated) - strlen(delegated), "%s+%s",
+                     delegated[0] != '\0' ? " " : "", controller);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int cgroups_init(const CgroupScope wanted_scope, const char *root, const CgroupLimits *wanted) {
+    char available[256];
+
+    if (mkdir(root, 0755) == -1 && errno != EEXIST) {
+        perror(root);
+        return -1;
+    }
+    root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1) {
+        perror(root);
+        return -1;
+    }
+    if (read_file(root_fd, "cgroup.controllers", available, sizeof(available)) == -1) {
+        fprintf(stderr, "%s is not a cgroup v2 directory.\n", root);
+        close(root_fd);
+        root_fd = -1;
+        return -1;
+    }
+
+    root_path = root;
+    scope = wanted_scope;
+    limits = *wanted;
+    if (!delegate(available, "cpu") && limits.cpu_weight != 0) {
+        log_event("cgroup %s has no cpu controller, the CPU weight is not applied.\n", root);
+        limits.cpu_weight = 0;
+    }
+    /* delegated without a limit too, for the peak each session reports */
+    if (!delegate(available, "memory") && limits.memory_max != 0) {
+        log_event("cgroup %s has no memory controller, the memory limit is not applied.\n", root);
+        limits.memory_max = 0;
+    }
+    if (!delegate(available, "pids") && limits.pids_max != 0) {
+        log_event("cgroup %s has no pids controller, the process limit is not applied.\n", root);
+        limits.pids_max = 0;
+    }
+
+    /* refused while the server itself runs in the root: a cgroup with processes cannot hand controllers down */
+    if (delegated[0] != '\0' && write_file(root_fd, "cgroup.subtree_control", delegated) == -1) {
+        perror("cgroup.subtree_control");
+        fprintf(stderr, "Cannot delegate %s under %s.\n", delegated, root);
+        close(root_fd);
+        root_fd = -1;
+        return -1;
+    }
+    log_event("Confining shells per %s under %s (%s).\n", scope == CGROUP_SCOPE_USER ? "user" : "session", root,
+              delegated[0] != '\0' ? delegated : "no controllers");
+    return 0;
+}
+
+/**
+ * @brief Writes one limit of a group, logging a failure.
+ */
+static void set_limit(const char *group, const char *file, const uint64_t value) {
+    char path[CGROUP_NAME_LENGTH + 16];
+    char text[24];
+
+    snprintf(path, sizeof(path), "%s/%s", group, file);
+    snprintf(text, sizeof(text), "%llu", (unsigned long long)value);
+    if (write_file(root_fd, path, text) == -1) {
+        perror(file);
+        log_event("Failed to set %s of cgroup %s to %s: %s\n", file, group, text, strerror(errno));
+    }
+}
+
+static void apply_limits(const char *group) {
+    if (limits.cpu_weight != 0) set_limit(group, "cpu.weight", limits.cpu_weight);
+    if (limits.memory_max != 0) set_limit(group, "memory.max", limits.memory_max);
+    if (limits.pids_max != 0) set_limit(group, "pids.max", limits.pids_max);
+}
+
+/**
+ * @brief Creates a user's group with its limits, unless it is there already.
+ * @return 0 once the group is there, -1 on failure with errno set.
+ */
+static int make_user_group(const char *group) {
+    if (mkdirat(root_fd, group, 0755) == -1) {
+        return errno == EEXIST ? 0 : -1;
+    }
+    apply_limits(group);
+
+    char path[CGROUP_NAME_LENGTH + 32];
+    snprintf(path, sizeof(path), "%s/cgroup.subtree_control", group);
+    if (delegated[0] != '\0' && write_file(root_fd, path, delegated) == -1) {
+        log_event("Failed to delegate %s to the sessions of cgroup %s: %s\n", delegated, group, strerror(errno));
+    }
+    return 0;
+}
+
+int cgroup_create(SessionCgroup *cgroup, const char *username) {
+    char group[8 + MAX_USERNAME_LENGTH];
+    char name[CGROUP_NAME_LENGTH];
+
+    cgroup->name[0] = '\0';
+    if (root_fd == -1) {
+        return -1;
+    }
+    if (scope == CGROUP_SCOPE_USER) {
+        /* the prefix keeps a username from naming an interface file, and the rest from leaving the root */
+        snprintf(group, sizeof(group), "user-%s", username);
+        for (char *c = group + 5; *c != '\0'; c++) {
+            if (!isalnum((unsigned char)*c) && *c != '-' && *c != '_' && *c != '.') {
+                *c = '_';
+            }
+        }
+        snprintf(name, sizeof(name), "%s/session-%d-%lu", group, (int)getpid(), ++leaves);
+    } else {
+        snprintf(name, sizeof(name), "session-%d-%lu", (int)getpid(), ++leaves);
+    }
+
+    int made = scope == CGROUP_SCOPE_USER ? make_user_group(group) : 0;
+    if (made == 0) {
+        made = mkdirat(root_fd, name, 0755);
+        if (made == -1 && errno == ENOENT && scope == CGROUP_SCOPE_USER && make_user_group(group) == 0) {
+            made = mkdirat(root_fd, name, 0755);   // the user's last session elsewhere had just removed the group
+        }
+    }
+    if (made == -1) {
+        perror("mkdir cgroup");
+        log_event("Failed to create cgroup %s, the shell is not confined: %s\n", name, strerror(errno));
+        return -1;
+    }
+    if (scope == CGROUP_SCOPE_SESSION) {
+        apply_limits(name);
+    }
+
+    const int fd = openat(root_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("open cgroup");
+        log_event("Failed to open cgroup %s, the shell is not confined: %s\n", name, strerror(errno));
+        unlinkat(root_fd, name, AT_REMOVEDIR);
+        return -1;
+    }
+    strcpy(cgroup->name, name);
+    return fd;
+}
+
+int cgroup_open(const SessionCgroup *cgroup) {
+    if (root_fd == -1 || cgroup->name[0] == '\0') {
+        return -1;
+    }
+    return openat(root_fd, cgroup->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+void cgroup_adopt(SessionCgroup *cgroup, const char *name) {
+    cgroup->name[0] = '\0';
+    if (root_fd != -1 && strlen(name) < sizeof(cgroup->name)) {
+        strcpy(cgroup->name, name);
+    }
+}
+
+int cgroup_move(const int cgroup_fd, const pid_t pid) {
+    char text[16];
+    snprintf(text, sizeof(text), "%d", (int)pid);
+    if (write_file(cgroup_fd, "cgroup.procs", text) == -1) {
+        perror("cgroup.procs");
+        log_event("Failed to move PID %d into its session's cgroup: %s\n", (int)pid, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+pid_t cgroup_fork(const int cgroup_fd) {
+#if defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+    struct clone_args args = { 0 };
+    args.flags = CLONE_INTO_CGROUP;
+    args.exit_signal = SIGCHLD;
+    args.cgroup = (uint64_t)cgroup_fd;
+
+    /* a raw clone3() runs no fork handlers; the child makes only async-signal-safe calls, see spawn_shell() */
+    const long pid = syscall(SYS_clone3, &args, sizeof(args));
+    if (pid != -1 || (errno != ENOSYS && errno != E2BIG && errno != EINVAL)) {
+        return (pid_t)pid;
+    }
+#endif
+    /* kernels before 5.7 start the child where the server is and move it */
+    const pid_t pid_forked = fork();
+    if (pid_forked > 0) {
+        cgroup_move(cgroup_fd, pid_forked);
+    }
+    return pid_forked;
+}
+
+int cgroup_usage(const SessionCgroup *cgroup, CgroupUsage *usage) {
+    char path[CGROUP_NAME_LENGTH + 16];
+    char text[512];
+
+    if (root_fd == -1 || cgroup->name[0] == '\0') {
+        return -1;
+    }
+    usage->cpu_usec = 0;
+    usage->memory_peak = 0;
+
+    /* cpu.stat is there without the cpu controller; memory.peak needs the memory one and Linux 5.19 */
+    snprintf(path, sizeof(path), "%s/cpu.stat", cgroup->name);
+    if (read_file(root_fd, path, text, sizeof(text)) > 0) {
+        const char *usage_usec = strstr(text, "usage_usec ");
+        if (usage_usec != NULL) {
+            usage->cpu_usec = strtoull(usage_usec + strlen("usage_usec "), NULL, 10);
+        }
+    }
+    snprintf(path, sizeof(path), "%s/memory.peak", cgroup->name);
+    if (read_file(root_fd, path, text, sizeof(text)) > 0) {
+        usage->memory_peak = strtoull(text, NULL, 10);
+    }
+    return 0;
+}
+
+/**
+ * @brief Removes a leaf, and its user's group if that was the user's last session.
+ * @return 0 on success, -1 on failure with errno set, EBUSY while the leaf still has processes.
+ */
+static int remove_leaf(const char *name) {
+    if (unlinkat(root_fd, name, AT_REMOVEDIR) == -1) {
+        return -1;
+    }
+    const char *slash = strrchr(name, '/');
+    if (slash != NULL) {
+        char group[CGROUP_NAME_LENGTH];
+        snprintf(group, sizeof(group), "%.*s", (int)(slash - name), name);
+        unlinkat(root_fd, group, AT_REMOVEDIR);     // fails while other sessions of the user run
+    }
+    return 0;
+}
+
+void cgroup_remove(SessionCgroup *cgroup) {
+    char path[CGROUP_NAME_LENGTH + 16];
+
+    if (root_fd == -1 || cgroup->name[0] == '\0') {
+        return;
+    }
+
+    /* Linux 5.14 and later kill whatever the shell left behind; before that only the shell is killed */
+    snprintf(path, sizeof(path), "%s/cgroup.kill", cgroup->name);
+    write_file(root_fd, path, "1");
+
+    /* opened before the rmdir(), so the leaf emptying in between is not missed */
+    snprintf(path, sizeof(path), "%s/cgroup.events", cgroup->name);
+    const int events_fd = openat(root_fd, path, O_RDONLY | O_CLOEXEC);
+
+    Draining *leaf = NULL;
+    const int removed = remove_leaf(cgroup->name);
+    if (removed == -1 && (errno != EBUSY || (leaf = malloc(sizeof(Draining))) == NULL)) {
+        log_event("Failed to remove cgroup %s: %s\n", cgroup->name, strerror(errno));
+    }
+    if (leaf == NULL) {
+        if (events_fd != -1) {
+            close(events_fd);
+        }
+        cgroup->name[0] = '\0';
+        return;
+    }
+    strcpy(leaf->name, cgroup->name);
+    leaf->events_fd = events_fd;
+    if (events_fd != -1 && cgroups_drain_fd() != -1) {
+        struct epoll_event event = { .events = EPOLLPRI | EPOLLET };
+        epoll_ctl(drain_fd, EPOLL_CTL_ADD, events_fd, &event);
+    }
+    leaf->next = draining;
+    draining = leaf;
+    cgroup->name[0] = '\0';
+}
+
+int cgroups_drain_fd() {
+    if (drain_fd == -1) {
+        drain_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (drain_fd == -1) {
+            perror("epoll_create1 cgroups");
+        }
+    }
+    return drain_fd;
+}
+
+static long long now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void cgroups_sweep(const int wait_ms) {
+    const long long deadline = now_ms() + wait_ms;
+    struct epoll_event marked[16];
+
+    /* the marks only say that some leaf changed; rmdir() finds out which have emptied */
+    while (drain_fd != -1 && epoll_wait(drain_fd, marked, 16, 0) == 16) {}
+    while (draining != NULL) {
+        for (Draining **link = &draining; *link != NULL;) {
+            Draining *leaf = *link;
+            if (remove_leaf(leaf->name) == -1 && errno == EBUSY) {
+                link = &leaf->next;
+                continue;
+            }
+            *link = leaf->next;
+            if (leaf->events_fd != -1) {
+                close(leaf->events_fd);
+            }
+            free(leaf);
+        }
+
+        const long long left = deadline - now_ms();
+        if (draining == NULL || left <= 0) {
+            break;
+        }
+        const int slice = left < CGROUP_SWEEP_SLICE_MS ? (int)left : CGROUP_SWEEP_SLICE_MS;
+        if (drain_fd == -1 || epoll_wait(drain_fd, marked, 16, slice) == -1) {
+            poll(NULL, 0, slice);
+        }
+    }
+
+    if (wait_ms > 0 && draining != NULL) {
+        log_event("Left cgroups under %s that did not empty in %dms, %s among them.\n", root_path, wait_ms,
+                  draining->name);
+    }
+}
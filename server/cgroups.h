@@ -0,0 +1,141 @@
+/**
+ * @file cgroups.h
+ * @brief Shells confined to cgroup v2 groups per user or per session, with CPU, memory and process limits
+ *
+ * With -g every session gets a leaf cgroup under a cgroup v2 directory
+ * (-G), which must be writable by the server and must not hold the
+ * server's own processes:
+ *
+ * - session: ROOT/session-<pid>-<n>, which carries the -L limits itself.
+ * - user: ROOT/user-<name>/session-<pid>-<n>, where the user's group carries
+ *   the limits, shared by all of that user's sessions, and each leaf only
+ *   counts its own session.
+ *
+ * A shell is started straight in its leaf by clone3() with
+ * CLONE_INTO_CGROUP, so placing it costs no syscall after the fork. Where
+ * clone3() is missing it is forked and then moved, as a pooled shell, which
+ * started before anyone logged in, is moved when a session takes it.
+ *
+ * When a session ends its CPU time and peak memory are read from the leaf
+ * for the session's log line. Then everything left in the leaf is killed
+ * and the leaf removed; one that is still emptying is removed by
+ * cgroups_sweep() once cgroups_drain_fd() says it may have emptied, and a
+ * user's group goes with its last session.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef CGROUPS_H
+#define CGROUPS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CGROUP_ROOT "/sys/fs/cgroup/eggshell"  // default directory the groups are created in
+#define CGROUP_NAME_LENGTH 128                  // longest leaf name under the root, terminator included
+#define CGROUP_DRAIN_MS 1000                    // how long an exiting server waits for its leaves to empty
+
+/* Which sessions share a cgroup's limits */
+typedef enum {
+    CGROUP_SCOPE_NONE,      // shells stay in the server's cgroup (default)
+    CGROUP_SCOPE_SESSION,   // every session is limited on its own
+    CGROUP_SCOPE_USER,      // the sessions of one user are limited together
+} CgroupScope;
+
+/* Limits written to every group; 0 leaves the kernel's default */
+typedef struct {
+    unsigned cpu_weight;    // cpu.weight, 1 to 10000, 100 being the kernel's default
+    uint64_t memory_max;    // memory.max in bytes
+    uint64_t pids_max;      // pids.max
+} CgroupLimits;
+
+/* The leaf a session's shells run in */
+typedef struct {
+    char name[CGROUP_NAME_LENGTH];  // relative to the root, empty when the session has none
+} SessionCgroup;
+
+/* What a session's shells used, as the kernel accounted it */
+typedef struct {
+    uint64_t cpu_usec;      // user and system CPU time
+    uint64_t memory_peak;   // most memory charged at once, 0 when memory is not accounted
+} CgroupUsage;
+
+/**
+ * @brief Parses "cpu=<weight>,memory=<bytes>[K|M|G],pids=<count>", any of them in any order.
+ * @return 0 on success, -1 if it is malformed.
+ */
+int cgroups_parse_limits(const char *text, CgroupLimits *limits);
+
+/**
+ * @brief Opens the root, creating it if need be, and delegates the controllers the limits need to its groups.
+ *
+ * Must be called before the server forks. A limit whose controller the
+ * root does not have is logged and dropped.
+ *
+ * @return 0 on success, -1 if the root cannot be used; shells then stay in the server's cgroup.
+ */
+int cgroups_init(CgroupScope scope, const char *root, const CgroupLimits *limits);
+
+/**
+ * @brief Creates the leaf of a session that just logged in, and the user's group if it has none.
+ *
+ * @param cgroup Receives the leaf's name, empty if the session gets none.
+ * @param username Who logged in.
+ * @return A descriptor of the leaf for spawning shells into, to be closed by the caller,
+ *         or -1 when cgroups are off or the leaf could not be created.
+ */
+int cgroup_create(SessionCgroup *cgroup, const char *username);
+
+/**
+ * @brief Opens a session's leaf again, for a shell started after the first.
+ * @return A descriptor of the leaf, or -1 if the session has none.
+ */
+int cgroup_open(const SessionCgroup *cgroup);
+
+/**
+ * @brief Takes on the leaf of a session passed on by the server this one replaces.
+ * @param name The leaf's name, which may be empty.
+ */
+void cgroup_adopt(SessionCgroup *cgroup, const char *name);
+
+/**
+ * @brief Starts a child process in a cgroup, as fork() does.
+ * @param cgroup_fd A descriptor of the cgroup.
+ * @return As fork(): the child's pid in the parent, 0 in the child, -1 on failure.
+ */
+pid_t cgroup_fork(int cgroup_fd);
+
+/**
+ * @brief Moves a running process into a cgroup.
+ * @return 0 on success, -1 on failure; the process then stays where it was.
+ */
+int cgroup_move(int cgroup_fd, pid_t pid);
+
+/**
+ * @brief Reads what a session's shells have used so far.
+ * @return 0 on success, -1 if the session has no leaf.
+ */
+int cgroup_usage(const SessionCgroup *cgroup, CgroupUsage *usage);
+
+/**
+ * @brief Kills whatever is left in a session's leaf and removes it, or queues it for cgroups_sweep().
+ */
+void cgroup_remove(SessionCgroup *cgroup);
+
+/**
+ * @brief Returns this process's descriptor that becomes readable when a queued leaf may have emptied.
+ *
+ * Created on first use, so each serving process has its own.
+ *
+ * @return The descriptor, or -1 if it could not be created.
+ */
+int cgroups_drain_fd();
+
+/**
+ * @brief Removes the queued leaves that have emptied.
+ * @param wait_ms How long to wait for the rest to empty, 0 to not wait.
+ */
+void cgroups_sweep(int wait_ms);
+
+#endif // CGROUPS_H
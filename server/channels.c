@@ -0,0 +1,127 @@
+/**
+ * @file channels.c
+ * @brief Shells multiplexed over one fork-mode connection, each under its own output window
+ *
+ * Turns pass from channel to channel after every data frame, so a channel
+ * with a long queue sends at most one frame before each of the others. The
+ * turn only stays put while a frame is half written, because frames of
+ * different channels cannot interleave on the wire.
+ */
+
+#include "channels.h"
+#include "server.h"
+#include "shell_pool.h"
+#include "children.h"
+
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+
+void channels_init(Channel *channels, const int master_fd, OutputBacklog *output, const int windowed) {
+    for (int i = 0; i < CHANNEL_MAX; i++) {
+        channels[i] = (Channel){ .master_fd = -1, .shell_pid = -1 };
+    }
+    channels[0].master_fd = master_fd;
+    channels[0].output = output;
+    channels[0].window = windowed ? CHANNEL_WINDOW_SIZE : SIZE_MAX;
+}
+
+int channel_open(Channel *channel, const SessionCgroup *cgroup) {
+    const int cgroup_fd = cgroup_open(cgroup);
+    const int started = acquire_shell(&channel->master_fd, &channel->shell_pid, cgroup_fd);
+    if (cgroup_fd != -1) {
+        close(cgroup_fd);
+    }
+    if (started == -1) {
+        channel->master_fd = -1;
+        return -1;
+    }
+    if (backlog_init(&channel->queue, server_config.output_queue) == -1) {
+        log_event("Failed to allocate the output queue of a channel.\n");
+        channel_close(channel);
+        return -1;
+    }
+    fcntl(channel->master_fd, F_SETFL, fcntl(channel->master_fd, F_GETFL) | O_NONBLOCK);
+    channel->output = &channel->queue;
+    channel->input.length = channel->input.offset = 0;
+    channel->window = CHANNEL_WINDOW_SIZE;
+    channel->exited = 0;
+    return 0;
+}
+
+void channel_close(Channel *channel) {
+    if (channel->master_fd != -1) {
+        close(channel->master_fd);
+        kill(channel->shell_pid, SIGKILL);
+        children_wait(channel->shell_pid);
+    }
+    backlog_free(&channel->queue);
+    *channel = (Channel){ .master_fd = -1, .shell_pid = -1 };
+}
+
+int channel_readable(const Channel *channel) {
+    return channel->master_fd != -1 && !channel->exited && !backlog_full(channel->output) && channel->window > 0;
+}
+
+ssize_t channel_read(Channel *channel) {
+    const ssize_t nbytes = backlog_fill_at_most(channel->output, channel->master_fd, channel->window);
+    if (nbytes > 0 && channel->window != SIZE_MAX) {
+        channel->window -= nbytes;
+    }
+    return nbytes;
+}
+
+int channels_input_idle(const Channel *channels) {
+    for (int i = 0; i < CHANNEL_MAX; i++) {
+        if (channels[i].input.length > 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int channels_unsent(const Channel *channels) {
+    for (int i = 0; i < CHANNEL_MAX; i++) {
+        if (channels[i].output != NULL && channels[i].output->length > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void channels_masters(const Channel *channels, int *masters) {
+    for (int i = 0; i < CHANNEL_MAX; i++) {
+        masters[i] = channels[i].exited ? -1 : channels[i].master_fd;
+    }
+}
+
+int channels_flush(ClientStream *stream, Channel *channels, int *turn, const int fd, const int flush) {
+    if (!stream->channels) {
+        return stream_flush(stream, channels[0].output, fd, flush);
+    }
+
+    int idle = 0;   // channels in a row with nothing queued
+    while (idle < CHANNEL_MAX) {
+        OutputBacklog *output = channels[*turn].output;
+        if (output == NULL || output->offset == output->length) {
+            idle++;
+            *turn = (*turn + 1) % CHANNEL_MAX;
+            continue;
+        }
+        const int result = stream_flush_channel(stream, *turn, output, fd, 0, FRAME_MAX_PAYLOAD);
+        if (result == -1) {
+            return -1;
+        }
+        if (stream->frame_left > 0) {
+            return 0;
+        }
+        idle = 0;
+        *turn = (*turn + 1) % CHANNEL_MAX;
+        if (result == 0) {
+            return 0;
+        }
+    }
+    /* every queue is empty: what is left are control frames and the sync flush */
+    return stream_flush(stream, channels[0].output, fd, flush);
+}
@@ -0,0 +1,96 @@
+/**
+ * @file channels.h
+ * @brief Shells multiplexed over one fork-mode connection, each under its own output window
+ *
+ * A client that asked for channels can open shells besides its login shell,
+ * which is channel 0. Each channel has its own output queue and input chunk.
+ * Its PTY is read only while the client's window for it is open. A channel
+ * whose output the client leaves unread therefore stops its own shell and
+ * no other. The queues are sent in turn, a data frame at a time.
+ *
+ * Channels other than 0 belong to the connection. They end when it drops,
+ * and a resumed session has only channel 0.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef CHANNELS_H
+#define CHANNELS_H
+
+#include "session.h"
+#include "detach.h"
+#include "client_stream.h"
+
+#include <sys/types.h>
+
+/* One shell of a connection */
+typedef struct {
+    int master_fd;          // -1 while the channel is closed
+    pid_t shell_pid;
+    OutputBacklog *output;  // PTY output waiting for the client
+    OutputBacklog queue;    // the output of a channel other than 0; channel 0 uses the session's queue
+    PendingWrite input;     // client input waiting for the PTY
+    size_t window;          // output the client takes before it grants more, SIZE_MAX when not windowed
+    int exited;             // the shell hung up; the channel closes once its output is sent
+} Channel;
+
+/**
+ * @brief Sets up channel 0 for the session's shell and marks the others closed.
+ * @param channels CHANNEL_MAX channels.
+ * @param master_fd The session's PTY master.
+ * @param output The session's output queue, already allocated.
+ * @param windowed Nonzero if the client grants windows, i.e. it asked for channels.
+ */
+void channels_init(Channel *channels, int master_fd, OutputBacklog *output, int windowed);
+
+/**
+ * @brief Starts a shell for a closed channel, with a non-blocking PTY and a full window.
+ * @param cgroup The session's cgroup, which the shell joins.
+ * @return 0 on success, -1 on failure.
+ */
+int channel_open(Channel *channel, const SessionCgroup *cgroup);
+
+/**
+ * @brief Ends a channel other than 0: kills its shell and drops its queued output.
+ */
+void channel_close(Channel *channel);
+
+/**
+ * @brief Checks whether the channel's PTY can be read: the shell runs, and the queue and window have room.
+ */
+int channel_readable(const Channel *channel);
+
+/**
+ * @brief Reads the channel's PTY into its queue, within its window.
+ * @return As backlog_fill().
+ */
+ssize_t channel_read(Channel *channel);
+
+/**
+ * @brief Checks whether every channel's input has reached its PTY.
+ */
+int channels_input_idle(const Channel *channels);
+
+/**
+ * @brief Checks whether any channel has output queued.
+ */
+int channels_unsent(const Channel *channels);
+
+/**
+ * @brief Fills in the PTY master of each channel, for stream_next_input().
+ */
+void channels_masters(const Channel *channels, int *masters);
+
+/**
+ * @brief Writes the channels' output in turn, a data frame of each at a time, as the client takes it.
+ * @param stream The connection's stream.
+ * @param channels CHANNEL_MAX channels.
+ * @param turn The channel whose output goes next; kept between calls.
+ * @param fd The client socket.
+ * @param flush Nonzero to sync-flush once everything is written.
+ * @return 1 when every queue is consumed and written, 0 if bytes remain, -1 on error.
+ */
+int channels_flush(ClientStream *stream, Channel *channels, int *turn, int fd, int flush);
+
+#endif // CHANNELS_H
@@ -0,0 +1,248 @@
+/**
+ * @file children.c
+ * @brief Child processes: shell exits collected in the serving loops instead of a SIGCHLD handler
+ *
+ * The known shells, and the listener's connection children, sit in a
+ * chained hash table keyed by pid, which doubles once it holds as many
+ * entries as it has buckets. An entry leaves the table
+ * when its shell is reaped, so a pid the kernel hands out again is never
+ * mistaken for the old shell.
+ */
+
+#define _GNU_SOURCE     // wait4
+
+#include "children.h"
+#include "server.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define CHILDREN_BUCKETS 64     // buckets to start with, a power of two
+
+typedef struct Child {
+    pid_t pid;
+    ChildExitHandler handler;
+    void *owner;
+    int shell;          // counted and logged when reaped
+    struct Child *next;
+} Child;
+
+static Child **table = NULL;
+static size_t bucket_count = 0;
+static size_t child_count = 0;
+static int signal_fd = -1;
+
+void children_init() {
+    sigset_t exits;
+    sigemptyset(&exits);
+    sigaddset(&exits, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &exits, NULL);
+    signal(SIGCHLD, SIG_DFL);
+}
+
+int children_signal_fd() {
+    if (signal_fd != -1) {
+        return signal_fd;
+    }
+    sigset_t exits;
+    sigemptyset(&exits);
+    sigaddset(&exits, SIGCHLD);
+    signal_fd = signalfd(-1, &exits, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        perror("signalfd");
+    }
+    return signal_fd;
+}
+
+/**
+ * @brief Returns the link that points at a pid's entry, or the empty link at the end of its bucket.
+ */
+static Child **find(const pid_t pid) {
+    Child **link = &table[(size_t)pid & (bucket_count - 1)];
+    while (*link != NULL && (*link)->pid != pid) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/**
+ * @brief Doubles the table, or allocates it.
+ * @return 0 on success, -1 if out of memory; the table is left as it was.
+ */
+static int grow() {
+    const size_t count = bucket_count > 0 ? bucket_count * 2 : CHILDREN_BUCKETS;
+    Child **grown = calloc(count, sizeof(Child *));
+    if (grown == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < bucket_count; i++) {
+        while (table[i] != NULL) {
+            Child *child = table[i];
+            table[i] = child->next;
+            child->next = grown[(size_t)child->pid & (count - 1)];
+            grown[(size_t)child->pid & (count - 1)] = child;
+        }
+    }
+    free(table);
+    table = grown;
+    bucket_count = count;
+    return 0;
+}
+
+/**
+ * @brief Notes a child, or hands a known one to a new owner.
+ */
+static int watch(const pid_t pid, const ChildExitHandler handler, void *owner, const int shell) {
+    if (bucket_count > 0) {
+        Child *known = *find(pid);
+        if (known != NULL) {
+            known->handler = handler;
+            known->owner = owner;
+            return 0;
+        }
+    }
+    if (child_count >= bucket_count && grow() == -1 && bucket_count == 0) {
+        return -1;
+    }
+
+    Child *child = malloc(sizeof(Child));
+    if (child == NULL) {
+        return -1;
+    }
+    Child **link = &table[(size_t)pid & (bucket_count - 1)];
+    child->pid = pid;
+    child->handler = handler;
+    child->owner = owner;
+    child->shell = shell;
+    child->next = *link;
+    *link = child;
+    child_count++;
+    return 0;
+}
+
+int children_watch(const pid_t pid, const ChildExitHandler handler, void *owner) {
+    return watch(pid, handler, owner, 1);
+}
+
+int children_watch_relay(const pid_t pid, const ChildExitHandler handler, void *owner) {
+    return watch(pid, handler, owner, 0);
+}
+
+void children_disown(const pid_t pid) {
+    if (bucket_count == 0) {
+        return;
+    }
+    Child *known = *find(pid);
+    if (known != NULL) {
+        known->handler = NULL;
+        known->owner = NULL;
+    }
+}
+
+static double cpu_seconds(const struct timeval *time) {
+    return (double)time->tv_sec + (double)time->tv_usec / 1e6;
+}
+
+static uint64_t cpu_microseconds(const struct timeval *time) {
+    return (uint64_t)time->tv_sec * 1000000 + (uint64_t)time->tv_usec;
+}
+
+/**
+ * @brief Counts a reaped child if it is a known shell, and tells the owner of any known child.
+ */
+static void collected(const pid_t pid, const int status, const struct rusage *usage) {
+    if (bucket_count == 0) {
+        return;
+    }
+    Child **link = find(pid);
+    Child *child = *link;
+    if (child == NULL) {
+        return;     // a worker, a server started by an upgrade, or a relay nobody watches
+    }
+    *link = child->next;
+    child_count--;
+
+    const ChildExitHandler handler = child->handler;
+    void *owner = child->owner;
+    const int shell = child->shell;
+    free(child);
+    if (!shell) {
+        if (handler != NULL) handler(owner);
+        return;
+    }
+
+    char ended[48];
+    if (WIFSIGNALED(status)) {
+        metrics_add(METRIC_SHELL_EXITS_SIGNAL, 1);
+        snprintf(ended, sizeof(ended), "was killed by signal %d", WTERMSIG(status));
+    } else {
+        metrics_add(WEXITSTATUS(status) == 0 ? METRIC_SHELL_EXITS_SUCCESS : METRIC_SHELL_EXITS_FAILURE, 1);
+        snprintf(ended, sizeof(ended), "exited with status %d", WEXITSTATUS(status));
+    }
+    metrics_add(METRIC_SHELL_CPU_USER, cpu_microseconds(&usage->ru_utime));
+    metrics_add(METRIC_SHELL_CPU_SYSTEM, cpu_microseconds(&usage->ru_stime));
+    log_event("Shell (PID %d) %s after %.3fs user and %.3fs system CPU.\n", pid, ended,
+              cpu_seconds(&usage->ru_utime), cpu_seconds(&usage->ru_stime));
+
+    if (handler != NULL) {
+        handler(owner);
+    }
+}
+
+int children_reap() {
+    struct signalfd_siginfo info;
+    struct rusage usage;
+    int status;
+    pid_t pid;
+    int reaped = 0;
+
+    /* the signals only say that something exited; wait4() finds out what */
+    while (signal_fd != -1 && read(signal_fd, &info, sizeof(info)) == sizeof(info)) {}
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        collected(pid, status, &usage);
+        reaped++;
+    }
+    return reaped;
+}
+
+int children_wait(const pid_t pid) {
+    struct rusage usage;
+    int status;
+    pid_t reaped;
+
+    while ((reaped = wait4(pid, &status, 0, &usage)) == -1 && errno == EINTR) {}
+    if (reaped != pid) {
+        return -1;
+    }
+    collected(pid, status, &usage);
+    return 0;
+}
+
+int children_pidfd(const pid_t pid) {
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+int children_signal(const pid_t pid, const int pidfd, const int signal) {
+#ifdef SYS_pidfd_send_signal
+    if (pidfd != -1) {
+        return (int)syscall(SYS_pidfd_send_signal, pidfd, signal, NULL, 0);
+    }
+#else
+    (void)pidfd;
+#endif
+    return kill(pid, signal);
+}
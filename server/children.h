@@ -0,0 +1,108 @@
+/**
+ * @file children.h
+ * @brief Child processes: shell exits collected in the serving loops instead of a SIGCHLD handler
+ *
+ * SIGCHLD stays blocked in every thread and is read from a signalfd that the
+ * fork-mode listener polls and the epoll loop watches. When it is readable,
+ * children_reap() collects every child that has exited with wait4(), so no
+ * handler interrupts accept() or races the relay waiting for its own shell.
+ *
+ * Every shell spawn_shell() starts is known by its pid. Its exit status and
+ * CPU time go to the metrics and the log whichever process reaps it, and
+ * the session that owns it, if any, is told at once, whether or not its PTY
+ * has hung up. Looking a pid up costs one hash probe, so thousands of shells
+ * cost nothing extra per exit.
+ *
+ * The fork-mode listener also notes its connection children, so it can give
+ * back what one held when it dies without cleaning up after itself.
+ *
+ * A process that does not reap its own children waits for the shell it
+ * killed with children_wait(), and can watch a shell it did not start,
+ * such as a pooled shell handed over by the fork-mode listener, through
+ * children_pidfd().
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef CHILDREN_H
+#define CHILDREN_H
+
+#include <sys/types.h>
+
+/**
+ * @brief Tells the owner of a shell that it has exited and has been reaped.
+ * @param owner What was passed to children_watch().
+ */
+typedef void (*ChildExitHandler)(void *owner);
+
+/**
+ * @brief Blocks SIGCHLD, leaving it to children_signal_fd().
+ *
+ * Must be called before any thread is started, so every thread keeps it blocked.
+ */
+void children_init();
+
+/**
+ * @brief Returns this process's descriptor that becomes readable when a child exits.
+ *
+ * Created on first use; a forked process that inherits it reads its own signals from it.
+ *
+ * @return The descriptor, or -1 if it could not be created.
+ */
+int children_signal_fd();
+
+/**
+ * @brief Notes a shell this process started, or hands it to a new owner.
+ *
+ * @param pid The shell's pid.
+ * @param handler Called once the shell has been reaped, NULL if nobody is waiting for it.
+ * @param owner Passed to the handler.
+ * @return 0 on success, -1 if the shell could not be noted; its exit then goes uncounted.
+ */
+int children_watch(pid_t pid, ChildExitHandler handler, void *owner);
+
+/**
+ * @brief Notes a fork-mode connection child, whose owner is told when it has been reaped.
+ *
+ * Unlike a shell, it is not counted in the metrics or logged.
+ *
+ * @return 0 on success, -1 if it could not be noted.
+ */
+int children_watch_relay(pid_t pid, ChildExitHandler handler, void *owner);
+
+/**
+ * @brief Forgets the owner of a shell, which is still counted when it is reaped.
+ */
+void children_disown(pid_t pid);
+
+/**
+ * @brief Reaps every child that has exited, without waiting, and tells the owners of the shells among them.
+ * @return The number of children reaped.
+ */
+int children_reap();
+
+/**
+ * @brief Waits for one child to exit and reaps it.
+ * @return 0 once reaped, -1 if it is not a child of this process.
+ */
+int children_wait(pid_t pid);
+
+/**
+ * @brief Opens a descriptor that becomes readable once a process has exited, whoever its parent is.
+ * @return The descriptor, or -1 where pidfds are not supported.
+ */
+int children_pidfd(pid_t pid);
+
+/**
+ * @brief Signals a process through its pidfd, which cannot name a process that reused its pid.
+ *
+ * For a shell that is not a child of this process, whose pid may be reaped
+ * and reused at any time.
+ *
+ * @param pidfd From children_pidfd(), or -1 to signal the pid.
+ * @return 0 on success, -1 on failure (errno set).
+ */
+int children_signal(pid_t pid, int pidfd, int signal);
+
+#endif // CHILDREN_H
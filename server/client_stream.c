@@ -0,0 +1,434 @@
+/**
+ * @file client_stream.c
+ * @brief A client connection's relay stream: frames and negotiated deflate compression
+ *
+ * Output is encoded straight from the output queue. Frame headers, control
+ * frames and deflate() output go through a small wire buffer, which is
+ * written as the socket takes it; a plain framed connection writes the
+ * buffer and the frame's payload with one writev(). Only what was encoded
+ * is removed from the queue, so the queue stays the bound on buffered output.
+ */
+
+#include "client_stream.h"
+#include "server.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+int stream_negotiate(int requests, const Message *msg) {
+    if (msg->status_code == SCROLLBACK_REQUEST) {
+        return requests | STREAM_SCROLLBACK;
+    }
+    if (msg->status_code == RELAY_FRAMED) {
+        return requests | STREAM_FRAMED | (strcmp(msg->content, RELAY_CHANNELS) == 0 ? STREAM_CHANNELS : 0);
+    }
+    requests |= STREAM_COMPRESS_ASKED;
+    if (!server_config.compression) {
+        return requests;
+    }
+    const size_t length = strlen(COMPRESS_CODEC);
+    for (const char *name = msg->content; (name = strstr(name, COMPRESS_CODEC)) != NULL; name += length) {
+        const int starts = name == msg->content || name[-1] == ' ';
+        const int ends = name[length] == '\0' || name[length] == ' ';
+        if (starts && ends) {
+            return requests | STREAM_COMPRESS_AGREED;
+        }
+    }
+    return requests;
+}
+
+static int start_deflater(ClientStream *stream) {
+    memset(&stream->deflater, 0, sizeof(stream->deflater));
+    /* raw deflate: the stream is already framed by the connection */
+    if (deflateInit2(&stream->deflater, COMPRESS_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        log_event("deflateInit2 failed, sending output uncompressed.\n");
+        return -1;
+    }
+    stream->compressed = 1;
+    metrics_add(METRIC_COMPRESSED_SESSIONS, 1);
+    return 0;
+}
+
+/**
+ * @brief Ends any previous stream and starts an empty one, without channels or compression.
+ */
+static void stream_reset(ClientStream *stream, const int framed) {
+    stream_end(stream, -1);
+    stream->framed = framed;
+    stream->channels = 0;
+    stream->output_channel = stream->input_channel = 0;
+    stream->frame_left = 0;
+    stream->control_length = 0;
+    stream->head_length = stream->head_offset = 0;
+    stream->input_length = 0;
+    stream->unflushed = 0;
+    stream->wire_length = stream->wire_offset = 0;
+}
+
+void stream_begin(ClientStream *stream, const int client_fd, const int requests) {
+    stream_reset(stream, (requests & STREAM_FRAMED) != 0);
+    /* one process per connection can give each channel its own shell */
+    stream->channels = stream->framed && (requests & STREAM_CHANNELS) && server_config.mode == SERVER_MODE_FORK;
+
+    if (stream->framed) {
+        send_response(client_fd, RELAY_FRAMED, stream->channels ? RELAY_CHANNELS : "");
+    }
+    if (requests & STREAM_COMPRESS_ASKED) {
+        const int agreed = (requests & STREAM_COMPRESS_AGREED) && start_deflater(stream) == 0;
+        send_response(client_fd, COMPRESS_START, agreed ? COMPRESS_CODEC : "");
+    }
+}
+
+void stream_adopt(ClientStream *stream, const int framed) {
+    stream_reset(stream, framed != 0);
+}
+
+void stream_end(ClientStream *stream, const int client_fd) {
+    if (!stream->compressed) {
+        return;
+    }
+    deflateEnd(&stream->deflater);
+    stream->compressed = 0;
+    if (stream->bytes_in > 0 && client_fd != -1) {
+        log_event("Output for client_fd %d compressed from %llu to %llu bytes (%.1fx) in %.1f ms.\n", client_fd,
+                  (unsigned long long)stream->bytes_in, (unsigned long long)stream->bytes_out,
+                  stream->bytes_out > 0 ? (double)stream->bytes_in / (double)stream->bytes_out : 0.0,
+                  (double)stream->nanoseconds / 1e6);
+    }
+    stream->bytes_in = stream->bytes_out = stream->nanoseconds = 0;
+}
+
+int stream_pending(const ClientStream *stream) {
+    return stream->wire_offset < stream->wire_length || stream->control_length > 0 ||
+           stream->head_offset < stream->head_length;
+}
+
+/**
+ * @brief Adds a frame to the control frames waiting for the current data frame to end.
+ * @return 0 on success, -1 if it does not fit.
+ */
+static int queue_control(ClientStream *stream, const ResponseCode type, const ControlCode control_code,
+                         const char *content, const size_t length) {
+    if (stream->control_length + MESSAGE_HEADER_SIZE + length > sizeof(stream->control)) {
+        return -1;
+    }
+    char *frame = stream->control + stream->control_length;
+    encode_frame_header(frame, type, control_code, length);
+    if (length > 0) {
+        memcpy(frame + MESSAGE_HEADER_SIZE, content, length);
+    }
+    stream->control_length += MESSAGE_HEADER_SIZE + length;
+    return 0;
+}
+
+int stream_send_control(ClientStream *stream, const ControlCode control_code, const char *content, const size_t length) {
+    return stream->framed ? queue_control(stream, RELAY_CONTROL, control_code, content, length) : 0;
+}
+
+int stream_send_notice(ClientStream *stream, OutputBacklog *queue, const char *notice) {
+    if (stream->framed) {
+        return stream_send_control(stream, ESCAPE_CODE_NOTICE, notice, strlen(notice));
+    }
+    char line[MESSAGE_MAX_WIRE_SIZE];
+    const int length = snprintf(line, sizeof(line), "\r\n[%s]\r\n", notice);
+    if (length < 0 || (size_t)length >= sizeof(line) || queue->capacity - (queue->length - queue->offset) < (size_t)length) {
+        return -1;
+    }
+    backlog_append(queue, line, (size_t)length);
+    return 0;
+}
+
+int stream_send_channel(ClientStream *stream, const ResponseCode type, const int channel) {
+    return queue_control(stream, type, (ControlCode)channel, NULL, 0);
+}
+
+/**
+ * @brief Writes the wire buffer, then as much of data as the socket takes, with one writev().
+ * @return Bytes of data written, 0 if the socket is full, -1 on error.
+ */
+static ssize_t write_through(ClientStream *stream, const int fd, const char *data, const size_t length) {
+    struct iovec parts[2] = {
+        { stream->wire + stream->wire_offset, stream->wire_length - stream->wire_offset },
+        { (void *)data, length },
+    };
+    ssize_t written;
+    while ((written = writev(fd, parts, 2)) == -1 && errno == EINTR) {}
+    if (written < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    const size_t from_wire = (size_t)written < parts[0].iov_len ? (size_t)written : parts[0].iov_len;
+    stream->wire_offset += from_wire;
+    if (stream->wire_offset == stream->wire_length) {
+        stream->wire_length = stream->wire_offset = 0;
+    }
+    return written - (ssize_t)from_wire;
+}
+
+/**
+ * @brief Writes the wire buffer.
+ * @return 1 when it is empty, 0 if bytes remain, -1 on error.
+ */
+static int write_wire(ClientStream *stream, const int fd) {
+    while (stream->wire_offset < stream->wire_length) {
+        const ssize_t written = write(fd, stream->wire + stream->wire_offset, stream->wire_length - stream->wire_offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        stream->wire_offset += written;
+    }
+    stream->wire_length = stream->wire_offset = 0;
+    return 1;
+}
+
+/**
+ * @brief Runs deflate() from the given input into the wire buffer's free space.
+ * @return The number of input bytes consumed.
+ */
+static size_t deflate_into_wire(ClientStream *stream, const char *data, const size_t length, const int mode) {
+    z_stream *deflater = &stream->deflater;
+    const size_t room = sizeof(stream->wire) - stream->wire_length;
+    deflater->next_in = (Bytef *)data;
+    deflater->avail_in = (uInt)length;
+    deflater->next_out = (Bytef *)stream->wire + stream->wire_length;
+    deflater->avail_out = (uInt)room;
+
+    const uint64_t started = metrics_now();
+    deflate(deflater, mode);     // Z_BUF_ERROR only means there was nothing to do
+    const uint64_t elapsed = metrics_now() - started;
+
+    const size_t consumed = length - deflater->avail_in;
+    const size_t produced = room - deflater->avail_out;
+    stream->wire_length += produced;
+    stream->bytes_in += consumed;
+    stream->bytes_out += produced;
+    stream->nanoseconds += elapsed;
+    metrics_add(METRIC_COMPRESS_INPUT_BYTES, consumed);
+    metrics_add(METRIC_COMPRESS_OUTPUT_BYTES, produced);
+    metrics_add(METRIC_COMPRESS_NANOSECONDS, elapsed);
+
+    /* a sync flush is complete once deflate() had room to spare */
+    if (mode == Z_SYNC_FLUSH && deflater->avail_out > 0) {
+        stream->unflushed = 0;
+    } else if (consumed > 0 || deflater->avail_out == 0) {
+        stream->unflushed = 1;
+    }
+    return consumed;
+}
+
+/**
+ * @brief Adds a frame header or control frame to the empty wire buffer, compressing it if the stream does.
+ *
+ * deflate() may fill the buffer with a block it was holding before it takes
+ * all of the bytes; the rest stay in the stream's head for stream_flush().
+ */
+static void add_to_wire(ClientStream *stream, const char *data, const size_t length) {
+    if (stream->compressed) {
+        memcpy(stream->head, data, length);
+        stream->head_length = length;
+        stream->head_offset = deflate_into_wire(stream, stream->head, length, Z_NO_FLUSH);
+    } else {
+        memcpy(stream->wire + stream->wire_length, data, length);
+        stream->wire_length += length;
+    }
+}
+
+/**
+ * @brief Encodes the queue onto the wire, with the control frames at frame boundaries, as the socket takes it.
+ * @param limit Most bytes of the queue to take.
+ * @return 1 when those bytes are consumed and written, 0 if bytes remain, -1 on error.
+ */
+static int encode_output(ClientStream *stream, OutputBacklog *queue, const int fd, const int flush, size_t limit) {
+    while (1) {
+        const int written = write_wire(stream, fd);
+        if (written != 1) {
+            return written;
+        }
+
+        size_t unsent = queue->length - queue->offset;
+        if (unsent > limit) {
+            unsent = limit;
+        }
+        if (stream->head_offset < stream->head_length) {
+            stream->head_offset += deflate_into_wire(stream, stream->head + stream->head_offset,
+                                                     stream->head_length - stream->head_offset, Z_NO_FLUSH);
+        } else if (stream->control_length > 0 && stream->frame_left == 0) {
+            add_to_wire(stream, stream->control, stream->control_length);
+            stream->control_length = 0;
+        } else if (unsent > 0) {
+            if (stream->framed && stream->frame_left == 0) {
+                char header[MESSAGE_HEADER_SIZE];
+                stream->frame_left = unsent < FRAME_MAX_PAYLOAD ? unsent : FRAME_MAX_PAYLOAD;
+                encode_frame_header(header, RELAY_DATA, ESCAPE_CODE_NONE, stream->frame_left);
+                add_to_wire(stream, header, sizeof(header));
+                if (stream->head_offset < stream->head_length) {
+                    continue;   // the payload follows the whole header
+                }
+            }
+            if (stream->framed && unsent > stream->frame_left) {
+                unsent = stream->frame_left;
+            }
+
+            ssize_t consumed;
+            if (stream->compressed) {
+                consumed = deflate_into_wire(stream, queue->data + queue->offset, unsent, Z_NO_FLUSH);
+            } else if ((consumed = write_through(stream, fd, queue->data + queue->offset, unsent)) == -1) {
+                return -1;
+            }
+            queue->offset += consumed;
+            limit -= consumed;
+            if (stream->framed) {
+                stream->frame_left -= consumed;
+            }
+            if (queue->offset == queue->length) {
+                queue->length = queue->offset = 0;
+            } else if (!stream->compressed && (size_t)consumed < unsent) {
+                return 0;   // the socket is full
+            }
+        } else if (flush && stream->unflushed) {
+            deflate_into_wire(stream, NULL, 0, Z_SYNC_FLUSH);
+        } else {
+            return 1;
+        }
+    }
+}
+
+int stream_flush(ClientStream *stream, OutputBacklog *queue, const int fd, const int flush) {
+    return stream_flush_channel(stream, 0, queue, fd, flush, SIZE_MAX);
+}
+
+int stream_flush_channel(ClientStream *stream, const int channel, OutputBacklog *queue, const int fd, const int flush,
+                         const size_t limit) {
+    if (!stream->compressed && !stream->framed) {
+        return backlog_flush(queue, fd);
+    }
+    if (channel != stream->output_channel && queue->length > queue->offset) {
+        if (stream->frame_left > 0 || queue_control(stream, CHANNEL_SELECT, (ControlCode)channel, NULL, 0) == -1) {
+            /* another channel's frame, or the control frames that fill the queue, go first */
+            OutputBacklog nothing = { 0 };
+            return encode_output(stream, &nothing, fd, flush, 0) == -1 ? -1 : 0;
+        }
+        stream->output_channel = channel;
+    }
+    return encode_output(stream, queue, fd, flush, limit);
+}
+
+ssize_t stream_read_input(ClientStream *stream, const int fd, char *data) {
+    if (!stream->framed) {
+        return read(fd, data, FRAME_MAX_PAYLOAD);
+    }
+    /* never full here: a complete frame is decoded before more is read */
+    return read(fd, stream->input + stream->input_length, sizeof(stream->input) - stream->input_length);
+}
+
+/**
+ * @brief Applies one control frame from the client.
+ * @return Bytes it put in data for the PTY.
+ */
+static size_t apply_control(ClientStream *stream, const int master_fd, const Frame *frame, char *data) {
+    static const char *arrows[] = { "\033[A", "\033[B", "\033[D", "\033[C" };
+    unsigned short rows, columns;
+    struct termios modes;
+
+    switch (frame->control_code) {
+    case ESCAPE_CODE_WINDOW_SIZE:
+        if (decode_window_size(frame, &rows, &columns) == 0) {
+            /* the kernel sends SIGWINCH to the shell's foreground job */
+            struct winsize size = { .ws_row = rows, .ws_col = columns };
+            if (ioctl(master_fd, TIOCSWINSZ, &size) == -1) {
+                log_event("Failed to resize the PTY of master_fd %d: %s\n", master_fd, strerror(errno));
+            }
+        }
+        return 0;
+    case ESCAPE_CODE_CTRL_C:
+    case ESCAPE_CODE_CTRL_Z:
+        if (ioctl(master_fd, TIOCSIG, frame->control_code == ESCAPE_CODE_CTRL_C ? SIGINT : SIGTSTP) == -1) {
+            log_event("Failed to signal the PTY of master_fd %d: %s\n", master_fd, strerror(errno));
+        }
+        return 0;
+    case ESCAPE_CODE_CTRL_D:
+        /* end of file is a character of the terminal's, not a signal */
+        data[0] = tcgetattr(master_fd, &modes) == 0 ? (char)modes.c_cc[VEOF] : 4;
+        return 1;
+    case ESCAPE_CODE_UP_ARROW:
+    case ESCAPE_CODE_DOWN_ARROW:
+    case ESCAPE_CODE_LEFT_ARROW:
+    case ESCAPE_CODE_RIGHT_ARROW:
+        memcpy(data, arrows[frame->control_code - ESCAPE_CODE_UP_ARROW], 3);
+        return 3;
+    case ESCAPE_CODE_KEEPALIVE:
+        stream_send_control(stream, ESCAPE_CODE_KEEPALIVE, NULL, 0);
+        return 0;
+    default:
+        return 0;   // unknown to this server, ignored
+    }
+}
+
+int stream_next_input(ClientStream *stream, const int *masters, char *data, StreamInput *input) {
+    Frame frame;
+    int consumed;
+
+    input->length = 0;
+    input->request = RESPONSE_OK;
+    while (input->length == 0 && input->request == RESPONSE_OK &&
+           (consumed = decode_frame(stream->input, stream->input_length, &frame)) != 0) {
+        if (consumed < 0) {
+            return -1;
+        }
+        const int channel = (int)frame.control_code;     // for channel frames
+        input->channel = stream->input_channel;
+        if (frame.type == RELAY_DATA) {
+            memcpy(data, frame.payload, frame.length);
+            input->length = frame.length;
+        } else if (frame.type == RELAY_CONTROL && masters[stream->input_channel] != -1) {
+            input->length = apply_control(stream, masters[stream->input_channel], &frame, data);
+        } else if (frame.type >= CHANNEL_OPEN && frame.type <= CHANNEL_CLOSE) {
+            if (channel >= CHANNEL_MAX || (!stream->channels && frame.type != CHANNEL_OPEN)) {
+                return -1;
+            }
+            if (frame.type == CHANNEL_SELECT) {
+                stream->input_channel = channel;
+            } else if (!stream->channels) {
+                stream_send_channel(stream, CHANNEL_CLOSE, channel);    // a CHANNEL_OPEN, refused
+            } else if (frame.type == CHANNEL_WINDOW && decode_channel_credit(&frame, &input->credit) == -1) {
+                return -1;
+            } else {
+                input->channel = channel;
+                input->request = frame.type;
+            }
+        }
+        stream->input_length -= consumed;
+        memmove(stream->input, stream->input + consumed, stream->input_length);
+    }
+    return 0;
+}
+
+int stream_finish(ClientStream *stream, const int fd) {
+    if (!stream->compressed) {
+        return 0;
+    }
+    int status = Z_OK;
+    while (status == Z_OK) {
+        if (write_wire(stream, fd) != 1) {
+            return -1;
+        }
+        z_stream *deflater = &stream->deflater;
+        deflater->next_in = NULL;
+        deflater->avail_in = 0;
+        deflater->next_out = (Bytef *)stream->wire;
+        deflater->avail_out = sizeof(stream->wire);
+        status = deflate(deflater, Z_FINISH);
+        stream->wire_length = sizeof(stream->wire) - deflater->avail_out;
+        stream->wire_offset = 0;
+        stream->bytes_out += stream->wire_length;
+    }
+    return status == Z_STREAM_END && write_wire(stream, fd) == 1 ? 0 : -1;
+}
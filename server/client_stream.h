@@ -0,0 +1,206 @@
+/**
+ * @file client_stream.h
+ * @brief A client connection's relay stream: frames and negotiated deflate compression
+ *
+ * Before logging in or resuming, a client may ask for a framed relay
+ * (RELAY_FRAMED) and for compressed output (COMPRESS_REQUEST). Both are
+ * per connection, so the session's output queue and detach backlog always
+ * hold plain shell output and any connection can replay them.
+ *
+ * A framed connection carries RELAY_DATA frames for terminal bytes and
+ * RELAY_CONTROL frames for window size, signals and keepalives in both
+ * directions; the shell's output is framed as it is written, and control
+ * frames go out between data frames.
+ *
+ * A framed connection in fork mode can also carry channels: more shells
+ * opened with CHANNEL_OPEN, each numbered in the control byte. CHANNEL_SELECT
+ * says which channel the data and control frames after it belong to, in
+ * either direction, and each channel's output is limited by a window the
+ * client grants with CHANNEL_WINDOW.
+ *
+ * A compressed connection gets its output, frames included, as one raw
+ * deflate stream, so the 32 KiB window carries over from chunk to chunk for
+ * the whole connection. Bulk output is compressed without flushing, small
+ * chunks and output that has paused are sync-flushed at once so an echo is
+ * never held back. Each compressed connection holds about 256 KiB of zlib
+ * state. Output already compressed for a connection that drops is lost with
+ * it, like the bytes in its socket buffer.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef CLIENT_STREAM_H
+#define CLIENT_STREAM_H
+
+#include "detach.h"
+#include "../protocol.h"
+
+#include <stdint.h>
+#include <zlib.h>
+
+#define COMPRESS_CODEC "deflate"   // the only codec, named in COMPRESS_REQUEST and COMPRESS_START
+#define COMPRESS_LEVEL 1            // fastest zlib level; terminal output still shrinks several times
+#define STREAM_WIRE_SIZE 8192       // encoded bytes held for a client that is slow to take them
+
+/* What a client asked for before logging in or resuming, kept until its stream begins */
+#define STREAM_COMPRESS_ASKED 0x01  // it sent COMPRESS_REQUEST and waits for COMPRESS_START
+#define STREAM_COMPRESS_AGREED 0x02 // it offered a codec this server uses
+#define STREAM_FRAMED 0x04          // it sent RELAY_FRAMED
+#define STREAM_CHANNELS 0x08        // it asked for channels in RELAY_FRAMED
+#define STREAM_SCROLLBACK 0x10      // it sent SCROLLBACK_REQUEST: replay the scrollback on resume
+
+/* Relay state of one client connection */
+typedef struct {
+    int framed;                     // the relay uses RELAY_DATA and RELAY_CONTROL frames
+    int channels;                   // the client may open channels
+    int output_channel;             // channel of the data frames being sent
+    int input_channel;              // channel the client's frames are for
+    size_t frame_left;              // payload of the data frame being sent that is still queued
+    char control[MESSAGE_MAX_WIRE_SIZE];    // control frames waiting for the current data frame to end
+    size_t control_length;
+    char input[FRAME_MAX_WIRE_SIZE];        // client bytes of a frame not yet complete
+    size_t input_length;
+
+    z_stream deflater;
+    int compressed;                 // the client asked for compression and the deflater is set up
+    char head[MESSAGE_MAX_WIRE_SIZE];   // frame header or control frame deflate() has not taken all of
+    size_t head_length;
+    size_t head_offset;
+    int unflushed;                  // bytes were deflated since the last sync flush
+    char wire[STREAM_WIRE_SIZE];    // encoded bytes the client has not taken yet
+    size_t wire_length;
+    size_t wire_offset;
+    uint64_t bytes_in;              // connection totals, for the log when the stream ends
+    uint64_t bytes_out;
+    uint64_t nanoseconds;           // time spent in deflate()
+} ClientStream;
+
+/* What stream_next_input() decoded */
+typedef struct {
+    int channel;                    // the channel it is for
+    size_t length;                  // terminal bytes for the channel's PTY
+    ResponseCode request;           // CHANNEL_OPEN, CHANNEL_CLOSE or CHANNEL_WINDOW for the relay, else RESPONSE_OK
+    uint32_t credit;                // CHANNEL_WINDOW: further bytes of the channel's output the client takes
+} StreamInput;
+
+/**
+ * @brief Records a RELAY_FRAMED, COMPRESS_REQUEST or SCROLLBACK_REQUEST message received before the username.
+ * @param requests What the client asked for so far, 0 at first.
+ * @param msg The message.
+ * @return The updated requests, STREAM_* flags.
+ */
+int stream_negotiate(int requests, const Message *msg);
+
+/**
+ * @brief Answers the client's requests and starts a stream for its connection.
+ *
+ * Ends any previous stream first. Sends RELAY_FRAMED if the client asked for
+ * frames, naming channels if it asked for those and the fork mode serves it,
+ * then COMPRESS_START if it asked for compression; if zlib cannot be set up
+ * the client is told no codec and gets plain output.
+ *
+ * @param stream The connection's stream.
+ * @param client_fd The client socket.
+ * @param requests What stream_negotiate() returned, 0 if the client asked for nothing.
+ */
+void stream_begin(ClientStream *stream, int client_fd, int requests);
+
+/**
+ * @brief Carries on, without a word to the client, a plain or framed stream another server process began.
+ *
+ * For a session passed on by an upgrade, which only passes streams that
+ * are not compressed and sit between frames.
+ */
+void stream_adopt(ClientStream *stream, int framed);
+
+/**
+ * @brief Drops the stream, with anything it had not written; logs the compression totals once.
+ * @param client_fd The client the stream was for, for the log.
+ */
+void stream_end(ClientStream *stream, int client_fd);
+
+/**
+ * @brief Writes as much queued output as the client takes, framed and compressed as negotiated.
+ *
+ * For a plain connection this is backlog_flush(). The output is channel 0's.
+ *
+ * @param stream The connection's stream.
+ * @param queue Plain shell output; consumed as it is encoded.
+ * @param fd The client socket.
+ * @param flush Nonzero to sync-flush once the queue is consumed, so the client can show it all.
+ * @return 1 when the queue is consumed and written, 0 if bytes remain, -1 on error.
+ */
+int stream_flush(ClientStream *stream, OutputBacklog *queue, int fd, int flush);
+
+/**
+ * @brief stream_flush() for part of the output of one channel, selecting the channel first if need be.
+ *
+ * A data frame is never interrupted: while frame_left is nonzero the same
+ * channel has to be flushed again before any other.
+ *
+ * @param limit Most bytes of the queue to take.
+ * @return 1 when those bytes are consumed and written, 0 if bytes remain, -1 on error.
+ */
+int stream_flush_channel(ClientStream *stream, int channel, OutputBacklog *queue, int fd, int flush, size_t limit);
+
+/**
+ * @brief Checks whether encoded bytes or a control frame are waiting for the client to take them.
+ */
+int stream_pending(const ClientStream *stream);
+
+/**
+ * @brief Queues a control frame for a framed connection; it goes out with the next stream_flush().
+ * @return 0 on success, -1 if too many control frames are waiting.
+ */
+int stream_send_control(ClientStream *stream, ControlCode control_code, const char *content, size_t length);
+
+/**
+ * @brief Queues a line of text for the user: a NOTICE control frame, or on a plain connection terminal output.
+ * @param queue The output queue a plain connection's notice is added to.
+ * @return 0 on success, -1 if there is no room for it.
+ */
+int stream_send_notice(ClientStream *stream, OutputBacklog *queue, const char *notice);
+
+/**
+ * @brief Queues CHANNEL_OPEN or CHANNEL_CLOSE for a channel, like a control frame.
+ * @return 0 on success, -1 if too many control frames are waiting.
+ */
+int stream_send_channel(ClientStream *stream, ResponseCode type, int channel);
+
+/**
+ * @brief Reads client input from the socket.
+ *
+ * A plain connection's bytes go straight to data; a framed connection's are
+ * kept in the stream for stream_next_input().
+ *
+ * @param data Receives plain input (FRAME_MAX_PAYLOAD bytes).
+ * @return As read(): bytes read, 0 at end of file, -1 on error.
+ */
+ssize_t stream_read_input(ClientStream *stream, int fd, char *data);
+
+/**
+ * @brief Decodes the framed input up to the next terminal bytes or channel request, applying control frames.
+ *
+ * Window sizes are set on the PTY, signals are sent to its foreground
+ * process group and keepalives are answered. Without channels, CHANNEL_OPEN
+ * is refused here.
+ *
+ * @param stream The connection's stream.
+ * @param masters The PTY master of each channel, -1 where none is open; only the first without channels.
+ * @param data Receives the bytes for the PTY (FRAME_MAX_PAYLOAD bytes).
+ * @param input Receives what was decoded; length and request are empty if no complete frame is buffered.
+ * @return 0 on success, -1 if the client sent a malformed frame.
+ */
+int stream_next_input(ClientStream *stream, const int *masters, char *data, StreamInput *input);
+
+/**
+ * @brief Ends a compressed stream with a final block so the client reads plain messages after it.
+ *
+ * For a blocking socket: the final block is written before returning.
+ *
+ * @return 0 on success, -1 if writing failed.
+ */
+int stream_finish(ClientStream *stream, int fd);
+
+#endif // CLIENT_STREAM_H
@@ -0,0 +1,431 @@
+/**
+ * @file detach.c
+ * @brief Detached sessions: tokens, output backlogs and handing a client to its session
+ *
+ * Every process that owns resumable sessions listens on an abstract Unix
+ * seqpacket socket named after its pid, so a token is enough to find the
+ * owner and nothing is left behind in the filesystem. Abstract names can be
+ * bound by anyone, so a client is only handed to, and the owner only
+ * signalled, once SO_PEERCRED shows the listener is that pid running as us.
+ * A handoff connection carries one message: the token, a byte of what the
+ * client asked for, then any bytes the client already sent, with the client
+ * socket attached as SCM_RIGHTS.
+ */
+
+#define _GNU_SOURCE     // MSG_CMSG_CLOEXEC
+
+#include "detach.h"
+#include "server.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/random.h>
+
+static int handoff_fd = -1;
+static pid_t handoff_owner = 0;     // the process handoff_fd was bound for
+
+static char armed_token[SESSION_TOKEN_LENGTH + 1];
+static volatile sig_atomic_t takeover_fd = -1;
+static volatile sig_atomic_t taken_fd = -1;     // a handoff accepted by takeover(), for wait_for_resume()
+
+int backlog_init(OutputBacklog *backlog, const size_t capacity) {
+    if (backlog->data != NULL) {
+        return 0;
+    }
+    backlog->data = malloc(capacity);
+    if (backlog->data == NULL) {
+        perror("malloc backlog");
+        return -1;
+    }
+    backlog->capacity = capacity;
+    backlog->length = 0;
+    backlog->offset = 0;
+    return 0;
+}
+
+void backlog_free(OutputBacklog *backlog) {
+    free(backlog->data);
+    backlog->data = NULL;
+    backlog->capacity = backlog->length = backlog->offset = 0;
+}
+
+/**
+ * @brief Drops the bytes already sent from the front of the backlog.
+ */
+static void backlog_compact(OutputBacklog *backlog) {
+    backlog->length -= backlog->offset;
+    memmove(backlog->data, backlog->data + backlog->offset, backlog->length);
+    backlog->offset = 0;
+}
+
+size_t backlog_append(OutputBacklog *backlog, const char *data, const size_t length) {
+    if (backlog->offset > 0) {
+        /* part of it was already sent on a resume that has since dropped too */
+        backlog_compact(backlog);
+    }
+    const size_t room = backlog->capacity - backlog->length;
+    const size_t copied = length < room ? length : room;
+    memcpy(backlog->data + backlog->length, data, copied);
+    backlog->length += copied;
+    return copied;
+}
+
+int backlog_full(const OutputBacklog *backlog) {
+    return backlog->length - backlog->offset >= backlog->capacity;
+}
+
+size_t backlog_move(OutputBacklog *to, OutputBacklog *from) {
+    const size_t unsent = from->length - from->offset;
+    const size_t kept = unsent > 0 ? backlog_append(to, from->data + from->offset, unsent) : 0;
+    from->length = 0;
+    from->offset = 0;
+    return unsent - kept;
+}
+
+ssize_t backlog_fill(OutputBacklog *backlog, const int fd) {
+    return backlog_fill_at_most(backlog, fd, SIZE_MAX);
+}
+
+ssize_t backlog_fill_at_most(OutputBacklog *backlog, const int fd, const size_t limit) {
+    /* moving at most half the capacity once per half drained keeps this linear */
+    if (backlog->offset > 0 && (backlog->length == backlog->capacity || backlog->offset >= backlog->capacity / 2)) {
+        backlog_compact(backlog);
+    }
+    if (backlog->length == backlog->capacity) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    const size_t room = backlog->capacity - backlog->length;
+    ssize_t nbytes;
+    while ((nbytes = read(fd, backlog->data + backlog->length, room < limit ? room : limit)) == -1 &&
+           errno == EINTR) {}
+    if (nbytes > 0) {
+        backlog->length += nbytes;
+    }
+    return nbytes;
+}
+
+int backlog_flush(OutputBacklog *backlog, const int fd) {
+    while (backlog->offset < backlog->length) {
+        const ssize_t written = write(fd, backlog->data + backlog->offset, backlog->length - backlog->offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        backlog->offset += written;
+    }
+    backlog->length = 0;
+    backlog->offset = 0;
+    return 1;
+}
+
+void session_token_new(char *token) {
+    unsigned char random_bytes[(SESSION_TOKEN_LENGTH - 8) / 2];
+
+    if (getrandom(random_bytes, sizeof(random_bytes), 0) != sizeof(random_bytes)) {
+        /* never expected on Linux; a predictable token would let anyone take the session */
+        perror("getrandom");
+        abort();
+    }
+    snprintf(token, 9, "%08x", (unsigned int)getpid());
+    for (size_t i = 0; i < sizeof(random_bytes); i++) {
+        snprintf(token + 8 + i * 2, 3, "%02x", random_bytes[i]);
+    }
+}
+
+/**
+ * @brief Returns the pid a token names, or -1 if the token is malformed.
+ */
+static pid_t token_owner(const char *token) {
+    if (strlen(token) != SESSION_TOKEN_LENGTH || strspn(token, "0123456789abcdef") != SESSION_TOKEN_LENGTH) {
+        return -1;
+    }
+    char pid_hex[9];
+    memcpy(pid_hex, token, 8);
+    pid_hex[8] = '\0';
+    const long pid = strtol(pid_hex, NULL, 16);
+    return pid > 0 ? (pid_t)pid : -1;
+}
+
+int session_token_is_local(const char *token) {
+    return token_owner(token) == getpid();
+}
+
+int session_token_matches(const char *a, const char *b) {
+    unsigned char difference = 0;
+    for (int i = 0; i < SESSION_TOKEN_LENGTH; i++) {
+        difference |= (unsigned char)(a[i] ^ b[i]);
+    }
+    return difference == 0;
+}
+
+static socklen_t handoff_address(const pid_t pid, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    /* sun_path[0] stays NUL: an abstract name */
+    const int length = snprintf(address->sun_path + 1, sizeof(address->sun_path) - 1, "eggshell-handoff-%08x", (unsigned int)pid);
+    return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + length);
+}
+
+int handoff_socket() {
+    if (handoff_fd != -1 && handoff_owner == getpid()) {
+        return handoff_fd;
+    }
+    if (handoff_fd != -1) {
+        close(handoff_fd);  // inherited from the parent, whose name it carries
+    }
+
+    struct sockaddr_un address;
+    const socklen_t length = handoff_address(getpid(), &address);
+    handoff_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (handoff_fd == -1) {
+        perror("socket handoff");
+        return -1;
+    }
+    /* listen() records our credentials, which handoff_client() checks */
+    if (bind(handoff_fd, (struct sockaddr *)&address, length) == -1 || listen(handoff_fd, SOMAXCONN) == -1) {
+        perror("bind handoff");
+        close(handoff_fd);
+        handoff_fd = -1;
+        return -1;
+    }
+    handoff_owner = getpid();
+    return handoff_fd;
+}
+
+int handoff_client(const char *token, const int client_fd, const int requests, const char *pending, size_t pending_length) {
+    const pid_t owner = token_owner(token);
+    if (owner == -1) {
+        return -1;
+    }
+    if (pending_length > HANDOFF_MAX_PENDING) {
+        pending_length = HANDOFF_MAX_PENDING;
+    }
+
+    const int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket handoff");
+        return -1;
+    }
+
+    struct sockaddr_un address;
+    if (connect(fd, (struct sockaddr *)&address, handoff_address(owner, &address)) == -1) {
+        close(fd);
+        return -1;  // no process has that name, so the session is gone
+    }
+    struct ucred peer;
+    socklen_t peer_length = sizeof(peer);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_length) == -1 ||
+        peer.pid != owner || peer.uid != geteuid()) {
+        log_event("Handoff socket of session %.8s... is held by pid %d, not its owner; refusing the resume.\n",
+                  token, (int)peer.pid);
+        close(fd);
+        return -1;
+    }
+
+    char request = (char)requests;
+    struct iovec parts[3] = {
+        { (void *)token, SESSION_TOKEN_LENGTH },
+        { &request, 1 },
+        { (void *)pending, pending_length },
+    };
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr message = { 0 };
+    message.msg_iov = parts;
+    message.msg_iovlen = pending_length > 0 ? 3 : 2;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &client_fd, sizeof(int));
+
+    const ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+    close(fd);
+    if (sent == -1) {
+        return -1;
+    }
+
+    /* a fork-mode owner may be busy relaying to the connection being replaced */
+    if (server_config.mode == SERVER_MODE_FORK) {
+        kill(owner, SIGUSR1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the next handoff connection, the one takeover() accepted first.
+ * @return The connection, or -1 with errno set.
+ */
+static int next_handoff() {
+    if (taken_fd != -1) {
+        const int connection = taken_fd;
+        taken_fd = -1;
+        return connection;
+    }
+    return accept4(handoff_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+int receive_handoff(char *token, int *client_fd, int *requests, char *pending, size_t *pending_length) {
+    char data[SESSION_TOKEN_LENGTH + 1 + HANDOFF_MAX_PENDING];
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    while (1) {
+        const int connection = next_handoff();
+        if (connection == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        /* the sender writes right after connecting; only our own user may keep us waiting */
+        struct ucred peer;
+        socklen_t peer_length = sizeof(peer);
+        struct pollfd ready = { .fd = connection, .events = POLLIN };
+        if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &peer, &peer_length) == -1 ||
+            peer.uid != geteuid() || poll(&ready, 1, HANDOFF_WAIT_MS) != 1) {
+            close(connection);
+            continue;
+        }
+
+        struct iovec part = { data, sizeof(data) };
+        struct msghdr message = { 0 };
+        message.msg_iov = &part;
+        message.msg_iovlen = 1;
+        message.msg_control = control.space;
+        message.msg_controllen = sizeof(control.space);
+
+        const ssize_t received = recvmsg(connection, &message, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        close(connection);
+
+        int fd = -1;
+        struct cmsghdr *header = received > 0 ? CMSG_FIRSTHDR(&message) : NULL;
+        if (header != NULL && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(header), sizeof(int));
+        }
+        if (fd == -1 || received < SESSION_TOKEN_LENGTH + 1) {
+            if (fd != -1) close(fd);
+            continue;   // not from handoff_client(); drop it
+        }
+
+        memcpy(token, data, SESSION_TOKEN_LENGTH);
+        token[SESSION_TOKEN_LENGTH] = '\0';
+        *requests = (unsigned char)data[SESSION_TOKEN_LENGTH];
+        *pending_length = received - SESSION_TOKEN_LENGTH - 1;
+        memcpy(pending, data + SESSION_TOKEN_LENGTH + 1, *pending_length);
+        *client_fd = fd;
+        return 1;
+    }
+}
+
+/**
+ * @brief SIGUSR1: a handoff was sent here; drop the attached client if it is for our session.
+ *
+ * Accepts the handoff and only peeks at its message, keeping it in taken_fd
+ * for wait_for_resume(). One that is not for our session is closed, which
+ * hangs up on its client; one not yet written is looked at again on the
+ * signal its sender sends after writing it.
+ */
+static void takeover(const int sig) {
+    char head[SESSION_TOKEN_LENGTH];
+    const int saved_errno = errno;
+    (void)sig;
+
+    while (takeover_fd != -1 && handoff_fd != -1) {
+        if (taken_fd == -1 && (taken_fd = accept4(handoff_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+            break;
+        }
+        const ssize_t peeked = recv(taken_fd, head, sizeof(head), MSG_PEEK | MSG_DONTWAIT);
+        if (peeked == sizeof(head) && session_token_matches(head, armed_token)) {
+            shutdown(takeover_fd, SHUT_RDWR);
+            break;
+        }
+        if (peeked == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        close(taken_fd);
+        taken_fd = -1;
+    }
+    errno = saved_errno;
+}
+
+void takeover_arm(const char *token, const int client_fd) {
+    if (strcmp(armed_token, token) != 0) {
+        struct sigaction sa;
+        memcpy(armed_token, token, sizeof(armed_token));
+        sa.sa_handler = takeover;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &sa, NULL);
+        handoff_socket();   // bound only once the handler is in place
+    }
+    takeover_fd = client_fd;
+}
+
+int wait_for_resume(const int master_fd, const char *token, OutputBacklog *backlog, int *requests,
+                    char *pending, size_t *pending_length) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const time_t deadline = now.tv_sec + server_config.detach_grace;
+
+    if (handoff_socket() == -1 || backlog_init(backlog, server_config.detach_backlog) == -1) {
+        return -1;
+    }
+
+    while (1) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec >= deadline) {
+            log_event("Detached session %.8s... expired.\n", token);
+            return -1;
+        }
+
+        /* a full backlog leaves the PTY unread, so the shell blocks on its output */
+        struct pollfd fds[2] = {
+            { .fd = handoff_fd, .events = POLLIN },
+            { .fd = master_fd, .events = backlog_full(backlog) ? 0 : POLLIN },
+        };
+        /* a handoff takeover() already accepted is not in the listen queue any more */
+        if (poll(fds, 2, taken_fd != -1 ? 0 : (int)(deadline - now.tv_sec) * 1000) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return -1;
+        }
+
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            const ssize_t nbytes = backlog_fill(backlog, master_fd);
+            if (nbytes == 0 || (nbytes == -1 && errno != EAGAIN && errno != ENOBUFS)) {
+                log_event("Shell of detached session %.8s... exited.\n", token);
+                return -1;
+            }
+        }
+
+        if ((fds[0].revents & POLLIN) || taken_fd != -1) {
+            char presented[SESSION_TOKEN_LENGTH + 1];
+            int client_fd;
+            while (receive_handoff(presented, &client_fd, requests, pending, pending_length) == 1) {
+                if (session_token_matches(presented, token)) {
+                    return client_fd;
+                }
+                send_response(client_fd, SESSION_RESUME_FAIL, NULL);
+                close(client_fd);
+            }
+        }
+    }
+}
@@ -0,0 +1,171 @@
+/**
+ * @file detach.h
+ * @brief Detached sessions: tokens, output backlogs and handing a client to its session
+ *
+ * When a client disconnects, its shell is kept running for a grace period
+ * and its output is kept in a bounded backlog. Once the backlog is full the
+ * PTY is no longer read, so the shell blocks instead of output being lost.
+ * A reconnecting client presents the session token instead of a username.
+ *
+ * The token names the process that owns the session. A resume that arrives
+ * at another process (another worker, or a new fork-mode connection child)
+ * is passed on to the owner: the client socket travels over a Unix seqpacket
+ * connection with SCM_RIGHTS, once the listener's credentials show it is
+ * the owner.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef DETACH_H
+#define DETACH_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define SESSION_TOKEN_LENGTH 32     // hex characters: the owner's pid, then 96 random bits
+#define DETACH_GRACE 60             // default seconds a detached session is kept
+#define DETACH_BACKLOG 65536        // default bytes of output kept for a detached session
+#define HANDOFF_MAX_PENDING 1024    // client bytes that can travel with a handed-off socket
+#define HANDOFF_WAIT_MS 100         // how long an owner waits for a handoff connection's message
+
+/* Bounded output waiting for a client: a session's output queue, or what it produced while detached */
+typedef struct {
+    char *data;
+    size_t capacity;
+    size_t length;
+    size_t offset;      // bytes at the front already sent
+} OutputBacklog;
+
+/**
+ * @brief Allocates the backlog's buffer if it has none yet.
+ * @return 0 on success, -1 on failure.
+ */
+int backlog_init(OutputBacklog *backlog, size_t capacity);
+
+/**
+ * @brief Frees the backlog's buffer.
+ */
+void backlog_free(OutputBacklog *backlog);
+
+/**
+ * @brief Copies data into the backlog.
+ * @return The number of bytes that fit.
+ */
+size_t backlog_append(OutputBacklog *backlog, const char *data, size_t length);
+
+/**
+ * @brief Checks whether the backlog has no room left, counting bytes already sent as room.
+ */
+int backlog_full(const OutputBacklog *backlog);
+
+/**
+ * @brief Moves the unsent part of one backlog to the end of another and empties the source.
+ * @return The number of bytes that did not fit and were dropped.
+ */
+size_t backlog_move(OutputBacklog *to, OutputBacklog *from);
+
+/**
+ * @brief Reads from a descriptor into the backlog's free space.
+ *
+ * Sent bytes at the front are reclaimed first once they take up half the
+ * backlog, so a backlog used as a queue keeps reading while it drains.
+ *
+ * @return Bytes read, 0 at end of file, -1 on error (errno set, EAGAIN included,
+ *         ENOBUFS if the backlog is full).
+ */
+ssize_t backlog_fill(OutputBacklog *backlog, int fd);
+
+/**
+ * @brief backlog_fill() reading at most limit bytes, for output that is under a flow-control window.
+ */
+ssize_t backlog_fill_at_most(OutputBacklog *backlog, int fd, size_t limit);
+
+/**
+ * @brief Writes as much of the backlog as the descriptor accepts.
+ * @return 1 when the backlog is empty, 0 if bytes remain, -1 on error.
+ */
+int backlog_flush(OutputBacklog *backlog, int fd);
+
+/**
+ * @brief Creates a token for a session owned by this process.
+ * @param token Receives SESSION_TOKEN_LENGTH characters and a terminating NUL.
+ */
+void session_token_new(char *token);
+
+/**
+ * @brief Compares two tokens in constant time.
+ */
+int session_token_matches(const char *a, const char *b);
+
+/**
+ * @brief Checks that a token is well formed and owned by this process.
+ */
+int session_token_is_local(const char *token);
+
+/**
+ * @brief Returns this process's socket for receiving handed-off clients.
+ *
+ * The socket is bound on first use and is non-blocking.
+ *
+ * @return The socket, or -1 if it could not be created.
+ */
+int handoff_socket();
+
+/**
+ * @brief Passes a client that asked to resume a session to the process owning it.
+ *
+ * @param token The token the client presented.
+ * @param client_fd The client socket; the caller still closes its own copy.
+ * @param requests What the client asked for before resuming, see stream_negotiate().
+ * @param pending Bytes already read from the client after its resume message.
+ * @param pending_length Number of pending bytes.
+ * The owner is signalled in fork mode, and only after the socket named for
+ * it turned out to be held by that pid running as this server's user.
+ *
+ * @return 0 if the owner received the client, -1 if there is no such owner.
+ */
+int handoff_client(const char *token, int client_fd, int requests, const char *pending, size_t pending_length);
+
+/**
+ * @brief Receives one handed-off client from handoff_socket().
+ *
+ * @param token Receives the presented token (SESSION_TOKEN_LENGTH + 1 bytes).
+ * @param client_fd Receives the client socket.
+ * @param requests Receives what the client asked for before resuming.
+ * @param pending Receives the pending bytes (HANDOFF_MAX_PENDING bytes).
+ * @param pending_length Receives the number of pending bytes.
+ * @return 1 if a client was received, 0 if none is waiting, -1 on error.
+ */
+int receive_handoff(char *token, int *client_fd, int *requests, char *pending, size_t *pending_length);
+
+/**
+ * @brief Lets a resume take this process's session over from a connection that is still open.
+ *
+ * For fork mode, where the relay engines watch only the client and the PTY.
+ * When a resume with this token is handed to the process, the attached
+ * client socket is shut down, which ends the relay so the resume can be
+ * picked up.
+ *
+ * @param token The session's token.
+ * @param client_fd The attached client socket, or -1 while detached.
+ */
+void takeover_arm(const char *token, int client_fd);
+
+/**
+ * @brief Waits, detached, for a client to resume a fork-mode session.
+ *
+ * Reads shell output into the backlog until it is full.
+ *
+ * @param master_fd The session's PTY master.
+ * @param token The session's token.
+ * @param backlog Receives the shell's output meanwhile.
+ * @param requests Receives what the new client asked for before resuming.
+ * @param pending Receives bytes the new client already sent (HANDOFF_MAX_PENDING bytes).
+ * @param pending_length Receives the number of pending bytes.
+ * @return The resumed client socket, or -1 if the grace period ran out or the shell exited.
+ */
+int wait_for_resume(int master_fd, const char *token, OutputBacklog *backlog, int *requests,
+                    char *pending, size_t *pending_length);
+
+#endif // DETACH_H
@@ -0,0 +1,1048 @@
+/**
+ * @file eggbench.c
+ * @brief Load generator and latency benchmark for the server
+ *
+ * Opens a number of sessions against a server, logs each in with a user from
+ * a users file and runs a workload script in all of them at once, then
+ * reports login latency, keystroke echo round trips, command latency and
+ * bulk output throughput, as a table and optionally as JSON.
+ *
+ * One thread drives every session from an epoll loop, as a real client would
+ * type: a keystroke is sent, its echo awaited and timed, and the next one
+ * follows after a think time. A command line ends with "; echo EGGBENCH-DONE"
+ * and is done when that marker comes back and the shell prompts again;
+ * nothing is sent while the shell is busy because egg_shell flushes
+ * typeahead before each prompt.
+ *
+ * A workload script has one step per line, '#' starting a comment:
+ *
+ *     keys 20          type "echo kkk..." a keystroke at a time, then run it
+ *     run ls -l        run a command and time it to the prompt
+ *     bulk 1048576     cat a file of that many bytes and time the output
+ *     sleep 500        idle for that many milliseconds
+ *
+ * The server counts the benchmark against its admission limits like any
+ * other client, so a run with many sessions from localhost needs the server
+ * started with, for example, -I 0 -U 0 -P 0 -S 0.
+ */
+
+#include "server.h"
+#include "bench_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <zlib.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define BENCH_MARKER "EGGBENCH-DONE"
+#define BENCH_MAX_STEPS 64
+#define BENCH_MAX_USERS 1024
+#define BENCH_MAX_REASONS 16
+#define BENCH_COMMAND_LENGTH 256
+#define BENCH_READ_SIZE 65536
+#define BENCH_BULK_LINE 64      // bytes per line of a bulk file, newline included
+
+typedef enum {
+    STEP_KEYS,
+    STEP_RUN,
+    STEP_BULK,
+    STEP_SLEEP
+} StepKind;
+
+/* One line of the workload script */
+typedef struct {
+    StepKind kind;
+    long count;                             // keystrokes, bytes or milliseconds
+    char command[BENCH_COMMAND_LENGTH];     // run and bulk: the command line, without the marker
+} Step;
+
+typedef struct {
+    char name[MAX_USERNAME_LENGTH + 1];
+    char password[MAX_PASSWORD_LENGTH + 1];
+} BenchUser;
+
+typedef enum {
+    PHASE_WAITING,      // not started yet; connects at wake_at
+    PHASE_CONNECTING,
+    PHASE_USERNAME,     // waiting for the username prompt
+    PHASE_PASSWORD,     // waiting for the password prompt
+    PHASE_AUTH,
+    PHASE_TOKEN,
+    PHASE_FRAMED,       // waiting for RELAY_FRAMED to be confirmed
+    PHASE_COMPRESS,     // waiting for COMPRESS_START
+    PHASE_RELAY,
+    PHASE_FINISHED
+} Phase;
+
+/* What a session in the relay waits for in the shell's output */
+typedef enum {
+    AWAIT_NOTHING,      // idle until wake_at
+    AWAIT_ECHO,         // the echo of the keystroke just sent
+    AWAIT_ENTER,        // the newline the shell echoes for a command line
+    AWAIT_MARKER,       // the marker the command line ends with
+    AWAIT_PROMPT,       // the prompt after the marker, or the first one after logging in
+    AWAIT_EOF           // the server closing the connection after "exit"
+} Await;
+
+typedef struct {
+    int fd;
+    Phase phase;
+    const BenchUser *user;
+
+    Await await;
+    const char *needle;     // for AWAIT_ENTER, AWAIT_MARKER and AWAIT_PROMPT
+    size_t matched;         // bytes of the needle matched so far
+    char echo;              // for AWAIT_ECHO
+    int logged_in;          // the first prompt has been seen
+    int step;               // the workload step running
+    int round;              // how many times the workload has run
+    long typed;             // keystrokes of a keys step sent so far
+    uint64_t started;       // when the connection or the awaited thing began
+    uint64_t wake_at;       // when to connect, type the next key or end a sleep; 0 for never
+    uint64_t deadline;      // when what is awaited is overdue
+    uint64_t bulk_bytes;    // output of a bulk step so far
+
+    int framed;
+    int compressed;
+    z_stream inflater;
+    char in[FRAME_MAX_WIRE_SIZE];   // a message or frame not complete yet
+    size_t in_length;
+} BenchSession;
+
+typedef enum {
+    OUTCOME_COMPLETED,
+    OUTCOME_REFUSED,
+    OUTCOME_FAILED
+} Outcome;
+
+typedef struct {
+    char text[128];
+    int count;
+} Reason;
+
+/* Command line settings */
+static struct {
+    const char *address;
+    int port;
+    int sessions;
+    double ramp;            // sessions started per second, 0 for all at once
+    const char *users_path;
+    const char *script_path;
+    int rounds;
+    long think_ms;
+    int framed;
+    int compress;
+    int pipelined;          // log in with one AUTH_REQUEST instead of answering prompts
+    const char *prompt;
+    long timeout_ms;
+    const char *json_path;
+} config = {
+    .address = "127.0.0.1",
+    .port = DEFAULT_PORT,
+    .sessions = 10,
+    .users_path = "users.txt",
+    .rounds = 1,
+    .think_ms = 20,
+    .prompt = "%",
+    .timeout_ms = 30000,
+};
+
+static Step steps[BENCH_MAX_STEPS];
+static int step_count = 0;
+static BenchUser users[BENCH_MAX_USERS];
+static int user_count = 0;
+static int epoll_fd = -1;
+
+/* Results */
+static Samples login_ms, echo_ms, command_ms, bulk_rate;
+static int outcomes[3];
+static Reason reasons[BENCH_MAX_REASONS];
+static uint64_t bulk_total, bulk_first_start, bulk_last_end;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-a address] [-n sessions] [-R rate] [-u users] [-s script] [-r rounds] [-k think_ms] [-f] [-z] [-L] [-P prompt] [-T timeout_s] [-j file] [port]\n", program);
+    fprintf(stderr, "  -a address  server IPv4 address (default 127.0.0.1)\n");
+    fprintf(stderr, "  -n sessions concurrent sessions (default 10)\n");
+    fprintf(stderr, "  -R rate     sessions started per second (default all at once)\n");
+    fprintf(stderr, "  -u users    user:password file, used round robin (default users.txt)\n");
+    fprintf(stderr, "  -s script   workload script (default: keys 20, run pwd, bulk 1048576)\n");
+    fprintf(stderr, "  -r rounds   times each session runs the script (default 1)\n");
+    fprintf(stderr, "  -k think_ms pause between keystrokes (default 20)\n");
+    fprintf(stderr, "  -f          ask for a framed relay\n");
+    fprintf(stderr, "  -z          ask for compressed output\n");
+    fprintf(stderr, "  -L          log in with a single pipelined AUTH_REQUEST\n");
+    fprintf(stderr, "  -P prompt   text the shell prompts with (default %%)\n");
+    fprintf(stderr, "  -T timeout  seconds a session may wait for any reply (default 30)\n");
+    fprintf(stderr, "  -j file     also write the results as JSON, - for stdout\n");
+}
+
+/**
+ * @brief Reads user:password lines; blank lines and lines starting with '#' are skipped.
+ * @return 0 on success, -1 if the file cannot be read or has no users.
+ */
+static int read_bench_users(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    char line[256];
+    while (user_count < BENCH_MAX_USERS && fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *colon = strchr(line, ':');
+        if (line[0] == '#' || colon == NULL ||
+            colon - line > MAX_USERNAME_LENGTH || strlen(colon + 1) > MAX_PASSWORD_LENGTH) {
+            continue;   // the server would not take it either
+        }
+        *colon = '\0';
+        BenchUser *user = &users[user_count++];
+        memcpy(user->name, line, colon - line + 1);
+        memcpy(user->password, colon + 1, strlen(colon + 1) + 1);
+    }
+    fclose(file);
+    if (user_count == 0) {
+        fprintf(stderr, "%s: no user:password lines\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses one script line into the next step.
+ * @return 0 on success or for a blank line, -1 if it is malformed.
+ */
+static int parse_step(char *line) {
+    line[strcspn(line, "#\r\n")] = '\0';
+    char *word = line + strspn(line, " \t");
+    if (*word == '\0') {
+        return 0;
+    }
+    if (step_count == BENCH_MAX_STEPS) {
+        fprintf(stderr, "more than %d steps\n", BENCH_MAX_STEPS);
+        return -1;
+    }
+
+    const size_t length = strcspn(word, " \t");
+    char *argument = word + length;
+    argument += strspn(argument, " \t");
+    Step *step = &steps[step_count];
+    char *end;
+    step->count = strtol(argument, &end, 10);
+    const int number = end != argument && *end == '\0' && step->count > 0;
+
+    if (length == 4 && strncmp(word, "keys", 4) == 0 && number) {
+        step->kind = STEP_KEYS;
+    } else if (length == 4 && strncmp(word, "bulk", 4) == 0 && number) {
+        step->kind = STEP_BULK;
+    } else if (length == 5 && strncmp(word, "sleep", 5) == 0 && number) {
+        step->kind = STEP_SLEEP;
+    } else if (length == 3 && strncmp(word, "run", 3) == 0 && *argument != '\0') {
+        step->kind = STEP_RUN;
+        snprintf(step->command, sizeof(step->command), "%s", argument);
+    } else {
+        return -1;
+    }
+    step_count++;
+    return 0;
+}
+
+static int load_script(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    char line[BENCH_COMMAND_LENGTH + 16];
+    int number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        number++;
+        if (parse_step(line) == -1) {
+            fprintf(stderr, "%s:%d: expected keys N, run COMMAND, bulk BYTES or sleep MS\n", path, number);
+            fclose(file);
+            return -1;
+        }
+    }
+    fclose(file);
+    if (step_count == 0) {
+        fprintf(stderr, "%s: no steps\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static void default_script() {
+    char lines[][32] = { "keys 20", "run pwd", "bulk 1048576" };
+    for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+        parse_step(lines[i]);
+    }
+}
+
+/**
+ * @brief Writes the file each bulk step cats, in /tmp, and points its command at it.
+ * @return 0 on success, -1 if a file could not be written.
+ */
+static int prepare_bulk_files() {
+    char line[BENCH_BULK_LINE];
+    for (int i = 0; i < BENCH_BULK_LINE - 1; i++) {
+        line[i] = "abcdefghijklmnopqrstuvwxyz0123456789"[i % 36];
+    }
+    line[BENCH_BULK_LINE - 1] = '\n';
+
+    for (int i = 0; i < step_count; i++) {
+        if (steps[i].kind != STEP_BULK) {
+            continue;
+        }
+        char path[64];
+        snprintf(path, sizeof(path), "/tmp/eggbench-%d-%ld", (int)getpid(), steps[i].count);
+        snprintf(steps[i].command, sizeof(steps[i].command), "cat %s", path);
+        if (access(path, R_OK) == 0) {
+            continue;   // an earlier step of the same size
+        }
+        FILE *file = fopen(path, "w");
+        if (file == NULL) {
+            perror(path);
+            return -1;
+        }
+        for (long left = steps[i].count; left > 0; left -= BENCH_BULK_LINE) {
+            const size_t length = left < BENCH_BULK_LINE ? (size_t)left : BENCH_BULK_LINE;
+            fwrite(line + BENCH_BULK_LINE - length, 1, length, file);
+        }
+        if (fclose(file) != 0) {
+            perror(path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void remove_bulk_files() {
+    for (int i = 0; i < step_count; i++) {
+        if (steps[i].kind == STEP_BULK) {
+            unlink(steps[i].command + strlen("cat "));
+        }
+    }
+}
+
+/* Counts why sessions did not complete, by message */
+static void add_reason(const char *text) {
+    for (int i = 0; i < BENCH_MAX_REASONS; i++) {
+        if (reasons[i].count == 0) {
+            snprintf(reasons[i].text, sizeof(reasons[i].text), "%s", text);
+        }
+        if (strncmp(reasons[i].text, text, sizeof(reasons[i].text) - 1) == 0) {
+            reasons[i].count++;
+            return;
+        }
+    }
+}
+
+static void finish(BenchSession *session, const Outcome outcome, const char *reason) {
+    if (session->phase == PHASE_FINISHED) {
+        return;
+    }
+    if (session->fd != -1) {
+        close(session->fd);
+        session->fd = -1;
+    }
+    if (session->compressed) {
+        inflateEnd(&session->inflater);
+        session->compressed = 0;
+    }
+    session->phase = PHASE_FINISHED;
+    session->wake_at = session->deadline = 0;
+    outcomes[outcome]++;
+    if (reason != NULL) {
+        add_reason(reason);
+    }
+}
+
+/**
+ * @brief Writes to the server; anything this client sends fits in an idle socket buffer.
+ * @return 0 on success, -1 if the session failed.
+ */
+static int send_bytes(BenchSession *session, const char *data, const size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        const ssize_t result = send(session->fd, data + sent, length - sent, MSG_NOSIGNAL);
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            finish(session, OUTCOME_FAILED, errno == EAGAIN ? "server not reading input" : "write to server failed");
+            return -1;
+        }
+        sent += result;
+    }
+    return 0;
+}
+
+static int send_text_message(BenchSession *session, const ResponseCode code, const char *content) {
+    Message msg = { .status_code = code, .control_code = ESCAPE_CODE_NONE };
+    msg.content_length = snprintf(msg.content, sizeof(msg.content), "%s", content);
+    char wire[MESSAGE_MAX_WIRE_SIZE];
+    const int length = encode_message(&msg, wire, sizeof(wire));
+    return send_bytes(session, wire, length);
+}
+
+/**
+ * @brief Sends the requests for a framed relay and compression, then the username or the whole login, in one write.
+ * @return 0 on success, -1 if the session failed.
+ */
+static int send_login(BenchSession *session) {
+    char wire[3 * MESSAGE_MAX_WIRE_SIZE];
+    Message msg = { .control_code = ESCAPE_CODE_NONE };
+    int length = 0;
+
+    if (config.framed) {
+        msg.status_code = RELAY_FRAMED;
+        msg.content_length = 0;
+        length += encode_message(&msg, wire + length, sizeof(wire) - length);
+    }
+    if (config.compress) {
+        msg.status_code = COMPRESS_REQUEST;
+        msg.content_length = snprintf(msg.content, sizeof(msg.content), "%s", COMPRESS_CODEC);
+        length += encode_message(&msg, wire + length, sizeof(wire) - length);
+    }
+    if (config.pipelined) {
+        AuthRequest login = { .rows = 24, .columns = 80, .term = "xterm-256color" };
+        strcpy(login.username, session->user->name);
+        strcpy(login.password, session->user->password);
+        encode_auth_request(&login, &msg);  // always fits: the users file limits both fields
+    } else {
+        msg.status_code = RESPONSE_OK;
+        msg.content_length = snprintf(msg.content, sizeof(msg.content), "%s", session->user->name);
+    }
+    length += encode_message(&msg, wire + length, sizeof(wire) - length);
+    return send_bytes(session, wire, length);
+}
+
+/* Terminal input, framed if the relay is */
+static int send_input(BenchSession *session, const char *data, const size_t length) {
+    if (!session->framed) {
+        return send_bytes(session, data, length);
+    }
+    char frame[MESSAGE_HEADER_SIZE + BENCH_COMMAND_LENGTH + 32];
+    encode_frame_header(frame, RELAY_DATA, ESCAPE_CODE_NONE, length);
+    memcpy(frame + MESSAGE_HEADER_SIZE, data, length);
+    return send_bytes(session, frame, MESSAGE_HEADER_SIZE + length);
+}
+
+static void await_output(BenchSession *session, const Await await, const char *needle) {
+    session->await = await;
+    session->needle = needle;
+    session->matched = 0;
+    session->deadline = now_ns() + (uint64_t)config.timeout_ms * 1000000;
+}
+
+static void send_keystroke(BenchSession *session) {
+    const long typed = session->typed;
+    const char key = typed < 5 ? "echo "[typed] : 'k';
+    session->started = now_ns();
+    if (send_input(session, &key, 1) == 0) {
+        await_output(session, AWAIT_ECHO, NULL);
+        session->echo = key;
+    }
+}
+
+/* Ends the line typed so far with the marker and enters it */
+static void send_line(BenchSession *session, const char *command) {
+    char line[BENCH_COMMAND_LENGTH + 32];
+    const int length = snprintf(line, sizeof(line), "%s; echo " BENCH_MARKER "\n", command);
+    session->started = now_ns();
+    session->bulk_bytes = 0;
+    if (send_input(session, line, length) == 0) {
+        await_output(session, AWAIT_ENTER, "\r\n");
+    }
+}
+
+/* Starts the session's current step, or the next round, or logs out */
+static void start_step(BenchSession *session) {
+    if (session->step == step_count) {
+        session->step = 0;
+        if (++session->round == config.rounds) {
+            if (send_input(session, "exit\n", 5) == 0) {
+                await_output(session, AWAIT_EOF, NULL);
+            }
+            return;
+        }
+    }
+
+    Step *step = &steps[session->step];
+    switch (step->kind) {
+        case STEP_KEYS:
+            session->typed = 0;
+            send_keystroke(session);
+            break;
+        case STEP_RUN:
+        case STEP_BULK:
+            send_line(session, step->command);
+            break;
+        case STEP_SLEEP:
+            session->await = AWAIT_NOTHING;
+            session->deadline = 0;
+            session->wake_at = now_ns() + (uint64_t)step->count * 1000000;
+            break;
+    }
+}
+
+/* Records what the end of a command line measures */
+static void command_done(BenchSession *session, const uint64_t now) {
+    const Step *step = &steps[session->step];
+    if (step->kind == STEP_RUN) {
+        samples_add(&command_ms, (double)(now - session->started) / 1e6);
+    } else if (step->kind == STEP_BULK) {
+        const double seconds = (double)(now - session->started) / 1e9;
+        samples_add(&bulk_rate, (double)session->bulk_bytes / (1024.0 * 1024.0) / seconds);
+        bulk_total += session->bulk_bytes;
+        if (bulk_first_start == 0 || session->started < bulk_first_start) {
+            bulk_first_start = session->started;
+        }
+        if (now > bulk_last_end) {
+            bulk_last_end = now;
+        }
+    }
+}
+
+/* Advances the needle over one output byte; returns 1 when it is matched in full */
+static int match_byte(BenchSession *session, const char c) {
+    if (c == session->needle[session->matched]) {
+        session->matched++;
+    } else {
+        session->matched = c == session->needle[0] ? 1 : 0;
+    }
+    if (session->needle[session->matched] == '\0') {
+        session->matched = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/* Plain terminal output from the shell */
+static void feed_output(BenchSession *session, const char *data, const size_t length) {
+    const uint64_t now = now_ns();
+    for (size_t i = 0; i < length && session->phase == PHASE_RELAY; i++) {
+        switch (session->await) {
+            case AWAIT_NOTHING:
+            case AWAIT_EOF:
+                return;
+            case AWAIT_ECHO:
+                if (data[i] != session->echo) {
+                    break;
+                }
+                samples_add(&echo_ms, (double)(now - session->started) / 1e6);
+                session->await = AWAIT_NOTHING;
+                session->deadline = 0;
+                if (++session->typed == steps[session->step].count) {
+                    send_line(session, "");
+                } else if (config.think_ms > 0) {
+                    session->wake_at = now + (uint64_t)config.think_ms * 1000000;
+                } else {
+                    send_keystroke(session);
+                }
+                break;
+            case AWAIT_ENTER:
+                if (match_byte(session, data[i])) {
+                    await_output(session, AWAIT_MARKER, BENCH_MARKER "\r\n");
+                }
+                break;
+            case AWAIT_MARKER:
+                session->bulk_bytes++;
+                if (match_byte(session, data[i])) {
+                    session->bulk_bytes -= strlen(BENCH_MARKER "\r\n");
+                    command_done(session, now);
+                    await_output(session, AWAIT_PROMPT, config.prompt);
+                }
+                break;
+            case AWAIT_PROMPT:
+                if (!match_byte(session, data[i])) {
+                    break;
+                }
+                if (session->logged_in) {
+                    session->step++;
+                } else {
+                    samples_add(&login_ms, (double)(now - session->started) / 1e6);
+                    session->logged_in = 1;
+                }
+                session->deadline = 0;
+                start_step(session);
+                break;
+        }
+    }
+}
+
+/* Relay bytes once inflated: frames, or plain output */
+static void feed_wire(BenchSession *session, const char *data, size_t length) {
+    if (!session->framed) {
+        feed_output(session, data, length);
+        return;
+    }
+    while (length > 0 && session->phase == PHASE_RELAY) {
+        const size_t take = length < sizeof(session->in) - session->in_length ? length : sizeof(session->in) - session->in_length;
+        memcpy(session->in + session->in_length, data, take);
+        session->in_length += take;
+        data += take;
+        length -= take;
+
+        size_t used = 0;
+        Frame frame;
+        int consumed;
+        while ((consumed = decode_frame(session->in + used, session->in_length - used, &frame)) > 0) {
+            used += consumed;
+            if (frame.type == RELAY_DATA) {
+                feed_output(session, frame.payload, frame.length);
+                if (session->phase != PHASE_RELAY) {
+                    return;
+                }
+            }
+        }
+        if (consumed == -1) {
+            finish(session, OUTCOME_FAILED, "malformed frame");
+            return;
+        }
+        memmove(session->in, session->in + used, session->in_length - used);
+        session->in_length -= used;
+    }
+}
+
+/* Relay bytes as read from the socket */
+static void feed_relay(BenchSession *session, const char *data, const size_t length) {
+    if (session->await == AWAIT_EOF) {
+        return;     // the goodbye, and a compressed stream's final block
+    }
+    if (!session->compressed) {
+        feed_wire(session, data, length);
+        return;
+    }
+
+    char plain[BENCH_READ_SIZE];
+    session->inflater.next_in = (Bytef *)data;
+    session->inflater.avail_in = length;
+    do {
+        session->inflater.next_out = (Bytef *)plain;
+        session->inflater.avail_out = sizeof(plain);
+        const int result = inflate(&session->inflater, Z_NO_FLUSH);
+        if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+            finish(session, OUTCOME_FAILED, "corrupt compressed stream");
+            return;
+        }
+        feed_wire(session, plain, sizeof(plain) - session->inflater.avail_out);
+        if (result == Z_STREAM_END) {
+            return;
+        }
+    } while (session->phase == PHASE_RELAY && session->inflater.avail_out == 0);
+}
+
+static void start_relay(BenchSession *session) {
+    session->phase = PHASE_RELAY;
+    await_output(session, AWAIT_PROMPT, config.prompt);
+}
+
+/* One login message from the server */
+static void handle_message(BenchSession *session, const Message *msg) {
+    if (msg->status_code == CONNECTION_FAILURE) {
+        finish(session, OUTCOME_REFUSED, msg->content);
+        return;
+    }
+
+    switch (session->phase) {
+        case PHASE_USERNAME:
+            if (config.pipelined) {
+                session->phase = PHASE_AUTH;    // the login went out with the connection
+            } else if (send_login(session) == 0) {
+                session->phase = PHASE_PASSWORD;
+            }
+            break;
+        case PHASE_PASSWORD:
+            if (send_text_message(session, RESPONSE_OK, session->user->password) == 0) {
+                session->phase = PHASE_AUTH;
+            }
+            break;
+        case PHASE_AUTH:
+            if (msg->status_code != AUTH_SUCCESS) {
+                finish(session, OUTCOME_FAILED, "authentication failed");
+                return;
+            }
+            session->phase = PHASE_TOKEN;
+            break;
+        case PHASE_TOKEN:
+            if (config.framed) {
+                session->phase = PHASE_FRAMED;
+            } else if (config.compress) {
+                session->phase = PHASE_COMPRESS;
+            } else {
+                start_relay(session);
+            }
+            break;
+        case PHASE_FRAMED:
+            session->framed = msg->status_code == RELAY_FRAMED;
+            if (config.compress) {
+                session->phase = PHASE_COMPRESS;
+            } else {
+                start_relay(session);
+            }
+            break;
+        case PHASE_COMPRESS:
+            if (msg->status_code == COMPRESS_START && strcmp(msg->content, COMPRESS_CODEC) == 0) {
+                if (inflateInit2(&session->inflater, -MAX_WBITS) != Z_OK) {
+                    finish(session, OUTCOME_FAILED, "zlib initialisation failed");
+                    return;
+                }
+                session->compressed = 1;
+            }
+            start_relay(session);
+            break;
+        default:
+            break;
+    }
+}
+
+/* Bytes read from the server, login messages first and then the relay */
+static void on_bytes(BenchSession *session, const char *data, size_t length) {
+    while (length > 0 && session->phase < PHASE_RELAY) {
+        const size_t take = length < sizeof(session->in) - session->in_length ? length : sizeof(session->in) - session->in_length;
+        memcpy(session->in + session->in_length, data, take);
+        session->in_length += take;
+        data += take;
+        length -= take;
+
+        size_t used = 0;
+        Message msg;
+        int consumed = 0;
+        while (session->phase < PHASE_RELAY &&
+               (consumed = decode_message(session->in + used, session->in_length - used, &msg)) > 0) {
+            used += consumed;
+            handle_message(session, &msg);
+        }
+        if (session->phase == PHASE_FINISHED) {
+            return;
+        }
+        if (consumed == -1) {
+            finish(session, OUTCOME_FAILED, "malformed login message");
+            return;
+        }
+
+        const size_t left = session->in_length - used;
+        if (session->phase == PHASE_RELAY) {
+            /* what follows the last login message already belongs to the relay */
+            char relay[sizeof(session->in)];
+            memcpy(relay, session->in + used, left);
+            session->in_length = 0;
+            feed_relay(session, relay, left);
+        } else {
+            memmove(session->in, session->in + used, left);
+            session->in_length = left;
+        }
+    }
+    if (length > 0 && session->phase == PHASE_RELAY) {
+        feed_relay(session, data, length);
+    }
+}
+
+static void on_readable(BenchSession *session) {
+    static char buffer[BENCH_READ_SIZE];
+    while (session->phase != PHASE_FINISHED) {
+        const ssize_t nbytes = read(session->fd, buffer, sizeof(buffer));
+        if (nbytes > 0) {
+            on_bytes(session, buffer, nbytes);
+        } else if (nbytes == 0) {
+            if (session->phase == PHASE_RELAY && session->await == AWAIT_EOF) {
+                finish(session, OUTCOME_COMPLETED, NULL);
+            } else {
+                finish(session, OUTCOME_FAILED, session->phase < PHASE_RELAY ? "closed during login" : "closed during the workload");
+            }
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else if (errno != EINTR) {
+            finish(session, OUTCOME_FAILED, "read from server failed");
+        }
+    }
+}
+
+static void start_connect(BenchSession *session, const struct sockaddr_in *address) {
+    session->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (session->fd == -1) {
+        perror("socket");
+        finish(session, OUTCOME_FAILED, "socket() failed");
+        return;
+    }
+    const int one = 1;
+    setsockopt(session->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    session->started = now_ns();
+    session->wake_at = 0;
+    session->deadline = session->started + (uint64_t)config.timeout_ms * 1000000;
+    struct epoll_event event = { .events = EPOLLIN | EPOLLOUT, .data.ptr = session };
+    if (connect(session->fd, (const struct sockaddr *)address, sizeof(*address)) == -1 && errno != EINPROGRESS) {
+        finish(session, OUTCOME_FAILED, "connect() failed");
+    } else if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, session->fd, &event) == -1) {
+        perror("epoll_ctl");
+        finish(session, OUTCOME_FAILED, "epoll_ctl() failed");
+    } else {
+        session->phase = PHASE_CONNECTING;
+    }
+}
+
+static void on_connected(BenchSession *session) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(session->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    if (error != 0) {
+        finish(session, OUTCOME_FAILED, strerror(error));
+        return;
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = session };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, session->fd, &event);
+    if (config.pipelined && send_login(session) == -1) {
+        return;
+    }
+    session->phase = PHASE_USERNAME;
+}
+
+/* A session's timer: time to connect or type, a sleep that ended, or a reply that is overdue */
+static void on_timer(BenchSession *session, const uint64_t now, const struct sockaddr_in *address) {
+    if (session->wake_at != 0 && now >= session->wake_at) {
+        session->wake_at = 0;
+        if (session->phase == PHASE_WAITING) {
+            start_connect(session, address);
+        } else if (steps[session->step].kind == STEP_KEYS) {
+            send_keystroke(session);
+        } else {
+            session->step++;
+            start_step(session);
+        }
+    }
+    if (session->deadline != 0 && now >= session->deadline) {
+        finish(session, OUTCOME_FAILED, session->phase < PHASE_RELAY ? "timed out logging in" :
+                                        session->await == AWAIT_ECHO ? "timed out waiting for an echo" :
+                                        session->await == AWAIT_EOF ? "timed out logging out" :
+                                        "timed out waiting for a command");
+    }
+}
+
+/**
+ * @brief Runs every session to its end.
+ * @return The wall time taken, in seconds.
+ */
+static double run(BenchSession *sessions, const struct sockaddr_in *address) {
+    const uint64_t begin = now_ns();
+    for (int i = 0; i < config.sessions; i++) {
+        sessions[i] = (BenchSession){ .fd = -1, .phase = PHASE_WAITING, .user = &users[i % user_count] };
+        sessions[i].wake_at = begin + (config.ramp > 0 ? (uint64_t)(i / config.ramp * 1e9) : 0);
+    }
+
+    struct epoll_event events[256];
+    int finished = 0;
+    while (finished < config.sessions) {
+        uint64_t now = now_ns();
+        uint64_t next = UINT64_MAX;
+        finished = 0;
+        for (int i = 0; i < config.sessions; i++) {
+            BenchSession *session = &sessions[i];
+            on_timer(session, now, address);
+            if (session->phase == PHASE_FINISHED) {
+                finished++;
+            }
+            if (session->wake_at != 0 && session->wake_at < next) {
+                next = session->wake_at;
+            }
+            if (session->deadline != 0 && session->deadline < next) {
+                next = session->deadline;
+            }
+        }
+        if (finished == config.sessions) {
+            break;
+        }
+
+        const int timeout = next == UINT64_MAX ? 1000 : next <= now ? 0 : (int)((next - now + 999999) / 1000000);
+        const int count = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout);
+        if (count == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            BenchSession *session = events[i].data.ptr;
+            if (session->phase == PHASE_CONNECTING) {
+                on_connected(session);
+            }
+            if (session->phase != PHASE_FINISHED && session->phase != PHASE_CONNECTING) {
+                on_readable(session);
+            }
+        }
+    }
+    return (double)(now_ns() - begin) / 1e9;
+}
+
+static void print_row(const char *name, Samples *samples) {
+    const SampleSummary summary = samples_summarise(samples);
+    printf("%-14s %8zu %10.3f %10.3f %10.3f %10.3f %10.3f\n", name, summary.count,
+           summary.mean, summary.p50, summary.p99, summary.p999, summary.max);
+}
+
+static void print_report(const double seconds) {
+    printf("%d sessions: %d completed, %d refused, %d failed in %.2f s\n", config.sessions,
+           outcomes[OUTCOME_COMPLETED], outcomes[OUTCOME_REFUSED], outcomes[OUTCOME_FAILED], seconds);
+    printf("%-14s %8s %10s %10s %10s %10s %10s\n", "", "count", "mean", "p50", "p99", "p99.9", "max");
+    print_row("login ms", &login_ms);
+    print_row("echo ms", &echo_ms);
+    print_row("command ms", &command_ms);
+    print_row("bulk MiB/s", &bulk_rate);
+    if (bulk_total > 0) {
+        printf("bulk output: %.2f MiB, %.2f MiB/s across all sessions\n", (double)bulk_total / (1024.0 * 1024.0),
+               (double)bulk_total / (1024.0 * 1024.0) / ((double)(bulk_last_end - bulk_first_start) / 1e9));
+    }
+    for (int i = 0; i < BENCH_MAX_REASONS && reasons[i].count > 0; i++) {
+        printf("%6d x %s\n", reasons[i].count, reasons[i].text);
+    }
+}
+
+static void write_json_string(FILE *out, const char *text) {
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(out, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(out, "\\u%04x", *c);
+        } else {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static int write_json(const char *path, const double seconds) {
+    FILE *out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (out == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    fprintf(out, "{\"sessions\":%d,\"completed\":%d,\"refused\":%d,\"failed\":%d,\"seconds\":%.4f,",
+            config.sessions, outcomes[OUTCOME_COMPLETED], outcomes[OUTCOME_REFUSED], outcomes[OUTCOME_FAILED], seconds);
+    fprintf(out, "\"mode\":{\"framed\":%s,\"compressed\":%s,\"pipelined\":%s,\"rounds\":%d,\"think_ms\":%ld},",
+            config.framed ? "true" : "false", config.compress ? "true" : "false", config.pipelined ? "true" : "false",
+            config.rounds, config.think_ms);
+    const struct {
+        const char *name;
+        Samples *samples;
+    } measurements[] = {
+        { "login_ms", &login_ms }, { "echo_ms", &echo_ms }, { "command_ms", &command_ms }, { "bulk_mib_per_s", &bulk_rate },
+    };
+    for (size_t i = 0; i < sizeof(measurements) / sizeof(measurements[0]); i++) {
+        const SampleSummary summary = samples_summarise(measurements[i].samples);
+        fprintf(out, "\"%s\":", measurements[i].name);
+        summary_write_json(out, &summary);
+        fputc(',', out);
+    }
+    const double bulk_seconds = (double)(bulk_last_end - bulk_first_start) / 1e9;
+    fprintf(out, "\"bulk_bytes\":%llu,\"bulk_aggregate_mib_per_s\":%.4f,\"errors\":{",
+            (unsigned long long)bulk_total, bulk_total > 0 ? (double)bulk_total / (1024.0 * 1024.0) / bulk_seconds : 0.0);
+    for (int i = 0; i < BENCH_MAX_REASONS && reasons[i].count > 0; i++) {
+        fprintf(out, "%s", i > 0 ? "," : "");
+        write_json_string(out, reasons[i].text);
+        fprintf(out, ":%d", reasons[i].count);
+    }
+    fprintf(out, "}}\n");
+
+    if (out != stdout && fclose(out) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Lets one process hold a socket per session */
+static void raise_file_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "a:n:R:u:s:r:k:fzLP:T:j:")) != -1) {
+        switch (opt) {
+            case 'a': config.address = optarg; break;
+            case 'n': config.sessions = atoi(optarg); break;
+            case 'R': config.ramp = atof(optarg); break;
+            case 'u': config.users_path = optarg; break;
+            case 's': config.script_path = optarg; break;
+            case 'r': config.rounds = atoi(optarg); break;
+            case 'k': config.think_ms = atol(optarg); break;
+            case 'f': config.framed = 1; break;
+            case 'z': config.compress = 1; break;
+            case 'L': config.pipelined = 1; break;
+            case 'P': config.prompt = optarg; break;
+            case 'T': config.timeout_ms = (long)(atof(optarg) * 1000); break;
+            case 'j': config.json_path = optarg; break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind < argc) {
+        config.port = atoi(argv[optind]);
+    }
+    if (config.sessions <= 0 || config.rounds <= 0 || config.think_ms < 0 || config.timeout_ms <= 0 ||
+        config.ramp < 0 || config.prompt[0] == '\0' || config.port <= 0 || config.port > 65535) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(config.port) };
+    if (inet_pton(AF_INET, config.address, &address.sin_addr) != 1) {
+        fprintf(stderr, "%s: not an IPv4 address\n", config.address);
+        return EXIT_FAILURE;
+    }
+    if (read_bench_users(config.users_path) == -1) {
+        return EXIT_FAILURE;
+    }
+    if (config.script_path == NULL) {
+        default_script();
+    } else if (load_script(config.script_path) == -1) {
+        return EXIT_FAILURE;
+    }
+    if (prepare_bulk_files() == -1) {
+        remove_bulk_files();
+        return EXIT_FAILURE;
+    }
+
+    raise_file_limit();
+    epoll_fd = epoll_create1(0);
+    BenchSession *sessions = calloc(config.sessions, sizeof(BenchSession));
+    if (epoll_fd == -1 || sessions == NULL) {
+        perror("eggbench");
+        remove_bulk_files();
+        return EXIT_FAILURE;
+    }
+
+    const double seconds = run(sessions, &address);
+    remove_bulk_files();
+    print_report(seconds);
+    const int written = config.json_path == NULL ? 0 : write_json(config.json_path, seconds);
+
+    free(sessions);
+    close(epoll_fd);
+    samples_free(&login_ms);
+    samples_free(&echo_ms);
+    samples_free(&command_ms);
+    samples_free(&bulk_rate);
+    return written == 0 && outcomes[OUTCOME_COMPLETED] == config.sessions ? EXIT_SUCCESS : EXIT_FAILURE;
+}
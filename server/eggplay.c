@@ -0,0 +1,318 @@
+/**
+ * @file eggplay.c
+ * @brief Player for the server's session recordings
+ *
+ * Writes a recorded session's output to stdout with its original timing,
+ * sped up with -x. With -s playback starts that far into the session: the
+ * index frames are read first, by walking back from the end frame, or by
+ * skipping from frame header to frame header in a recording that was not
+ * closed cleanly, and playback seeks straight to the last one before that
+ * time. Output from there up to the time asked for is written at once, so
+ * the screen is not left empty. With -l the recording is summarised instead.
+ */
+
+#include "recording.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+
+/* A seek point: the session time of an index frame and where it is */
+typedef struct {
+    uint64_t elapsed_us;
+    uint64_t offset;
+} SeekPoint;
+
+typedef struct {
+    SeekPoint *points;
+    size_t count;
+    size_t capacity;
+    int closed;             // the recording ends with an end frame
+    uint64_t length_us;     // session time of the end frame
+} SeekIndex;
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-s seconds] [-x speed] [-i seconds] [-l] file\n", program);
+    fprintf(stderr, "  -s seconds  start this far into the session\n");
+    fprintf(stderr, "  -x speed    play this many times faster, 0 for no pauses (default: 1)\n");
+    fprintf(stderr, "  -i seconds  longest pause, after speeding up (default: none)\n");
+    fprintf(stderr, "  -l          summarise the recording instead of playing it\n");
+}
+
+static int add_point(SeekIndex *index, const uint64_t elapsed_us, const uint64_t offset) {
+    if (index->count == index->capacity) {
+        const size_t capacity = index->capacity == 0 ? 256 : index->capacity * 2;
+        SeekPoint *points = realloc(index->points, capacity * sizeof(SeekPoint));
+        if (points == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        index->points = points;
+        index->capacity = capacity;
+    }
+    index->points[index->count].elapsed_us = elapsed_us;
+    index->points[index->count].offset = offset;
+    index->count++;
+    return 0;
+}
+
+/**
+ * @brief Reads an index or end frame at an offset.
+ * @return 0 on success, -1 if there is no such frame there.
+ */
+static int read_index_at(FILE *file, const uint64_t offset, const RecordingKind kind, RecordingIndex *index) {
+    unsigned char header[RECORDING_FRAME_HEADER];
+    unsigned char payload[RECORDING_INDEX_PAYLOAD];
+    RecordingFrame frame;
+
+    if (fseeko(file, (off_t)offset, SEEK_SET) == -1 ||
+        fread(header, 1, sizeof(header), file) != sizeof(header) ||
+        recording_decode_frame(header, &frame) == -1 || frame.kind != kind ||
+        fread(payload, 1, sizeof(payload), file) != sizeof(payload)) {
+        return -1;
+    }
+    recording_decode_index(payload, index);
+    return 0;
+}
+
+/**
+ * @brief Follows the chain of index frames back from the end frame, one seek per index frame.
+ * @return 0 on success, -1 if the recording has no end frame or the chain is broken.
+ */
+static int load_index_backwards(FILE *file, SeekIndex *index) {
+    RecordingIndex entry;
+
+    if (fseeko(file, 0, SEEK_END) == -1) {
+        return -1;
+    }
+    const off_t end = ftello(file);
+    if (end < RECORDING_FILE_HEADER + RECORDING_FRAME_HEADER + RECORDING_INDEX_PAYLOAD ||
+        read_index_at(file, (uint64_t)end - RECORDING_FRAME_HEADER - RECORDING_INDEX_PAYLOAD, RECORDING_END, &entry) == -1) {
+        return -1;
+    }
+    index->length_us = entry.elapsed_us;
+
+    uint64_t offset = entry.previous;
+    while (offset >= RECORDING_FILE_HEADER) {
+        if (read_index_at(file, offset, RECORDING_INDEX, &entry) == -1 || entry.previous >= offset ||
+            add_point(index, entry.elapsed_us, offset) == -1) {
+            index->count = 0;
+            return -1;
+        }
+        offset = entry.previous;
+    }
+
+    /* found newest first */
+    for (size_t i = 0; i < index->count / 2; i++) {
+        const SeekPoint point = index->points[i];
+        index->points[i] = index->points[index->count - 1 - i];
+        index->points[index->count - 1 - i] = point;
+    }
+    index->closed = 1;
+    return 0;
+}
+
+/**
+ * @brief Collects the index frames by skipping from header to header, for a recording cut short.
+ */
+static void load_index_forwards(FILE *file, SeekIndex *index) {
+    unsigned char header[RECORDING_FRAME_HEADER];
+    unsigned char payload[RECORDING_INDEX_PAYLOAD];
+    RecordingFrame frame;
+    RecordingIndex entry;
+    uint64_t offset = RECORDING_FILE_HEADER;
+
+    if (fseeko(file, RECORDING_FILE_HEADER, SEEK_SET) == -1) {
+        return;
+    }
+    while (fread(header, 1, sizeof(header), file) == sizeof(header) && recording_decode_frame(header, &frame) == 0) {
+        if (frame.kind == RECORDING_INDEX) {
+            if (fread(payload, 1, sizeof(payload), file) != sizeof(payload)) {
+                break;
+            }
+            recording_decode_index(payload, &entry);
+            if (add_point(index, entry.elapsed_us, offset) == -1) {
+                break;
+            }
+            index->length_us = entry.elapsed_us;
+        } else if (fseeko(file, frame.length, SEEK_CUR) == -1) {
+            break;
+        }
+        offset += RECORDING_FRAME_HEADER + frame.length;
+    }
+}
+
+/**
+ * @brief The last seek point at or before a session time.
+ */
+static const SeekPoint *find_point(const SeekIndex *index, const uint64_t elapsed_us) {
+    size_t low = 0, high = index->count;
+    while (high - low > 1) {
+        const size_t middle = low + (high - low) / 2;
+        if (index->points[middle].elapsed_us <= elapsed_us) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return index->count > 0 ? &index->points[low] : NULL;
+}
+
+static void pause_until(struct timespec *deadline, const uint64_t pause_us) {
+    deadline->tv_sec += (time_t)(pause_us / 1000000);
+    deadline->tv_nsec += (long)(pause_us % 1000000) * 1000;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR) {}
+}
+
+static void summarise(FILE *file, const char *path, const uint64_t started_us, const SeekIndex *index) {
+    unsigned char header[RECORDING_FRAME_HEADER];
+    RecordingFrame frame;
+    unsigned long long frames[RECORDING_END + 1] = { 0 };
+    unsigned long long bytes[RECORDING_END + 1] = { 0 };
+
+    fseeko(file, RECORDING_FILE_HEADER, SEEK_SET);
+    while (fread(header, 1, sizeof(header), file) == sizeof(header) && recording_decode_frame(header, &frame) == 0 &&
+           fseeko(file, frame.length, SEEK_CUR) == 0) {
+        frames[frame.kind]++;
+        bytes[frame.kind] += frame.length;
+    }
+
+    const time_t seconds = (time_t)(started_us / 1000000);
+    struct tm tm_info;
+    char stamp[32] = "";
+    if (localtime_r(&seconds, &tm_info) != NULL) {
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm_info);
+    }
+    printf("%s\n", path);
+    printf("  started   %s\n", stamp);
+    printf("  length    %.3fs%s\n", (double)index->length_us / 1e6, index->closed ? "" : " or more, not closed cleanly");
+    printf("  output    %llu bytes in %llu frames\n", bytes[RECORDING_OUTPUT], frames[RECORDING_OUTPUT]);
+    printf("  input     %llu bytes in %llu frames\n", bytes[RECORDING_INPUT], frames[RECORDING_INPUT]);
+    printf("  index     %zu seek points\n", index->count);
+}
+
+int main(int argc, char *argv[]) {
+    double start = 0, speed = 1, longest_pause = 0;
+    int list = 0, option;
+
+    while ((option = getopt(argc, argv, "s:x:i:lh")) != -1) {
+        switch (option) {
+        case 's': start = atof(optarg); break;
+        case 'x': speed = atof(optarg); break;
+        case 'i': longest_pause = atof(optarg); break;
+        case 'l': list = 1; break;
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc || start < 0 || speed < 0 || longest_pause < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *path = argv[optind];
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    unsigned char file_header[RECORDING_FILE_HEADER];
+    uint64_t started_us;
+    if (fread(file_header, 1, sizeof(file_header), file) != sizeof(file_header) ||
+        recording_decode_start(file_header, &started_us) == -1) {
+        fprintf(stderr, "%s is not a session recording\n", path);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+
+    SeekIndex index = { 0 };
+    if (load_index_backwards(file, &index) == -1) {
+        load_index_forwards(file, &index);
+    }
+    if (list) {
+        summarise(file, path, started_us, &index);
+        free(index.points);
+        fclose(file);
+        return EXIT_SUCCESS;
+    }
+
+    const uint64_t start_us = (uint64_t)(start * 1e6);
+    const SeekPoint *point = find_point(&index, start_us);
+    if (fseeko(file, point != NULL ? (off_t)point->offset : RECORDING_FILE_HEADER, SEEK_SET) == -1) {
+        perror("fseeko");
+        free(index.points);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+
+    unsigned char header[RECORDING_FRAME_HEADER];
+    unsigned char *payload = NULL;
+    size_t capacity = 0;
+    RecordingFrame frame;
+    RecordingIndex entry;
+    uint64_t elapsed_us = point != NULL ? point->elapsed_us : 0;
+    uint64_t played_us = start_us;     // session time of the last output written
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    while (fread(header, 1, sizeof(header), file) == sizeof(header)) {
+        if (recording_decode_frame(header, &frame) == -1) {
+            fprintf(stderr, "Corrupt frame header at offset %lld\n", (long long)ftello(file) - (long long)sizeof(header));
+            break;
+        }
+        if (frame.length > capacity) {
+            capacity = frame.length;
+            payload = realloc(payload, capacity);
+            if (payload == NULL) {
+                perror("realloc");
+                break;
+            }
+        }
+        if (fread(payload, 1, frame.length, file) != frame.length) {
+            fprintf(stderr, "Truncated frame at end of %s\n", path);
+            break;
+        }
+
+        /* an index frame also sets the clock right after a delta that saturated */
+        elapsed_us += frame.delta_us;
+        if (frame.kind == RECORDING_INDEX || frame.kind == RECORDING_END) {
+            recording_decode_index(payload, &entry);
+            elapsed_us = entry.elapsed_us;
+        }
+        if (frame.kind != RECORDING_OUTPUT) {
+            continue;
+        }
+
+        if (elapsed_us > played_us && speed > 0) {
+            uint64_t pause_us = (uint64_t)((double)(elapsed_us - played_us) / speed);
+            if (longest_pause > 0 && pause_us > (uint64_t)(longest_pause * 1e6)) {
+                pause_us = (uint64_t)(longest_pause * 1e6);
+            }
+            fflush(stdout);
+            pause_until(&deadline, pause_us);
+        }
+        if (elapsed_us > played_us) {
+            played_us = elapsed_us;
+        }
+        fwrite(payload, 1, frame.length, stdout);
+    }
+    fflush(stdout);
+
+    free(payload);
+    free(index.points);
+    fclose(file);
+    return EXIT_SUCCESS;
+}
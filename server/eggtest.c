@@ -0,0 +1,1015 @@
+/**
+ * @file eggtest.c
+ * @brief Unit tests of the server's modules, run without a server
+ *
+ * Usage: eggtest
+ * Prints each failed check and exits non-zero if there was one. The wheel
+ * runs on a clock the tests move by hand: the program is linked with
+ * --wrap=clock_gettime, so timer_wheel.c reads fake_ms instead of the
+ * system's monotonic clock and hours of timers run in no time. The
+ * recorder's session times come from the same clock. Other
+ * clocks, such as the one the logger's writer thread waits on, are real.
+ *
+ * The modules under test that reach into server.c get its configuration
+ * and its logging from here instead, so no server is linked in. Channels
+ * get their shells here too: a socket stands in for each one's PTY.
+ */
+
+#include "timer_wheel.h"
+#include "users.h"
+#include "admission.h"
+#include "logger.h"
+#include "scrollback.h"
+#include "detach.h"
+#include "recorder.h"
+#include "channels.h"
+#include "client_stream.h"
+#include "shell_pool.h"
+#include "children.h"
+#include "server.h"
+#include "../protocol.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+
+static int failures;
+static int checks;
+
+static void check(const int passed, const char *condition, const char *file, const int line) {
+    checks++;
+    if (!passed) {
+        fprintf(stderr, "FAIL %s:%d: %s\n", file, line, condition);
+        failures++;
+    }
+}
+
+/* What server.c would provide; each test sets the configuration it needs */
+ServerConfig server_config;
+
+void log_event(const char *format, ...) {
+    (void)format;
+}
+
+void send_response(const int client_fd, const ResponseCode response_code, const char *message) {
+    (void)client_fd;
+    (void)response_code;
+    (void)message;
+}
+
+/* The other end of the last channel shell's socket, which the test writes the shell's output into */
+static int shell_end = -1;
+
+int acquire_shell(int *master_fd, pid_t *shell_pid, const int cgroup_fd) {
+    int ends[2];
+
+    (void)cgroup_fd;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, ends) == -1) {
+        return -1;
+    }
+    /* a child for channel_close() to kill and reap */
+    *shell_pid = fork();
+    if (*shell_pid == 0) {
+        pause();
+        _exit(EXIT_SUCCESS);
+    }
+    if (*shell_pid == -1) {
+        close(ends[0]);
+        close(ends[1]);
+        return -1;
+    }
+    *master_fd = ends[0];
+    shell_end = ends[1];
+    return 0;
+}
+
+int cgroup_open(const SessionCgroup *cgroup) {
+    (void)cgroup;
+    return -1;
+}
+
+int children_wait(const pid_t pid) {
+    return waitpid(pid, NULL, 0) == pid ? 0 : -1;
+}
+
+/* The time timer_wheel.c sees */
+static uint64_t fake_ms = 1000000;
+
+int __real_clock_gettime(clockid_t clock, struct timespec *now);
+
+int __wrap_clock_gettime(clockid_t clock, struct timespec *now) {
+    if (clock != CLOCK_MONOTONIC) {
+        return __real_clock_gettime(clock, now);
+    }
+    now->tv_sec = (time_t)(fake_ms / 1000);
+    now->tv_nsec = (long)(fake_ms % 1000) * 1000000;
+    return 0;
+}
+
+/* A timer that notes the tick it fired on, and in which order */
+typedef struct {
+    Timer timer;
+    uint64_t delay_ms;
+    uint64_t fired_tick;
+    int fired_order;    // 0 until it fires
+} TestTimer;
+
+static TimerWheel wheel;
+static int fired_count;
+
+static void note_firing(void *owner) {
+    TestTimer *test = owner;
+    test->fired_tick = wheel.tick;
+    test->fired_order = ++fired_count;
+}
+
+/**
+ * @brief Timers on every level fire on their own tick and in deadline order, stepped or in one jump.
+ */
+static void test_wheel_order(const uint64_t step_ms) {
+    /* either side of each level's reach: 64 ticks, 64^2 and 64^3 */
+    static const uint64_t delays_ms[] = {
+        100, 6300, 6400, 6500, 409500, 409600, 409700, 26214300, 26214400, 26214500, 250, 12800, 1000000,
+    };
+    const size_t count = sizeof(delays_ms) / sizeof(delays_ms[0]);
+    TestTimer timers[sizeof(delays_ms) / sizeof(delays_ms[0])];
+
+    timer_wheel_init(&wheel);
+    fired_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        timers[i].delay_ms = delays_ms[i];
+        timers[i].fired_order = 0;
+        timer_init(&timers[i].timer, note_firing, &timers[i]);
+        timer_arm(&wheel, &timers[i].timer, delays_ms[i]);
+    }
+    CHECK(wheel.armed == count);
+
+    const uint64_t end = fake_ms + 26214500 + TIMER_TICK_MS;
+    while (fake_ms < end) {
+        fake_ms += step_ms < end - fake_ms ? step_ms : end - fake_ms;
+        timer_wheel_run(&wheel);
+    }
+    CHECK(wheel.armed == 0);
+    CHECK(fired_count == (int)count);
+
+    for (size_t i = 0; i < count; i++) {
+        CHECK(timers[i].fired_order != 0);
+        CHECK(timers[i].fired_tick == (timers[i].delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+        for (size_t j = 0; j < count; j++) {
+            if (timers[i].delay_ms < timers[j].delay_ms) {
+                CHECK(timers[i].fired_order < timers[j].fired_order);
+            }
+        }
+    }
+}
+
+/**
+ * @brief A cancelled timer does not fire, and one moved by timer_arm() fires only at its new time.
+ */
+static void test_wheel_cancel() {
+    TestTimer cancelled = { .fired_order = 0 }, moved = { .fired_order = 0 };
+
+    timer_wheel_init(&wheel);
+    fired_count = 0;
+    timer_init(&cancelled.timer, note_firing, &cancelled);
+    timer_init(&moved.timer, note_firing, &moved);
+    timer_arm(&wheel, &cancelled.timer, 500);
+    timer_arm(&wheel, &moved.timer, 500);
+    timer_arm(&wheel, &moved.timer, 10000);
+    timer_cancel(&wheel, &cancelled.timer);
+    timer_cancel(&wheel, &cancelled.timer);
+    CHECK(!timer_armed(&cancelled.timer));
+    CHECK(wheel.armed == 1);
+
+    fake_ms += 5000;
+    CHECK(timer_wheel_run(&wheel) == 0);
+    fake_ms += 5000;
+    CHECK(timer_wheel_run(&wheel) == 1);
+    CHECK(cancelled.fired_order == 0);
+    CHECK(moved.fired_tick == 100);
+}
+
+/**
+ * @brief timer_wheel_timeout() wakes the loop for the next due slot, or at the next turn for coarser levels.
+ */
+static void test_wheel_timeout() {
+    Timer near, far;
+
+    timer_wheel_init(&wheel);
+    CHECK(timer_wheel_timeout(&wheel) == -1);
+
+    /* rounded up to whole ticks, counted from the wheel's start */
+    timer_init(&near, note_firing, &(TestTimer){ 0 });
+    timer_arm(&wheel, &near, 250);
+    CHECK(timer_wheel_timeout(&wheel) == 300);
+    fake_ms += 120;
+    CHECK(timer_wheel_timeout(&wheel) == 180);
+    fake_ms += 500;
+    CHECK(timer_wheel_timeout(&wheel) == 0);
+    timer_wheel_run(&wheel);
+    CHECK(timer_wheel_timeout(&wheel) == -1);
+
+    /* a timer a level up is looked at when the first level comes round, 64 ticks from tick 0 */
+    timer_init(&far, note_firing, &(TestTimer){ 0 });
+    timer_arm(&wheel, &far, 20000);
+    CHECK(far.expires == 206);
+    CHECK(timer_wheel_timeout(&wheel) == 6400 - 620);
+    fake_ms += 6400 - 620;
+    CHECK(timer_wheel_run(&wheel) == 0);
+    CHECK(timer_wheel_timeout(&wheel) == 6400);
+    fake_ms += 6400 * 2;
+    CHECK(timer_wheel_run(&wheel) == 0);
+    CHECK(timer_wheel_timeout(&wheel) == 1400);
+
+    /* a slot behind the wheel's position in its turn is the next turn's */
+    timer_arm(&wheel, &near, 100 * (TIMER_WHEEL_SLOTS - 1));
+    CHECK(timer_wheel_timeout(&wheel) == 1400);
+    fake_ms += 1400;
+    CHECK(timer_wheel_run(&wheel) == 1);
+    CHECK(timer_wheel_timeout(&wheel) == 100 * (TIMER_WHEEL_SLOTS - 1) - 1400);
+    timer_cancel(&wheel, &near);
+}
+
+/**
+ * @brief Encodes a message header as it goes on the wire.
+ */
+static void put_header(char *wire, const int code, const int control, const uint16_t length) {
+    const uint16_t wire_length = htons(length);
+    wire[0] = (char)code;
+    wire[1] = (char)control;
+    memcpy(wire + 2, &wire_length, sizeof(wire_length));
+}
+
+/**
+ * @brief Messages read from a stream: incomplete ones wait for more bytes, oversized ones are refused at once.
+ */
+static void test_decode_message() {
+    char wire[2 * MESSAGE_MAX_WIRE_SIZE];
+    Message msg;
+
+    put_header(wire, SESSION_TOKEN, ESCAPE_CODE_NONE, 5);
+    memcpy(wire + MESSAGE_HEADER_SIZE, "abcde", 5);
+    put_header(wire + MESSAGE_HEADER_SIZE + 5, RESPONSE_OK, ESCAPE_CODE_NONE, 0);
+    for (size_t length = 0; length < MESSAGE_HEADER_SIZE + 5; length++) {
+        CHECK(decode_message(wire, length, &msg) == 0);
+    }
+
+    /* one message at a time, the next one left for the following call */
+    CHECK(decode_message(wire, MESSAGE_HEADER_SIZE * 2 + 5, &msg) == MESSAGE_HEADER_SIZE + 5);
+    CHECK(msg.status_code == SESSION_TOKEN && msg.content_length == 5 && strcmp(msg.content, "abcde") == 0);
+    CHECK(decode_message(wire + MESSAGE_HEADER_SIZE + 5, MESSAGE_HEADER_SIZE, &msg) == MESSAGE_HEADER_SIZE);
+    CHECK(msg.status_code == RESPONSE_OK && msg.content_length == 0 && msg.content[0] == '\0');
+
+    /* a message fills its content and the terminator, no more; refused from the header alone */
+    put_header(wire, RESPONSE_OK, ESCAPE_CODE_NONE, MESSAGE_MAX_CONTENT);
+    memset(wire + MESSAGE_HEADER_SIZE, 'x', MESSAGE_MAX_CONTENT);
+    CHECK(decode_message(wire, MESSAGE_MAX_WIRE_SIZE - 1, &msg) == 0);
+    CHECK(decode_message(wire, MESSAGE_MAX_WIRE_SIZE, &msg) == (int)MESSAGE_MAX_WIRE_SIZE);
+    CHECK(msg.content[MESSAGE_MAX_CONTENT] == '\0');
+    put_header(wire, RESPONSE_OK, ESCAPE_CODE_NONE, MESSAGE_MAX_CONTENT + 1);
+    CHECK(decode_message(wire, MESSAGE_HEADER_SIZE, &msg) == -1);
+    put_header(wire, RESPONSE_OK, ESCAPE_CODE_NONE, UINT16_MAX);
+    CHECK(decode_message(wire, sizeof(wire), &msg) == -1);
+
+    /* what encode_message() writes comes back as it was */
+    Message sent = { .status_code = AUTH_FAIL, .control_code = ESCAPE_CODE_NONE, .content_length = 3 };
+    memcpy(sent.content, "no.", 4);
+    const int encoded = encode_message(&sent, wire, sizeof(wire));
+    CHECK(encoded == MESSAGE_HEADER_SIZE + 3);
+    CHECK(decode_message(wire, (size_t)encoded, &msg) == encoded);
+    CHECK(msg.status_code == AUTH_FAIL && strcmp(msg.content, "no.") == 0);
+}
+
+/**
+ * @brief Relay frames: decoded in place, incomplete ones wait, oversized ones are refused; window-size contents.
+ */
+static void test_decode_frame() {
+    static char wire[2 * FRAME_MAX_WIRE_SIZE];
+    Frame frame;
+    unsigned short rows, columns;
+
+    put_header(wire, RELAY_DATA, ESCAPE_CODE_NONE, 5);
+    memcpy(wire + MESSAGE_HEADER_SIZE, "abcde", 5);
+    for (size_t length = 0; length < MESSAGE_HEADER_SIZE + 5; length++) {
+        CHECK(decode_frame(wire, length, &frame) == 0);
+    }
+    CHECK(decode_frame(wire, sizeof(wire), &frame) == MESSAGE_HEADER_SIZE + 5);
+    CHECK(frame.type == RELAY_DATA && frame.length == 5 && frame.payload == wire + MESSAGE_HEADER_SIZE);
+
+    /* a data frame carries more than a message's content, up to FRAME_MAX_PAYLOAD */
+    put_header(wire, RELAY_DATA, ESCAPE_CODE_NONE, FRAME_MAX_PAYLOAD);
+    CHECK(decode_frame(wire, FRAME_MAX_WIRE_SIZE - 1, &frame) == 0);
+    CHECK(decode_frame(wire, FRAME_MAX_WIRE_SIZE, &frame) == FRAME_MAX_WIRE_SIZE);
+    put_header(wire, RELAY_DATA, ESCAPE_CODE_NONE, FRAME_MAX_PAYLOAD + 1);
+    CHECK(decode_frame(wire, MESSAGE_HEADER_SIZE, &frame) == -1);
+
+    encode_frame_header(wire, RELAY_CONTROL, ESCAPE_CODE_WINDOW_SIZE, WINDOW_SIZE_LENGTH);
+    encode_window_size(wire + MESSAGE_HEADER_SIZE, 50, 132);
+    CHECK(decode_frame(wire, MESSAGE_HEADER_SIZE + WINDOW_SIZE_LENGTH, &frame) == MESSAGE_HEADER_SIZE + WINDOW_SIZE_LENGTH);
+    CHECK(frame.type == RELAY_CONTROL && frame.control_code == ESCAPE_CODE_WINDOW_SIZE);
+    CHECK(decode_window_size(&frame, &rows, &columns) == 0 && rows == 50 && columns == 132);
+    frame.length = WINDOW_SIZE_LENGTH - 1;
+    CHECK(decode_window_size(&frame, &rows, &columns) == -1);
+    frame.length = WINDOW_SIZE_LENGTH + 1;
+    CHECK(decode_window_size(&frame, &rows, &columns) == -1);
+}
+
+/**
+ * @brief Builds an AUTH_REQUEST message from raw content, which may be malformed.
+ */
+static void auth_message(Message *msg, const char *content, const size_t length) {
+    msg->status_code = AUTH_REQUEST;
+    msg->control_code = ESCAPE_CODE_NONE;
+    memcpy(msg->content, content, length);
+    msg->content_length = (uint16_t)length;
+    msg->content[length] = '\0';
+}
+
+/**
+ * @brief AUTH_REQUEST: round trip, and missing, unterminated or oversized fields.
+ */
+static void test_decode_auth_request() {
+    AuthRequest login = { .username = "test", .password = "secret", .rows = 40, .columns = 120, .term = "xterm" };
+    AuthRequest decoded;
+    Message msg;
+    char content[MESSAGE_MAX_CONTENT];
+
+    CHECK(encode_auth_request(&login, &msg) == 0);
+    CHECK(decode_auth_request(&msg, &decoded) == 0);
+    CHECK(strcmp(decoded.username, "test") == 0 && strcmp(decoded.password, "secret") == 0);
+    CHECK(decoded.rows == 40 && decoded.columns == 120 && strcmp(decoded.term, "xterm") == 0);
+
+    /* settings are optional, unknown ones skipped */
+    auth_message(&msg, "bob\0pw\0colour=red\0rows=9", 25);
+    CHECK(decode_auth_request(&msg, &decoded) == 0 && strcmp(decoded.username, "bob") == 0 && decoded.rows == 9);
+    auth_message(&msg, "bob\0pw", 7);
+    CHECK(decode_auth_request(&msg, &decoded) == 0 && decoded.rows == 0 && decoded.term[0] == '\0');
+
+    /* every prefix short of the password's terminator is refused */
+    for (size_t length = 0; length < 7; length++) {
+        auth_message(&msg, "bob\0pw", length);
+        CHECK(decode_auth_request(&msg, &decoded) == -1);
+    }
+    auth_message(&msg, "bob\0pw\0rows=", 12);
+    CHECK(decode_auth_request(&msg, &decoded) == -1);
+
+    /* a field must leave room for its terminator */
+    memset(content, 'u', AUTH_FIELD_MAX - 1);
+    memcpy(content + AUTH_FIELD_MAX - 1, "\0pw", 4);
+    auth_message(&msg, content, AUTH_FIELD_MAX + 3);
+    CHECK(decode_auth_request(&msg, &decoded) == 0 && strlen(decoded.username) == AUTH_FIELD_MAX - 1);
+    memset(content, 'u', AUTH_FIELD_MAX);
+    memcpy(content + AUTH_FIELD_MAX, "\0pw", 4);
+    auth_message(&msg, content, AUTH_FIELD_MAX + 4);
+    CHECK(decode_auth_request(&msg, &decoded) == -1);
+    memset(content, 's', sizeof(content));
+    memcpy(content, "bob\0pw\0term=", 12);
+    content[sizeof(content) - 1] = '\0';
+    auth_message(&msg, content, sizeof(content));
+    CHECK(decode_auth_request(&msg, &decoded) == -1);
+
+    /* the longest fields encode and come back whole */
+    memset(login.username, 'u', AUTH_FIELD_MAX - 1);
+    login.username[AUTH_FIELD_MAX - 1] = '\0';
+    memset(login.term, 't', AUTH_FIELD_MAX - 1);
+    login.term[AUTH_FIELD_MAX - 1] = '\0';
+    CHECK(encode_auth_request(&login, &msg) == 0);
+    CHECK(decode_auth_request(&msg, &decoded) == 0 && strcmp(decoded.username, login.username) == 0);
+    CHECK(strcmp(decoded.term, login.term) == 0);
+}
+
+/**
+ * @brief The users table, from the text file and from a compiled database, with enough users that probes collide.
+ */
+static void test_users() {
+    char text_path[] = "/tmp/eggtest-users-XXXXXX";
+    char db_path[sizeof(text_path) + 3];
+    const int users = 5000;
+    char username[32], password[32];
+
+    const int fd = mkstemp(text_path);
+    CHECK(fd != -1);
+    if (fd == -1) {
+        return;
+    }
+    FILE *file = fdopen(fd, "w");
+    for (int i = 0; i < users; i++) {
+        fprintf(file, "user%d:pw%d\n", i, i * 7);
+    }
+    fclose(file);
+    snprintf(db_path, sizeof(db_path), "%s.db", text_path);
+
+    CHECK(users_load(text_path) == users);
+    for (int pass = 0; pass < 2; pass++) {
+        CHECK(users_count() == (uint32_t)users);
+        int matched = 0;
+        for (int i = 0; i < users; i++) {
+            snprintf(username, sizeof(username), "user%d", i);
+            snprintf(password, sizeof(password), "pw%d", i * 7);
+            matched += users_authenticate(username, password);
+            password[0] = 'P';
+            CHECK(users_authenticate(username, password) == 0);
+        }
+        CHECK(matched == users);
+        CHECK(users_authenticate("user", "pw0") == 0);
+        CHECK(users_authenticate("user00", "pw0") == 0);
+        CHECK(users_authenticate("user0", "") == 0);
+        CHECK(users_authenticate("", "") == 0);
+
+        CHECK(users_compile(text_path, db_path) == users);
+        CHECK(users_load(db_path) == users);
+    }
+
+    /* a failed load keeps the table in use */
+    CHECK(users_load("/nonexistent/eggtest-users") == -1);
+    CHECK(users_authenticate("user1", "pw7") == 1);
+    unlink(text_path);
+    unlink(db_path);
+}
+
+/**
+ * @brief Admission: rate parsing, source and user buckets on the fake clock, the caps, and stale claims.
+ */
+static void test_admission() {
+    const uint32_t first_address = htonl(0x7f000001), other_address = htonl(0x7f000002);
+    Admission claims[4], stale, fresh;
+    RateLimit limit;
+
+    CHECK(admission_parse_rate("10", &limit) == 0 && limit.rate == 10 && limit.burst == 20);
+    CHECK(admission_parse_rate("0.5:3", &limit) == 0 && limit.rate == 0.5 && limit.burst == 3);
+    CHECK(admission_parse_rate("0", &limit) == 0 && limit.rate == 0);
+    CHECK(admission_parse_rate("", &limit) == -1);
+    CHECK(admission_parse_rate("x", &limit) == -1);
+    CHECK(admission_parse_rate("-1", &limit) == -1);
+    CHECK(admission_parse_rate("1:0", &limit) == -1);
+    CHECK(admission_parse_rate("2:", &limit) == -1);
+    CHECK(admission_parse_rate("2:3x", &limit) == -1);
+
+    /* nothing is limited before the shared state exists */
+    CHECK(admission_accept(&claims[0], first_address) == NULL && claims[0].slot == -1);
+    CHECK(admission_init() == 0);
+
+    /* a source's burst, then a token a second; another source has its own bucket */
+    server_config.source_limit = (RateLimit){ 1, 3 };
+    for (int i = 0; i < 3; i++) {
+        CHECK(admission_accept(&claims[i], first_address) == NULL);
+        admission_release(&claims[i]);
+    }
+    CHECK(admission_accept(&claims[0], first_address) != NULL && claims[0].slot == -1);
+    CHECK(admission_accept(&claims[0], other_address) == NULL);
+    admission_release(&claims[0]);
+    fake_ms += 999;
+    CHECK(admission_accept(&claims[0], first_address) != NULL);
+    fake_ms += 1;
+    CHECK(admission_accept(&claims[0], first_address) == NULL);
+    admission_release(&claims[0]);
+    server_config.source_limit.rate = 0;
+
+    /* the cap on connections not logged in yet, which logging in frees */
+    server_config.max_preauth = 2;
+    server_config.max_sessions = 1;
+    CHECK(admission_accept(&claims[0], first_address) == NULL);
+    CHECK(admission_accept(&claims[1], first_address) == NULL);
+    CHECK(admission_accept(&claims[2], first_address) != NULL && claims[2].slot == -1);
+    CHECK(admission_start_session(&claims[0]) == NULL);
+    CHECK(admission_accept(&claims[2], first_address) == NULL);
+
+    /* the session cap; releasing a session, even twice, gives back one */
+    CHECK(admission_start_session(&claims[1]) != NULL);
+    admission_release(&claims[1]);
+    admission_release(&claims[0]);
+    admission_release(&claims[0]);
+    CHECK(claims[0].slot == -1);
+    CHECK(admission_start_session(&claims[2]) == NULL);
+    CHECK(admission_accept(&claims[3], first_address) == NULL);
+    CHECK(admission_start_session(&claims[3]) != NULL);
+    admission_release(&claims[3]);
+
+    /* an adopted session counts over the cap */
+    admission_adopt_session(&claims[3]);
+    CHECK(claims[3].slot != -1);
+    admission_release(&claims[2]);
+    CHECK(admission_accept(&claims[2], first_address) == NULL);
+    CHECK(admission_start_session(&claims[2]) != NULL);
+    admission_release(&claims[3]);
+    CHECK(admission_start_session(&claims[2]) == NULL);
+    admission_release(&claims[2]);
+
+    /* a copy of a released claim does not release the slot's next connection */
+    server_config.max_preauth = 1;
+    CHECK(admission_accept(&stale, first_address) == NULL);
+    Admission copy = stale;
+    admission_release(&stale);
+    int reused = 0;
+    for (int i = 0; i < ADMISSION_SLOTS && !reused && admission_accept(&fresh, first_address) == NULL; i++) {
+        reused = fresh.slot == copy.slot;
+        if (!reused) {
+            admission_release(&fresh);
+        }
+    }
+    CHECK(reused && fresh.use != copy.use);
+    admission_release(&copy);
+    CHECK(admission_accept(&claims[0], first_address) != NULL);
+    admission_release(&fresh);
+    CHECK(admission_accept(&claims[0], first_address) == NULL);
+    admission_release(&claims[0]);
+    server_config.max_preauth = 0;
+    server_config.max_sessions = 0;
+
+    /* only failed logins take from a user's bucket */
+    server_config.user_limit = (RateLimit){ 1, 2 };
+    CHECK(admission_user("bob") == NULL);
+    CHECK(admission_user("bob") == NULL);
+    CHECK(admission_user("bob") == NULL);
+    admission_login_failed("bob");
+    admission_login_failed("bob");
+    CHECK(admission_user("bob") != NULL);
+    CHECK(admission_user("alice") == NULL);
+    fake_ms += 1000;
+    CHECK(admission_user("bob") == NULL);
+    server_config.user_limit.rate = 0;
+}
+
+#define LOG_THREADS 4
+#define LOG_THREAD_RECORDS 20000
+
+/* One of the threads appending to the same log at once */
+typedef struct {
+    Logger *log;
+    char name;
+} LogProducer;
+
+static void *append_records(void *arg) {
+    const LogProducer *producer = arg;
+    char record[16];
+
+    for (int i = 0; i < LOG_THREAD_RECORDS; i++) {
+        const int length = snprintf(record, sizeof(record), "%c%07d\n", producer->name, i);
+        logger_write(producer->log, record, (size_t)length, NULL, 0);
+    }
+    return NULL;
+}
+
+/**
+ * @brief The log ring: two-part and oversized records, the file header, and threads appending at once.
+ *
+ * A full ring drops records instead of blocking, and when it fills depends
+ * on the writer thread, so with several threads the check is that every
+ * record either reached the file whole and in its thread's order or was
+ * counted as dropped.
+ */
+static void test_logger() {
+    char path[] = "/tmp/eggtest-log-XXXXXX";
+    static char contents[LOG_THREADS * LOG_THREAD_RECORDS * 9 + 256];
+    const char header[] = "EGGLOG\n";
+    char head[40];
+
+    const int fd = mkstemp(path);
+    CHECK(fd != -1);
+    if (fd == -1) {
+        return;
+    }
+    Logger *log = logger_open(path, 32, header, sizeof(header) - 1);
+    CHECK(log != NULL);
+    if (log == NULL) {
+        close(fd);
+        unlink(path);
+        return;
+    }
+    const unsigned long dropped = logger_dropped();
+
+    /* the parts go back to back; a long head is cut to a record, a body that does not fit drops it */
+    logger_write(log, "head:", 5, "body\n", 5);
+    memset(head, 'h', sizeof(head));
+    logger_write(log, head, sizeof(head), NULL, 0);
+    logger_write(log, head, 20, head, 20);
+    CHECK(logger_dropped() == dropped + 1);
+
+    pthread_t threads[LOG_THREADS];
+    LogProducer producers[LOG_THREADS];
+    for (int i = 0; i < LOG_THREADS; i++) {
+        producers[i] = (LogProducer){ log, (char)('a' + i) };
+        CHECK(pthread_create(&threads[i], NULL, append_records, &producers[i]) == 0);
+    }
+    for (int i = 0; i < LOG_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    logger_flush();
+
+    /* a log opened on a file that is not new does not repeat the header */
+    Logger *again = logger_open(path, 32, header, sizeof(header) - 1);
+    CHECK(again != NULL);
+    if (again != NULL) {
+        logger_write(again, "tail\n", 5, NULL, 0);
+        logger_flush();
+    }
+
+    const ssize_t length = read(fd, contents, sizeof(contents) - 1);
+    close(fd);
+    unlink(path);
+    CHECK(length > 0);
+    if (length <= 0) {
+        return;
+    }
+    contents[length] = '\0';
+
+    size_t offset = sizeof(header) - 1;
+    CHECK(strncmp(contents, header, offset) == 0);
+    CHECK(strncmp(contents + offset, "head:body\n", 10) == 0);
+    offset += 10;
+    CHECK(strspn(contents + offset, "h") == 32);
+    offset += 32;
+
+    int next[LOG_THREADS] = { 0 };
+    int written = 0, ordered = 1;
+    while (offset + 9 <= (size_t)length && contents[offset] >= 'a' && contents[offset] < 'a' + LOG_THREADS) {
+        const int thread = contents[offset] - 'a';
+        const int number = atoi(contents + offset + 1);
+        ordered &= contents[offset + 8] == '\n' && number >= next[thread];
+        next[thread] = number + 1;
+        written++;
+        offset += 9;
+    }
+    CHECK(ordered);
+    CHECK(written + (logger_dropped() - dropped - 1) == LOG_THREADS * LOG_THREAD_RECORDS);
+    CHECK(written > 0);
+    CHECK(strcmp(contents + offset, again != NULL ? "tail\n" : "") == 0);
+}
+
+/**
+ * @brief Channels: credit frames, reads held to the window and the queue, and output sent a frame per channel in turn.
+ */
+static void test_channels() {
+    static char wire[4 * FRAME_MAX_WIRE_SIZE];
+    static char received[2][8192];
+    char output[8192], data[FRAME_MAX_PAYLOAD];
+    Channel channels[CHANNEL_MAX];
+    OutputBacklog queue = { 0 };
+    ClientStream stream = { 0 };
+    StreamInput input;
+    SessionCgroup cgroup = { 0 };
+    int masters[CHANNEL_MAX], pty[2], client[2];
+    uint32_t credit;
+    Frame frame;
+
+    for (size_t i = 0; i < sizeof(output); i++) {
+        output[i] = (char)('a' + i % 26);
+    }
+    server_config.mode = SERVER_MODE_FORK;
+    server_config.output_queue = 8192;
+
+    /* a credit is four bytes, no more and no less */
+    encode_channel_credit(wire, 70000);
+    frame.payload = wire;
+    frame.length = CHANNEL_CREDIT_LENGTH;
+    CHECK(decode_channel_credit(&frame, &credit) == 0 && credit == 70000);
+    frame.length = CHANNEL_CREDIT_LENGTH + 1;
+    CHECK(decode_channel_credit(&frame, &credit) == -1);
+    frame.length = CHANNEL_CREDIT_LENGTH - 1;
+    CHECK(decode_channel_credit(&frame, &credit) == -1);
+
+    /* CHANNEL_WINDOW from the client, which only a connection with channels may send */
+    stream_begin(&stream, -1, STREAM_FRAMED | STREAM_CHANNELS);
+    CHECK(stream.channels);
+    channels_init(channels, -1, &queue, 1);
+    channels_masters(channels, masters);
+    encode_frame_header(stream.input, CHANNEL_WINDOW, (ControlCode)2, CHANNEL_CREDIT_LENGTH);
+    encode_channel_credit(stream.input + MESSAGE_HEADER_SIZE, 5000);
+    stream.input_length = MESSAGE_HEADER_SIZE + CHANNEL_CREDIT_LENGTH;
+    CHECK(stream_next_input(&stream, masters, data, &input) == 0);
+    CHECK(input.request == CHANNEL_WINDOW && input.channel == 2 && input.credit == 5000 && stream.input_length == 0);
+    encode_frame_header(stream.input, CHANNEL_WINDOW, (ControlCode)2, CHANNEL_CREDIT_LENGTH - 1);
+    stream.input_length = MESSAGE_HEADER_SIZE + CHANNEL_CREDIT_LENGTH - 1;
+    CHECK(stream_next_input(&stream, masters, data, &input) == -1);
+    stream_begin(&stream, -1, STREAM_FRAMED);
+    encode_frame_header(stream.input, CHANNEL_WINDOW, (ControlCode)0, CHANNEL_CREDIT_LENGTH);
+    stream.input_length = MESSAGE_HEADER_SIZE + CHANNEL_CREDIT_LENGTH;
+    CHECK(stream_next_input(&stream, masters, data, &input) == -1);
+
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, pty) == 0);
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, client) == 0);
+    fcntl(pty[0], F_SETFL, O_NONBLOCK);
+    CHECK(backlog_init(&queue, server_config.output_queue) == 0);
+
+    /* without windows a channel reads until its queue is full */
+    channels_init(channels, pty[0], &queue, 0);
+    CHECK(channels[0].window == SIZE_MAX);
+    CHECK(channel_readable(&channels[0]) && !channel_readable(&channels[1]));
+    CHECK(write(pty[1], output, sizeof(output)) == (ssize_t)sizeof(output));
+    CHECK(write(pty[1], output, 100) == 100);
+    CHECK(channel_read(&channels[0]) == (ssize_t)sizeof(output));
+    CHECK(channels[0].window == SIZE_MAX && !channel_readable(&channels[0]));
+    queue.length = queue.offset = 0;
+    CHECK(channel_read(&channels[0]) == 100);
+
+    /* a channel's reads stop at its window until the client grants more */
+    queue.length = queue.offset = 0;
+    channels_init(channels, pty[0], &queue, 1);
+    CHECK(channels[0].window == CHANNEL_WINDOW_SIZE);
+    CHECK(channel_open(&channels[1], &cgroup) == 0);
+    CHECK(channels[1].window == CHANNEL_WINDOW_SIZE && channels[1].output == &channels[1].queue);
+    channels[1].window = 100;
+    CHECK(write(shell_end, output, 300) == 300);
+    CHECK(channel_read(&channels[1]) == 100);
+    CHECK(channels[1].window == 0 && !channel_readable(&channels[1]));
+    channels[1].window += 150;
+    CHECK(channel_readable(&channels[1]));
+    CHECK(channel_read(&channels[1]) == 150);
+    CHECK(channels[1].window == 0 && channels[1].queue.length == 250);
+
+    /* channel 0's 5000 bytes and channel 1's 250 go out a data frame at a time, in turns */
+    CHECK(write(pty[1], output, 5000) == 5000);
+    CHECK(channel_read(&channels[0]) == 5000);
+    CHECK(channels_unsent(channels) && channels_input_idle(channels));
+    stream_begin(&stream, -1, STREAM_FRAMED | STREAM_CHANNELS);
+    int turn = 0;
+    CHECK(channels_flush(&stream, channels, &turn, client[0], 0) == 1);
+    CHECK(!channels_unsent(channels));
+
+    const ssize_t length = read(client[1], wire, sizeof(wire));
+    size_t offset = 0, got[2] = { 0, 0 };
+    int current = 0, frames = 0, consumed;
+    char order[8] = "";
+    while (length > 0 && (consumed = decode_frame(wire + offset, (size_t)length - offset, &frame)) > 0) {
+        if (frame.type == CHANNEL_SELECT) {
+            current = (int)frame.control_code;
+        } else if (frame.type == RELAY_DATA && current < 2 && got[current] + frame.length <= sizeof(received[0]) &&
+                   frames < (int)sizeof(order) - 1) {
+            memcpy(received[current] + got[current], frame.payload, frame.length);
+            got[current] += frame.length;
+            order[frames++] = (char)('0' + current);
+        }
+        offset += (size_t)consumed;
+    }
+    CHECK(offset == (size_t)length);
+    CHECK(strcmp(order, "010") == 0);
+    CHECK(got[0] == 5000 && memcmp(received[0], output, 5000) == 0);
+    CHECK(got[1] == 250 && memcmp(received[1], output, 250) == 0);
+
+    /* a channel whose shell hung up is no longer decoded for; closing kills and reaps its shell */
+    channels[1].exited = 1;
+    channels_masters(channels, masters);
+    CHECK(masters[0] == pty[0] && masters[1] == -1 && masters[2] == -1);
+    const pid_t shell_pid = channels[1].shell_pid;
+    channel_close(&channels[1]);
+    CHECK(channels[1].master_fd == -1 && kill(shell_pid, 0) == -1);
+    close(shell_end);
+    close(pty[0]);
+    close(pty[1]);
+    close(client[0]);
+    close(client[1]);
+    backlog_free(&queue);
+}
+
+static void fill_pattern(char *data, const size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        data[i] = (char)(i % 251);
+    }
+}
+
+/**
+ * @brief Scrollback kept to -k, evicted oldest first across sessions, and replayed into a backlog that is then reused.
+ */
+static void test_scrollback() {
+    static char output[4 * SCROLLBACK_CHUNK];
+    Scrollback first, second, third;
+    OutputBacklog backlog = {0};
+
+    server_config.scrollback = 3 * SCROLLBACK_CHUNK;
+    CHECK(scrollback_init(4 * SCROLLBACK_CHUNK) == 0);
+    fill_pattern(output, sizeof(output));
+
+    /* past -k the session's oldest chunk goes, a whole chunk at a time */
+    const size_t written = 3 * SCROLLBACK_CHUNK + 2712;
+    scrollback_start(&first);
+    scrollback_append(&first, output, written);
+    CHECK(first.count == 3);
+    CHECK(first.last_length == 2712);
+    CHECK(scrollback_replay(&first, &backlog) == written - SCROLLBACK_CHUNK);
+    CHECK(backlog.length == written - SCROLLBACK_CHUNK);
+    CHECK(backlog.capacity >= backlog.length);
+    CHECK(memcmp(backlog.data, output + SCROLLBACK_CHUNK, backlog.length) == 0);
+    backlog_free(&backlog);
+
+    /* the pool has one chunk left; a second session takes it, then the first session's oldest */
+    scrollback_start(&second);
+    scrollback_append(&second, output, SCROLLBACK_CHUNK + 1);
+    CHECK(second.count == 2);
+    CHECK(scrollback_replay(&first, &backlog) == written - 2 * SCROLLBACK_CHUNK);
+    CHECK(first.count == 2);
+    CHECK(memcmp(backlog.data, output + 2 * SCROLLBACK_CHUNK, backlog.length) == 0);
+    backlog_free(&backlog);
+
+    /* forgetting output sent to the backlog instead goes back into the chunk before */
+    scrollback_forget(&second, 2);
+    CHECK(second.count == 1);
+    CHECK(second.last_length == SCROLLBACK_CHUNK - 1);
+    scrollback_free(&second);
+    scrollback_free(&first);
+    CHECK(first.count == 0);
+
+    /* detach with unsent output, resume asking for scrollback, detach again and fill the backlog */
+    const size_t capacity = 1024;
+    scrollback_start(&third);
+    scrollback_append(&third, output, 100);
+    CHECK(backlog_init(&backlog, capacity) == 0);
+    CHECK(backlog_append(&backlog, "xyz", 3) == 3);
+    CHECK(scrollback_replay(&third, &backlog) == 100);
+    CHECK(backlog.length == 103);
+    CHECK(backlog.capacity >= capacity);
+    CHECK(memcmp(backlog.data, output, 100) == 0);
+    CHECK(memcmp(backlog.data + 100, "xyz", 3) == 0);
+
+    const int sink = open("/dev/null", O_WRONLY);
+    CHECK(backlog_flush(&backlog, sink) == 1);
+    close(sink);
+    CHECK(backlog_init(&backlog, capacity) == 0);
+
+    int pipe_fds[2];
+    CHECK(pipe(pipe_fds) == 0);
+    CHECK(write(pipe_fds[1], output, 2 * capacity) == (ssize_t)(2 * capacity));
+    ssize_t nbytes;
+    while ((nbytes = backlog_fill(&backlog, pipe_fds[0])) > 0) {}
+    CHECK(nbytes == -1 && errno == ENOBUFS);
+    CHECK(backlog.length == backlog.capacity);
+    CHECK(memcmp(backlog.data, output, backlog.length) == 0);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    backlog_free(&backlog);
+    scrollback_free(&third);
+}
+
+/**
+ * @brief Reads the frame header at an offset of a recording, and the payload of an index or end frame.
+ * @return 0 on success, -1 if the file ends there or the header does not decode.
+ */
+static int read_recording_frame(const int fd, const uint64_t offset, RecordingFrame *frame, RecordingIndex *index) {
+    unsigned char header[RECORDING_FRAME_HEADER];
+    unsigned char payload[RECORDING_INDEX_PAYLOAD];
+
+    if (pread(fd, header, sizeof(header), (off_t)offset) != (ssize_t)sizeof(header) ||
+        recording_decode_frame(header, frame) == -1) {
+        return -1;
+    }
+    if (frame->kind == RECORDING_INDEX || frame->kind == RECORDING_END) {
+        if (pread(fd, payload, sizeof(payload), (off_t)(offset + sizeof(header))) != (ssize_t)sizeof(payload)) {
+            return -1;
+        }
+        recording_decode_index(payload, index);
+    }
+    return 0;
+}
+
+/**
+ * @brief The recorder: index frames at most RECORDING_INDEX_US apart, each pointing at the one before, and the
+ * end frame at the last, so the chain walked back from the end finds every seek point.
+ */
+static void test_recorder() {
+    char directory[] = "/tmp/eggtest-XXXXXX";
+    char path[600], chunk[100];
+    uint64_t offsets[32], times[32];
+    size_t indexes = 0;
+
+    fill_pattern(chunk, sizeof(chunk));
+    if (mkdtemp(directory) == NULL) {
+        CHECK(!"mkdtemp");
+        return;
+    }
+
+    /* a chunk every 250 ms for 4.5 s, then one after a gap longer than a delta can hold */
+    Recorder *recorder = recorder_open(directory, "egg/../tester");
+    CHECK(recorder != NULL);
+    const uint64_t started_ms = fake_ms;
+    for (int i = 0; i < 19; i++) {
+        fake_ms = started_ms + (uint64_t)i * 250;
+        recorder_frame(recorder, i % 2 ? RECORDING_INPUT : RECORDING_OUTPUT, chunk, sizeof(chunk));
+    }
+    recorder_frame(recorder, RECORDING_OUTPUT, chunk, 0);
+    fake_ms += 5000000;
+    recorder_frame(recorder, RECORDING_OUTPUT, chunk, sizeof(chunk));
+    fake_ms += 10;
+    recorder_close(recorder);
+
+    /* one file, with the username made safe for a path */
+    const char *name = "";
+    DIR *listing = opendir(directory);
+    struct dirent *entry;
+    while (listing != NULL && (entry = readdir(listing)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            name = entry->d_name;
+            break;
+        }
+    }
+    CHECK(strstr(name, "-egg_.._tester-") != NULL);
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+    if (listing != NULL) {
+        closedir(listing);
+    }
+    const int fd = open(path, O_RDONLY);
+    CHECK(fd != -1);
+
+    unsigned char start[RECORDING_FILE_HEADER];
+    uint64_t started_us;
+    CHECK(pread(fd, start, sizeof(start), 0) == (ssize_t)sizeof(start) &&
+          recording_decode_start(start, &started_us) == 0 && started_us > 0);
+
+    /* read forwards: each index frame points at the one before and agrees with the deltas unless one saturated */
+    RecordingFrame frame;
+    RecordingIndex index = { 0, 0 }, end = { 0, 0 };
+    uint64_t offset = RECORDING_FILE_HEADER, elapsed_us = 0;
+    int chunks = 0, ended = 0;
+    while (!ended && read_recording_frame(fd, offset, &frame, &index) == 0) {
+        elapsed_us += frame.delta_us;
+        if (frame.kind == RECORDING_INDEX) {
+            CHECK(indexes < sizeof(offsets) / sizeof(offsets[0]));
+            CHECK(index.previous == (indexes > 0 ? offsets[indexes - 1] : 0));
+            CHECK(index.elapsed_us == elapsed_us || frame.delta_us == UINT32_MAX);
+            if (indexes < sizeof(offsets) / sizeof(offsets[0])) {
+                offsets[indexes] = offset;
+                times[indexes++] = index.elapsed_us;
+            }
+            elapsed_us = index.elapsed_us;
+        } else if (frame.kind == RECORDING_END) {
+            end = index;
+            ended = 1;
+        } else {
+            CHECK(frame.length == sizeof(chunk));
+            chunks++;
+        }
+        offset += RECORDING_FRAME_HEADER + frame.length;
+    }
+    struct stat file_stat;
+    CHECK(ended && fstat(fd, &file_stat) == 0 && (uint64_t)file_stat.st_size == offset);
+    CHECK(chunks == 20);
+
+    /* a seek point each second of the 4.5 s, and one after the gap with the time the saturated delta lost */
+    CHECK(indexes == 6);
+    for (size_t i = 0; i < 5 && i < indexes; i++) {
+        CHECK(times[i] == i * RECORDING_INDEX_US);
+    }
+    CHECK(indexes == 6 && times[5] == 5000000000ull + 18 * 250000);
+    CHECK(end.elapsed_us == 5000000000ull + 18 * 250000 + 10000);
+
+    /* and backwards: the end frame leads to the last index frame, and each to the one before */
+    size_t walked = 0;
+    offset = end.previous;
+    while (offset != 0 && walked < indexes && read_recording_frame(fd, offset, &frame, &index) == 0 &&
+           frame.kind == RECORDING_INDEX) {
+        CHECK(offset == offsets[indexes - 1 - walked] && index.elapsed_us == times[indexes - 1 - walked]);
+        walked++;
+        offset = index.previous;
+    }
+    CHECK(walked == indexes && offset == 0);
+
+    /* index and end frames carry exactly one payload, and kinds past RECORDING_END are refused */
+    unsigned char header[RECORDING_FRAME_HEADER];
+    RecordingFrame bad = { RECORDING_INDEX, RECORDING_INDEX_PAYLOAD - 1, 0 };
+    recording_encode_frame(&bad, header);
+    CHECK(recording_decode_frame(header, &frame) == -1);
+    bad.kind = RECORDING_END;
+    bad.length = RECORDING_INDEX_PAYLOAD;
+    recording_encode_frame(&bad, header);
+    CHECK(recording_decode_frame(header, &frame) == 0 && frame.kind == RECORDING_END);
+    bad.kind = RECORDING_END + 1;
+    recording_encode_frame(&bad, header);
+    CHECK(recording_decode_frame(header, &frame) == -1);
+    memcpy(start, "EGGREC00", RECORDING_MAGIC_LENGTH);
+    CHECK(recording_decode_start(start, &started_us) == -1);
+
+    if (fd != -1) {
+        close(fd);
+    }
+    unlink(path);
+    rmdir(directory);
+}
+
+int main() {
+    test_wheel_order(TIMER_TICK_MS);
+    test_wheel_order(3 * 60 * 60 * 1000);
+    test_wheel_cancel();
+    test_wheel_timeout();
+    test_decode_message();
+    test_decode_frame();
+    test_decode_auth_request();
+    test_users();
+    test_admission();
+    test_logger();
+    test_channels();
+    test_scrollback();
+    test_recorder();
+
+    printf("%d of %d checks passed\n", checks - failures, checks);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
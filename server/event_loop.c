@@ -0,0 +1,1169 @@
+/**
+ * @file event_loop.c
+ * @brief Single-process epoll server mode
+ *
+ * Every descriptor is non-blocking and level-triggered. Shell output goes
+ * through each session's bounded output queue, and the PTY is read only
+ * while the queue has room, so a slow client blocks its own shell and
+ * nothing else. Client input is read one chunk at a time, once the previous
+ * chunk has reached the PTY.
+ *
+ * A session whose client drops is detached instead of closed when resuming
+ * is on: its PTY output goes to the session's backlog until the backlog is
+ * full, and the session expires if nobody resumes it within the grace period.
+ *
+ * Deadlines are timers on one timer wheel: each session's login timeout,
+ * then its grace period while detached, and its idle and session length
+ * timeouts. epoll_wait() waits no longer than the wheel's next tick with
+ * a timer in it, so thousands of sessions cost no scan.
+ *
+ * A shell that exits is reaped as soon as SIGCHLD reaches the children
+ * signalfd, and its session ends once the output left in its PTY is sent,
+ * even if something the shell started still holds the PTY open. A session
+ * taken over from the server this one replaced has a shell this process
+ * cannot reap, and ends when its PTY hangs up.
+ *
+ * SIGUSR2 hands the port to a freshly started server (see upgrade.h), and
+ * with -H every session that can move as it is goes along. The loop then
+ * drains: it serves the sessions left until the last has ended, and returns.
+ *
+ * A client socket corked for bulk output stays corked only while its PTY
+ * keeps producing bulk chunks: while any socket is corked, epoll_wait()
+ * only polls, and after each batch the sockets that got no bulk chunk in it
+ * are uncorked. Compressed output is held back the same way: bulk chunks
+ * are deflated without a flush, and the stream is sync-flushed along with
+ * the uncork.
+ */
+
+#define _GNU_SOURCE     // accept4
+
+#include "event_loop.h"
+#include "session.h"
+#include "server.h"
+#include "users.h"
+#include "metrics.h"
+#include "shell_pool.h"
+#include "detach.h"
+#include "socket_tuning.h"
+#include "client_stream.h"
+#include "upgrade.h"
+#include "children.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static int epoll_fd = -1;
+static Session *closed_sessions = NULL;
+static Session *relay_sessions = NULL;  // sessions with a shell, attached or detached
+static TimerWheel timers;               // every session's deadlines and timeouts
+static Session *corked_sessions = NULL;
+static size_t live_sessions = 0;        // sessions not freed yet, logged in or not
+static int draining = 0;                // the port went to a new server; the loop ends with the last session
+
+static void link_relay_session(Session *session) {
+    session->relay_prev = NULL;
+    session->relay_next = relay_sessions;
+    if (relay_sessions != NULL) relay_sessions->relay_prev = session;
+    relay_sessions = session;
+}
+
+static void unlink_relay_session(Session *session) {
+    if (session->relay_prev != NULL) {
+        session->relay_prev->relay_next = session->relay_next;
+    } else if (relay_sessions == session) {
+        relay_sessions = session->relay_next;
+    }
+    if (session->relay_next != NULL) session->relay_next->relay_prev = session->relay_prev;
+    session->relay_prev = session->relay_next = NULL;
+}
+
+/**
+ * @brief Marks a session closed; it is freed once the current batch of events is done.
+ */
+static void close_session(Session *session) {
+    if (session->closing) {
+        return;
+    }
+    session->closing = 1;
+    timer_cancel(&timers, &session->deadline);
+    timeouts_stop(&session->stats.timeouts);
+    if (session->client_fd != -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session->client_fd, NULL);
+    }
+    if (session->master_fd != -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session->master_fd, NULL);
+        unlink_relay_session(session);
+    }
+    session->next_closed = closed_sessions;
+    closed_sessions = session;
+}
+
+static void free_closed_sessions() {
+    while (closed_sessions != NULL) {
+        Session *session = closed_sessions;
+        closed_sessions = session->next_closed;
+        if (session->handed_over) {
+            log_event("Session of %s on client_fd %d passed to the new server.\n", session->username, session->client_fd);
+        } else if (session->state == SESSION_RELAY || session->state == SESSION_DETACHED) {
+            log_session_end(&session->stats, session->client_fd, session->token);
+        } else if (session->client_fd != -1) {
+            log_event("Session for client_fd %d closed before login.\n", session->client_fd);
+        }
+        session_destroy(session);
+        live_sessions--;
+    }
+}
+
+/**
+ * @brief Registers or updates the epoll interest of a descriptor when it changed.
+ */
+static int watch(const int fd, EventSource *source, uint32_t *current, const uint32_t wanted, const int add) {
+    if (!add && *current == wanted) {
+        return 0;
+    }
+
+    struct epoll_event event;
+    event.events = wanted;
+    event.data.ptr = source;
+    if (epoll_ctl(epoll_fd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event) == -1) {
+        log_event("epoll_ctl failed for fd %d: %s\n", fd, strerror(errno));
+        return -1;
+    }
+    *current = wanted;
+    return 0;
+}
+
+/**
+ * @brief Reads the PTY while the output queue has room, and the client while its last input is written.
+ */
+static void update_interest(Session *session) {
+    uint32_t client_events = 0;
+    uint32_t pty_events = 0;
+
+    if (session->state == SESSION_DETACHED) {
+        /* a full backlog leaves the PTY unread, so the shell blocks on its output */
+        if (!backlog_full(&session->backlog)) pty_events |= EPOLLIN;
+        if (session->to_pty.length > 0) pty_events |= EPOLLOUT;
+    } else if (session->state != SESSION_RELAY) {
+        client_events = EPOLLIN;
+    } else {
+        /* after a resume, the backlog goes out before the queue */
+        if (session->to_pty.length == 0 && !session->shell_exited) client_events |= EPOLLIN;
+        if (session->to_client.length > 0 || session->backlog.length > 0 || stream_pending(&session->stream)) {
+            client_events |= EPOLLOUT;
+        }
+        if (!backlog_full(&session->to_client)) pty_events |= EPOLLIN;
+        if (session->to_pty.length > 0) pty_events |= EPOLLOUT;
+    }
+    if (session->shell_exited) {
+        pty_events = 0;     // no longer registered, see shell_exited()
+    }
+
+    if (session->client_fd != -1 &&
+        watch(session->client_fd, &session->client_source, &session->client_events, client_events, 0) == -1) {
+        close_session(session);
+        return;
+    }
+    if (session->master_fd != -1 &&
+        watch(session->master_fd, &session->pty_source, &session->pty_events, pty_events, 0) == -1) {
+        close_session(session);
+    }
+}
+
+/**
+ * @brief Moves output the client has not received into the backlog, so a resume replays it.
+ *
+ * The scrollback forgets it until then, so a replay does not show it twice.
+ */
+static void keep_unsent_output(Session *session) {
+    scrollback_forget(&session->stats.scrollback, session->to_client.length - session->to_client.offset);
+    const size_t lost = backlog_move(&session->backlog, &session->to_client);
+    if (lost > 0) {
+        log_event("Backlog of session %.8s... full, %zu bytes of output lost.\n", session->token, lost);
+    }
+}
+
+/**
+ * @brief Sends the client the backlog of a resume, then the output queue, flushing a compressed stream.
+ * @return 1 when everything is sent, 0 if bytes remain, -1 on error.
+ */
+static int flush_output(Session *session) {
+    int result = stream_flush(&session->stream, &session->backlog, session->client_fd, 1);
+    if (result == 1) {
+        result = stream_flush(&session->stream, &session->to_client, session->client_fd, 1);
+    }
+    if (result == 1) {
+        trace_echo_sent(&session->stats);
+    }
+    return result;
+}
+
+/**
+ * @brief Writes the client input waiting for the PTY, telling the echo trace once it is all in.
+ * @return As flush_pending().
+ */
+static int write_to_pty(Session *session) {
+    const int result = flush_pending(session->master_fd, &session->to_pty);
+    if (result == 1) {
+        trace_echo_written(&session->stats);
+    }
+    return result;
+}
+
+/**
+ * @brief Stops watching the PTY of a shell that has exited; the session closes once its output is sent.
+ */
+static void shell_exited(Session *session) {
+    if (flush_output(session) != 0) {
+        close_session(session);
+        return;
+    }
+    /* a hung-up PTY reports EPOLLHUP whatever the interest, so it has to leave epoll */
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session->master_fd, NULL);
+    session->pty_events = 0;
+    session->shell_exited = 1;
+    session->to_pty.length = 0;
+}
+
+/**
+ * @brief Drops the session's client; the session waits detached for a resume if it can.
+ */
+static void client_lost(Session *session) {
+    if (session->token[0] == '\0' || session->shell_exited || session->shell_pid == -1 ||
+        backlog_init(&session->backlog, server_config.detach_backlog) == -1) {
+        close_session(session);
+        return;
+    }
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session->client_fd, NULL);
+    stream_end(&session->stream, session->client_fd);
+    close(session->client_fd);
+    session->client_fd = -1;
+    session->client_events = 0;
+    output_cork_init(&session->cork, -1);
+    keep_unsent_output(session);
+
+    session->state = SESSION_DETACHED;
+    timer_arm(&timers, &session->deadline, (uint64_t)server_config.detach_grace * 1000);
+    log_event("Client of session %.8s... disconnected, detaching for %ds.\n", session->token, server_config.detach_grace);
+    update_interest(session);
+}
+
+/**
+ * @brief Fires at the login timeout of a session not logged in yet, and at the end of a detached session's grace period.
+ */
+static void session_deadline(void *owner) {
+    Session *session = owner;
+    if (session->state == SESSION_DETACHED) {
+        log_event("Detached session %.8s... expired.\n", session->token);
+    } else {
+        log_event("client_fd %d did not log in within %ds.\n", session->client_fd, server_config.login_timeout);
+        metrics_add(METRIC_TIMEOUTS_LOGIN, 1);
+        send_response(session->client_fd, CONNECTION_FAILURE, "Login timed out.");
+    }
+    close_session(session);
+}
+
+/**
+ * @brief Tells the client about an idle or session length timeout; an expired session closes once the notice is out.
+ *
+ * A detached session has nobody to tell, and just closes when it expires.
+ */
+static void session_timed_out(void *owner, const char *notice, const int expired) {
+    Session *session = owner;
+    if (session->state == SESSION_DETACHED) {
+        if (expired) {
+            log_event("Closing detached session %.8s...: %s\n", session->token, notice);
+            close_session(session);
+        }
+        return;
+    }
+
+    if (stream_send_notice(&session->stream, &session->to_client, notice) == -1) {
+        log_event("No room for the timeout notice of client_fd %d.\n", session->client_fd);
+    }
+    if (expired) {
+        log_event("Closing the session of %s: %s\n", session->username, notice);
+        shell_exited(session);
+        if (session->closing) {
+            return;
+        }
+    }
+    update_interest(session);
+}
+
+/**
+ * @brief Queues what the PTY has for the client and pushes as much of the queue as the client takes.
+ * @return 1 if output was queued, 0 if the PTY had none, -1 if the shell has exited, -2 if writing to the client failed.
+ */
+static int relay_output(Session *session) {
+    OutputBacklog *queue = &session->to_client;
+    const ssize_t nbytes = backlog_fill(queue, session->master_fd);
+    if (nbytes < 0 && errno == EAGAIN) {
+        return session->shell_pid == -1 ? -1 : 0;   // a reaped shell has nothing more to say
+    }
+    if (nbytes < 0) {
+        /* EIO on the PTY master means the shell has gone away */
+        log_event("Failed to read from fd %d: %s\n", session->master_fd, strerror(errno));
+        return -1;
+    }
+    if (nbytes == 0) {
+        log_event("fd %d closed the connection.\n", session->master_fd);
+        return -1;
+    }
+
+    log_relay(&session->stats, session->client_fd, RELAY_TO_CLIENT, queue->data + queue->length - nbytes, nbytes);
+    output_cork_chunk(&session->cork, nbytes);
+    const int bulk = nbytes >= server_config.cork_threshold;
+
+    /* the backlog of a resume goes out before anything queued after it */
+    if (session->backlog.length == 0) {
+        const int flushed = stream_flush(&session->stream, queue, session->client_fd, !bulk);
+        if (flushed == -1) {
+            log_event("Failed to write to fd %d: %s\n", session->client_fd, strerror(errno));
+            return -2;
+        }
+        if (flushed == 1) {
+            trace_echo_sent(&session->stats);
+        }
+    }
+
+    if (session->cork.corked || session->stream.unflushed) {
+        session->cork_fed = bulk;
+        if (!session->cork_listed) {
+            session->cork_listed = 1;
+            session->next_corked = corked_sessions;
+            corked_sessions = session;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Queues the output a reaped shell left in its PTY, as much as the queue takes.
+ *
+ * The session closes once it is sent; whatever does not fit is read as the client makes room.
+ */
+static void read_last_output(Session *session) {
+    int result;
+    while ((result = relay_output(session)) == 1 && !backlog_full(&session->to_client)) {}
+    if (result == -1) {
+        shell_exited(session);
+    } else if (result == -2) {
+        close_session(session);
+    }
+}
+
+/**
+ * @brief Ends the session of a shell that has been reaped.
+ */
+static void shell_reaped(void *owner) {
+    Session *session = owner;
+    session->shell_pid = -1;
+    if (session->closing || session->shell_exited) {
+        return;
+    }
+    if (session->state == SESSION_DETACHED) {
+        log_event("Shell of detached session %.8s... exited.\n", session->token);
+        close_session(session);
+        return;
+    }
+    read_last_output(session);
+    if (!session->closing) {
+        update_interest(session);
+    }
+}
+
+/**
+ * @brief Authenticates the session and attaches it to a new shell.
+ * @param login The pipelined login the password came in, for the client's terminal; NULL after a prompt.
+ */
+static void start_shell(Session *session, const char *password, const AuthRequest *login) {
+    if (!authenticate_user(session->username, password)) {
+        admission_login_failed(session->username);
+        send_response(session->client_fd, AUTH_FAIL, "Authentication failed.");
+        log_event("Failed login attempt for user: %s\n", session->username);
+        close_session(session);
+        return;
+    }
+
+    /* sent in place of AUTH_SUCCESS: the client gives up as after a failed login */
+    const char *refusal = admission_start_session(&session->admission);
+    if (refusal != NULL) {
+        log_event("Refused session for user %s: %s\n", session->username, refusal);
+        send_response(session->client_fd, CONNECTION_FAILURE, refusal);
+        close_session(session);
+        return;
+    }
+
+    send_response(session->client_fd, AUTH_SUCCESS, "Authentication successful.");
+    log_event("User %s authenticated successfully.\n", session->username);
+
+    const int cgroup_fd = cgroup_create(&session->stats.cgroup, session->username);
+    const int started = acquire_shell(&session->master_fd, &session->shell_pid, cgroup_fd);
+    if (cgroup_fd != -1) {
+        close(cgroup_fd);
+    }
+    if (started == -1 || backlog_init(&session->to_client, server_config.output_queue) == -1) {
+        close_session(session);
+        return;
+    }
+    children_watch(session->shell_pid, shell_reaped, session);
+    fcntl(session->master_fd, F_SETFL, fcntl(session->master_fd, F_GETFL) | O_NONBLOCK);
+    if (login != NULL) {
+        apply_login_terminal(session->master_fd, login);
+    }
+
+    timer_cancel(&timers, &session->deadline);
+    session->state = SESSION_RELAY;
+    link_relay_session(session);
+    if (server_config.detach_grace > 0) {
+        session_token_new(session->token);
+    }
+    send_response(session->client_fd, SESSION_TOKEN, session->token);
+    stream_begin(&session->stream, session->client_fd, session->requests);
+    relay_stats_start(&session->stats, session->username);
+    timeouts_start(&session->stats.timeouts, &timers, server_config.idle_timeout, server_config.session_limit,
+                   session_timed_out, session);
+    if (watch(session->master_fd, &session->pty_source, &session->pty_events, EPOLLIN, 1) == -1) {
+        close_session(session);
+    }
+}
+
+/**
+ * @brief Decodes a framed client's buffered input, writing its data frames to the PTY until one is left over.
+ *
+ * Control frames are applied to the PTY as they are decoded.
+ *
+ * @return 0 to keep the session, -1 if the client sent a malformed frame, -2 if writing to the PTY failed.
+ */
+static int relay_framed_input(Session *session) {
+    PendingWrite *pending = &session->to_pty;
+    StreamInput input;
+    while (pending->length == 0 && session->stream.input_length > 0 && !session->shell_exited) {
+        if (stream_next_input(&session->stream, &session->master_fd, pending->data, &input) == -1) {
+            log_event("client_fd %d sent a malformed frame.\n", session->client_fd);
+            return -1;
+        }
+        pending->length = input.length;
+        if (pending->length == 0) {
+            break;  // the rest is part of a frame
+        }
+        pending->offset = 0;
+        log_relay(&session->stats, session->client_fd, RELAY_FROM_CLIENT, pending->data, pending->length);
+        if (write_to_pty(session) == -1) {
+            log_event("Failed to write to fd %d: %s\n", session->master_fd, strerror(errno));
+            return -2;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Finds the session a token names among this process's sessions, NULL if it has none.
+ */
+static Session *find_relay_session(const char *token) {
+    Session *session = relay_sessions;
+    while (session != NULL && !(session->token[0] != '\0' && session_token_matches(session->token, token))) {
+        session = session->relay_next;
+    }
+    return session;
+}
+
+/**
+ * @brief Attaches a client that presented a token to the session it names.
+ *
+ * Takes the session over if another client is still attached to it.
+ *
+ * @param client_fd The resuming client, not registered with epoll.
+ * @param token The token it presented.
+ * @param requests What it asked for before resuming, see stream_negotiate().
+ * @param pending Bytes it sent after its resume message, for the shell.
+ * @param pending_length Number of pending bytes.
+ */
+static void resume_session(const int client_fd, const char *token, const int requests,
+                           const char *pending, const size_t pending_length) {
+    Session *session = find_relay_session(token);
+    if (session == NULL || session->closing) {
+        log_event("client_fd %d asked to resume an unknown session.\n", client_fd);
+        send_response(client_fd, SESSION_RESUME_FAIL, NULL);
+        close(client_fd);
+        return;
+    }
+
+    if (session->state == SESSION_RELAY) {
+        /* the old connection has not noticed it is dead yet */
+        log_event("Session %.8s... taken over from client_fd %d.\n", session->token, session->client_fd);
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session->client_fd, NULL);
+        stream_end(&session->stream, session->client_fd);
+        close(session->client_fd);
+        if (backlog_init(&session->backlog, server_config.detach_backlog) == 0) {
+            keep_unsent_output(session);
+        }
+    }
+
+    session->client_fd = client_fd;
+    session->client_events = 0;
+    output_cork_init(&session->cork, client_fd);
+    session->state = SESSION_RELAY;
+    timer_cancel(&timers, &session->deadline);
+    timeouts_input(&session->stats.timeouts);
+    if (watch(client_fd, &session->client_source, &session->client_events, EPOLLIN, 1) == -1) {
+        close_session(session);
+        return;
+    }
+    send_response(client_fd, SESSION_RESUMED, NULL);
+    session->requests = requests;
+    stream_begin(&session->stream, client_fd, requests);
+    const size_t replayed = requests & STREAM_SCROLLBACK ? scrollback_replay(&session->stats.scrollback, &session->backlog) : 0;
+    const size_t unsent = session->backlog.length - session->backlog.offset - replayed;
+    log_event("Session %.8s... resumed on client_fd %d with %zu bytes of backlog and %zu of scrollback.\n",
+              session->token, client_fd, unsent, replayed);
+    if (unsent > 0) {
+        log_relay(&session->stats, client_fd, RELAY_TO_CLIENT, session->backlog.data + session->backlog.offset + replayed, unsent);
+    }
+
+    /* keystrokes typed after the resume request belong to the shell */
+    if (session->stream.framed) {
+        memcpy(session->stream.input, pending, pending_length);
+        session->stream.input_length = pending_length;
+        if (relay_framed_input(session) != 0) {
+            close_session(session);
+            return;
+        }
+    } else {
+        const size_t room = sizeof(session->to_pty.data) - session->to_pty.length;
+        const size_t copied = pending_length < room ? pending_length : room;
+        memcpy(session->to_pty.data + session->to_pty.length, pending, copied);
+        session->to_pty.length += copied;
+    }
+    update_interest(session);
+}
+
+/**
+ * @brief Resumes a session for a client still in the handshake, here or in the owning process.
+ */
+static void request_resume(Session *session, const Message *msg) {
+    char token[SESSION_TOKEN_LENGTH + 1];
+    read_credential(msg, token, sizeof(token));
+
+    /* the socket leaves this handshake session, which is then closed without it */
+    const int client_fd = session->client_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_fd, NULL);
+    session->client_fd = -1;
+    close_session(session);
+
+    /* a session passed on by an upgrade keeps the token of the server that started it */
+    if (find_relay_session(token) == NULL && !session_token_is_local(token) &&
+        handoff_client(token, client_fd, session->requests, session->handshake, session->handshake_length) == 0) {
+        close(client_fd);
+        return;
+    }
+    resume_session(client_fd, token, session->requests, session->handshake, session->handshake_length);
+}
+
+/**
+ * @brief Resumes the sessions of every client another process passed on.
+ */
+static void accept_handoffs() {
+    char token[SESSION_TOKEN_LENGTH + 1];
+    char pending[HANDOFF_MAX_PENDING];
+    size_t pending_length;
+    int client_fd;
+    int requests;
+
+    while (receive_handoff(token, &client_fd, &requests, pending, &pending_length) == 1) {
+        log_event("client_fd %d for session %.8s... passed on by another process.\n", client_fd, token);
+        fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+        resume_session(client_fd, token, requests, pending, pending_length);
+    }
+}
+
+/**
+ * @brief Consumes complete handshake messages from the session's handshake buffer.
+ */
+static void process_handshake(Session *session) {
+    Message msg;
+    int consumed;
+
+    while (session->state != SESSION_RELAY && !session->closing &&
+           (consumed = decode_message(session->handshake, session->handshake_length, &msg)) != 0) {
+        if (consumed < 0) {
+            send_response(session->client_fd, MESSAGE_TOO_LONG, NULL);
+            close_session(session);
+            return;
+        }
+        session->handshake_length -= consumed;
+        memmove(session->handshake, session->handshake + consumed, session->handshake_length);
+
+        if (session->state == SESSION_AUTH_USERNAME &&
+            (msg.status_code == COMPRESS_REQUEST || msg.status_code == RELAY_FRAMED ||
+             msg.status_code == SCROLLBACK_REQUEST)) {
+            session->requests = stream_negotiate(session->requests, &msg);
+        } else if (session->state == SESSION_AUTH_USERNAME && msg.status_code == SESSION_RESUME) {
+            request_resume(session, &msg);
+            return;
+        } else if (session->state == SESSION_AUTH_USERNAME) {
+            /* a pipelined login brings the password and the client's terminal with the username */
+            AuthRequest login;
+            const int pipelined = msg.status_code == AUTH_REQUEST;
+            if (pipelined) {
+                if (decode_auth_request(&msg, &login) == -1 || strlen(login.username) >= sizeof(session->username) ||
+                    strlen(login.password) >= MAX_PASSWORD_LENGTH) {
+                    log_event("client_fd %d sent a malformed login request.\n", session->client_fd);
+                    send_response(session->client_fd, AUTH_FAIL, "Malformed login request.");
+                    close_session(session);
+                    return;
+                }
+                memcpy(session->username, login.username, strlen(login.username) + 1);
+                log_event("Received login request for '%s' (%hux%hu, TERM '%s')\n",
+                          session->username, login.columns, login.rows, login.term);
+            } else {
+                read_credential(&msg, session->username, sizeof(session->username));
+                log_event("Received username: '%s'\n", session->username);
+            }
+            const char *refusal = admission_user(session->username);
+            if (refusal != NULL) {
+                log_event("Refused login for user %s: %s\n", session->username, refusal);
+                send_response(session->client_fd, CONNECTION_FAILURE, refusal);
+                close_session(session);
+                return;
+            }
+            if (pipelined) {
+                start_shell(session, login.password, &login);
+            } else {
+                send_response(session->client_fd, RESPONSE_OK, "Password:");
+                session->state = SESSION_AUTH_PASSWORD;
+            }
+        } else {
+            char password[MAX_PASSWORD_LENGTH];
+            read_credential(&msg, password, sizeof(password));
+            start_shell(session, password, NULL);
+        }
+    }
+
+    /* bytes the client sent after its password or login request belong to the shell */
+    if (session->state == SESSION_RELAY && !session->closing && session->handshake_length > 0) {
+        if (session->stream.framed) {
+            memcpy(session->stream.input, session->handshake, session->handshake_length);
+            session->stream.input_length = session->handshake_length;
+        } else {
+            memcpy(session->to_pty.data, session->handshake, session->handshake_length);
+            session->to_pty.length = session->handshake_length;
+        }
+        session->handshake_length = 0;
+    }
+}
+
+/**
+ * @brief Reads handshake bytes from a client that has not authenticated yet.
+ */
+static void handle_handshake_input(Session *session) {
+    const ssize_t nbytes = read(session->client_fd, session->handshake + session->handshake_length,
+                                sizeof(session->handshake) - session->handshake_length);
+    if (nbytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (nbytes <= 0) {
+        log_event("client_fd %d disconnected during authentication.\n", session->client_fd);
+        close_session(session);
+        return;
+    }
+    session->handshake_length += nbytes;
+    process_handshake(session);
+}
+
+/**
+ * @brief Moves one chunk of client input towards the PTY.
+ * @return 0 to keep the session, -1 if the client failed or closed, -2 if writing to the PTY failed.
+ */
+static int relay_input(Session *session) {
+    PendingWrite *pending = &session->to_pty;
+    const ssize_t nbytes = stream_read_input(&session->stream, session->client_fd, pending->data);
+    if (nbytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    if (nbytes < 0) {
+        log_event("Failed to read from fd %d: %s\n", session->client_fd, strerror(errno));
+        return -1;
+    }
+    if (nbytes == 0) {
+        log_event("fd %d closed the connection.\n", session->client_fd);
+        return -1;
+    }
+    if (session->stream.framed) {
+        session->stream.input_length += nbytes;
+        return relay_framed_input(session);
+    }
+
+    pending->length = nbytes;
+    pending->offset = 0;
+    log_relay(&session->stats, session->client_fd, RELAY_FROM_CLIENT, pending->data, nbytes);
+
+    if (write_to_pty(session) == -1) {
+        log_event("Failed to write to fd %d: %s\n", session->master_fd, strerror(errno));
+        return -2;
+    }
+    return 0;
+}
+
+static void handle_client_event(Session *session, const uint32_t events) {
+    if (session->client_fd == -1) {
+        return;     // the client left earlier in this batch of events
+    }
+    if (session->state != SESSION_RELAY) {
+        handle_handshake_input(session);
+        if (!session->closing && session->state == SESSION_RELAY &&
+            (write_to_pty(session) == -1 || relay_framed_input(session) != 0)) {
+            close_session(session);
+        }
+    } else {
+        if (events & EPOLLOUT) {
+            const int flushed = flush_output(session);
+            if (flushed == -1) {
+                log_event("Failed to write to client_fd %d: %s\n", session->client_fd, strerror(errno));
+                client_lost(session);
+                return;
+            }
+            if (flushed == 1 && session->shell_exited) {
+                close_session(session);
+                return;
+            }
+            if (session->shell_pid == -1 && !session->shell_exited && !backlog_full(&session->to_client)) {
+                read_last_output(session);
+                if (session->closing) {
+                    return;
+                }
+            }
+        }
+        if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && session->to_pty.length == 0 && !session->shell_exited) {
+            const int result = relay_input(session);
+            if (result == -1) {
+                client_lost(session);
+                return;
+            }
+            if (result == -2) {
+                close_session(session);
+                return;
+            }
+        }
+    }
+    if (!session->closing) {
+        update_interest(session);
+    }
+}
+
+static void handle_pty_event(Session *session, const uint32_t events) {
+    if ((events & EPOLLOUT) && write_to_pty(session) == -1) {
+        log_event("Failed to write to master_fd %d: %s\n", session->master_fd, strerror(errno));
+        close_session(session);
+        return;
+    }
+    /* a framed client's next data frame may be buffered behind the one just written */
+    if ((events & EPOLLOUT) && session->state == SESSION_RELAY) {
+        const int result = relay_framed_input(session);
+        if (result == -1) {
+            client_lost(session);
+            return;
+        }
+        if (result == -2) {
+            close_session(session);
+            return;
+        }
+    }
+    if (session->state == SESSION_DETACHED) {
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            const ssize_t nbytes = backlog_fill(&session->backlog, session->master_fd);
+            const int no_room = nbytes == -1 && errno == ENOBUFS;
+            if (nbytes == 0 || (nbytes == -1 && errno != EAGAIN && errno != EINTR && !no_room) ||
+                (no_room && (events & EPOLLHUP))) {
+                log_event("Shell of detached session %.8s... exited.\n", session->token);
+                close_session(session);
+                return;
+            }
+        }
+    } else if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !backlog_full(&session->to_client)) {
+        const int result = relay_output(session);
+        if (result == -1) {
+            shell_exited(session);
+            if (session->closing) {
+                return;
+            }
+        } else if (result == -2) {
+            client_lost(session);
+            return;
+        }
+    } else if ((events & EPOLLHUP) && session->state == SESSION_RELAY) {
+        /* the hang-up would be reported on every wait until the queue drains, as in the detached case */
+        log_event("Shell of client_fd %d exited with its output queue full, the rest of its output is dropped.\n",
+                  session->client_fd);
+        shell_exited(session);
+        if (session->closing) {
+            return;
+        }
+    }
+    update_interest(session);
+}
+
+/**
+ * @brief Flushes and uncorks the client sockets whose PTY produced no bulk chunk in the last batch.
+ */
+static void release_idle_corks() {
+    Session *still_corked = NULL;
+    for (Session *session = corked_sessions, *next; session != NULL; session = next) {
+        next = session->next_corked;
+        if (session->closing) {
+            continue;   // freed after this, and its socket goes with it
+        }
+        if (session->cork_fed && session->state == SESSION_RELAY) {
+            session->cork_fed = 0;
+            session->next_corked = still_corked;
+            still_corked = session;
+            continue;
+        }
+        session->cork_listed = 0;
+        session->cork_fed = 0;
+        if (session->state != SESSION_RELAY) {
+            continue;   // detached: the stream and the cork went with the client
+        }
+        /* what the client does not take now goes out on EPOLLOUT, flushed then too */
+        const int flushed = flush_output(session);
+        if (flushed == -1) {
+            log_event("Failed to write to client_fd %d: %s\n", session->client_fd, strerror(errno));
+            client_lost(session);
+            continue;
+        }
+        if (flushed == 1 && session->shell_exited) {
+            close_session(session);
+            continue;
+        }
+        output_uncork(&session->cork);
+        update_interest(session);
+    }
+    corked_sessions = still_corked;
+}
+
+/**
+ * @brief Accepts the pending connections on the listening socket, ACCEPT_BATCH at most.
+ *
+ * The listening socket is level-triggered, so connections left over are
+ * accepted after the sessions' events of the next batch; a storm of
+ * connections then delays the relays by one batch of accepts at a time.
+ */
+static void accept_clients(const int server_fd) {
+    for (int accepted = 0; accepted < ACCEPT_BATCH; accepted++) {
+        struct sockaddr_in client_address;
+        socklen_t sin_size = sizeof(client_address);
+        const int client_fd = accept4(server_fd, (struct sockaddr *)&client_address, &sin_size,
+                                      SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept");
+            }
+            return;
+        }
+        metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
+
+        log_event("Received connection from %s:%d.\n",
+          inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
+
+        Admission admission;
+        const char *refusal = admission_accept(&admission, client_address.sin_addr.s_addr);
+        if (refusal != NULL) {
+            log_event("Refused connection from %s: %s\n", inet_ntoa(client_address.sin_addr), refusal);
+            send_response(client_fd, CONNECTION_FAILURE, refusal);
+            close(client_fd);
+            continue;
+        }
+        tune_client_socket(client_fd);
+
+        Session *session = session_create(client_fd);
+        if (session == NULL) {
+            log_event("Failed to allocate session for client_fd %d.\n", client_fd);
+            admission_release(&admission);
+            close(client_fd);
+            continue;
+        }
+        session->admission = admission;
+
+        if (watch(client_fd, &session->client_source, &session->client_events, EPOLLIN, 1) == -1) {
+            session_destroy(session);
+            continue;
+        }
+        live_sessions++;
+        timer_init(&session->deadline, session_deadline, session);
+        if (server_config.login_timeout > 0) {
+            timer_arm(&timers, &session->deadline, (uint64_t)server_config.login_timeout * 1000);
+        }
+        send_response(client_fd, RESPONSE_OK, "Username:");
+    }
+}
+
+/**
+ * @brief Checks whether a session can move to a new server as it is: with its two descriptors only.
+ *
+ * It has to sit between frames with nothing queued either way, and not be
+ * compressed, since the deflate window cannot go along. A detached session
+ * stays too; resumes are passed on to it here.
+ */
+static int can_hand_over(const Session *session) {
+    return session->state == SESSION_RELAY && !session->closing && !session->shell_exited &&
+           !session->stream.compressed && session->stream.frame_left == 0 && session->stream.input_length == 0 &&
+           !stream_pending(&session->stream) && session->to_client.length == 0 && session->backlog.length == 0 &&
+           session->to_pty.length == 0;
+}
+
+/**
+ * @brief Passes every session that can move to the new server; the others end here.
+ * @return The number of sessions passed on.
+ */
+static size_t hand_over_sessions(const int upgrade_fd) {
+    size_t passed = 0;
+    for (Session *session = relay_sessions, *next; session != NULL; session = next) {
+        next = session->relay_next;
+        if (session->state == SESSION_RELAY && !session->closing && flush_output(session) == 1) {
+            output_uncork(&session->cork);
+        }
+        if (!can_hand_over(session)) {
+            continue;
+        }
+
+        UpgradeSession moving;
+        moving.shell_pid = session->shell_pid;
+        moving.requests = session->requests;
+        moving.framed = session->stream.framed;
+        memcpy(moving.username, session->username, sizeof(moving.username));
+        memcpy(moving.token, session->token, sizeof(moving.token));
+        memcpy(moving.cgroup, session->stats.cgroup.name, sizeof(moving.cgroup));
+        /* opened while the shell is still this process's to reap, so the pid cannot have been reused */
+        const int shell_pidfd = session->shell_pidfd != -1 ? session->shell_pidfd : children_pidfd(session->shell_pid);
+        const int sent = upgrade_send_session(upgrade_fd, &moving, session->client_fd, session->master_fd, shell_pidfd);
+        if (shell_pidfd != session->shell_pidfd && shell_pidfd != -1) {
+            close(shell_pidfd);
+        }
+        if (sent == -1) {
+            log_event("Failed to pass the session of %s on: %s\n", session->username, strerror(errno));
+            continue;
+        }
+        session->handed_over = 1;
+        children_disown(session->shell_pid);
+        session->shell_pid = -1;    // the new server's now, with its cgroup
+        session->stats.cgroup.name[0] = '\0';
+        close_session(session);
+        passed++;
+    }
+    log_event("Passed %zu sessions to the new server.\n", passed);
+    return passed;
+}
+
+/**
+ * @brief On SIGUSR2, hands the port to a new server and starts draining.
+ *
+ * A worker only drains: its supervisor has started the new server, whose
+ * workers bind sockets of their own.
+ *
+ * @param server_fd The listening socket, closed and set to -1 once handed over.
+ */
+static void upgrade(int *server_fd) {
+    if (!upgrade_requested() || draining) {
+        return;
+    }
+    size_t passed = 0;
+    if (server_config.mode == SERVER_MODE_EPOLL) {
+        const int upgrade_fd = upgrade_start(*server_fd);
+        if (upgrade_fd == -1) {
+            return;
+        }
+        if (server_config.upgrade_sessions) {
+            passed = hand_over_sessions(upgrade_fd);
+        }
+        close(upgrade_fd);
+    }
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, *server_fd, NULL);
+    close(*server_fd);
+    *server_fd = -1;
+    shell_pool_init(0, &timers);
+    draining = 1;
+    log_event("No longer accepting; draining %zu sessions.\n", live_sessions - passed);
+}
+
+/**
+ * @brief Serves a session the server this one replaces passed on, as it was.
+ */
+static void adopt_session(const UpgradeSession *moving, const int client_fd, const int master_fd, const int shell_pidfd) {
+    Session *session = session_create(client_fd);
+    if (session == NULL) {
+        log_event("Failed to allocate session for client_fd %d.\n", client_fd);
+        children_signal(moving->shell_pid, shell_pidfd, SIGKILL);
+        if (shell_pidfd != -1) {
+            close(shell_pidfd);
+        }
+        close(client_fd);
+        close(master_fd);
+        return;
+    }
+    live_sessions++;
+    session->master_fd = master_fd;
+    session->shell_pid = moving->shell_pid;
+    session->shell_pidfd = shell_pidfd;
+    session->requests = moving->requests;
+    memcpy(session->username, moving->username, sizeof(session->username));
+    memcpy(session->token, moving->token, sizeof(session->token));
+    admission_adopt_session(&session->admission);
+    timer_init(&session->deadline, session_deadline, session);
+
+    session->state = SESSION_RELAY;
+    link_relay_session(session);
+    stream_adopt(&session->stream, moving->framed);
+    relay_stats_start(&session->stats, session->username);
+    cgroup_adopt(&session->stats.cgroup, moving->cgroup);
+    timeouts_start(&session->stats.timeouts, &timers, server_config.idle_timeout, server_config.session_limit,
+                   session_timed_out, session);
+    log_event("Took over the session of %s on client_fd %d.\n", session->username, client_fd);
+    if (backlog_init(&session->to_client, server_config.output_queue) == -1 ||
+        watch(client_fd, &session->client_source, &session->client_events, EPOLLIN, 1) == -1 ||
+        watch(master_fd, &session->pty_source, &session->pty_events, EPOLLIN, 1) == -1) {
+        close_session(session);
+    }
+}
+
+/**
+ * @brief Takes over the sessions waiting on the upgrade socket.
+ */
+static void adopt_sessions() {
+    UpgradeSession moving;
+    int client_fd, master_fd, shell_pidfd;
+    int received;
+
+    while ((received = upgrade_receive_session(&moving, &client_fd, &master_fd, &shell_pidfd)) == 1) {
+        adopt_session(&moving, client_fd, master_fd, shell_pidfd);
+    }
+    if (received == -1) {
+        log_event("The server this one replaced has passed on all its sessions that could move.\n");
+    }
+}
+
+int run_event_loop(int server_fd) {
+    struct epoll_event events[MAX_EVENTS];
+    EventSource listen_source = { EVENT_LISTEN, NULL };
+    EventSource users_source = { EVENT_USERS, NULL };
+    EventSource handoff_source = { EVENT_HANDOFF, NULL };
+    EventSource upgrade_source = { EVENT_UPGRADE, NULL };
+    EventSource adopt_source = { EVENT_ADOPT, NULL };
+    EventSource child_source = { EVENT_CHILD, NULL };
+    EventSource cgroup_source = { EVENT_CGROUP, NULL };
+    EventSource exec_source = { EVENT_EXEC, NULL };
+    uint32_t listen_events = 0, users_events = 0, handoff_events = 0, upgrade_events = 0, adopt_events = 0;
+    uint32_t child_events = 0, cgroup_events = 0, exec_events = 0;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+    if (watch(server_fd, &listen_source, &listen_events, EPOLLIN, 1) == -1) {
+        close(epoll_fd);
+        return -1;
+    }
+
+    /* each process watches for itself, an inherited inotify descriptor would deliver each change to only one of them */
+    const int users_fd = users_watch(server_config.users_file);
+    if (users_fd != -1) {
+        watch(users_fd, &users_source, &users_events, EPOLLIN, 1);
+    }
+
+    /* resumes that reach another process are passed on to this one here */
+    if (server_config.detach_grace > 0 && handoff_socket() != -1) {
+        watch(handoff_socket(), &handoff_source, &handoff_events, EPOLLIN, 1);
+    }
+
+    if (upgrade_signal_fd() != -1) {
+        watch(upgrade_signal_fd(), &upgrade_source, &upgrade_events, EPOLLIN, 1);
+    }
+    if (children_signal_fd() != -1) {
+        watch(children_signal_fd(), &child_source, &child_events, EPOLLIN, 1);
+    }
+    /* a closed session's cgroup is removed once what was killed in it has exited */
+    if (server_config.cgroup_scope != CGROUP_SCOPE_NONE && cgroups_drain_fd() != -1) {
+        watch(cgroups_drain_fd(), &cgroup_source, &cgroup_events, EPOLLIN, 1);
+    }
+    /* a shell started here is timed until its exec without waiting for it */
+    if (shell_exec_fd() != -1) {
+        watch(shell_exec_fd(), &exec_source, &exec_events, EPOLLIN, 1);
+    }
+    /* the sessions of the server this one replaces, when it passes them on */
+    if (upgrade_channel() != -1) {
+        watch(upgrade_channel(), &adopt_source, &adopt_events, EPOLLIN, 1);
+    }
+
+    timer_wheel_init(&timers);
+    shell_pool_init(server_config.shell_pool, &timers);
+    while (!draining || live_sessions > 0) {
+        /* the shell pool is only topped up while no event is waiting */
+        int timeout = timer_wheel_timeout(&timers);
+        if (shell_pool_missing() > 0 || corked_sessions != NULL) {
+            timeout = 0;
+        }
+
+        const int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        if (ready == 0) {
+            shell_pool_refill(1);
+        }
+
+        for (int i = 0; i < ready; i++) {
+            const EventSource *source = events[i].data.ptr;
+            if (source->kind == EVENT_LISTEN) {
+                if (server_fd != -1) accept_clients(server_fd);
+            } else if (source->kind == EVENT_USERS) {
+                reload_users(users_fd);
+            } else if (source->kind == EVENT_HANDOFF) {
+                accept_handoffs();
+            } else if (source->kind == EVENT_UPGRADE) {
+                upgrade(&server_fd);
+            } else if (source->kind == EVENT_ADOPT) {
+                adopt_sessions();
+            } else if (source->kind == EVENT_CHILD) {
+                children_reap();
+            } else if (source->kind == EVENT_CGROUP) {
+                cgroups_sweep(0);
+            } else if (source->kind == EVENT_EXEC) {
+                shell_exec_collect();
+            } else if (!source->session->closing) {
+                if (source->kind == EVENT_CLIENT) {
+                    handle_client_event(source->session, events[i].events);
+                } else {
+                    handle_pty_event(source->session, events[i].events);
+                }
+            }
+        }
+        release_idle_corks();
+        timer_wheel_run(&timers);
+        free_closed_sessions();
+    }
+
+    shell_pool_shutdown();
+    cgroups_sweep(CGROUP_DRAIN_MS);
+    close(epoll_fd);
+    if (!draining) {
+        return -1;
+    }
+    log_event("Drained, exiting.\n");
+    return 0;
+}
@@ -0,0 +1,31 @@
+/**
+ * @file event_loop.h
+ * @brief Single-process epoll server mode
+ *
+ * Instead of forking a relay process per connection, the event loop keeps
+ * the listening socket, every client socket and every PTY master in one
+ * epoll set and drives each session as a small state machine.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#define MAX_EVENTS 64   // epoll events handled per wakeup
+#define ACCEPT_BATCH 16 // connections accepted per wakeup of the listening socket
+
+/**
+ * @brief Serves every connection on server_fd from the calling process.
+ *
+ * Returns if the epoll instance cannot be created or waited on, or once
+ * SIGUSR2 has handed the port to a new server and the last session left
+ * here has ended; server_fd is closed then.
+ *
+ * @param server_fd The bound and listening server socket.
+ * @return 0 after draining, -1 on failure.
+ */
+int run_event_loop(int server_fd);
+
+#endif // EVENT_LOOP_H
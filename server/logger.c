@@ -0,0 +1,342 @@
+/**
+ * @file logger.c
+ * @brief Asynchronous ring-buffer logger behind log_event()
+ *
+ * Each ring is a bounded multi-producer queue: each slot carries a sequence
+ * number that tells producers and the consumer whose turn it is, so
+ * appending is one compare-and-swap plus a memcpy. Only the consumer side
+ * (the writer thread, or logger_flush()) takes a lock.
+ *
+ * Every process that logs gets its own writer thread. After fork() the
+ * child discards the records it inherited, which the parent still owns,
+ * and starts a writer on its next append.
+ */
+
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+typedef struct {
+    atomic_size_t sequence;
+    uint32_t length;
+} SlotHeader;
+
+struct Logger {
+    int fd;
+    int echo_stdout;
+    size_t record_size;
+    size_t slot_stride;             // SlotHeader plus record_size, cache-line aligned
+    char *slots;
+    atomic_size_t enqueue_position;
+    atomic_size_t dequeue_position;
+    atomic_ulong dropped;
+    unsigned long reported_drops;
+};
+
+static Logger *loggers[LOGGER_MAX];
+static int logger_count = 0;
+static Logger *text_log = NULL;
+
+static atomic_int writer_running;
+static pthread_mutex_t consumer_lock = PTHREAD_MUTEX_INITIALIZER;
+static sem_t wakeup;
+static int initialised = 0;
+
+static __thread time_t stamp_second = 0;
+static __thread char stamp[32];
+
+static SlotHeader *slot_at(const Logger *logger, const size_t position) {
+    return (SlotHeader *)(logger->slots + (position & (LOG_RING_SLOTS - 1)) * logger->slot_stride);
+}
+
+static void write_all(const int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+/**
+ * @brief Writes out every ready record of one log. Caller holds consumer_lock.
+ */
+static void drain(Logger *logger) {
+    struct iovec file_iov[LOG_BATCH];
+    struct iovec stdout_iov[LOG_BATCH];
+
+    while (1) {
+        const size_t first = atomic_load_explicit(&logger->dequeue_position, memory_order_relaxed);
+        int count = 0;
+
+        while (count < LOG_BATCH) {
+            SlotHeader *slot = slot_at(logger, first + count);
+            if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != first + count + 1) {
+                break;
+            }
+            file_iov[count].iov_base = (char *)(slot + 1);
+            file_iov[count].iov_len = slot->length;
+            count++;
+        }
+        if (count == 0) {
+            break;
+        }
+
+        memcpy(stdout_iov, file_iov, sizeof(struct iovec) * count);
+        write_all(logger->fd, file_iov, count);
+        if (logger->echo_stdout) write_all(STDOUT_FILENO, stdout_iov, count);
+
+        /* hand the slots back to the producers */
+        for (int i = 0; i < count; i++) {
+            atomic_store_explicit(&slot_at(logger, first + i)->sequence,
+                                  first + i + LOG_RING_SLOTS, memory_order_release);
+        }
+        atomic_store_explicit(&logger->dequeue_position, first + count, memory_order_release);
+    }
+
+    /* drop notices always go to the text log, whichever ring overflowed */
+    const unsigned long dropped = atomic_load(&logger->dropped);
+    if (dropped != logger->reported_drops && text_log != NULL) {
+        char notice[128];
+        const int length = snprintf(notice, sizeof(notice), "[%s] Logger dropped %lu records under load.\n",
+                                    logger_timestamp(), dropped - logger->reported_drops);
+        logger->reported_drops = dropped;
+        if (write(text_log->fd, notice, length) < 0) perror("write to log file");
+        if (text_log->echo_stdout && write(STDOUT_FILENO, notice, length) < 0) perror("write to stdout");
+    }
+}
+
+static void drain_all() {
+    for (int i = 0; i < logger_count; i++) {
+        drain(loggers[i]);
+    }
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    while (1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        sem_timedwait(&wakeup, &deadline);
+
+        pthread_mutex_lock(&consumer_lock);
+        drain_all();
+        pthread_mutex_unlock(&consumer_lock);
+    }
+    return NULL;
+}
+
+static void start_writer() {
+    int expected = 0;
+    if (!atomic_compare_exchange_strong(&writer_running, &expected, 1)) {
+        return;
+    }
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, writer_main, NULL) != 0) {
+        perror("pthread_create logger");
+        atomic_store(&writer_running, 0);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+static void before_fork() {
+    pthread_mutex_lock(&consumer_lock);
+}
+
+static void after_fork_parent() {
+    pthread_mutex_unlock(&consumer_lock);
+}
+
+/**
+ * @brief Forgets, in a forked child, the records the parent flushes itself.
+ */
+static void forget_queued() {
+    for (int i = 0; i < logger_count; i++) {
+        Logger *logger = loggers[i];
+        const size_t end = atomic_load(&logger->enqueue_position);
+        for (size_t position = atomic_load(&logger->dequeue_position); position != end; position++) {
+            atomic_store(&slot_at(logger, position)->sequence, position + LOG_RING_SLOTS);
+        }
+        atomic_store(&logger->dequeue_position, end);
+    }
+    atomic_store(&writer_running, 0);
+}
+
+static void after_fork_child() {
+    /* the parent flushes what was queued before the fork; the child must not repeat it */
+    forget_queued();
+    pthread_mutex_unlock(&consumer_lock);
+}
+
+static void setup_once() {
+    if (initialised) {
+        return;
+    }
+    initialised = 1;
+    sem_init(&wakeup, 0, 0);
+    pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+    atexit(logger_flush);
+}
+
+Logger *logger_open(const char *path, const size_t record_size, const void *file_header, const size_t header_length) {
+    setup_once();
+    if (logger_count == LOGGER_MAX) {
+        fprintf(stderr, "Too many logs open, cannot open %s\n", path);
+        return NULL;
+    }
+
+    Logger *logger = calloc(1, sizeof(Logger));
+    if (logger == NULL) {
+        return NULL;
+    }
+    logger->record_size = record_size;
+    logger->slot_stride = (sizeof(SlotHeader) + record_size + 63) & ~(size_t)63;
+    logger->slots = aligned_alloc(64, logger->slot_stride * LOG_RING_SLOTS);
+    logger->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (logger->slots == NULL || logger->fd == -1) {
+        perror("open log file");
+        if (logger->fd != -1) close(logger->fd);
+        free(logger->slots);
+        free(logger);
+        return NULL;
+    }
+
+    struct stat info;
+    if (file_header != NULL && fstat(logger->fd, &info) == 0 && info.st_size == 0 &&
+        write(logger->fd, file_header, header_length) != (ssize_t)header_length) {
+        perror("write log header");
+    }
+
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++) {
+        atomic_init(&slot_at(logger, i)->sequence, i);
+    }
+
+    pthread_mutex_lock(&consumer_lock);
+    loggers[logger_count++] = logger;
+    pthread_mutex_unlock(&consumer_lock);
+    start_writer();
+    return logger;
+}
+
+int logger_init(const char *path, const int echo_stdout) {
+    if (text_log != NULL) {
+        return 0;
+    }
+    text_log = logger_open(path, LOG_RECORD_SIZE, NULL, 0);
+    if (text_log == NULL) {
+        return -1;
+    }
+    text_log->echo_stdout = echo_stdout;
+    return 0;
+}
+
+void logger_write(Logger *logger, const void *head, size_t head_length, const void *body, size_t body_length) {
+    if (!atomic_load_explicit(&writer_running, memory_order_relaxed)) {
+        start_writer();
+    }
+    if (head_length > logger->record_size) {
+        head_length = logger->record_size;
+    }
+    if (body_length > logger->record_size - head_length) {
+        /* the head may give the body's length, so a cut body would leave the file unreadable */
+        atomic_fetch_add_explicit(&logger->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    size_t position = atomic_load_explicit(&logger->enqueue_position, memory_order_relaxed);
+    SlotHeader *slot;
+    while (1) {
+        slot = slot_at(logger, position);
+        const size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        const intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&logger->enqueue_position, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            atomic_fetch_add_explicit(&logger->dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            position = atomic_load_explicit(&logger->enqueue_position, memory_order_relaxed);
+        }
+    }
+
+    char *record = (char *)(slot + 1);
+    memcpy(record, head, head_length);
+    if (body_length > 0) {
+        memcpy(record + head_length, body, body_length);
+    }
+    slot->length = (uint32_t)(head_length + body_length);
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+
+    /* only wake the writer early when the ring is filling up */
+    if (position - atomic_load_explicit(&logger->dequeue_position, memory_order_relaxed) == LOG_RING_SLOTS / 2) {
+        sem_post(&wakeup);
+    }
+}
+
+void logger_append(const char *record, const size_t length) {
+    if (text_log == NULL && logger_init(LOG_FILE, 1) == -1) {
+        return;
+    }
+    logger_write(text_log, record, length, NULL, 0);
+}
+
+void logger_flush() {
+    pthread_mutex_lock(&consumer_lock);
+    drain_all();
+    pthread_mutex_unlock(&consumer_lock);
+}
+
+const char *logger_timestamp() {
+    const time_t now = time(NULL);
+    if (now != stamp_second) {
+        struct tm tm_info;
+        if (localtime_r(&now, &tm_info) == NULL ||
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm_info) == 0) {
+            return "";
+        }
+        stamp_second = now;
+    }
+    return stamp;
+}
+
+unsigned long logger_dropped() {
+    unsigned long dropped = 0;
+    for (int i = 0; i < logger_count; i++) {
+        dropped += atomic_load(&loggers[i]->dropped);
+    }
+    return dropped;
+}
@@ -0,0 +1,98 @@
+/**
+ * @file logger.h
+ * @brief Asynchronous ring-buffer logger behind log_event()
+ *
+ * Callers append preformatted records to a lock-free in-memory ring and
+ * never touch the log file themselves. A background writer thread drains
+ * the ring in batches with one writev() per destination. If the ring is
+ * full the record is dropped and counted instead of blocking the caller.
+ *
+ * The text log used by log_event() is one such ring. Other logs, such as
+ * the binary payload log, open their own with logger_open() and share the
+ * same writer thread.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stddef.h>
+
+#define LOG_FILE "server.log"
+#define LOG_RING_SLOTS 512          // records held in memory per log, must be a power of two
+#define LOG_RECORD_SIZE 1024        // longest text record, longer ones are truncated
+#define LOG_FLUSH_INTERVAL_MS 20    // the writer drains at least this often
+#define LOG_BATCH 64                // records per writev()
+#define LOGGER_MAX 4                // logs that can be open at once
+
+typedef struct Logger Logger;
+
+/**
+ * @brief Opens the text log used by log_event() and starts the writer thread.
+ *
+ * Appending before this has been called opens LOG_FILE on first use.
+ *
+ * @param path Log file to append to.
+ * @param echo_stdout Also copy every record to standard output.
+ * @return 0 on success, -1 if the log file could not be opened.
+ */
+int logger_init(const char *path, int echo_stdout);
+
+/**
+ * @brief Opens an additional log with its own ring.
+ *
+ * @param path File to append to.
+ * @param record_size Longest record; see logger_write() for longer ones.
+ * @param file_header Written once if the file is new (may be NULL).
+ * @param header_length Length of file_header.
+ * @return The log, or NULL if it could not be opened.
+ */
+Logger *logger_open(const char *path, size_t record_size, const void *file_header, size_t header_length);
+
+/**
+ * @brief Queues one record made of two parts for the writer. Never blocks.
+ *
+ * The parts are copied back to back into one slot, which lets callers add a
+ * header to a payload without assembling it first. A head longer than a
+ * record is truncated; a body that does not fit after the head drops the
+ * record, counted like one dropped for a full ring, since the head may
+ * give the body's length.
+ *
+ * @param logger The log to append to.
+ * @param head First part of the record.
+ * @param head_length Length of the first part.
+ * @param body Second part of the record (may be NULL).
+ * @param body_length Length of the second part.
+ */
+void logger_write(Logger *logger, const void *head, size_t head_length, const void *body, size_t body_length);
+
+/**
+ * @brief Queues one text record for log_event()'s log. Never blocks.
+ * @param record The formatted record.
+ * @param length Length of the record in bytes.
+ */
+void logger_append(const char *record, size_t length);
+
+/**
+ * @brief Writes every queued record of every log before returning.
+ *
+ * Used before exec() and at exit, where the writer thread would otherwise
+ * take unflushed records with it.
+ */
+void logger_flush();
+
+/**
+ * @brief Returns the "YYYY-mm-dd HH:MM:SS" stamp of the current second.
+ *
+ * The string is only reformatted when the second changes.
+ */
+const char *logger_timestamp();
+
+/**
+ * @brief Returns how many records all logs dropped because their ring was full.
+ */
+unsigned long logger_dropped();
+
+#endif // LOGGER_H
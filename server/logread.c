@@ -0,0 +1,142 @@
+/**
+ * @file logread.c
+ * @brief Reader for the server's binary payload log
+ *
+ * Prints one line per record with its time, session and size, followed by
+ * the payload with control characters escaped. With -x the payload is shown
+ * as a hex dump, and with -r the raw payload bytes of one direction are
+ * written to stdout so a session's output can be replayed with cat.
+ */
+
+#include "binlog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-x] [-r] [-p pid] [-f fd] [-d to|from] [file]\n", program);
+    fprintf(stderr, "  -x       hex dump payloads\n");
+    fprintf(stderr, "  -r       write raw payload bytes only\n");
+    fprintf(stderr, "  -p pid   only records relayed by this process\n");
+    fprintf(stderr, "  -f fd    only records for this client socket\n");
+    fprintf(stderr, "  -d dir   only records going to or coming from the client\n");
+}
+
+static void print_escaped(const unsigned char *data, const uint32_t length) {
+    for (uint32_t i = 0; i < length; i++) {
+        if (data[i] == '\n') {
+            fputs("\\n", stdout);
+        } else if (data[i] == '\r') {
+            fputs("\\r", stdout);
+        } else if (data[i] < 0x20 || data[i] >= 0x7f) {
+            printf("\\x%02x", data[i]);
+        } else {
+            putchar(data[i]);
+        }
+    }
+    putchar('\n');
+}
+
+static void print_hex(const unsigned char *data, const uint32_t length) {
+    for (uint32_t i = 0; i < length; i += 16) {
+        printf("  %08x ", i);
+        for (uint32_t j = i; j < i + 16 && j < length; j++) {
+            printf(" %02x", data[j]);
+        }
+        putchar('\n');
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int hex = 0, raw = 0, option;
+    long pid_filter = -1, fd_filter = -1, direction_filter = -1;
+
+    while ((option = getopt(argc, argv, "xrp:f:d:h")) != -1) {
+        switch (option) {
+        case 'x': hex = 1; break;
+        case 'r': raw = 1; break;
+        case 'p': pid_filter = atol(optarg); break;
+        case 'f': fd_filter = atol(optarg); break;
+        case 'd':
+            direction_filter = strcmp(optarg, "from") == 0 ? BINLOG_FROM_CLIENT : BINLOG_TO_CLIENT;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    const char *path = optind < argc ? argv[optind] : BINLOG_FILE;
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    char magic[BINLOG_MAGIC_LENGTH];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, BINLOG_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s is not a binary payload log\n", path);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+
+    unsigned char header[BINLOG_HEADER_SIZE];
+    unsigned char *payload = NULL;
+    size_t capacity = 0;
+    BinlogRecord record;
+
+    while (fread(header, 1, sizeof(header), file) == sizeof(header)) {
+        if (binlog_decode_header(header, &record) == -1) {
+            fprintf(stderr, "Corrupt record header at offset %ld\n", ftell(file) - (long)sizeof(header));
+            break;
+        }
+        if (record.payload_length > capacity) {
+            capacity = record.payload_length;
+            payload = realloc(payload, capacity);
+            if (payload == NULL) {
+                perror("realloc");
+                break;
+            }
+        }
+        if (fread(payload, 1, record.payload_length, file) != record.payload_length) {
+            fprintf(stderr, "Truncated record at end of %s\n", path);
+            break;
+        }
+
+        if ((pid_filter != -1 && record.pid != (uint32_t)pid_filter) ||
+            (fd_filter != -1 && record.fd != fd_filter) ||
+            (direction_filter != -1 && record.direction != direction_filter)) {
+            continue;
+        }
+
+        if (raw) {
+            fwrite(payload, 1, record.payload_length, stdout);
+            continue;
+        }
+
+        const time_t seconds = (time_t)(record.time_us / 1000000);
+        struct tm tm_info;
+        char stamp[32];
+        localtime_r(&seconds, &tm_info);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm_info);
+        printf("[%s.%06u] pid %u fd %d %s %u bytes\n", stamp, (unsigned)(record.time_us % 1000000),
+               record.pid, record.fd, record.direction == BINLOG_TO_CLIENT ? "to client" : "from client",
+               record.payload_length);
+        if (hex) {
+            print_hex(payload, record.payload_length);
+        } else {
+            print_escaped(payload, record.payload_length);
+        }
+    }
+
+    free(payload);
+    fclose(file);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,389 @@
+/**
+ * @file metrics.c
+ * @brief Server-wide counters and histograms, exported in Prometheus text format
+ *
+ * Updates are relaxed atomic adds on the shared mapping; nothing on the
+ * relay path takes a lock. A scrape reads each value once, so a histogram
+ * may be a few observations behind its own _count while sessions are busy,
+ * which Prometheus tolerates.
+ */
+
+#define _GNU_SOURCE     // accept4
+
+#include "metrics.h"
+#include "scrollback.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+typedef struct {
+    atomic_ullong buckets[METRICS_MAX_BUCKETS]; // not cumulative; summed when rendered
+    atomic_ullong count;
+    atomic_ullong sum;
+} Histogram;
+
+typedef struct {
+    atomic_ullong counters[METRIC_COUNTERS];
+    Histogram histograms[METRIC_HISTOGRAMS];
+} SharedMetrics;
+
+typedef struct {
+    const char *name;
+    const char *help;
+    double scale;               // multiplies observed values into the exported unit
+    int bucket_count;
+    uint64_t bounds[METRICS_MAX_BUCKETS];   // upper bounds in observed units, +Inf is implied
+} HistogramInfo;
+
+#define US 1000ull
+#define MS 1000000ull
+#define SEC 1000000000ull
+
+static const HistogramInfo histogram_info[METRIC_HISTOGRAMS] = {
+    [METRIC_OPENPTY_DURATION] = { "eggshell_openpty_duration_seconds", "Time spent in openpty() per session.", 1e-9,
+        10, { 10 * US, 25 * US, 50 * US, 100 * US, 250 * US, 500 * US, 1 * MS, 5 * MS, 25 * MS, 100 * MS } },
+    [METRIC_FORK_DURATION] = { "eggshell_fork_duration_seconds", "Time spent in fork() for the shell, as seen by the parent.", 1e-9,
+        10, { 10 * US, 25 * US, 50 * US, 100 * US, 250 * US, 500 * US, 1 * MS, 5 * MS, 25 * MS, 100 * MS } },
+    [METRIC_EXEC_DURATION] = { "eggshell_exec_duration_seconds", "Time from fork() returning until execl() of the shell succeeded.", 1e-9,
+        10, { 100 * US, 250 * US, 500 * US, 1 * MS, 2500 * US, 5 * MS, 10 * MS, 25 * MS, 100 * MS, 1 * SEC } },
+    [METRIC_CHUNK_SIZE] = { "eggshell_relay_chunk_bytes", "Size of each relayed chunk.", 1,
+        9, { 1, 16, 64, 256, 1024, 4096, 16384, 65536, 262144 } },
+    [METRIC_SESSION_LIFETIME] = { "eggshell_session_duration_seconds", "Lifetime of finished sessions, from login to disconnect.", 1e-9,
+        9, { 1 * SEC, 10 * SEC, 60 * SEC, 300 * SEC, 900 * SEC, 3600 * SEC, 4 * 3600 * SEC, 12 * 3600 * SEC, 24 * 3600 * SEC } },
+    [METRIC_ECHO_INBOUND] = { "eggshell_echo_inbound_seconds", "Traced keystrokes: from arriving to being written to the PTY.", 1e-9,
+        12, { 10 * US, 25 * US, 50 * US, 100 * US, 250 * US, 500 * US, 1 * MS, 2500 * US, 5 * MS, 10 * MS, 25 * MS, 100 * MS } },
+    [METRIC_ECHO_SHELL] = { "eggshell_echo_shell_seconds", "Traced keystrokes: from the PTY write to the shell's first output.", 1e-9,
+        12, { 10 * US, 25 * US, 50 * US, 100 * US, 250 * US, 500 * US, 1 * MS, 2500 * US, 5 * MS, 10 * MS, 25 * MS, 100 * MS } },
+    [METRIC_ECHO_OUTBOUND] = { "eggshell_echo_outbound_seconds", "Traced keystrokes: from the shell's first output to it being written to the client.", 1e-9,
+        12, { 10 * US, 25 * US, 50 * US, 100 * US, 250 * US, 500 * US, 1 * MS, 2500 * US, 5 * MS, 10 * MS, 25 * MS, 100 * MS } },
+    [METRIC_ECHO_SERVER] = { "eggshell_echo_server_seconds", "Traced keystrokes: time in the server, from arriving to the echo written to the client.", 1e-9,
+        12, { 10 * US, 25 * US, 50 * US, 100 * US, 250 * US, 500 * US, 1 * MS, 2500 * US, 5 * MS, 10 * MS, 25 * MS, 100 * MS } },
+};
+
+static SharedMetrics *metrics = NULL;
+static int listen_fd = -1;
+static pthread_t serving;
+static int serving_started = 0;
+static const char *socket_profile = NULL;
+static int socket_cork_threshold = 0;
+
+int metrics_init() {
+    void *shared = mmap(NULL, sizeof(SharedMetrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap metrics");
+        return -1;
+    }
+    metrics = shared;   // an anonymous mapping starts zeroed
+    return 0;
+}
+
+void metrics_add(const MetricCounter counter, const uint64_t amount) {
+    if (metrics != NULL) {
+        atomic_fetch_add_explicit(&metrics->counters[counter], amount, memory_order_relaxed);
+    }
+}
+
+void metrics_observe(const MetricHistogram histogram, const uint64_t value) {
+    if (metrics == NULL) {
+        return;
+    }
+    const HistogramInfo *info = &histogram_info[histogram];
+    Histogram *h = &metrics->histograms[histogram];
+    int bucket = 0;
+    while (bucket < info->bucket_count && value > info->bounds[bucket]) {
+        bucket++;
+    }
+    /* bucket == bucket_count is the +Inf bucket */
+    atomic_fetch_add_explicit(&h->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+}
+
+void metrics_socket_profile(const char *profile, const int cork_threshold) {
+    socket_profile = profile;
+    socket_cork_threshold = cork_threshold;
+}
+
+uint64_t metrics_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * SEC + (uint64_t)now.tv_nsec;
+}
+
+static unsigned long long counter_value(const MetricCounter counter) {
+    return atomic_load_explicit(&metrics->counters[counter], memory_order_relaxed);
+}
+
+static void render_counter(FILE *out, const char *name, const char *type, const char *help, const unsigned long long value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name, value);
+}
+
+static void render_histogram(FILE *out, const MetricHistogram histogram) {
+    const HistogramInfo *info = &histogram_info[histogram];
+    Histogram *h = &metrics->histograms[histogram];
+    unsigned long long cumulative = 0;
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", info->name, info->help, info->name);
+    for (int i = 0; i <= info->bucket_count; i++) {
+        cumulative += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        if (i < info->bucket_count) {
+            fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", info->name, (double)info->bounds[i] * info->scale, cumulative);
+        } else {
+            fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", info->name, cumulative);
+        }
+    }
+    fprintf(out, "%s_sum %.9g\n%s_count %llu\n", info->name,
+            (double)atomic_load_explicit(&h->sum, memory_order_relaxed) * info->scale,
+            info->name, cumulative);
+}
+
+/**
+ * @brief Renders every metric in the Prometheus text exposition format.
+ * @return A malloc'd buffer the caller frees, or NULL.
+ */
+static char *render_metrics(size_t *length) {
+    char *text = NULL;
+    FILE *out = open_memstream(&text, length);
+    if (out == NULL) {
+        return NULL;
+    }
+
+    const unsigned long long started = counter_value(METRIC_SESSIONS_STARTED);
+    const unsigned long long ended = counter_value(METRIC_SESSIONS_ENDED);
+    render_counter(out, "eggshell_sessions_active", "gauge", "Sessions logged in and relaying.",
+                   started > ended ? started - ended : 0);
+    render_counter(out, "eggshell_sessions_total", "counter", "Sessions that logged in and got a shell.", started);
+    render_counter(out, "eggshell_connections_accepted_total", "counter",
+                   "Accepted connections; rate() of this is accepts per second.", counter_value(METRIC_CONNECTIONS_ACCEPTED));
+
+    fprintf(out, "# HELP eggshell_connections_rejected_total Connections refused by admission control, by limit.\n"
+                 "# TYPE eggshell_connections_rejected_total counter\n");
+    fprintf(out, "eggshell_connections_rejected_total{limit=\"source_rate\"} %llu\n", counter_value(METRIC_REJECTED_SOURCE_RATE));
+    fprintf(out, "eggshell_connections_rejected_total{limit=\"preauth\"} %llu\n", counter_value(METRIC_REJECTED_PREAUTH));
+    fprintf(out, "eggshell_connections_rejected_total{limit=\"user_rate\"} %llu\n", counter_value(METRIC_REJECTED_USER_RATE));
+    fprintf(out, "eggshell_connections_rejected_total{limit=\"sessions\"} %llu\n", counter_value(METRIC_REJECTED_SESSIONS));
+
+    fprintf(out, "# HELP eggshell_auth_total Login attempts by result.\n# TYPE eggshell_auth_total counter\n");
+    fprintf(out, "eggshell_auth_total{result=\"success\"} %llu\n", counter_value(METRIC_AUTH_SUCCESS));
+    fprintf(out, "eggshell_auth_total{result=\"failure\"} %llu\n", counter_value(METRIC_AUTH_FAILURE));
+
+    fprintf(out, "# HELP eggshell_relay_bytes_total Bytes relayed by direction.\n# TYPE eggshell_relay_bytes_total counter\n");
+    fprintf(out, "eggshell_relay_bytes_total{direction=\"to_client\"} %llu\n", counter_value(METRIC_BYTES_TO_CLIENT));
+    fprintf(out, "eggshell_relay_bytes_total{direction=\"from_client\"} %llu\n", counter_value(METRIC_BYTES_FROM_CLIENT));
+
+    fprintf(out, "# HELP eggshell_shell_pool_total Logins by whether a pooled shell was ready.\n# TYPE eggshell_shell_pool_total counter\n");
+    fprintf(out, "eggshell_shell_pool_total{result=\"hit\"} %llu\n", counter_value(METRIC_SHELL_POOL_HITS));
+    fprintf(out, "eggshell_shell_pool_total{result=\"miss\"} %llu\n", counter_value(METRIC_SHELL_POOL_MISSES));
+
+    if (socket_profile != NULL) {
+        fprintf(out, "# HELP eggshell_socket_profile_info TCP options applied to client sockets.\n# TYPE eggshell_socket_profile_info gauge\n");
+        fprintf(out, "eggshell_socket_profile_info{profile=\"%s\",cork_threshold=\"%d\"} 1\n", socket_profile, socket_cork_threshold);
+    }
+    render_counter(out, "eggshell_corked_bursts_total", "counter",
+                   "Bursts of bulk output sent with the client socket corked.", counter_value(METRIC_CORKED_BURSTS));
+    render_counter(out, "eggshell_corked_bytes_total", "counter",
+                   "Output bytes written while the client socket was corked.", counter_value(METRIC_CORKED_BYTES));
+
+    render_counter(out, "eggshell_compressed_connections_total", "counter",
+                   "Connections whose output is deflate-compressed.", counter_value(METRIC_COMPRESSED_SESSIONS));
+    fprintf(out, "# HELP eggshell_compression_bytes_total Output through the compressor, before and after; their ratio is the compression ratio.\n"
+                 "# TYPE eggshell_compression_bytes_total counter\n");
+    fprintf(out, "eggshell_compression_bytes_total{stage=\"input\"} %llu\n", counter_value(METRIC_COMPRESS_INPUT_BYTES));
+    fprintf(out, "eggshell_compression_bytes_total{stage=\"output\"} %llu\n", counter_value(METRIC_COMPRESS_OUTPUT_BYTES));
+    fprintf(out, "# HELP eggshell_compression_seconds_total Time spent compressing output.\n# TYPE eggshell_compression_seconds_total counter\n");
+    fprintf(out, "eggshell_compression_seconds_total %.9f\n", (double)counter_value(METRIC_COMPRESS_NANOSECONDS) / SEC);
+
+    const unsigned long long taken = counter_value(METRIC_SCROLLBACK_TAKEN);
+    const unsigned long long released = counter_value(METRIC_SCROLLBACK_RELEASED);
+    render_counter(out, "eggshell_scrollback_bytes", "gauge", "Memory the sessions' scrollback holds, out of the -K budget.",
+                   taken > released ? (taken - released) * SCROLLBACK_CHUNK : 0);
+    render_counter(out, "eggshell_scrollback_evictions_total", "counter",
+                   "Scrollback chunks taken from another session because the budget was used up.",
+                   counter_value(METRIC_SCROLLBACK_EVICTED));
+
+    fprintf(out, "# HELP eggshell_timeouts_total Connections and sessions closed by a timeout, by timeout.\n"
+                 "# TYPE eggshell_timeouts_total counter\n");
+    fprintf(out, "eggshell_timeouts_total{timeout=\"login\"} %llu\n", counter_value(METRIC_TIMEOUTS_LOGIN));
+    fprintf(out, "eggshell_timeouts_total{timeout=\"idle\"} %llu\n", counter_value(METRIC_TIMEOUTS_IDLE));
+    fprintf(out, "eggshell_timeouts_total{timeout=\"session\"} %llu\n", counter_value(METRIC_TIMEOUTS_LIMIT));
+
+    fprintf(out, "# HELP eggshell_shell_exits_total Shells reaped, by how they ended.\n# TYPE eggshell_shell_exits_total counter\n");
+    fprintf(out, "eggshell_shell_exits_total{status=\"success\"} %llu\n", counter_value(METRIC_SHELL_EXITS_SUCCESS));
+    fprintf(out, "eggshell_shell_exits_total{status=\"failure\"} %llu\n", counter_value(METRIC_SHELL_EXITS_FAILURE));
+    fprintf(out, "eggshell_shell_exits_total{status=\"signal\"} %llu\n", counter_value(METRIC_SHELL_EXITS_SIGNAL));
+    fprintf(out, "# HELP eggshell_shell_cpu_seconds_total CPU time of the shells reaped so far, by mode.\n"
+                 "# TYPE eggshell_shell_cpu_seconds_total counter\n");
+    fprintf(out, "eggshell_shell_cpu_seconds_total{mode=\"user\"} %.6f\n", (double)counter_value(METRIC_SHELL_CPU_USER) / 1e6);
+    fprintf(out, "eggshell_shell_cpu_seconds_total{mode=\"system\"} %.6f\n", (double)counter_value(METRIC_SHELL_CPU_SYSTEM) / 1e6);
+
+    for (int i = 0; i < METRIC_HISTOGRAMS; i++) {
+        render_histogram(out, i);
+    }
+
+    if (fclose(out) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+static void serve_scrape(const int fd) {
+    char request[1024];
+    size_t length;
+    const struct timeval timeout = { 1, 0 };
+
+    /* the request itself is not interpreted; wait for it so the client is not reset mid-send */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (recv(fd, request, sizeof(request), 0) <= 0) {
+        return;
+    }
+
+    char *body = render_metrics(&length);
+    if (body == NULL) {
+        return;
+    }
+    char header[128];
+    const int header_length = snprintf(header, sizeof(header),
+        "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", length);
+
+    if (send(fd, header, header_length, MSG_NOSIGNAL) == header_length) {
+        size_t sent = 0;
+        while (sent < length) {
+            const ssize_t n = send(fd, body + sent, length - sent, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            sent += n;
+        }
+    }
+    free(body);
+}
+
+static void *serve_thread(void *unused) {
+    (void)unused;
+    while (1) {
+        /* metrics_stop() cancels the thread while it waits here, never halfway through a scrape */
+        const int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("metrics accept");
+            return NULL;
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        serve_scrape(fd);
+        close(fd);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+}
+
+/* forked children do not serve scrapes, so they must not keep the endpoint open */
+static void close_endpoint() {
+    if (listen_fd != -1) {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+}
+
+/**
+ * @brief Starts the thread answering scrapes on listen_fd.
+ * @return 0 on success, -1 if the thread could not be started.
+ */
+static int start_serving() {
+    pthread_atfork(NULL, NULL, close_endpoint);
+    if (pthread_create(&serving, NULL, serve_thread, NULL) != 0) {
+        perror("pthread_create metrics");
+        close_endpoint();
+        return -1;
+    }
+    serving_started = 1;
+    return 0;
+}
+
+int metrics_serve(const char *address) {
+    const int yes = 1;
+    char *end;
+    const long port = strtol(address, &end, 10);
+
+    if (metrics == NULL) {
+        return -1;
+    }
+
+    if (*address != '\0' && *end == '\0') {
+        struct sockaddr_in local = { 0 };
+        if (port <= 0 || port > 65535) {
+            fprintf(stderr, "Invalid metrics port: %s\n", address);
+            return -1;
+        }
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        local.sin_port = htons((uint16_t)port);
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd == -1) {
+            perror("metrics socket");
+        } else {
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+            if (bind(listen_fd, (struct sockaddr *)&local, sizeof(local)) == -1) {
+                perror("metrics bind");
+                close_endpoint();
+            }
+        }
+    } else {
+        struct sockaddr_un local = { 0 };
+        if (strlen(address) >= sizeof(local.sun_path)) {
+            fprintf(stderr, "Metrics socket path too long: %s\n", address);
+            return -1;
+        }
+        local.sun_family = AF_UNIX;
+        strcpy(local.sun_path, address);
+        unlink(address);    // a stale socket from a previous run
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd == -1) {
+            perror("metrics socket");
+        } else if (bind(listen_fd, (struct sockaddr *)&local, sizeof(local)) == -1) {
+            perror("metrics bind");
+            close_endpoint();
+        }
+    }
+
+    if (listen_fd == -1) {
+        return -1;
+    }
+    if (listen(listen_fd, 16) == -1) {
+        perror("metrics listen");
+        close_endpoint();
+        return -1;
+    }
+    return start_serving();
+}
+
+int metrics_serve_endpoint(const int fd) {
+    if (metrics == NULL) {
+        close(fd);
+        return -1;
+    }
+    listen_fd = fd;
+    return start_serving();
+}
+
+int metrics_endpoint() {
+    return listen_fd;
+}
+
+void metrics_stop() {
+    if (serving_started) {
+        pthread_cancel(serving);
+        pthread_join(serving, NULL);
+        serving_started = 0;
+    }
+    close_endpoint();
+}
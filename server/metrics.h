@@ -0,0 +1,125 @@
+/**
+ * @file metrics.h
+ * @brief Server-wide counters and histograms, exported in Prometheus text format
+ *
+ * The metrics live in one shared anonymous mapping created before the server
+ * forks, so the per-connection children of fork mode and the workers of
+ * workers mode all update the same numbers with atomic adds. The process
+ * that called metrics_serve() answers scrapes from a background thread.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#define METRICS_MAX_BUCKETS 16
+
+/* Monotonic counters */
+typedef enum {
+    METRIC_CONNECTIONS_ACCEPTED,
+    METRIC_AUTH_SUCCESS,
+    METRIC_AUTH_FAILURE,
+    METRIC_SESSIONS_STARTED,
+    METRIC_SESSIONS_ENDED,
+    METRIC_BYTES_TO_CLIENT,
+    METRIC_BYTES_FROM_CLIENT,
+    METRIC_SHELL_POOL_HITS,     // logins given an already started shell
+    METRIC_SHELL_POOL_MISSES,   // logins that found the pool empty and started one
+    METRIC_CORKED_BURSTS,       // times a client socket was corked for bulk output
+    METRIC_CORKED_BYTES,        // output written while corked
+    METRIC_COMPRESSED_SESSIONS, // connections that negotiated compression
+    METRIC_COMPRESS_INPUT_BYTES,    // output bytes given to the compressor
+    METRIC_COMPRESS_OUTPUT_BYTES,   // compressed bytes it produced
+    METRIC_COMPRESS_NANOSECONDS,    // time spent compressing
+    METRIC_REJECTED_SOURCE_RATE,    // connections refused: their address connects too often
+    METRIC_REJECTED_PREAUTH,        // connections refused: too many others were logging in
+    METRIC_REJECTED_USER_RATE,      // logins refused: their username logs in too often
+    METRIC_REJECTED_SESSIONS,       // logins refused: the session cap was reached
+    METRIC_SCROLLBACK_TAKEN,        // scrollback chunks taken by a session
+    METRIC_SCROLLBACK_RELEASED,     // scrollback chunks given back or evicted
+    METRIC_SCROLLBACK_EVICTED,      // scrollback chunks taken from another session when the budget ran out
+    METRIC_TIMEOUTS_LOGIN,          // connections closed for not logging in in time
+    METRIC_TIMEOUTS_IDLE,           // sessions closed for getting no input
+    METRIC_TIMEOUTS_LIMIT,          // sessions closed at the session length limit
+    METRIC_SHELL_EXITS_SUCCESS,     // shells reaped after exiting with status 0
+    METRIC_SHELL_EXITS_FAILURE,     // shells reaped after exiting with another status
+    METRIC_SHELL_EXITS_SIGNAL,      // shells reaped after a signal killed them
+    METRIC_SHELL_CPU_USER,          // user CPU of reaped shells, in microseconds
+    METRIC_SHELL_CPU_SYSTEM,        // system CPU of reaped shells, in microseconds
+    METRIC_COUNTERS
+} MetricCounter;
+
+/* Histograms; durations are observed in nanoseconds */
+typedef enum {
+    METRIC_OPENPTY_DURATION,
+    METRIC_FORK_DURATION,
+    METRIC_EXEC_DURATION,       // from fork() returning to the shell image being exec'd
+    METRIC_CHUNK_SIZE,          // bytes per relayed chunk
+    METRIC_SESSION_LIFETIME,
+    METRIC_ECHO_INBOUND,        // traced keystroke: arrival to being written to the PTY
+    METRIC_ECHO_SHELL,          // traced keystroke: written to the PTY to the first output back
+    METRIC_ECHO_OUTBOUND,       // traced keystroke: first output back to written to the client
+    METRIC_ECHO_SERVER,         // traced keystroke: arrival to output written to the client
+    METRIC_HISTOGRAMS
+} MetricHistogram;
+
+/**
+ * @brief Maps the shared metrics; must be called before the server forks.
+ * @return 0 on success, -1 if the mapping failed (metrics are then ignored).
+ */
+int metrics_init();
+
+/**
+ * @brief Adds to a counter.
+ */
+void metrics_add(MetricCounter counter, uint64_t amount);
+
+/**
+ * @brief Records one observation in a histogram.
+ */
+void metrics_observe(MetricHistogram histogram, uint64_t value);
+
+/**
+ * @brief Returns CLOCK_MONOTONIC in nanoseconds, for timing observations.
+ */
+uint64_t metrics_now();
+
+/**
+ * @brief Records the socket profile in use, exported as eggshell_socket_profile_info.
+ * @param profile Name of the profile.
+ * @param cork_threshold Smallest chunk corked as bulk output, 0 if the profile never corks.
+ */
+void metrics_socket_profile(const char *profile, int cork_threshold);
+
+/**
+ * @brief Starts answering scrapes from a background thread.
+ *
+ * Any HTTP request to the endpoint gets the metrics, so it works both with
+ * Prometheus and with curl, including curl --unix-socket.
+ *
+ * @param address A port number for 127.0.0.1, or the path of a Unix socket.
+ * @return 0 on success, -1 if the endpoint could not be opened.
+ */
+int metrics_serve(const char *address);
+
+/**
+ * @brief Starts answering scrapes on an endpoint that is already listening, passed on by an upgrade.
+ * @return 0 on success, -1 if the thread could not be started; the endpoint is closed then.
+ */
+int metrics_serve_endpoint(int fd);
+
+/**
+ * @brief The listening socket of the metrics endpoint, -1 when not serving.
+ */
+int metrics_endpoint();
+
+/**
+ * @brief Stops answering scrapes and closes this process's copy of the endpoint.
+ */
+void metrics_stop();
+
+#endif // METRICS_H
@@ -0,0 +1,322 @@
+/**
+ * @file recorder.c
+ * @brief Records sessions into files a player can seek in, off the relay's path
+ *
+ * Each ring has one producer, the relay of its session, and one consumer,
+ * the writer thread or recorder_close(), so queueing a chunk is two memcpy()
+ * calls and a release store of the head. Only the consumer side takes a
+ * lock, which also guards the list of open recordings; a relay whose ring
+ * is full becomes the consumer for a moment if it gets the lock at once.
+ */
+
+#include "recorder.h"
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+struct Recorder {
+    int fd;
+    char path[512];
+    char *ring;
+    atomic_size_t head;             // bytes ever queued; moved by the relay
+    atomic_size_t tail;             // bytes ever written; moved by the consumer
+    uint64_t started_ns;            // monotonic
+    uint64_t last_frame_us;         // session time of the newest frame queued
+    uint64_t last_index_us;
+    uint64_t last_index_offset;     // file offset of the newest index frame queued
+    unsigned long dropped;          // chunks left out because the ring was full
+    uint64_t last_write_ns;         // consumer only
+    int failed;                     // consumer only: a write failed and was logged
+    Recorder *next;
+};
+
+static Recorder *recorders = NULL;  // open recordings, under writer_lock
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static sem_t wakeup;
+static int writer_started = 0;
+static unsigned int opened = 0;
+
+static uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Writes everything queued in one ring, in one writev(). Caller holds writer_lock.
+ */
+static void write_queued(Recorder *recorder) {
+    const size_t tail = atomic_load_explicit(&recorder->tail, memory_order_relaxed);
+    const size_t head = atomic_load_explicit(&recorder->head, memory_order_acquire);
+    if (head == tail) {
+        return;
+    }
+
+    /* the queued bytes wrap around the end of the ring at most once */
+    const size_t start = tail & (RECORDER_RING - 1);
+    const size_t first = head - tail < RECORDER_RING - start ? head - tail : RECORDER_RING - start;
+    struct iovec iov[2] = {
+        { recorder->ring + start, first },
+        { recorder->ring, head - tail - first },
+    };
+    struct iovec *next = iov;
+    int count = iov[1].iov_len > 0 ? 2 : 1;
+    while (count > 0) {
+        ssize_t written = writev(recorder->fd, next, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (!recorder->failed) {
+                log_event("Failed to write recording %s: %s\n", recorder->path, strerror(errno));
+                recorder->failed = 1;
+            }
+            break;
+        }
+        while (count > 0 && (size_t)written >= next->iov_len) {
+            written -= next->iov_len;
+            next++;
+            count--;
+        }
+        if (count > 0) {
+            next->iov_base = (char *)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+    atomic_store_explicit(&recorder->tail, head, memory_order_release);
+    recorder->last_write_ns = now_ns();
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    while (1) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += RECORDER_TICK_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        sem_timedwait(&wakeup, &deadline);
+
+        /* small amounts wait, so an idle session does not cost a write per keystroke */
+        const uint64_t now = now_ns();
+        pthread_mutex_lock(&writer_lock);
+        for (Recorder *recorder = recorders; recorder != NULL; recorder = recorder->next) {
+            const size_t queued = atomic_load_explicit(&recorder->head, memory_order_relaxed) -
+                                  atomic_load_explicit(&recorder->tail, memory_order_relaxed);
+            if (queued >= RECORDER_WRITE_MIN ||
+                (queued > 0 && now - recorder->last_write_ns >= RECORDER_FLUSH_MS * 1000000ull)) {
+                write_queued(recorder);
+            }
+        }
+        pthread_mutex_unlock(&writer_lock);
+    }
+    return NULL;
+}
+
+static int start_writer() {
+    if (writer_started) {
+        return 0;
+    }
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    sem_init(&wakeup, 0, 0);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    const int failed = pthread_create(&thread, &attr, writer_main, NULL);
+    pthread_attr_destroy(&attr);
+    if (failed != 0) {
+        errno = failed;
+        perror("pthread_create recorder");
+        sem_destroy(&wakeup);
+        return -1;
+    }
+    writer_started = 1;
+    return 0;
+}
+
+static void copy_in(Recorder *recorder, const size_t position, const void *data, const size_t length) {
+    const size_t start = position & (RECORDER_RING - 1);
+    const size_t first = length < RECORDER_RING - start ? length : RECORDER_RING - start;
+    memcpy(recorder->ring + start, data, first);
+    memcpy(recorder->ring, (const char *)data + first, length - first);
+}
+
+/**
+ * @brief Queues a frame header and its payload.
+ * @return 0 on success, -1 if the ring has no room for both.
+ */
+static int enqueue(Recorder *recorder, const unsigned char *header, const void *payload, const size_t length) {
+    const size_t head = atomic_load_explicit(&recorder->head, memory_order_relaxed);
+    const size_t queued = head - atomic_load_explicit(&recorder->tail, memory_order_acquire);
+    if (RECORDER_RING - queued < RECORDING_FRAME_HEADER + length) {
+        return -1;
+    }
+
+    copy_in(recorder, head, header, RECORDING_FRAME_HEADER);
+    copy_in(recorder, head + RECORDING_FRAME_HEADER, payload, length);
+    atomic_store_explicit(&recorder->head, head + RECORDING_FRAME_HEADER + length, memory_order_release);
+
+    /* only wake the writer early once there is a large write to make */
+    if (queued < RECORDER_WRITE_MIN && queued + RECORDING_FRAME_HEADER + length >= RECORDER_WRITE_MIN) {
+        sem_post(&wakeup);
+    }
+    return 0;
+}
+
+static uint32_t delta_since(const uint64_t earlier, const uint64_t later) {
+    return later - earlier > UINT32_MAX ? UINT32_MAX : (uint32_t)(later - earlier);
+}
+
+/**
+ * @brief Queues an index or end frame for the current session time.
+ * @return 0 on success, -1 if the ring has no room for it.
+ */
+static int enqueue_index(Recorder *recorder, const RecordingKind kind, const uint64_t elapsed_us) {
+    unsigned char header[RECORDING_FRAME_HEADER];
+    unsigned char payload[RECORDING_INDEX_PAYLOAD];
+    const RecordingFrame frame = { kind, RECORDING_INDEX_PAYLOAD, delta_since(recorder->last_frame_us, elapsed_us) };
+    const RecordingIndex index = { elapsed_us, recorder->last_index_offset };
+    const uint64_t offset = RECORDING_FILE_HEADER + atomic_load_explicit(&recorder->head, memory_order_relaxed);
+
+    recording_encode_frame(&frame, header);
+    recording_encode_index(&index, payload);
+    if (enqueue(recorder, header, payload, sizeof(payload)) == -1) {
+        return -1;
+    }
+    recorder->last_frame_us = elapsed_us;
+    if (kind == RECORDING_INDEX) {
+        recorder->last_index_us = elapsed_us;
+        recorder->last_index_offset = offset;
+    }
+    return 0;
+}
+
+Recorder *recorder_open(const char *directory, const char *username) {
+    char stamp[32] = "";
+    struct timespec wall;
+    struct tm tm_info;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    if (localtime_r(&wall.tv_sec, &tm_info) != NULL) {
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm_info);
+    }
+
+    /* the username goes into a path, so only plain characters are kept */
+    char name[MAX_USERNAME_LENGTH];
+    size_t length = 0;
+    for (; username[length] != '\0' && length < sizeof(name) - 1; length++) {
+        const char c = username[length];
+        const int plain = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+                          c == '-' || c == '_' || c == '.';
+        name[length] = plain ? c : '_';
+    }
+    name[length] = '\0';
+
+    Recorder *recorder = calloc(1, sizeof(Recorder));
+    if (recorder == NULL) {
+        return NULL;
+    }
+    snprintf(recorder->path, sizeof(recorder->path), "%s/%s-%s-%d-%u.rec",
+             directory, stamp, name, (int)getpid(), opened++);
+    recorder->ring = malloc(RECORDER_RING);
+    recorder->fd = open(recorder->path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (recorder->ring == NULL || recorder->fd == -1) {
+        perror("open recording");
+        log_event("Failed to create recording %s: %s\n", recorder->path, strerror(errno));
+        if (recorder->fd != -1) close(recorder->fd);
+        free(recorder->ring);
+        free(recorder);
+        return NULL;
+    }
+
+    unsigned char start[RECORDING_FILE_HEADER];
+    recording_encode_start((uint64_t)wall.tv_sec * 1000000 + (uint64_t)wall.tv_nsec / 1000, start);
+    if (write(recorder->fd, start, sizeof(start)) != (ssize_t)sizeof(start) || start_writer() == -1) {
+        log_event("Failed to start recording %s.\n", recorder->path);
+        close(recorder->fd);
+        unlink(recorder->path);
+        free(recorder->ring);
+        free(recorder);
+        return NULL;
+    }
+    recorder->started_ns = now_ns();
+    recorder->last_write_ns = recorder->started_ns;
+    enqueue_index(recorder, RECORDING_INDEX, 0);
+
+    pthread_mutex_lock(&writer_lock);
+    recorder->next = recorders;
+    recorders = recorder;
+    pthread_mutex_unlock(&writer_lock);
+    log_event("Recording session of %s to %s.\n", username, recorder->path);
+    return recorder;
+}
+
+void recorder_frame(Recorder *recorder, const RecordingKind kind, const char *data, const size_t length) {
+    if (recorder == NULL || length == 0) {
+        return;
+    }
+
+    const uint64_t elapsed_us = (now_ns() - recorder->started_ns) / 1000;
+    if (elapsed_us - recorder->last_index_us >= RECORDING_INDEX_US) {
+        enqueue_index(recorder, RECORDING_INDEX, elapsed_us);
+    }
+
+    unsigned char header[RECORDING_FRAME_HEADER];
+    const RecordingFrame frame = { kind, (uint32_t)length, delta_since(recorder->last_frame_us, elapsed_us) };
+    recording_encode_frame(&frame, header);
+    if (length > RECORDING_MAX_PAYLOAD) {
+        recorder->dropped++;
+        return;
+    }
+
+    /* a burst can fill the ring between two looks of the writer; empty it here unless the writer is at it */
+    int queued = enqueue(recorder, header, data, length) == 0;
+    if (!queued && pthread_mutex_trylock(&writer_lock) == 0) {
+        write_queued(recorder);
+        pthread_mutex_unlock(&writer_lock);
+        queued = enqueue(recorder, header, data, length) == 0;
+    }
+    if (!queued) {
+        recorder->dropped++;
+        return;
+    }
+    recorder->last_frame_us = elapsed_us;
+}
+
+void recorder_close(Recorder *recorder) {
+    if (recorder == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&writer_lock);
+    for (Recorder **link = &recorders; *link != NULL; link = &(*link)->next) {
+        if (*link == recorder) {
+            *link = recorder->next;
+            break;
+        }
+    }
+
+    /* the end frame goes in after the rest is written, so a full ring cannot keep it out */
+    write_queued(recorder);
+    enqueue_index(recorder, RECORDING_END, (now_ns() - recorder->started_ns) / 1000);
+    write_queued(recorder);
+    pthread_mutex_unlock(&writer_lock);
+
+    if (recorder->dropped > 0) {
+        log_event("Recording %s left out %lu chunks the writer could not keep up with.\n",
+                  recorder->path, recorder->dropped);
+    }
+    close(recorder->fd);
+    free(recorder->ring);
+    free(recorder);
+}
@@ -0,0 +1,60 @@
+/**
+ * @file recorder.h
+ * @brief Records sessions into files a player can seek in, off the relay's path
+ *
+ * With -R each session is recorded into its own file in that directory, in
+ * the format of recording.h. The relay only copies each chunk, behind a frame
+ * header, into the session's ring in memory. A writer thread per process
+ * empties the rings with one large write each, once RECORDER_WRITE_MIN bytes
+ * are waiting or the oldest has waited RECORDER_FLUSH_MS. When a burst fills
+ * a ring, the relay writes it out itself if the writer is not busy; if it
+ * is, the chunk is left out of the recording and counted instead of holding
+ * up the session.
+ *
+ * Output the splice relay moves never passes through the server, so the
+ * server uses the select relay instead while recording.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include "recording.h"
+
+#include <stddef.h>
+
+#define RECORDER_RING (256 * 1024)      // bytes of frames a session can have waiting, a power of two
+#define RECORDER_WRITE_MIN (64 * 1024)  // bytes waiting that get written without waiting longer
+#define RECORDER_FLUSH_MS 1000          // longest time frames wait to be written
+#define RECORDER_TICK_MS 100            // how often the writer looks at the rings
+
+typedef struct Recorder Recorder;
+
+/**
+ * @brief Creates the recording of a session that has just begun and starts the writer thread.
+ *
+ * The file is named after the start time, the username, the process and a
+ * counter, and logged.
+ *
+ * @param directory Directory to create the file in.
+ * @param username Who logged in.
+ * @return The recorder, or NULL if the file could not be created.
+ */
+Recorder *recorder_open(const char *directory, const char *username);
+
+/**
+ * @brief Queues one relayed chunk for the writer. Never blocks.
+ * @param recorder The session's recorder; nothing happens when NULL.
+ * @param kind RECORDING_OUTPUT or RECORDING_INPUT.
+ */
+void recorder_frame(Recorder *recorder, RecordingKind kind, const char *data, size_t length);
+
+/**
+ * @brief Writes what is still queued and the end frame, then closes the file.
+ * @param recorder The session's recorder; nothing happens when NULL.
+ */
+void recorder_close(Recorder *recorder);
+
+#endif // RECORDER_H
@@ -0,0 +1,71 @@
+/**
+ * @file recording.c
+ * @brief Session recording file format
+ *
+ * Shared by the server, which records sessions, and eggplay, which plays them back.
+ */
+
+#include "recording.h"
+
+#include <string.h>
+
+static void put_u32(unsigned char *out, const uint32_t value) {
+    out[0] = (unsigned char)(value >> 24);
+    out[1] = (unsigned char)(value >> 16);
+    out[2] = (unsigned char)(value >> 8);
+    out[3] = (unsigned char)value;
+}
+
+static uint32_t get_u32(const unsigned char *in) {
+    return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | in[3];
+}
+
+static void put_u64(unsigned char *out, const uint64_t value) {
+    put_u32(out, (uint32_t)(value >> 32));
+    put_u32(out + 4, (uint32_t)value);
+}
+
+static uint64_t get_u64(const unsigned char *in) {
+    return ((uint64_t)get_u32(in) << 32) | get_u32(in + 4);
+}
+
+void recording_encode_start(const uint64_t started_us, unsigned char *out) {
+    memcpy(out, RECORDING_MAGIC, RECORDING_MAGIC_LENGTH);
+    put_u64(out + RECORDING_MAGIC_LENGTH, started_us);
+}
+
+int recording_decode_start(const unsigned char *in, uint64_t *started_us) {
+    if (memcmp(in, RECORDING_MAGIC, RECORDING_MAGIC_LENGTH) != 0) {
+        return -1;
+    }
+    *started_us = get_u64(in + RECORDING_MAGIC_LENGTH);
+    return 0;
+}
+
+void recording_encode_frame(const RecordingFrame *frame, unsigned char *out) {
+    put_u32(out, ((uint32_t)frame->kind << 24) | (frame->length & RECORDING_MAX_PAYLOAD));
+    put_u32(out + 4, frame->delta_us);
+}
+
+int recording_decode_frame(const unsigned char *in, RecordingFrame *frame) {
+    frame->kind = in[0];
+    frame->length = get_u32(in) & RECORDING_MAX_PAYLOAD;
+    frame->delta_us = get_u32(in + 4);
+    if (frame->kind > RECORDING_END) {
+        return -1;
+    }
+    if ((frame->kind == RECORDING_INDEX || frame->kind == RECORDING_END) && frame->length != RECORDING_INDEX_PAYLOAD) {
+        return -1;
+    }
+    return 0;
+}
+
+void recording_encode_index(const RecordingIndex *index, unsigned char *out) {
+    put_u64(out, index->elapsed_us);
+    put_u64(out + 8, index->previous);
+}
+
+void recording_decode_index(const unsigned char *in, RecordingIndex *index) {
+    index->elapsed_us = get_u64(in);
+    index->previous = get_u64(in + 8);
+}
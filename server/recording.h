@@ -0,0 +1,99 @@
+/**
+ * @file recording.h
+ * @brief Session recording file format
+ *
+ * A recording holds one session: what its shell sent and what its client
+ * typed, with the time between them, so it can be played back as it
+ * happened. The file starts with RECORDING_MAGIC and the wall clock time the
+ * session started, in microseconds, followed by frames laid out as (all
+ * integers big-endian):
+ *
+ *   kind       1 byte   a RecordingKind
+ *   length     3 bytes  payload bytes that follow the header
+ *   delta_us   4 bytes  microseconds since the previous frame, saturating
+ *   payload    length bytes
+ *
+ * An index frame comes first and then at most RECORDING_INDEX_US after the
+ * previous one. Its payload is the session time in microseconds, which also
+ * corrects a saturated delta, and the file offset of the index frame before
+ * it (0 for the first). A recording closed cleanly ends with an end frame of
+ * the same layout, pointing at the last index frame, so a player can walk
+ * the chain back and seek without reading the frames in between.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef RECORDING_H
+#define RECORDING_H
+
+#include <stdint.h>
+
+#define RECORDING_MAGIC "EGGREC01"
+#define RECORDING_MAGIC_LENGTH 8
+#define RECORDING_FILE_HEADER 16        // magic, then the start time
+#define RECORDING_FRAME_HEADER 8
+#define RECORDING_INDEX_PAYLOAD 16      // payload of index and end frames
+#define RECORDING_MAX_PAYLOAD 0xffffff
+#define RECORDING_INDEX_US 1000000      // longest session time between index frames
+
+typedef enum {
+    RECORDING_OUTPUT,   // PTY output going to the client
+    RECORDING_INPUT,    // client input going to the PTY
+    RECORDING_INDEX,    // a seek point
+    RECORDING_END,      // the last frame of a recording closed cleanly
+} RecordingKind;
+
+typedef struct {
+    uint8_t kind;
+    uint32_t length;
+    uint32_t delta_us;
+} RecordingFrame;
+
+/* Payload of an index or end frame */
+typedef struct {
+    uint64_t elapsed_us;    // session time of the frame
+    uint64_t previous;      // offset of the index frame before, 0 for none
+} RecordingIndex;
+
+/**
+ * @brief Encodes the file header.
+ * @param started_us Wall clock time the session started, in microseconds.
+ * @param out Receives RECORDING_FILE_HEADER bytes.
+ */
+void recording_encode_start(uint64_t started_us, unsigned char *out);
+
+/**
+ * @brief Decodes the file header.
+ * @param in RECORDING_FILE_HEADER bytes read from the start of a file.
+ * @param started_us Receives the wall clock time the session started.
+ * @return 0 on success, -1 if the file is not a recording.
+ */
+int recording_decode_start(const unsigned char *in, uint64_t *started_us);
+
+/**
+ * @brief Encodes a frame header.
+ * @param out Receives RECORDING_FRAME_HEADER bytes.
+ */
+void recording_encode_frame(const RecordingFrame *frame, unsigned char *out);
+
+/**
+ * @brief Decodes a frame header.
+ * @param in RECORDING_FRAME_HEADER bytes.
+ * @return 0 on success, -1 if the kind is unknown or an index or end frame has the wrong length.
+ */
+int recording_decode_frame(const unsigned char *in, RecordingFrame *frame);
+
+/**
+ * @brief Encodes the payload of an index or end frame.
+ * @param out Receives RECORDING_INDEX_PAYLOAD bytes.
+ */
+void recording_encode_index(const RecordingIndex *index, unsigned char *out);
+
+/**
+ * @brief Decodes the payload of an index or end frame.
+ * @param in RECORDING_INDEX_PAYLOAD bytes.
+ */
+void recording_decode_index(const unsigned char *in, RecordingIndex *index);
+
+#endif // RECORDING_H
@@ -0,0 +1,166 @@
+/**
+ * @file relay_splice.c
+ * @brief Zero-copy splice() relay engine for the per-connection relay
+ *
+ * Each direction owns a pipe. When its source is readable, up to
+ * SPLICE_CHUNK bytes are spliced into the pipe and the pipe is then
+ * spliced empty into the destination before the next select(). Bulk
+ * output is corked towards the client the same way relay_data() does it.
+ *
+ * The shell's exit is watched on exit_fd too. When it fires the PTY is
+ * made non-blocking and spliced until it is empty, then the relay ends.
+ */
+
+#define _GNU_SOURCE     // splice
+
+#include "relay_splice.h"
+#include "server.h"
+#include "socket_tuning.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/select.h>
+
+typedef struct {
+    int src, dst;
+    RelayDirection direction;
+    int pipe_fds[2];
+    int use_splice;     // cleared if the kernel cannot splice from src
+    OutputCork *cork;   // the client's output, NULL for the direction going to the PTY
+} SpliceDirection;
+
+/**
+ * @brief Copies one chunk through user space for a direction that cannot be spliced.
+ * @return 1 if bytes moved, 0 on EOF, -1 on error.
+ */
+static int copy_chunk(const SpliceDirection *dir, RelayStats *stats, const int client_fd) {
+    char buffer[BUFFER_SIZE];
+    const ssize_t nbytes = read(dir->src, buffer, sizeof(buffer));
+    if (nbytes <= 0) {
+        return nbytes == 0 ? 0 : -1;
+    }
+    if (dir->cork != NULL) output_cork_chunk(dir->cork, nbytes);
+    if (write(dir->dst, buffer, nbytes) != nbytes) {
+        return -1;
+    }
+    log_relay(stats, client_fd, dir->direction, NULL, nbytes);
+    return 1;
+}
+
+/**
+ * @brief Moves one chunk from src to dst through the direction's pipe.
+ * @return 1 if bytes moved, 0 on EOF, -1 on error.
+ */
+static int splice_chunk(SpliceDirection *dir, RelayStats *stats, const int client_fd) {
+    if (!dir->use_splice) {
+        return copy_chunk(dir, stats, client_fd);
+    }
+
+    ssize_t in_pipe = splice(dir->src, NULL, dir->pipe_fds[1], NULL, SPLICE_CHUNK, SPLICE_F_MOVE);
+    if (in_pipe < 0 && errno == EINVAL) {
+        log_event("fd %d cannot be spliced, copying that direction instead.\n", dir->src);
+        dir->use_splice = 0;
+        return copy_chunk(dir, stats, client_fd);
+    }
+    if (in_pipe <= 0) {
+        return in_pipe == 0 ? 0 : -1;
+    }
+    log_relay(stats, client_fd, dir->direction, NULL, in_pipe);
+    if (dir->cork != NULL) output_cork_chunk(dir->cork, in_pipe);
+
+    /* drain the pipe completely so the next select() only reflects the source */
+    while (in_pipe > 0) {
+        const ssize_t out = splice(dir->pipe_fds[0], NULL, dir->dst, NULL, in_pipe, SPLICE_F_MOVE);
+        if (out < 0 && errno == EINTR) continue;
+        if (out <= 0) {
+            return -1;
+        }
+        in_pipe -= out;
+    }
+    return 1;
+}
+
+/**
+ * @brief Relays what the PTY still holds once the shell has exited, without waiting for more.
+ */
+static void drain_output(SpliceDirection *dir, RelayStats *stats, const int client_fd) {
+    const int flags = fcntl(dir->src, F_GETFL);
+    fcntl(dir->src, F_SETFL, flags | O_NONBLOCK);
+    while (splice_chunk(dir, stats, client_fd) > 0) {}
+    fcntl(dir->src, F_SETFL, flags);
+}
+
+int relay_data_splice(const int master_fd, const int exit_fd, const int client_fd, RelayStats *stats) {
+    OutputCork cork;
+    SpliceDirection dirs[2] = {
+        { master_fd, client_fd, RELAY_TO_CLIENT, { -1, -1 }, 1, &cork },
+        { client_fd, master_fd, RELAY_FROM_CLIENT, { -1, -1 }, 1, NULL },
+    };
+
+    for (int i = 0; i < 2; i++) {
+        if (pipe2(dirs[i].pipe_fds, O_CLOEXEC) == -1) {
+            log_event("pipe2 failed (%s), using the select relay.\n", strerror(errno));
+            if (i == 1) {
+                close(dirs[0].pipe_fds[0]);
+                close(dirs[0].pipe_fds[1]);
+            }
+            return -1;
+        }
+    }
+
+    fd_set read_fds;
+    int max_fd = (master_fd > client_fd) ? master_fd : client_fd;
+    if (exit_fd > max_fd) max_fd = exit_fd;
+
+    output_cork_init(&cork, client_fd);
+    while (1) {
+        FD_ZERO(&read_fds);
+        FD_SET(master_fd, &read_fds);
+        FD_SET(client_fd, &read_fds);
+        if (exit_fd != -1) FD_SET(exit_fd, &read_fds);
+
+        /* while corked, only poll: nothing ready means the burst is over */
+        struct timeval no_wait = { 0, 0 };
+        const int ready = select(max_fd + 1, &read_fds, NULL, NULL, cork.corked ? &no_wait : NULL);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            perror("select");
+            log_event("select() failed: %s\n", strerror(errno));
+            break;
+        }
+        if (ready == 0) {
+            output_uncork(&cork);
+            continue;
+        }
+
+        int result = 1;
+        for (int i = 0; i < 2 && result > 0; i++) {
+            if (!FD_ISSET(dirs[i].src, &read_fds)) continue;
+            result = splice_chunk(&dirs[i], stats, client_fd);
+            if (result == 0) {
+                log_event("fd %d closed the connection.\n", dirs[i].src);
+            } else if (result < 0) {
+                log_event("Failed to relay from fd %d to fd %d: %s\n", dirs[i].src, dirs[i].dst, strerror(errno));
+            }
+        }
+        if (result <= 0) {
+            break;
+        }
+
+        /* EIO never comes while something the shell left running holds the PTY open */
+        if (exit_fd != -1 && FD_ISSET(exit_fd, &read_fds)) {
+            drain_output(&dirs[0], stats, client_fd);
+            break;
+        }
+    }
+
+    output_uncork(&cork);
+    for (int i = 0; i < 2; i++) {
+        close(dirs[i].pipe_fds[0]);
+        close(dirs[i].pipe_fds[1]);
+    }
+    return 0;
+}
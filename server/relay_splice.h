@@ -0,0 +1,39 @@
+/**
+ * @file relay_splice.h
+ * @brief Zero-copy splice() relay engine for the per-connection relay
+ *
+ * Bytes move from one descriptor into a pipe and from the pipe to the
+ * other descriptor without ever being copied into user space. Because the
+ * payload is never seen, this engine is not used at LOG_LEVEL_PAYLOAD.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef RELAY_SPLICE_H
+#define RELAY_SPLICE_H
+
+#include "server.h"
+
+#define SPLICE_CHUNK 65536  // most bytes moved by one splice() call, the default pipe capacity
+
+/**
+ * @brief Relays data between the PTY master and the client socket with splice().
+ *
+ * A direction the kernel cannot splice (e.g. a tty without splice support)
+ * is relayed with read()/write() instead, without ending the session.
+ *
+ * Once exit_fd fires, what the PTY holds is relayed without waiting for
+ * more and the session ends, even if something the shell left running
+ * still holds the PTY open.
+ *
+ * @param master_fd The PTY master file descriptor.
+ * @param exit_fd Readable once the shell has exited, -1 to rely on the PTY hanging up.
+ * @param client_fd The client socket file descriptor.
+ * @param stats Traffic totals of the session.
+ * @return 0 once the session has ended, or -1 if the pipes could not be
+ *         created and the caller should fall back to relay_data().
+ */
+int relay_data_splice(const int master_fd, const int exit_fd, const int client_fd, RelayStats *stats);
+
+#endif // RELAY_SPLICE_H
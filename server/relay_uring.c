@@ -0,0 +1,508 @@
+/**
+ * @file relay_uring.c
+ * @brief io_uring relay engine for the per-connection relay
+ *
+ * The ring is driven through the raw system calls so the server does not
+ * need liburing. Each direction owns a group of provided buffers. A read
+ * completion queues its buffer for writing to the other side, and the
+ * buffer goes back to the group once the write has finished. Writes in one
+ * direction are linked so they reach the peer in order. Only one chain per
+ * direction is in flight, and a short write cancels the rest of its chain,
+ * which is resubmitted from where it stopped. When every buffer of a
+ * direction is waiting to be written, reads on that side stop
+ * (ENOBUFS) until the peer catches up.
+ *
+ * A read armed on the PTY is not woken when the shell hangs up, so a poll
+ * for POLLHUP on the master is kept in the ring as well. When it fires the
+ * read is cancelled and replaced by plain reads, which return what the
+ * shell left and then EIO; the session ends once that output is written.
+ *
+ * Something the shell left running can hold the PTY open past its exit, so
+ * the shell's exit_fd is polled in the ring too. When it fires, the PTY
+ * read is cancelled and not armed again; once the output read so far is
+ * written, what the PTY still holds is read without waiting and written
+ * directly, and the relay ends.
+ */
+
+#include "relay_uring.h"
+#include "server.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* added in Linux 6.7, newer than some of the kernel headers we build against */
+#define URING_OP_READ_MULTISHOT 49
+
+#define OP_READ   1
+#define OP_WRITE  2
+#define OP_HANGUP 3
+#define OP_CANCEL 4
+#define OP_EXIT   5
+
+#define DIR_TO_CLIENT 0     // PTY output going to the client
+#define DIR_TO_PTY    1     // client input going to the PTY
+
+#define USER_DATA(op, dir, slot) (((uint64_t)(slot) << 16) | ((op) << 8) | (dir))
+#define USER_DATA_OP(data)   (((data) >> 8) & 0xff)
+#define USER_DATA_DIR(data)  ((data) & 0xff)
+#define USER_DATA_SLOT(data) ((unsigned)((data) >> 16))
+
+typedef struct {
+    int ring_fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+    unsigned to_submit;
+} Uring;
+
+/* A buffer that has been read and is waiting to be written to the other side */
+typedef struct {
+    uint16_t bid;
+    uint32_t length;
+    uint32_t offset;
+} Chunk;
+
+typedef struct {
+    int src, dst;
+    RelayDirection direction;
+    struct io_uring_buf_ring *buf_ring; // provided buffers that reads from src pick from
+    uint16_t buf_tail;
+    char *slots;                        // URING_BUFFERS * BUFFER_SIZE bytes of the registered region
+    Chunk queue[URING_BUFFERS];         // FIFO of chunks not yet fully written
+    unsigned head, count;
+    unsigned writes_in_flight;
+    int read_armed;
+    int multishot;                      // whether the armed read is a multishot one
+} Direction;
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_close(Uring *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED) munmap(ring->sq_ptr, ring->sq_size);
+    if (ring->ring_fd != -1) close(ring->ring_fd);
+}
+
+static int uring_open(Uring *ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->ring_fd = uring_setup(URING_ENTRIES, &params);
+    if (ring->ring_fd == -1) {
+        return -1;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        uring_close(ring);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            uring_close(ring);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        uring_close(ring);
+        return -1;
+    }
+
+    char *sq = ring->sq_ptr;
+    char *cq = ring->cq_ptr;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = (unsigned *)(sq + params.sq_off.ring_entries);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * @brief Returns a zeroed submission entry, or NULL if the queue is full.
+ */
+static struct io_uring_sqe *get_sqe(Uring *ring) {
+    const unsigned tail = *ring->sq_tail;
+    const unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= *ring->sq_entries) {
+        return NULL;
+    }
+
+    const unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+/**
+ * @brief Hands a buffer back to its direction's provided buffer group.
+ */
+static void recycle_buffer(Direction *dir, const uint16_t bid) {
+    struct io_uring_buf *buf = &dir->buf_ring->bufs[dir->buf_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(dir->slots + (size_t)bid * BUFFER_SIZE);
+    buf->len = BUFFER_SIZE;
+    buf->bid = bid;
+    dir->buf_tail++;
+    __atomic_store_n(&dir->buf_ring->tail, dir->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int arm_read(Uring *ring, Direction *dir, const int index, const int multishot) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = multishot ? URING_OP_READ_MULTISHOT : IORING_OP_READ;
+    sqe->fd = dir->src;
+    sqe->off = (uint64_t)-1;
+    sqe->len = multishot ? 0 : BUFFER_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = (uint16_t)index;
+    sqe->user_data = USER_DATA(OP_READ, index, 0);
+    dir->read_armed = 1;
+    dir->multishot = multishot;
+    return 0;
+}
+
+/**
+ * @brief Polls the PTY master once for the shell hanging up.
+ */
+static int arm_hangup(Uring *ring, const int master_fd) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = master_fd;
+    sqe->poll32_events = POLLHUP;
+    sqe->user_data = USER_DATA(OP_HANGUP, DIR_TO_CLIENT, 0);
+    return 0;
+}
+
+/**
+ * @brief Polls the shell's exit_fd once for the shell exiting.
+ */
+static int arm_exit(Uring *ring, const int exit_fd) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = exit_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = USER_DATA(OP_EXIT, DIR_TO_CLIENT, 0);
+    return 0;
+}
+
+/**
+ * @brief Cancels the read armed on a direction, which then completes with ECANCELED.
+ */
+static int cancel_read(Uring *ring, const int index) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = USER_DATA(OP_READ, index, 0);
+    sqe->user_data = USER_DATA(OP_CANCEL, index, 0);
+    return 0;
+}
+
+/**
+ * @brief Submits every queued chunk of a direction as one linked chain of fixed-buffer writes.
+ */
+static int submit_writes(Uring *ring, Direction *dir, const int index) {
+    for (unsigned i = 0; i < dir->count; i++) {
+        const unsigned slot = (dir->head + i) % URING_BUFFERS;
+        const Chunk *chunk = &dir->queue[slot];
+        struct io_uring_sqe *sqe = get_sqe(ring);
+        if (sqe == NULL) {
+            return -1;
+        }
+
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = dir->dst;
+        sqe->off = (uint64_t)-1;
+        sqe->addr = (uint64_t)(uintptr_t)(dir->slots + (size_t)chunk->bid * BUFFER_SIZE + chunk->offset);
+        sqe->len = chunk->length - chunk->offset;
+        sqe->buf_index = 0;
+        sqe->flags = (i + 1 < dir->count) ? IOSQE_IO_LINK : 0;
+        sqe->user_data = USER_DATA(OP_WRITE, index, slot);
+        dir->writes_in_flight++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Drops fully written chunks from the front of the queue and recycles their buffers.
+ */
+static void retire_written(Direction *dir) {
+    while (dir->count > 0) {
+        const Chunk *chunk = &dir->queue[dir->head];
+        if (chunk->offset < chunk->length) {
+            break;
+        }
+        recycle_buffer(dir, chunk->bid);
+        dir->head = (dir->head + 1) % URING_BUFFERS;
+        dir->count--;
+    }
+}
+
+/**
+ * @brief Registers the buffer memory and both provided buffer groups.
+ */
+static int register_buffers(Uring *ring, Direction dirs[2], char *slots, struct io_uring_buf_ring *buf_rings[2]) {
+    struct iovec region = { slots, 2 * URING_BUFFERS * BUFFER_SIZE };
+    if (uring_register(ring->ring_fd, IORING_REGISTER_BUFFERS, &region, 1) == -1) {
+        return -1;
+    }
+
+    for (int d = 0; d < 2; d++) {
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)(uintptr_t)buf_rings[d];
+        reg.ring_entries = URING_BUFFERS;
+        reg.bgid = (uint16_t)d;
+        if (uring_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+            return -1;
+        }
+
+        dirs[d].buf_ring = buf_rings[d];
+        dirs[d].slots = slots + (size_t)d * URING_BUFFERS * BUFFER_SIZE;
+        for (uint16_t bid = 0; bid < URING_BUFFERS; bid++) {
+            recycle_buffer(&dirs[d], bid);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Relays what the PTY still holds once the shell has exited, without waiting for more.
+ */
+static void drain_output(const int master_fd, const int client_fd, RelayStats *stats) {
+    char buffer[BUFFER_SIZE];
+    ssize_t nbytes;
+    int failed = 0;
+
+    const int flags = fcntl(master_fd, F_GETFL);
+    fcntl(master_fd, F_SETFL, flags | O_NONBLOCK);
+    while (!failed && (nbytes = read(master_fd, buffer, sizeof(buffer))) > 0) {
+        log_relay(stats, client_fd, RELAY_TO_CLIENT, buffer, (size_t)nbytes);
+        for (ssize_t sent = 0; sent < nbytes && !failed;) {
+            const ssize_t written = write(client_fd, buffer + sent, (size_t)(nbytes - sent));
+            if (written > 0) {
+                sent += written;
+            } else if (written == -1 && errno != EINTR) {
+                log_event("Failed to write to fd %d: %s\n", client_fd, strerror(errno));
+                failed = 1;
+            }
+        }
+    }
+    fcntl(master_fd, F_SETFL, flags);
+}
+
+int relay_data_uring(const int master_fd, const int exit_fd, const int client_fd, RelayStats *stats) {
+    Uring ring;
+    Direction dirs[2];
+    const size_t slots_size = 2 * URING_BUFFERS * BUFFER_SIZE;
+    const size_t buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+
+    if (uring_open(&ring) == -1) {
+        log_event("io_uring unavailable (%s), using the select relay.\n", strerror(errno));
+        return -1;
+    }
+
+    memset(dirs, 0, sizeof(dirs));
+    dirs[DIR_TO_CLIENT].src = master_fd;
+    dirs[DIR_TO_CLIENT].dst = client_fd;
+    dirs[DIR_TO_CLIENT].direction = RELAY_TO_CLIENT;
+    dirs[DIR_TO_PTY].src = client_fd;
+    dirs[DIR_TO_PTY].dst = master_fd;
+    dirs[DIR_TO_PTY].direction = RELAY_FROM_CLIENT;
+
+    char *slots = mmap(NULL, slots_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    struct io_uring_buf_ring *buf_rings[2];
+    buf_rings[0] = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buf_rings[1] = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED || buf_rings[0] == MAP_FAILED || buf_rings[1] == MAP_FAILED ||
+        register_buffers(&ring, dirs, slots, buf_rings) == -1) {
+        log_event("io_uring buffer registration failed (%s), using the select relay.\n", strerror(errno));
+        uring_close(&ring);
+        if (slots != MAP_FAILED) munmap(slots, slots_size);
+        if (buf_rings[0] != MAP_FAILED) munmap(buf_rings[0], buf_ring_size);
+        if (buf_rings[1] != MAP_FAILED) munmap(buf_rings[1], buf_ring_size);
+        return -1;
+    }
+
+    int multishot = 1;
+    int relayed = 0;
+    int hangup = 0;     // the shell hung up; the PTY is read without waiting from now on
+    int draining = 0;   // the PTY has nothing more; ends once its output is written
+    int shell_gone = 0; // exit_fd fired; the PTY is emptied once what was read is written
+    int done = 0;
+
+    arm_read(&ring, &dirs[DIR_TO_CLIENT], DIR_TO_CLIENT, multishot);
+    arm_read(&ring, &dirs[DIR_TO_PTY], DIR_TO_PTY, multishot);
+    arm_hangup(&ring, master_fd);
+    if (exit_fd != -1) {
+        arm_exit(&ring, exit_fd);
+    }
+
+    while (!done) {
+        const int submitted = uring_enter(ring.ring_fd, ring.to_submit, 1, IORING_ENTER_GETEVENTS);
+        if (submitted == -1) {
+            if (errno == EINTR) continue;
+            perror("io_uring_enter");
+            log_event("io_uring_enter failed: %s\n", strerror(errno));
+            break;
+        }
+        /* the kernel stops at an entry it rejects; the ones after it go in on the next call */
+        ring.to_submit -= (unsigned)submitted;
+
+        /* reap every completion that is ready before submitting anything new */
+        unsigned head = *ring.cq_head;
+        const unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail && !done; head++) {
+            const struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            const int index = USER_DATA_DIR(cqe->user_data);
+            Direction *dir = &dirs[index];
+
+            if (USER_DATA_OP(cqe->user_data) == OP_HANGUP) {
+                if (cqe->res > 0) {
+                    hangup = 1;
+                    if (dir->read_armed && cancel_read(&ring, DIR_TO_CLIENT) == -1) {
+                        done = 1;
+                    }
+                }
+            } else if (USER_DATA_OP(cqe->user_data) == OP_EXIT) {
+                if (cqe->res > 0) {
+                    shell_gone = 1;
+                    if (dir->read_armed && cancel_read(&ring, DIR_TO_CLIENT) == -1) {
+                        done = 1;
+                    }
+                }
+            } else if (USER_DATA_OP(cqe->user_data) == OP_CANCEL) {
+                /* the read completes on its own, with ECANCELED or with what it read first */
+            } else if (USER_DATA_OP(cqe->user_data) == OP_READ) {
+                if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                    dir->read_armed = 0;
+                }
+                if (cqe->res > 0) {
+                    const uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                    const unsigned slot = (dir->head + dir->count) % URING_BUFFERS;
+                    dir->queue[slot].bid = bid;
+                    dir->queue[slot].length = (uint32_t)cqe->res;
+                    dir->queue[slot].offset = 0;
+                    dir->count++;
+                    relayed = 1;
+                    log_relay(stats, client_fd, dir->direction,
+                              dir->slots + (size_t)bid * BUFFER_SIZE, (size_t)cqe->res);
+                } else if (cqe->res == -ENOBUFS || cqe->res == -ECANCELED) {
+                    /* every buffer is waiting on the peer, or the shell hung up; re-armed below */
+                } else if (cqe->res == -EINVAL && dir->multishot && !relayed) {
+                    /* kernel without multishot reads: keep io_uring but re-arm after each read,
+                       in both directions since both were armed as multishot */
+                    multishot = 0;
+                } else {
+                    if (cqe->res == 0) {
+                        log_event("fd %d closed the connection.\n", dir->src);
+                    } else {
+                        log_event("Failed to read from fd %d: %s\n", dir->src, strerror(-cqe->res));
+                    }
+                    /* EIO once the shell has exited; its last output still goes out */
+                    if (index == DIR_TO_CLIENT) {
+                        draining = 1;
+                    } else {
+                        done = 1;
+                    }
+                }
+            } else {
+                Chunk *chunk = &dir->queue[USER_DATA_SLOT(cqe->user_data)];
+                dir->writes_in_flight--;
+                if (cqe->res > 0) {
+                    chunk->offset += (uint32_t)cqe->res;
+                } else if (cqe->res != -ECANCELED) {
+                    log_event("Failed to write to fd %d: %s\n", dir->dst, strerror(-cqe->res));
+                    done = 1;
+                }
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        /* queue the next batch: one write chain and one read per direction */
+        for (int d = 0; d < 2 && !done; d++) {
+            if (dirs[d].writes_in_flight == 0) {
+                retire_written(&dirs[d]);
+                if (dirs[d].count > 0 && submit_writes(&ring, &dirs[d], d) == -1) {
+                    done = 1;
+                }
+            }
+            if (!dirs[d].read_armed && dirs[d].count < URING_BUFFERS &&
+                !(d == DIR_TO_CLIENT && (draining || shell_gone)) &&
+                arm_read(&ring, &dirs[d], d, multishot && !(d == DIR_TO_CLIENT && hangup)) == -1) {
+                done = 1;
+            }
+        }
+        if ((draining || (shell_gone && !dirs[DIR_TO_CLIENT].read_armed)) && dirs[DIR_TO_CLIENT].count == 0) {
+            done = 1;
+            if (!draining) {
+                drain_output(master_fd, client_fd, stats);
+            }
+        }
+    }
+
+    uring_close(&ring);
+    munmap(slots, slots_size);
+    munmap(buf_rings[0], buf_ring_size);
+    munmap(buf_rings[1], buf_ring_size);
+    return 0;
+}
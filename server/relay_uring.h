@@ -0,0 +1,40 @@
+/**
+ * @file relay_uring.h
+ * @brief io_uring relay engine for the per-connection relay
+ *
+ * Keeps a read posted on both the PTY master and the client socket at all
+ * times, reads into provided buffers that are also registered as a fixed
+ * buffer, and submits the matching writes in linked batches. One
+ * io_uring_enter() call then covers many chunks in both directions instead
+ * of a select(), read() and write() per chunk.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef RELAY_URING_H
+#define RELAY_URING_H
+
+#include "server.h"
+
+#define URING_ENTRIES 64    // submission queue size
+#define URING_BUFFERS 16    // buffers per direction, must be a power of two
+
+/**
+ * @brief Relays data between the PTY master and the client socket using io_uring.
+ *
+ * Once exit_fd fires, what the PTY holds is relayed without waiting for
+ * more and the session ends, even if something the shell left running
+ * still holds the PTY open.
+ *
+ * @param master_fd The PTY master file descriptor.
+ * @param exit_fd Readable once the shell has exited, -1 to rely on the PTY hanging up.
+ * @param client_fd The client socket file descriptor.
+ * @param stats Traffic totals of the session.
+ * @return 0 once the session has ended, or -1 if io_uring is not available
+ *         and nothing has been relayed, in which case the caller should fall
+ *         back to relay_data().
+ */
+int relay_data_uring(const int master_fd, const int exit_fd, const int client_fd, RelayStats *stats);
+
+#endif // RELAY_URING_H
@@ -0,0 +1,331 @@
+/**
+ * @file scrollback.c
+ * @brief Scrollback: the recent output of every session, in a memory budget shared by the whole server
+ *
+ * The pool's free list, clock hand and chunk states change under a spinlock,
+ * once per chunk taken or given back, never per byte. A session writes its
+ * newest chunk without the lock because a chunk being written is never
+ * taken. Its full chunks are read like a seqlock: the generation is checked
+ * before and after the copy, and a chunk taken meanwhile is thrown away.
+ *
+ * A chunk being written records the pid writing it, so the parent that
+ * reaps a process which died mid-chunk can give the chunk back.
+ */
+
+#include "scrollback.h"
+#include "server.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define CHUNK_NONE UINT32_MAX
+
+typedef enum {
+    CHUNK_FREE,
+    CHUNK_WRITING,      // a session's newest chunk, never evicted
+    CHUNK_FULL          // may be evicted by any process
+} ChunkState;
+
+typedef struct {
+    atomic_uint generation;
+    atomic_int state;
+    atomic_int owner;   // the process writing it, while CHUNK_WRITING
+    uint32_t next_free; // free list link
+} ChunkInfo;
+
+typedef struct {
+    atomic_flag lock;   // guards the free list, the hand and every state change
+    uint32_t chunk_count;
+    uint32_t free_head;
+    uint32_t hand;      // the next chunk the clock looks at when the pool is used up
+    ChunkInfo info[];
+} SharedPool;
+
+static SharedPool *pool = NULL;
+static char *chunk_data = NULL;
+
+int scrollback_init(const size_t budget) {
+    const size_t count = budget / SCROLLBACK_CHUNK;
+    if (count == 0) {
+        return 0;
+    }
+
+    /* the chunks are page aligned after the header; untouched pages cost nothing */
+    const size_t page = 4096;
+    const size_t header = (sizeof(SharedPool) + count * sizeof(ChunkInfo) + page - 1) / page * page;
+    void *shared = mmap(NULL, header + count * SCROLLBACK_CHUNK, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap scrollback");
+        return -1;
+    }
+    pool = shared;      // zeroed: lock clear, every chunk free at generation 0
+    chunk_data = (char *)shared + header;
+    pool->chunk_count = (uint32_t)count;
+    for (uint32_t i = 0; i < pool->chunk_count; i++) {
+        pool->info[i].next_free = i + 1 < pool->chunk_count ? i + 1 : CHUNK_NONE;
+    }
+    pool->free_head = 0;
+    return 0;
+}
+
+static void lock_pool() {
+    while (atomic_flag_test_and_set_explicit(&pool->lock, memory_order_acquire)) {}
+}
+
+static void unlock_pool() {
+    atomic_flag_clear_explicit(&pool->lock, memory_order_release);
+}
+
+static int session_chunks() {
+    return (server_config.scrollback + SCROLLBACK_CHUNK - 1) / SCROLLBACK_CHUNK;
+}
+
+static ScrollbackChunk *ring_at(Scrollback *scrollback, const int position) {
+    return &scrollback->chunks[(scrollback->first + position) % SCROLLBACK_MAX_CHUNKS];
+}
+
+static int still_owned(const ScrollbackChunk *chunk) {
+    return atomic_load_explicit(&pool->info[chunk->index].generation, memory_order_acquire) == chunk->generation;
+}
+
+/**
+ * @brief Takes a free chunk, or the next full one of any session when there is none.
+ * @return 0 on success, -1 if every chunk is being written.
+ */
+static int take_chunk(ScrollbackChunk *chunk) {
+    uint32_t index = CHUNK_NONE;
+
+    lock_pool();
+    if (pool->free_head != CHUNK_NONE) {
+        index = pool->free_head;
+        pool->free_head = pool->info[index].next_free;
+    } else {
+        for (uint32_t i = 0; i < pool->chunk_count && index == CHUNK_NONE; i++) {
+            const uint32_t candidate = pool->hand;
+            pool->hand = (pool->hand + 1) % pool->chunk_count;
+            if (atomic_load_explicit(&pool->info[candidate].state, memory_order_relaxed) == CHUNK_FULL) {
+                index = candidate;
+            }
+        }
+        if (index != CHUNK_NONE) {
+            metrics_add(METRIC_SCROLLBACK_EVICTED, 1);
+            metrics_add(METRIC_SCROLLBACK_RELEASED, 1);     // on its old owner's behalf
+        }
+    }
+    if (index != CHUNK_NONE) {
+        /* the new generation is published before any new byte, so a reader of the old one sees the change */
+        chunk->index = index;
+        chunk->generation = atomic_fetch_add_explicit(&pool->info[index].generation, 1, memory_order_acq_rel) + 1;
+        atomic_store_explicit(&pool->info[index].state, CHUNK_WRITING, memory_order_relaxed);
+        atomic_store_explicit(&pool->info[index].owner, getpid(), memory_order_relaxed);
+        metrics_add(METRIC_SCROLLBACK_TAKEN, 1);
+    }
+    unlock_pool();
+    return index == CHUNK_NONE ? -1 : 0;
+}
+
+/**
+ * @brief Gives a chunk back to the pool, unless it was evicted already.
+ */
+static void release_chunk(const ScrollbackChunk *chunk) {
+    lock_pool();
+    if (still_owned(chunk)) {
+        atomic_store_explicit(&pool->info[chunk->index].state, CHUNK_FREE, memory_order_relaxed);
+        pool->info[chunk->index].next_free = pool->free_head;
+        pool->free_head = chunk->index;
+        metrics_add(METRIC_SCROLLBACK_RELEASED, 1);
+    }
+    unlock_pool();
+}
+
+/**
+ * @brief Moves a chunk between writing and full, unless it was evicted.
+ * @return 0 on success, -1 if it was evicted.
+ */
+static int set_state(const ScrollbackChunk *chunk, const ChunkState state) {
+    lock_pool();
+    const int owned = still_owned(chunk);
+    if (owned) {
+        atomic_store_explicit(&pool->info[chunk->index].state, state, memory_order_relaxed);
+        atomic_store_explicit(&pool->info[chunk->index].owner, state == CHUNK_WRITING ? getpid() : 0,
+                              memory_order_relaxed);
+    }
+    unlock_pool();
+    return owned ? 0 : -1;
+}
+
+void scrollback_reclaim(const pid_t pid) {
+    if (pool == NULL) {
+        return;
+    }
+
+    lock_pool();
+    for (uint32_t i = 0; i < pool->chunk_count; i++) {
+        ChunkInfo *info = &pool->info[i];
+        if (atomic_load_explicit(&info->state, memory_order_relaxed) == CHUNK_WRITING &&
+            atomic_load_explicit(&info->owner, memory_order_relaxed) == pid) {
+            atomic_store_explicit(&info->state, CHUNK_FREE, memory_order_relaxed);
+            atomic_store_explicit(&info->owner, 0, memory_order_relaxed);
+            info->next_free = pool->free_head;
+            pool->free_head = i;
+            metrics_add(METRIC_SCROLLBACK_RELEASED, 1);
+        }
+    }
+    unlock_pool();
+}
+
+void scrollback_start(Scrollback *scrollback) {
+    scrollback->first = 0;
+    scrollback->count = 0;
+    scrollback->last_length = 0;
+}
+
+/**
+ * @brief Makes room for the next chunk of output: a new chunk while under -k, else the session's oldest.
+ * @return 0 on success, -1 if there is nothing to write into.
+ */
+static int next_chunk(Scrollback *scrollback) {
+    ScrollbackChunk chunk;
+
+    while (scrollback->count > 0 && scrollback->count >= session_chunks()) {
+        chunk = *ring_at(scrollback, 0);
+        scrollback->first = (scrollback->first + 1) % SCROLLBACK_MAX_CHUNKS;
+        scrollback->count--;
+        if (set_state(&chunk, CHUNK_WRITING) == 0) {
+            *ring_at(scrollback, scrollback->count++) = chunk;
+            return 0;
+        }
+    }
+    if (take_chunk(&chunk) == 0) {
+        *ring_at(scrollback, scrollback->count++) = chunk;
+        return 0;
+    }
+
+    /* the pool is all being written: start over in our own oldest chunk */
+    while (scrollback->count > 0) {
+        chunk = *ring_at(scrollback, 0);
+        scrollback->first = (scrollback->first + 1) % SCROLLBACK_MAX_CHUNKS;
+        scrollback->count--;
+        if (set_state(&chunk, CHUNK_WRITING) == 0) {
+            *ring_at(scrollback, scrollback->count++) = chunk;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void scrollback_append(Scrollback *scrollback, const char *data, size_t length) {
+    if (pool == NULL || server_config.scrollback == 0) {
+        return;
+    }
+
+    while (length > 0) {
+        if (scrollback->count == 0 || scrollback->last_length == SCROLLBACK_CHUNK) {
+            if (scrollback->count > 0) {
+                set_state(ring_at(scrollback, scrollback->count - 1), CHUNK_FULL);
+            }
+            scrollback->last_length = 0;
+            if (next_chunk(scrollback) == -1) {
+                return;
+            }
+        }
+        const ScrollbackChunk *newest = ring_at(scrollback, scrollback->count - 1);
+        const size_t room = SCROLLBACK_CHUNK - scrollback->last_length;
+        const size_t take = length < room ? length : room;
+        memcpy(chunk_data + (size_t)newest->index * SCROLLBACK_CHUNK + scrollback->last_length, data, take);
+        scrollback->last_length += take;
+        data += take;
+        length -= take;
+    }
+}
+
+void scrollback_forget(Scrollback *scrollback, size_t length) {
+    while (length > 0 && scrollback->count > 0) {
+        if (length < scrollback->last_length) {
+            scrollback->last_length -= length;
+            return;
+        }
+        length -= scrollback->last_length;
+        release_chunk(ring_at(scrollback, --scrollback->count));
+        scrollback->last_length = 0;
+
+        /* the chunk before becomes the one being written again; if it was evicted, so was the rest */
+        if (scrollback->count > 0) {
+            if (set_state(ring_at(scrollback, scrollback->count - 1), CHUNK_WRITING) == -1) {
+                scrollback_free(scrollback);
+                return;
+            }
+            scrollback->last_length = SCROLLBACK_CHUNK;
+        }
+    }
+}
+
+size_t scrollback_replay(Scrollback *scrollback, OutputBacklog *backlog) {
+    if (pool == NULL || scrollback->count == 0) {
+        return 0;
+    }
+
+    /* only the chunks after the newest one evicted follow on from each other */
+    int kept = 1;
+    while (kept < scrollback->count && still_owned(ring_at(scrollback, scrollback->count - 1 - kept))) {
+        kept++;
+    }
+    while (scrollback->count > kept) {
+        release_chunk(ring_at(scrollback, 0));
+        scrollback->first = (scrollback->first + 1) % SCROLLBACK_MAX_CHUNKS;
+        scrollback->count--;
+    }
+
+    const size_t unsent = backlog->length - backlog->offset;
+    const size_t planned = (size_t)(scrollback->count - 1) * SCROLLBACK_CHUNK + scrollback->last_length;
+
+    /* never smaller than the backlog was: backlog_init() keeps a buffer it finds, capacity and all */
+    size_t size = planned + unsent > backlog->capacity ? planned + unsent : backlog->capacity;
+    if (size == 0) {
+        size = 1;
+    }
+    char *data = malloc(size);
+    if (data == NULL) {
+        return 0;
+    }
+
+    /* newest first, so a chunk evicted during the copy cuts off only what is older */
+    size_t start = planned;
+    for (int position = scrollback->count - 1; position >= 0; position--) {
+        const ScrollbackChunk *chunk = ring_at(scrollback, position);
+        const size_t length = position == scrollback->count - 1 ? scrollback->last_length : SCROLLBACK_CHUNK;
+        memcpy(data + start - length, chunk_data + (size_t)chunk->index * SCROLLBACK_CHUNK, length);
+        atomic_thread_fence(memory_order_acquire);
+        if (!still_owned(chunk)) {
+            break;
+        }
+        start -= length;
+    }
+    const size_t replayed = planned - start;
+    memmove(data, data + start, replayed);
+    if (unsent > 0) {
+        memcpy(data + replayed, backlog->data + backlog->offset, unsent);
+    }
+
+    free(backlog->data);
+    backlog->data = data;
+    backlog->length = replayed + unsent;
+    backlog->offset = 0;
+    backlog->capacity = size;
+    return replayed;
+}
+
+void scrollback_free(Scrollback *scrollback) {
+    if (pool != NULL) {
+        for (int position = 0; position < scrollback->count; position++) {
+            release_chunk(ring_at(scrollback, position));
+        }
+    }
+    scrollback_start(scrollback);
+}
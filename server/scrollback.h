@@ -0,0 +1,100 @@
+/**
+ * @file scrollback.h
+ * @brief Scrollback: the recent output of every session, in a memory budget shared by the whole server
+ *
+ * Each session keeps the last -k bytes its shell sent towards the client, so
+ * a client that resumes with SCROLLBACK_REQUEST gets them replayed ahead of
+ * the detach backlog, in one write. The bytes live in fixed-size chunks of
+ * one shared anonymous mapping of -K bytes, created before the server forks
+ * like the metrics, so fork-mode children and the workers draw on the same
+ * budget and memory use does not grow with the number of sessions.
+ *
+ * A session grows its scrollback a chunk at a time, and once it has -k
+ * bytes it reuses its own oldest chunk. When the budget is used up, a new
+ * chunk is taken from another session: a clock hand sweeps the pool and
+ * takes the first full chunk it meets, so the output evicted is roughly the
+ * oldest anywhere. The chunk a session is writing is never taken. Each chunk
+ * carries a generation that changes when it is taken, which is how its old
+ * owner finds out; a session's scrollback is only the chunks after the last
+ * one it lost, so a replay never has a gap.
+ *
+ * Output the splice relay moves never passes through the server, so those
+ * sessions have no scrollback. A process that dies while it writes a chunk
+ * holds that chunk until its parent reaps it and calls scrollback_reclaim().
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef SCROLLBACK_H
+#define SCROLLBACK_H
+
+#include "detach.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SCROLLBACK_CHUNK 4096                   // bytes a scrollback grows by, and loses to eviction
+#define SCROLLBACK_MAX_CHUNKS 64                // chunks one session may hold, so -k is at most 256 KiB
+#define SCROLLBACK_SESSION 16384                // default bytes of scrollback per session
+#define SCROLLBACK_BUDGET (64 * 1024 * 1024)    // default bytes of scrollback for the whole server
+
+/* A chunk of the pool as its owner knows it */
+typedef struct {
+    uint32_t index;
+    uint32_t generation;    // the chunk's generation when it was taken; another means it was evicted
+} ScrollbackChunk;
+
+/* One session's recent output: a ring of chunks, the newest one being written */
+typedef struct {
+    ScrollbackChunk chunks[SCROLLBACK_MAX_CHUNKS];
+    int first;              // the oldest chunk in the ring
+    int count;
+    size_t last_length;     // bytes in the newest chunk; the others are full
+} Scrollback;
+
+/**
+ * @brief Maps the shared chunk pool; must be called before the server forks.
+ * @param budget Bytes for all sessions, rounded down to whole chunks; 0 turns scrollback off.
+ * @return 0 on success, -1 if the mapping failed (scrollback is then off).
+ */
+int scrollback_init(size_t budget);
+
+/**
+ * @brief Gives back the chunks a dead process was writing, which nothing else would evict.
+ *
+ * For the process that reaped it: the fork-mode listener or the workers'
+ * supervisor. Its full chunks are evicted as usual.
+ *
+ * @param pid The reaped process.
+ */
+void scrollback_reclaim(pid_t pid);
+
+/**
+ * @brief Starts an empty scrollback for a new session.
+ */
+void scrollback_start(Scrollback *scrollback);
+
+/**
+ * @brief Keeps output on its way to the client, dropping the oldest beyond the session's -k bytes.
+ */
+void scrollback_append(Scrollback *scrollback, const char *data, size_t length);
+
+/**
+ * @brief Forgets the newest bytes, for output that was kept but never sent and goes to the detach backlog.
+ */
+void scrollback_forget(Scrollback *scrollback, size_t length);
+
+/**
+ * @brief Puts the scrollback in front of the unsent bytes of a backlog, which grows to hold both.
+ * @return Bytes of scrollback put in, 0 if there was none or no memory for it.
+ */
+size_t scrollback_replay(Scrollback *scrollback, OutputBacklog *backlog);
+
+/**
+ * @brief Gives the session's chunks back to the pool.
+ */
+void scrollback_free(Scrollback *scrollback);
+
+#endif // SCROLLBACK_H
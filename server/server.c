@@ -7,12 +7,27 @@
  */
 
 #include "server.h"
+#include "session.h"
+#include "event_loop.h"
+#include "workers.h"
+#include "relay_uring.h"
+#include "relay_splice.h"
+#include "logger.h"
+#include "binlog.h"
+#include "users.h"
+#include "metrics.h"
+#include "shell_pool.h"
+#include "detach.h"
+#include "socket_tuning.h"
+#include "client_stream.h"
+#include "channels.h"
+#include "upgrade.h"
+#include "children.h"
 #include "../protocol.h"
 
-#include <pty.h>
-#include <termios.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
@@ -21,48 +36,199 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <signal.h>
-#include <time.h>
-#include <sys/wait.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <poll.h>
 /* these are used for logs */
 #include <errno.h>
 #include <stdarg.h>
-#include <sys/file.h>
 
-#define USER_FILE "users.txt"
-#define MAX_USERS 100
-#define MAX_USERNAME_LENGTH 50
-#define MAX_PASSWORD_LENGTH 50
+ServerConfig server_config = {
+    .port = DEFAULT_PORT,
+    .mode = SERVER_MODE_FORK,
+    .backlog = BACKLOG,
+    .workers = 0,
+    .relay_engine = RELAY_ENGINE_SELECT,
+    .log_level = LOG_LEVEL_EVENTS,
+    .users_file = USER_FILE,
+    .metrics_address = NULL,
+    .shell_pool = 0,
+    .detach_grace = DETACH_GRACE,
+    .detach_backlog = DETACH_BACKLOG,
+    .socket_profile = SOCKET_PROFILE_CORK,
+    .cork_threshold = CORK_THRESHOLD,
+    .output_queue = OUTPUT_QUEUE,
+    .compression = 1,
+    .max_sessions = ADMISSION_MAX_SESSIONS,
+    .max_preauth = ADMISSION_MAX_PREAUTH,
+    .source_limit = { ADMISSION_SOURCE_RATE, 2 * ADMISSION_SOURCE_RATE },
+    .user_limit = { ADMISSION_USER_RATE, 2 * ADMISSION_USER_RATE },
+    .scrollback = SCROLLBACK_SESSION,
+    .scrollback_budget = SCROLLBACK_BUDGET,
+    .login_timeout = TIMEOUT_LOGIN,
+    .cgroup_root = CGROUP_ROOT,
+};
+
+static Logger *payload_log = NULL;
+
+/* The login of a fork-mode child, ended by SIGALRM once the login timeout is up */
+static volatile sig_atomic_t login_fd = -1;
+static volatile sig_atomic_t login_expired = 0;
+
+/* A fork-mode child serves one session, whose timeouts are the only timers on its wheel */
+static TimerWheel session_timers;
+
+/* Where the timeout notices of a fork-mode session go */
+typedef struct {
+    ClientStream *stream;
+    OutputBacklog *output;  // the relay's output queue, for a plain connection's notices
+    const char *username;
+} TimeoutTarget;
 
+/* What a fork-mode connection child holds in memory shared with the listener */
 typedef struct {
-    char username[MAX_USERNAME_LENGTH];
-    char password[MAX_PASSWORD_LENGTH];
-} User;
+    pid_t pid;
+    Admission admission;    // copied when it was forked
+} RelayChild;
 
-User users[MAX_USERS];
-int user_count = 0;
+/**
+ * @brief A fork-mode connection child has been reaped: gives back what it still held.
+ * @param owner The child's RelayChild.
+ */
+static void relay_exited(void *owner) {
+    RelayChild *child = owner;
+    admission_release(&child->admission);
+    scrollback_reclaim(child->pid);
+    free(child);
+}
 
 /**
  * @brief Entry point for the server application.
  */
 int main(int argc, char *argv[]) {
-    int server_fd, port = DEFAULT_PORT;
+    int server_fd;
+    int metrics_fd;
 
-    if (argc == 2) {
-        port = atoi(argv[1]);
-        if (port <= 0 || port > 65535) {
-            fprintf(stderr, "Invalid port number: %s\n", argv[1]);
-            exit(EXIT_FAILURE);
+    parse_arguments(argc, argv, &server_config);
+    upgrade_init(argv);
+    children_init();
+    setup_signal_handlers();
+    if (upgrade_take_over(&server_fd, &metrics_fd) == -1) {
+        return EXIT_FAILURE;
+    }
+    logger_init(LOG_FILE, 1);
+    metrics_init();
+    admission_init();
+    if (server_config.scrollback > 0) {
+        scrollback_init(server_config.scrollback_budget);
+    }
+    metrics_socket_profile(socket_profile_name(),
+                           server_config.socket_profile == SOCKET_PROFILE_CORK ? server_config.cork_threshold : 0);
+    if (metrics_fd != -1) {
+        if (metrics_serve_endpoint(metrics_fd) == 0) {
+            log_event("Serving metrics on %s, taken over from PID %d.\n", server_config.metrics_address, getppid());
+        }
+    } else if (server_config.metrics_address != NULL) {
+        if (metrics_serve(server_config.metrics_address) == 0) {
+            log_event("Serving metrics on %s.\n", server_config.metrics_address);
+        } else {
+            log_event("Failed to serve metrics on %s.\n", server_config.metrics_address);
         }
     }
+    if (server_config.log_level == LOG_LEVEL_PAYLOAD) {
+        payload_log = logger_open(BINLOG_FILE, BINLOG_HEADER_SIZE + BUFFER_SIZE, BINLOG_MAGIC, BINLOG_MAGIC_LENGTH);
+        if (payload_log == NULL) {
+            fprintf(stderr, "Cannot open %s, payload logging disabled.\n", BINLOG_FILE);
+            server_config.log_level = LOG_LEVEL_META;
+        }
+    }
+    if (server_config.recordings != NULL && access(server_config.recordings, W_OK | X_OK) == -1) {
+        perror(server_config.recordings);
+        fprintf(stderr, "Cannot write recordings to %s, recording disabled.\n", server_config.recordings);
+        server_config.recordings = NULL;
+    }
+    if (server_config.cgroup_scope != CGROUP_SCOPE_NONE &&
+        cgroups_init(server_config.cgroup_scope, server_config.cgroup_root, &server_config.cgroup_limits) == -1) {
+        fprintf(stderr, "Cannot use cgroups under %s, shells run in the server's cgroup.\n", server_config.cgroup_root);
+        server_config.cgroup_scope = CGROUP_SCOPE_NONE;
+    }
 
-    setup_signal_handlers();
+    /* load the credentials once; every mode and every forked process shares this table */
+    if (!load_users()) {
+        log_event("Failed to load user credentials.\n");
+        return EXIT_FAILURE;
+    }
 
-    /* bind the server socket */
-    setup_server(&server_fd, port);
-    log_event("Server listening on port %d.\n", port);
+    if (server_config.mode == SERVER_MODE_WORKERS) {
+        run_workers(&server_config);
+        return 0;
+    }
 
-    /* accept and handle incoming connections */
+    /* bind the server socket, unless the server this one replaces passed it on */
+    if (server_fd == -1) {
+        setup_server(&server_fd, server_config.port, 0);
+        log_event("Server listening on port %d.\n", server_config.port);
+    } else {
+        log_event("Server took over port %d from PID %d.\n", server_config.port, getppid());
+    }
+    upgrade_ready(server_config.mode == SERVER_MODE_EPOLL);
+
+    if (server_config.mode == SERVER_MODE_EPOLL) {
+        if (run_event_loop(server_fd) == 0) {
+            return EXIT_SUCCESS;
+        }
+        close(server_fd);
+        return EXIT_FAILURE;
+    }
+
+    /* accept and handle incoming connections, reloading the users file when it changes, reaping exited
+       children and lending them pooled shells */
+    TimerWheel pool_timers;
+    timer_wheel_init(&pool_timers);
+    shell_pool_init(server_config.shell_pool, &pool_timers);
+    struct pollfd watched[6] = {
+        { .fd = server_fd, .events = POLLIN },
+        { .fd = users_watch(server_config.users_file), .events = POLLIN },
+        { .fd = upgrade_signal_fd(), .events = POLLIN },
+        { .fd = children_signal_fd(), .events = POLLIN },
+        { .fd = server_config.shell_pool > 0 ? shell_pool_lender() : -1, .events = POLLIN },
+        { .fd = server_config.shell_pool > 0 ? shell_exec_fd() : -1, .events = POLLIN },
+    };
     while (1) {
+        /* the shell pool is only topped up while no connection is waiting */
+        const int ready = poll(watched, 6, shell_pool_missing() > 0 ? 0 : timer_wheel_timeout(&pool_timers));
+        if (ready == -1) {
+            if (errno != EINTR) perror("poll");
+            continue;
+        }
+        timer_wheel_run(&pool_timers);
+        if (ready == 0) {
+            shell_pool_refill(1);
+            continue;
+        }
+        if (watched[4].revents & POLLIN) {
+            shell_pool_lend();
+        }
+        if (watched[5].revents & POLLIN) {
+            shell_exec_collect();
+        }
+        if (watched[1].revents & POLLIN) {
+            reload_users(watched[1].fd);
+        }
+        if (watched[3].revents & POLLIN) {
+            children_reap();
+        }
+        if ((watched[2].revents & POLLIN) && upgrade_requested()) {
+            const int upgrade_fd = upgrade_start(server_fd);
+            if (upgrade_fd != -1) {
+                close(upgrade_fd);
+                break;
+            }
+        }
+        if (!(watched[0].revents & POLLIN)) {
+            continue;
+        }
+
         struct sockaddr_in client_address;
         socklen_t sin_size = sizeof(client_address);
         const int client_fd = accept(server_fd, (struct sockaddr *)&client_address, &sin_size);
@@ -70,46 +236,357 @@ int main(int argc, char *argv[]) {
             perror("accept");
             continue;
         }
+        metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
+        fcntl(client_fd, F_SETFD, FD_CLOEXEC);  // or whatever a shell leaves running keeps the connection open
 
         log_event("Received connection from %s:%d.\n",
           inet_ntoa(client_address.sin_addr), ntohs(client_address.sin_port));
 
-        /* child process handle the client */
+        /* turned away here, a storm of connections costs no fork */
+        Admission admission;
+        const char *refusal = admission_accept(&admission, client_address.sin_addr.s_addr);
+        if (refusal != NULL) {
+            log_event("Refused connection from %s: %s\n", inet_ntoa(client_address.sin_addr), refusal);
+            send_response(client_fd, CONNECTION_FAILURE, refusal);
+            close(client_fd);
+            continue;
+        }
+        tune_client_socket(client_fd);
+
+        /* child process handle the client; once its user has logged in it borrows a pooled shell */
         const pid_t pid = fork();
         if (pid < 0) {
             perror("fork");
             close(client_fd);
+            admission_release(&admission);
             continue;
         }
 
         if (pid == 0) {
             /* Child Process */
             close(server_fd);
-            handle_client(client_fd);
+            if (watched[1].fd != -1) close(watched[1].fd);
+            shell_pool_forget();
+            handle_client(client_fd, &admission);
+            admission_release(&admission);
+            shell_pool_shutdown();
             close(client_fd);
             exit(EXIT_SUCCESS);
         } else {
-            /* Parent Process */
+            /* Parent Process; the child holds the connection's admission and scrollback, given back here if it dies holding them */
             close(client_fd);
+            RelayChild *child = malloc(sizeof(RelayChild));
+            if (child != NULL) {
+                child->pid = pid;
+                child->admission = admission;
+                if (children_watch_relay(pid, relay_exited, child) == -1) free(child);
+            }
         }
     }
 
+    /* every connection has a relay process of its own, which carries on without this one */
+    log_event("Handed the port over; running sessions carry on in their own processes.\n");
+    shell_pool_shutdown();
     close(server_fd);
     return 0;
 }
 
+/**
+ * @brief Prints the command line usage.
+ */
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-m fork|epoll|workers] [-w workers] [-b backlog] [-r select|uring|splice] [-l events|meta|payload] [-u users] [-M metrics] [-p shells] [-d grace] [-D backlog] [-t kernel|nodelay|cork] [-c bytes] [-q bytes] [-z deflate|off] [-S sessions] [-P connections] [-I rate[:burst]] [-U rate[:burst]] [-e file] [-k bytes] [-K bytes] [-R directory] [-a seconds] [-i seconds] [-T seconds] [-H] [-g user|session] [-G directory] [-L limits] [port]\n", program);
+    fprintf(stderr, "  -m mode     fork: one process per connection (default)\n");
+    fprintf(stderr, "              epoll: one process serving every session\n");
+    fprintf(stderr, "              workers: pre-forked epoll workers sharing the port\n");
+    fprintf(stderr, "  -w workers  number of workers in workers mode (default: one per core)\n");
+    fprintf(stderr, "  -b backlog  listen backlog (default: %d)\n", BACKLOG);
+    fprintf(stderr, "  -r engine   relay engine in fork mode: select (default), uring or splice\n");
+    fprintf(stderr, "  -l level    events: sessions and logins only (default)\n");
+    fprintf(stderr, "              meta: plus size and time of every relayed chunk\n");
+    fprintf(stderr, "              payload: plus every chunk in %s (read with logread)\n", BINLOG_FILE);
+    fprintf(stderr, "  -u users    users file or compiled database (default: %s), reloaded when it changes\n", USER_FILE);
+    fprintf(stderr, "  -p shells   shells kept started ahead of logins, per process serving sessions (default: 0)\n");
+    fprintf(stderr, "  -d grace    seconds a disconnected session waits to be resumed, 0 to end it at once (default: %d)\n", DETACH_GRACE);
+    fprintf(stderr, "  -D backlog  bytes of output kept for a detached session (default: %d)\n", DETACH_BACKLOG);
+    fprintf(stderr, "  -t profile  client sockets: kernel: Nagle on, as the kernel sets them\n");
+    fprintf(stderr, "              nodelay: TCP_NODELAY for keystrokes and echoes\n");
+    fprintf(stderr, "              cork: TCP_NODELAY, and bulk output corked into full segments (default)\n");
+    fprintf(stderr, "  -c bytes    smallest PTY chunk corked as bulk output (default: %d)\n", CORK_THRESHOLD);
+    fprintf(stderr, "  -q bytes    shell output queued per session for a slow client before the shell is paused (default: %d)\n", OUTPUT_QUEUE);
+    fprintf(stderr, "  -z codec    deflate: compress the output of clients that ask for it (default), off: never\n");
+    fprintf(stderr, "  -M metrics  serve Prometheus metrics on this 127.0.0.1 port or Unix socket path\n");
+    fprintf(stderr, "  -S sessions most sessions with a shell, detached ones included, 0 for no cap (default: %d)\n", ADMISSION_MAX_SESSIONS);
+    fprintf(stderr, "  -P conns    most connections not logged in yet, 0 for no cap (default: %d)\n", ADMISSION_MAX_PREAUTH);
+    fprintf(stderr, "  -I rate     connections per second from one address, burst twice that unless given, 0 for no limit (default: %d)\n", ADMISSION_SOURCE_RATE);
+    fprintf(stderr, "  -U rate     failed logins per second for one username, as -I (default: %d)\n", ADMISSION_USER_RATE);
+    fprintf(stderr, "  -e file     trace keystroke-to-echo latency, appending each session's histograms to file as JSON\n");
+    fprintf(stderr, "  -k bytes    recent output kept per session and replayed to a resuming client that asks, 0 for none (default: %d)\n", SCROLLBACK_SESSION);
+    fprintf(stderr, "  -K bytes    scrollback memory for the whole server, the oldest evicted beyond it (default: %d)\n", SCROLLBACK_BUDGET);
+    fprintf(stderr, "  -R dir      record every session into its own file in dir (play back with eggplay)\n");
+    fprintf(stderr, "  -a seconds  time a connection has to log in, 0 for no limit (default: %d)\n", TIMEOUT_LOGIN);
+    fprintf(stderr, "  -i seconds  close sessions that get no input for this long, 0 for no limit (default: 0)\n");
+    fprintf(stderr, "  -T seconds  close sessions once they have lasted this long, 0 for no limit (default: 0)\n");
+    fprintf(stderr, "  -H          on SIGUSR2, which starts this binary again and hands it the port, pass it the epoll\n");
+    fprintf(stderr, "              server's live sessions too; the old server otherwise serves them until they end\n");
+    fprintf(stderr, "  -g scope    run each session's shells in a cgroup of their own, limited per user or per session\n");
+    fprintf(stderr, "  -G dir      cgroup v2 directory the groups are made in, outside the server's own (default: %s)\n", CGROUP_ROOT);
+    fprintf(stderr, "  -L limits   cpu=weight,memory=bytes[K|M|G],pids=count for each group, any of them (default: none)\n");
+}
+
+/**
+ * @brief Parses the command line into the server configuration.
+ *
+ * @param argc Argument count from main.
+ * @param argv Argument vector from main.
+ * @param config The configuration to fill in.
+ */
+void parse_arguments(int argc, char *argv[], ServerConfig *config) {
+    int option;
+
+    while ((option = getopt(argc, argv, "m:w:b:r:l:u:M:p:d:D:t:c:q:z:S:P:I:U:e:k:K:R:a:i:T:g:G:L:Hh")) != -1) {
+        switch (option) {
+        case 'm':
+            if (strcmp(optarg, "fork") == 0) {
+                config->mode = SERVER_MODE_FORK;
+            } else if (strcmp(optarg, "epoll") == 0) {
+                config->mode = SERVER_MODE_EPOLL;
+            } else if (strcmp(optarg, "workers") == 0) {
+                config->mode = SERVER_MODE_WORKERS;
+            } else {
+                fprintf(stderr, "Unknown server mode: %s\n", optarg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'w':
+            config->workers = atoi(optarg);
+            if (config->workers <= 0) {
+                fprintf(stderr, "Invalid worker count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'b':
+            config->backlog = atoi(optarg);
+            if (config->backlog <= 0) {
+                fprintf(stderr, "Invalid backlog: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            if (strcmp(optarg, "select") == 0) {
+                config->relay_engine = RELAY_ENGINE_SELECT;
+            } else if (strcmp(optarg, "uring") == 0) {
+                config->relay_engine = RELAY_ENGINE_URING;
+            } else if (strcmp(optarg, "splice") == 0) {
+                config->relay_engine = RELAY_ENGINE_SPLICE;
+            } else {
+                fprintf(stderr, "Unknown relay engine: %s\n", optarg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'l':
+            if (strcmp(optarg, "events") == 0) {
+                config->log_level = LOG_LEVEL_EVENTS;
+            } else if (strcmp(optarg, "meta") == 0) {
+                config->log_level = LOG_LEVEL_META;
+            } else if (strcmp(optarg, "payload") == 0) {
+                config->log_level = LOG_LEVEL_PAYLOAD;
+            } else {
+                fprintf(stderr, "Unknown log level: %s\n", optarg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'u':
+            config->users_file = optarg;
+            break;
+        case 'M':
+            config->metrics_address = optarg;
+            break;
+        case 'p':
+            config->shell_pool = atoi(optarg);
+            if (config->shell_pool < 0) {
+                fprintf(stderr, "Invalid shell pool size: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'd':
+            config->detach_grace = atoi(optarg);
+            if (config->detach_grace < 0) {
+                fprintf(stderr, "Invalid grace period: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'D':
+            config->detach_backlog = atoi(optarg);
+            if (config->detach_backlog < BUFFER_SIZE) {
+                fprintf(stderr, "Detach backlog must be at least %d bytes: %s\n", BUFFER_SIZE, optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't':
+            if (strcmp(optarg, "kernel") == 0) {
+                config->socket_profile = SOCKET_PROFILE_KERNEL;
+            } else if (strcmp(optarg, "nodelay") == 0) {
+                config->socket_profile = SOCKET_PROFILE_NODELAY;
+            } else if (strcmp(optarg, "cork") == 0) {
+                config->socket_profile = SOCKET_PROFILE_CORK;
+            } else {
+                fprintf(stderr, "Unknown socket profile: %s\n", optarg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            config->cork_threshold = atoi(optarg);
+            if (config->cork_threshold <= 0) {
+                fprintf(stderr, "Invalid cork threshold: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'q':
+            config->output_queue = atoi(optarg);
+            if (config->output_queue < BUFFER_SIZE) {
+                fprintf(stderr, "Output queue must be at least %d bytes: %s\n", BUFFER_SIZE, optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'z':
+            if (strcmp(optarg, COMPRESS_CODEC) == 0) {
+                config->compression = 1;
+            } else if (strcmp(optarg, "off") == 0) {
+                config->compression = 0;
+            } else {
+                fprintf(stderr, "Unknown compression: %s\n", optarg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'S':
+            config->max_sessions = atoi(optarg);
+            if (config->max_sessions < 0) {
+                fprintf(stderr, "Invalid session cap: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'P':
+            config->max_preauth = atoi(optarg);
+            if (config->max_preauth < 0) {
+                fprintf(stderr, "Invalid connection cap: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'I':
+        case 'U':
+            if (admission_parse_rate(optarg, option == 'I' ? &config->source_limit : &config->user_limit) == -1) {
+                fprintf(stderr, "Invalid rate: %s\n", optarg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'e':
+            config->echo_trace = optarg;
+            break;
+        case 'k':
+            config->scrollback = atoi(optarg);
+            if (config->scrollback < 0 || config->scrollback > SCROLLBACK_MAX_CHUNKS * SCROLLBACK_CHUNK) {
+                fprintf(stderr, "Scrollback must be 0 to %d bytes: %s\n", SCROLLBACK_MAX_CHUNKS * SCROLLBACK_CHUNK, optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'K':
+            config->scrollback_budget = strtoull(optarg, NULL, 10);
+            if (optarg[0] == '-' || config->scrollback_budget < SCROLLBACK_CHUNK) {
+                fprintf(stderr, "Scrollback budget must be at least %d bytes: %s\n", SCROLLBACK_CHUNK, optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'R':
+            config->recordings = optarg;
+            break;
+        case 'a':
+            config->login_timeout = atoi(optarg);
+            if (config->login_timeout < 0) {
+                fprintf(stderr, "Invalid login timeout: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'i':
+            config->idle_timeout = atoi(optarg);
+            if (config->idle_timeout < 0) {
+                fprintf(stderr, "Invalid idle timeout: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T':
+            config->session_limit = atoi(optarg);
+            if (config->session_limit < 0) {
+                fprintf(stderr, "Invalid session limit: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'H':
+            config->upgrade_sessions = 1;
+            break;
+        case 'g':
+            if (strcmp(optarg, "user") == 0) {
+                config->cgroup_scope = CGROUP_SCOPE_USER;
+            } else if (strcmp(optarg, "session") == 0) {
+                config->cgroup_scope = CGROUP_SCOPE_SESSION;
+            } else {
+                fprintf(stderr, "Unknown cgroup scope: %s\n", optarg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'G':
+            config->cgroup_root = optarg;
+            break;
+        case 'L':
+            if (cgroups_parse_limits(optarg, &config->cgroup_limits) == -1) {
+                fprintf(stderr, "Invalid cgroup limits: %s\n", optarg);
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind < argc) {
+        config->port = atoi(argv[optind]);
+        if (config->port <= 0 || config->port > 65535) {
+            fprintf(stderr, "Invalid port number: %s\n", argv[optind]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (config->workers == 0) {
+        const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        config->workers = cores > 0 ? (int)cores : 1;
+    }
+}
+
 /**
  * @brief Sets up the server socket.
  *
  * @param server_fd Pointer to store the server socket file descriptor.
  * @param port Port number to bind the server to.
+ * @param reuse_port Set SO_REUSEPORT so several workers can each bind the port.
  */
-void setup_server(int *server_fd, const int port) {
+void setup_server(int *server_fd, const int port, const int reuse_port) {
     struct sockaddr_in server_address;
     const int yes = 1;
 
-    /* Create a TCP socket */
-    if ((*server_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+    /* Create a TCP socket; shells must not hold it, or a draining worker's port would outlive it */
+    if ((*server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
         perror("socket");
         exit(EXIT_FAILURE);
     }
@@ -121,6 +598,13 @@ void setup_server(int *server_fd, const int port) {
         exit(EXIT_FAILURE);
     }
 
+    /* let the kernel balance connections across every worker bound to the port */
+    if (reuse_port && setsockopt(*server_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+        perror("setsockopt SO_REUSEPORT");
+        close(*server_fd);
+        exit(EXIT_FAILURE);
+    }
+
     /* bind the socket to the port */
     server_address.sin_family = AF_INET;
     server_address.sin_addr.s_addr = INADDR_ANY;
@@ -134,7 +618,7 @@ void setup_server(int *server_fd, const int port) {
     }
 
     /* listening on the socket */
-    if (listen(*server_fd, BACKLOG) == -1) {
+    if (listen(*server_fd, server_config.backlog) == -1) {
         perror("listen");
         close(*server_fd);
         exit(EXIT_FAILURE);
@@ -142,201 +626,612 @@ void setup_server(int *server_fd, const int port) {
 }
 
 /**
- * @brief Handles an individual client connection.
- *
- * @param client_fd The connected client socket file descriptor.
+ * @brief SIGALRM handler: the login took too long; shutting down the socket's read side wakes the blocked read.
  */
-void handle_client(const int client_fd) {
+static void login_timed_out(const int sig) {
+    (void)sig;
+    login_expired = 1;
+    if (login_fd != -1) {
+        shutdown(login_fd, SHUT_RD);
+    }
+}
 
-    if (user_count == 0 && !load_users()) {
-        log_event("Failed to load user credentials.\n");
-        close(client_fd);
+/**
+ * @brief Starts the login timeout of a fork-mode connection.
+ */
+static void login_timer_start(const int client_fd) {
+    if (server_config.login_timeout == 0) {
         return;
     }
+    struct sigaction sa;
+    sa.sa_handler = login_timed_out;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGALRM, &sa, NULL);
+    login_fd = client_fd;
+    alarm(server_config.login_timeout);
+}
+
+/**
+ * @brief Tells a client whose login ran out of time so, and counts it.
+ */
+static void login_timeout_reached(const int client_fd) {
+    log_event("client_fd %d did not log in within %ds.\n", client_fd, server_config.login_timeout);
+    metrics_add(METRIC_TIMEOUTS_LOGIN, 1);
+    send_response(client_fd, CONNECTION_FAILURE, "Login timed out.");
+}
+
+/**
+ * @brief Stops the login timeout once the client has sent all it has to.
+ * @return 0 on success, -1 if the timeout was reached first and the client has been told.
+ */
+static int login_timer_stop(const int client_fd) {
+    alarm(0);
+    login_fd = -1;
+    if (login_expired) {
+        login_timeout_reached(client_fd);
+        return -1;
+    }
+    return 0;
+}
 
+/**
+ * @brief Tells the client about a timeout of its session; an expired session's relay ends once the notice is out.
+ */
+static void session_timed_out(void *owner, const char *notice, const int expired) {
+    const TimeoutTarget *target = owner;
+    if (stream_send_notice(target->stream, target->output, notice) == -1) {
+        log_event("No room for the timeout notice of %s's session.\n", target->username);
+    }
+    if (expired) {
+        log_event("Closing the session of %s: %s\n", target->username, notice);
+    }
+}
 
+/**
+ * @brief Handles an individual client connection.
+ *
+ * @param client_fd The connected client socket file descriptor.
+ * @param admission The connection's claim on the admission limits; the caller releases it.
+ */
+void handle_client(const int client_fd, Admission *admission) {
     Message msg;
     char username[MAX_USERNAME_LENGTH];
     char password[MAX_PASSWORD_LENGTH];
+    int requests = 0;
 
-    // Prompt for username
+    // Prompt for username; requests for frames, compression and scrollback may come first
     send_response(client_fd, RESPONSE_OK, "Username:");
-    if (receive_message(client_fd, &msg) <= 0) {
-        send_response(client_fd, RESPONSE_FAIL, "Disconnected during username input.");
+    login_timer_start(client_fd);
+    while (1) {
+        if (receive_message(client_fd, &msg) <= 0) {
+            if (login_expired) {
+                login_timeout_reached(client_fd);
+            } else {
+                send_response(client_fd, RESPONSE_FAIL, "Disconnected during username input.");
+            }
+            close(client_fd);
+            return;
+        }
+        if (msg.status_code != COMPRESS_REQUEST && msg.status_code != RELAY_FRAMED && msg.status_code != SCROLLBACK_REQUEST) {
+            break;
+        }
+        requests = stream_negotiate(requests, &msg);
+    }
+
+    // A reconnecting client resumes its detached session instead of logging in
+    if (msg.status_code == SESSION_RESUME) {
+        char token[SESSION_TOKEN_LENGTH + 1];
+        read_credential(&msg, token, sizeof(token));
+        if (login_timer_stop(client_fd) == -1) {
+            close(client_fd);
+            return;
+        }
+        if (handoff_client(token, client_fd, requests, NULL, 0) == -1) {
+            log_event("client_fd %d asked to resume an unknown session.\n", client_fd);
+            send_response(client_fd, SESSION_RESUME_FAIL, NULL);
+        }
         close(client_fd);
         return;
     }
-    strncpy(username, msg.content, MAX_USERNAME_LENGTH - 1);
-    username[MAX_USERNAME_LENGTH - 1] = '\0';
-    username[strcspn(username, "\r\n")] = '\0';  // Remove trailing newline or spaces
 
-    // Log received username
-    log_event("Received username: '%s'\n", username);
+    // A pipelined login brings the password and the client's terminal with the username
+    AuthRequest login;
+    const int pipelined = msg.status_code == AUTH_REQUEST;
+    if (pipelined) {
+        if (decode_auth_request(&msg, &login) == -1 ||
+            strlen(login.username) >= sizeof(username) || strlen(login.password) >= sizeof(password)) {
+            log_event("client_fd %d sent a malformed login request.\n", client_fd);
+            send_response(client_fd, AUTH_FAIL, "Malformed login request.");
+            close(client_fd);
+            return;
+        }
+        memcpy(username, login.username, strlen(login.username) + 1);
+        memcpy(password, login.password, strlen(login.password) + 1);
+        log_event("Received login request for '%s' (%hux%hu, TERM '%s')\n", username, login.columns, login.rows, login.term);
+    } else {
+        read_credential(&msg, username, sizeof(username));
+
+        // Log received username
+        log_event("Received username: '%s'\n", username);
+    }
 
-    // Prompt for password
-    send_response(client_fd, RESPONSE_OK, "Password:");
-    if (receive_message(client_fd, &msg) <= 0) {
-        send_response(client_fd, RESPONSE_FAIL, "Disconnected during password input.");
+    const char *refusal = admission_user(username);
+    if (refusal != NULL) {
+        log_event("Refused login for user %s: %s\n", username, refusal);
+        send_response(client_fd, CONNECTION_FAILURE, refusal);
         close(client_fd);
         return;
     }
-    strncpy(password, msg.content, MAX_PASSWORD_LENGTH - 1);
-    password[MAX_PASSWORD_LENGTH - 1] = '\0';
-    password[strcspn(password, "\r\n")] = '\0';  // Remove trailing newline or spaces
 
-    // Log received password
-    log_event("Received password: '%s'\n", password);
+    // Prompt for password
+    if (!pipelined) {
+        send_response(client_fd, RESPONSE_OK, "Password:");
+        if (receive_message(client_fd, &msg) <= 0) {
+            if (login_expired) {
+                login_timeout_reached(client_fd);
+            } else {
+                send_response(client_fd, RESPONSE_FAIL, "Disconnected during password input.");
+            }
+            close(client_fd);
+            return;
+        }
+        read_credential(&msg, password, sizeof(password));
+
+        // Log received password
+        log_event("Received password: '%s'\n", password);
+    }
+    if (login_timer_stop(client_fd) == -1) {
+        close(client_fd);
+        return;
+    }
 
     // Authenticate user
     if (!authenticate_user(username, password)) {
+        admission_login_failed(username);
         send_response(client_fd, AUTH_FAIL, "Authentication failed.");
         log_event("Failed login attempt for user: %s\n", username);
         close(client_fd);
         return;
     }
 
+    /* sent in place of AUTH_SUCCESS: the client gives up as after a failed login */
+    if ((refusal = admission_start_session(admission)) != NULL) {
+        log_event("Refused session for user %s: %s\n", username, refusal);
+        send_response(client_fd, CONNECTION_FAILURE, refusal);
+        close(client_fd);
+        return;
+    }
+
     send_response(client_fd, AUTH_SUCCESS, "Authentication successful.");
     log_event("User %s authenticated successfully.\n", username);
 
-    int master_fd, slave_fd;
-    char slave_name[100];
-    struct termios termp;
-    struct winsize winp;
-
-    tcgetattr(STDIN_FILENO, &termp);
-    ioctl(STDIN_FILENO, TIOCGWINSZ, &winp);
+    int master_fd;
+    pid_t shell_pid;
+    RelayStats stats;
 
-    if (openpty(&master_fd, &slave_fd, slave_name, &termp, &winp) == -1) {
-        perror("openpty");
-        close(client_fd);
-        return;
+    /* attach a pooled shell, or create one, in the session's cgroup when there is one */
+    const int cgroup_fd = cgroup_create(&stats.cgroup, username);
+    const int started = acquire_shell(&master_fd, &shell_pid, cgroup_fd);
+    if (cgroup_fd != -1) {
+        close(cgroup_fd);
     }
-
-    /* create the shell */
-    pid_t shell_pid = fork();
-    if (shell_pid < 0) {
-        perror("fork");
-        log_event("Failed to fork process for client_fd %d: %s\n", client_fd, strerror(errno));
-        close(master_fd);
-        close(slave_fd);
+    if (started == -1) {
+        log_event("Failed to start shell for client_fd %d.\n", client_fd);
+        cgroup_remove(&stats.cgroup);
         close(client_fd);
         return;
     }
+    if (pipelined) {
+        apply_login_terminal(master_fd, &login);
+    }
 
-    if (shell_pid == 0) {
-        /* execute Shell */
-        log_event("Forked grandchild process (PID %d) to execute shell for client_fd %d.\n", getpid(), client_fd);
-        close(master_fd);
+    /* an empty token tells the client this session cannot be resumed */
+    char token[SESSION_TOKEN_LENGTH + 1] = "";
+    if (server_config.detach_grace > 0) {
+        session_token_new(token);
+        takeover_arm(token, client_fd);
+    }
+    send_response(client_fd, SESSION_TOKEN, token);
+
+    /* transmit data between master PTY and client, across reconnects */
+    OutputBacklog output = { 0 };
+    OutputBacklog backlog = { 0 };
+    ClientStream stream = { 0 };
+    int current_fd = client_fd;
+    stream_begin(&stream, client_fd, requests);
+    relay_stats_start(&stats, username);
+    TimeoutTarget timeout_target = { &stream, &output, username };
+    timer_wheel_init(&session_timers);
+    timeouts_start(&stats.timeouts, &session_timers, server_config.idle_timeout, server_config.session_limit,
+                   session_timed_out, &timeout_target);
+
+    /* readable once the shell exits, even if something it left behind keeps the PTY open */
+    const int exit_fd = children_pidfd(shell_pid);
+    while (1) {
+        run_relay(master_fd, exit_fd, current_fd, &stats, &output, &stream);
 
-        /* slave PTY as the controlling terminal */
-        if (setsid() == -1) {
-            perror("setsid");
-            log_event("setsid failed in shell process (PID %d): %s\n", getpid(), strerror(errno));
-            exit(EXIT_FAILURE);
+        /* the relay also ends when the shell exits, which hangs up the PTY, and when a timeout expires */
+        struct pollfd ended[2] = { { .fd = master_fd, .events = 0 }, { .fd = exit_fd, .events = POLLIN } };
+        if (server_config.detach_grace == 0 || stats.timeouts.expired ||
+            (poll(ended, 2, 0) > 0 && ((ended[0].revents & POLLHUP) || (ended[1].revents & POLLIN)))) {
+            break;
         }
 
-        if (ioctl(slave_fd, TIOCSCTTY, NULL) == -1) {
-            perror("ioctl TIOCSCTTY");
-            log_event("ioctl TIOCSCTTY failed in shell process (PID %d): %s\n", getpid(), strerror(errno));
-            exit(EXIT_FAILURE);
+        log_event("Client of session %.8s... disconnected, detaching for %ds.\n", token, server_config.detach_grace);
+        takeover_arm(token, -1);
+        stream_end(&stream, current_fd);
+        close(current_fd);
+
+        /* output the old client never took goes out first on resume, and is kept as scrollback once sent */
+        scrollback_forget(&stats.scrollback, output.length - output.offset);
+        if (backlog_init(&backlog, server_config.detach_backlog) == 0) {
+            const size_t lost = backlog_move(&backlog, &output);
+            if (lost > 0) {
+                log_event("Backlog of session %.8s... full, %zu bytes of output lost.\n", token, lost);
+            }
         }
 
-        /* slave_fd to standard streams */
-        if (dup2(slave_fd, STDIN_FILENO) == -1) {
-            perror("dup2 STDIN");
-            log_event("dup2 STDIN failed in shell process (PID %d): %s\n", getpid(), strerror(errno));
-            exit(EXIT_FAILURE);
+        char pending[HANDOFF_MAX_PENDING];
+        size_t pending_length;
+        current_fd = wait_for_resume(master_fd, token, &backlog, &requests, pending, &pending_length);
+        if (current_fd == -1) {
+            break;
         }
-        if (dup2(slave_fd, STDOUT_FILENO) == -1) {
-            perror("dup2 STDOUT");
-            log_event("dup2 STDOUT failed in shell process (PID %d): %s\n", getpid(), strerror(errno));
-            exit(EXIT_FAILURE);
+
+        /* the resumed socket may arrive non-blocking from an epoll process; the relays expect blocking */
+        fcntl(current_fd, F_SETFL, fcntl(current_fd, F_GETFL) & ~O_NONBLOCK);
+        takeover_arm(token, current_fd);
+        timeouts_input(&stats.timeouts);
+        send_response(current_fd, SESSION_RESUMED, NULL);
+        stream_begin(&stream, current_fd, requests);
+        const size_t replayed = requests & STREAM_SCROLLBACK ? scrollback_replay(&stats.scrollback, &backlog) : 0;
+        log_event("Session %.8s... resumed on client_fd %d with %zu bytes of backlog and %zu of scrollback.\n",
+                  token, current_fd, backlog.length - replayed, replayed);
+        if (backlog.length > replayed) {
+            log_relay(&stats, current_fd, RELAY_TO_CLIENT, backlog.data + replayed, backlog.length - replayed);
         }
-        if (dup2(slave_fd, STDERR_FILENO) == -1) {
-            perror("dup2 STDERR");
-            log_event("dup2 STDERR failed in shell process (PID %d): %s\n", getpid(), strerror(errno));
-            exit(EXIT_FAILURE);
+        if (stream.framed) {
+            /* frames the client sent after its resume message are decoded by the relay */
+            memcpy(stream.input, pending, pending_length);
+            stream.input_length = pending_length;
+            pending_length = 0;
         }
-
-        if (slave_fd > STDERR_FILENO) {
-            close(slave_fd);
+        if (stream_flush(&stream, &backlog, current_fd, 1) == -1 ||
+            (pending_length > 0 && write(master_fd, pending, pending_length) != (ssize_t)pending_length)) {
+            log_event("Failed to resume session %.8s...: %s\n", token, strerror(errno));
         }
+    }
+    log_session_end(&stats, current_fd, token);
+    timeouts_stop(&stats.timeouts);
+    scrollback_free(&stats.scrollback);
+    recorder_close(stats.recorder);
+    backlog_free(&output);
+    backlog_free(&backlog);
 
-        /* set the TERM environment variable */
-        setenv("TERM", "xterm-256color", 1);
-        log_event("Set TERM environment variable to xterm-256color in shell process (PID %d).\n", getpid());
+    // Cleanup
+    close(master_fd);
+    if (exit_fd != -1) {
+        close(exit_fd);
+    }
+    kill(shell_pid, SIGKILL);
+    children_wait(shell_pid);   // a pooled shell is the listener's child, and reaped there
+    cgroup_remove(&stats.cgroup);
+    if (current_fd != -1) {
+        /* the stream ends before the plain message, so the client can read it */
+        stream_finish(&stream, current_fd);
+        stream_end(&stream, current_fd);
+        send_response(current_fd, RESPONSE_OK, "Session ended.");
+        close(current_fd);
+    }
 
-        /* Execute the egg_shell */
-        log_event("Executing custom shell: ../shell/egg_shell in shell process (PID %d).\n", getpid());
-        execl("../shell/egg_shell", "egg_shell", NULL);
+    /* this process ends with the session, so a leaf still emptying is removed now or never */
+    cgroups_sweep(CGROUP_DRAIN_MS);
+}
 
-        perror("execl");
-        log_event("execl failed in shell process (PID %d): %s\n", getpid(), strerror(errno));
-        exit(EXIT_FAILURE);
+/**
+ * @brief Relays with the configured engine, falling back to relay_data() when it is unavailable.
+ *
+ * @param master_fd The PTY master file descriptor.
+ * @param exit_fd Readable once the shell has exited, -1 if there is none.
+ * @param client_fd The client socket file descriptor.
+ * @param stats Traffic totals of the session.
+ * @param output The session's output queue, used by relay_data().
+ * @param stream The connection's relay stream, used by relay_data().
+ */
+void run_relay(const int master_fd, const int exit_fd, const int client_fd, RelayStats *stats, OutputBacklog *output,
+               ClientStream *stream) {
+    /* only the copying relay frames and compresses */
+    if ((stream->framed || stream->compressed) && server_config.relay_engine != RELAY_ENGINE_SELECT) {
+        log_event("client_fd %d relays in frames or compressed, using the select relay.\n", client_fd);
+    } else if (server_config.echo_trace != NULL && server_config.relay_engine != RELAY_ENGINE_SELECT) {
+        /* the echo trace follows the chunk through the queues only the copying relay has */
+        log_event("Echo tracing is on, using the select relay.\n");
+    } else if (stats->timeouts.wheel != NULL && server_config.relay_engine != RELAY_ENGINE_SELECT) {
+        /* the timeouts' wheel runs in the select loop, and their notices go out through its queues */
+        log_event("Session timeouts are on, using the select relay.\n");
+    } else if (server_config.relay_engine == RELAY_ENGINE_URING &&
+               relay_data_uring(master_fd, exit_fd, client_fd, stats) == 0) {
+        return;
+    } else if (server_config.relay_engine == RELAY_ENGINE_SPLICE) {
+        /* splice never sees the payload, so inspecting it needs the copying relay */
+        if (server_config.log_level == LOG_LEVEL_PAYLOAD || server_config.recordings != NULL) {
+            log_event("Payload logging or recording is on, using the select relay instead of splice.\n");
+        } else if (relay_data_splice(master_fd, exit_fd, client_fd, stats) == 0) {
+            return;
+        }
     }
+    relay_data(master_fd, exit_fd, client_fd, stats, output, stream);
+}
 
-    /* parent process */
-    close(slave_fd);
+/**
+ * @brief Acts on a channel request from the client: opens or closes a channel, or widens its window.
+ * @return 0 to carry on, -1 if the answer could not be queued.
+ */
+static int answer_channel_request(ClientStream *stream, Channel *channels, const StreamInput *input, const int client_fd,
+                                  const SessionCgroup *cgroup) {
+    Channel *channel = &channels[input->channel];
+
+    switch (input->request) {
+    case CHANNEL_OPEN:
+        /* channel 0 and open channels are already there; a closing one is reopened once its CHANNEL_CLOSE is out */
+        if (input->channel == 0 || channel->master_fd != -1) {
+            log_event("client_fd %d asked to open channel %d, which is open.\n", client_fd, input->channel);
+            return 0;
+        }
+        if (channel_open(channel, cgroup) == -1) {
+            log_event("Failed to open channel %d for client_fd %d.\n", input->channel, client_fd);
+            return stream_send_channel(stream, CHANNEL_CLOSE, input->channel);
+        }
+        log_event("Opened channel %d for client_fd %d (PID %d).\n", input->channel, client_fd, channel->shell_pid);
+        return stream_send_channel(stream, CHANNEL_OPEN, input->channel);
+    case CHANNEL_CLOSE:
+        if (input->channel == 0 || channel->master_fd == -1) {
+            return 0;
+        }
+        /* the shell is ended at once and the output it still had queued is dropped */
+        channel_close(channel);
+        log_event("client_fd %d closed channel %d.\n", client_fd, input->channel);
+        return stream_send_channel(stream, CHANNEL_CLOSE, input->channel);
+    case CHANNEL_WINDOW:
+        if (channel->master_fd != -1) {
+            channel->window = (SIZE_MAX - channel->window < input->credit) ? SIZE_MAX : channel->window + input->credit;
+        }
+        return 0;
+    default:
+        return 0;
+    }
+}
 
-    /* transmit data between master PTY and client */
-    relay_data(master_fd, client_fd);
+/**
+ * @brief Checks whether the relay takes more client input: the previous chunk of every channel is written
+ *        and the answers to channel requests are not piling up.
+ */
+static int client_input_wanted(const ClientStream *stream, const Channel *channels) {
+    return !channels[0].exited && channels_input_idle(channels) && stream->control_length < sizeof(stream->control) / 2;
+}
 
-    // Cleanup
-    close(master_fd);
-    kill(shell_pid, SIGKILL);
-    waitpid(shell_pid, NULL, 0);
-    send_response(client_fd, RESPONSE_OK, "Session ended.");
-    close(client_fd);
+/**
+ * @brief Decodes a framed client's buffered input while every channel's last input has reached its PTY.
+ *
+ * A channel whose shell stops reading its input holds up the input of the
+ * other channels too; keystrokes are small, so this only shows with pasted
+ * text. Channel requests are answered as they come, and decoding stops
+ * while their answers fill the control frame queue.
+ *
+ * @return 0 to carry on, -1 if the client sent a malformed frame.
+ */
+static int take_client_input(ClientStream *stream, Channel *channels, const int client_fd, RelayStats *stats) {
+    int masters[CHANNEL_MAX];
+    char data[FRAME_MAX_PAYLOAD];
+    StreamInput input;
+
+    while (stream->input_length > 0 && client_input_wanted(stream, channels)) {
+        channels_masters(channels, masters);
+        if (stream_next_input(stream, masters, data, &input) == -1) {
+            log_event("client_fd %d sent a malformed frame.\n", client_fd);
+            return -1;
+        }
+        Channel *channel = &channels[input.channel];
+        if (input.request != RESPONSE_OK) {
+            if (answer_channel_request(stream, channels, &input, client_fd, &stats->cgroup) == -1) {
+                log_event("Too many control frames are waiting for client_fd %d.\n", client_fd);
+            }
+        } else if (input.length == 0) {
+            break;  // the rest of the frame is still to come
+        } else if (channel->master_fd != -1 && !channel->exited) {
+            /* input for a channel that has just closed is dropped */
+            memcpy(channel->input.data, data, input.length);
+            channel->input.length = input.length;
+            channel->input.offset = 0;
+            log_relay(stats, client_fd, RELAY_FROM_CLIENT, data, input.length);
+        }
+    }
+    return 0;
 }
 
 /**
  * @brief Relays data between the PTY master and the client socket.
  *
+ * Both descriptors are non-blocking while relaying. Shell output goes through
+ * the session's bounded output queue and the PTY is only read while the queue
+ * has room, so a slow client makes the shell block on its PTY instead of the
+ * server buffering without limit. Client input is read one chunk at a time,
+ * once the previous chunk has reached the PTY, and keeps flowing while the
+ * client is slow to take output.
+ *
+ * A framed client's input is decoded a frame at a time: control frames are
+ * applied to the PTY as they come, data frames are written like plain input.
+ * Compressed output is deflated as the client takes it and sync-flushed
+ * after a small chunk or once the output pauses, like uncorking.
+ *
+ * A client with channels gets the same for each channel's shell, see
+ * channels.h. The relay ends when channel 0's shell exits, and takes the
+ * other channels with it.
+ *
+ * With echo tracing on, a keystroke is timed from its read to its PTY write,
+ * to the first output read back and to that output leaving in full.
+ *
+ * With idle or session length timeouts on, select() also wakes for the
+ * session's timer wheel, and an expired timeout ends the relay like the
+ * shell exiting, once its notice has gone out.
+ *
+ * The shell's exit is seen on exit_fd as well as on the PTY: once it fires,
+ * the PTY is read until it is empty, and the relay ends with that output
+ * even if something the shell left running still holds the PTY open.
+ *
  * @param master_fd The PTY master file descriptor.
+ * @param exit_fd Readable once the shell has exited, -1 to rely on the PTY hanging up.
  * @param client_fd The client socket file descriptor.
+ * @param stats Traffic totals of the session.
+ * @param output The session's output queue; what the client has not taken is left in it.
+ * @param stream The connection's relay stream, which frames and compresses as negotiated.
  */
-void relay_data(const int master_fd, const int client_fd) {
-    fd_set read_fds;
-    const int max_fd = (master_fd > client_fd) ? master_fd : client_fd;
-    char buffer[BUFFER_SIZE];
-    int nbytes;
+void relay_data(const int master_fd, const int exit_fd, const int client_fd, RelayStats *stats, OutputBacklog *output,
+                ClientStream *stream) {
+    fd_set read_fds, write_fds;
+    Channel channels[CHANNEL_MAX];
+    Channel *const shell = &channels[0];
+    int shell_gone = 0;     // exit_fd fired; what the PTY still holds is the shell's last output
+    int turn = 0;
+    ssize_t nbytes;
+    OutputCork cork;
+
+    if (backlog_init(output, server_config.output_queue) == -1) {
+        log_event("Failed to allocate the output queue for client_fd %d.\n", client_fd);
+        return;
+    }
+    const int master_flags = fcntl(master_fd, F_GETFL);
+    const int client_flags = fcntl(client_fd, F_GETFL);
+    fcntl(master_fd, F_SETFL, master_flags | O_NONBLOCK);
+    fcntl(client_fd, F_SETFL, client_flags | O_NONBLOCK);
+
+    channels_init(channels, master_fd, output, stream->channels);
+    output_cork_init(&cork, client_fd);
+    while (!shell->exited || output->length > 0 || stream_pending(stream)) {
+        int bulk = 0;
+        int max_fd = client_fd;
+
+        /* a framed client's next data frame may already be buffered */
+        if (stream->framed && take_client_input(stream, channels, client_fd, stats) == -1) {
+            break;
+        }
 
-    while (1) {
-        FD_ZERO(&read_fds);
-        FD_SET(master_fd, &read_fds);
-        FD_SET(client_fd, &read_fds);
+        /* a channel whose shell exited closes once its last output is out */
+        for (int i = 1; i < CHANNEL_MAX; i++) {
+            if (channels[i].exited && channels[i].output->length == 0 &&
+                stream_send_channel(stream, CHANNEL_CLOSE, i) == 0) {
+                channel_close(&channels[i]);
+            }
+        }
 
-        if (select(max_fd + 1, &read_fds, NULL, NULL, NULL) == -1) {
+        const int unsent = channels_unsent(channels) || stream_pending(stream);
+        FD_ZERO(&read_fds);
+        FD_ZERO(&write_fds);
+        for (int i = 0; i < CHANNEL_MAX; i++) {
+            if (channel_readable(&channels[i])) FD_SET(channels[i].master_fd, &read_fds);
+            if (channels[i].input.length > 0) FD_SET(channels[i].master_fd, &write_fds);
+            if (channels[i].master_fd > max_fd) max_fd = channels[i].master_fd;
+        }
+        if (client_input_wanted(stream, channels)) FD_SET(client_fd, &read_fds);
+        if (unsent) FD_SET(client_fd, &write_fds);
+        if (exit_fd != -1 && !shell_gone) {
+            FD_SET(exit_fd, &read_fds);
+            if (exit_fd > max_fd) max_fd = exit_fd;
+        }
+        const int exec_fd = shell_exec_pending() ? shell_exec_fd() : -1;
+        if (exec_fd != -1) {
+            FD_SET(exec_fd, &read_fds);
+            if (exec_fd > max_fd) max_fd = exec_fd;
+        }
+        const int emptying = shell_gone && channel_readable(shell);
+
+        /* while corked or holding back compressed output, only poll: nothing ready means the burst is over */
+        struct timeval no_wait = { 0, 0 };
+        struct timeval until_timer;
+        struct timeval *wait = NULL;
+        const int bursting = cork.corked || (stream->unflushed && !unsent);
+        const int timer_ms = stats->timeouts.wheel != NULL ? timer_wheel_timeout(stats->timeouts.wheel) : -1;
+        if (bursting || emptying) {
+            wait = &no_wait;
+        } else if (timer_ms >= 0) {
+            until_timer.tv_sec = timer_ms / 1000;
+            until_timer.tv_usec = (timer_ms % 1000) * 1000;
+            wait = &until_timer;
+        }
+        const int ready = select(max_fd + 1, &read_fds, &write_fds, NULL, wait);
+        if (ready == -1) {
+            if (errno == EINTR) continue;   // SIGUSR1 from a resume, see takeover_arm()
             perror("select");
             log_event("select() failed: %s\n", strerror(errno));
             break;
         }
 
-        // data from server to client
-        if (FD_ISSET(master_fd, &read_fds)) {
-            nbytes = read(master_fd, buffer, sizeof(buffer));
-            if (nbytes < 0) {
-                perror("read from master_fd");
-                log_event("Failed to read from master_fd %d: %s\n", master_fd, strerror(errno));
+        /* a timeout's notice is queued like output; once one expires the relay ends when the output is out */
+        if (stats->timeouts.wheel != NULL && timer_wheel_run(stats->timeouts.wheel) > 0 && stats->timeouts.expired) {
+            shell->exited = 1;
+            shell->input.length = 0;
+        }
+        if (exit_fd != -1 && !shell_gone && FD_ISSET(exit_fd, &read_fds)) {
+            shell_gone = 1;
+        }
+        if (exec_fd != -1 && FD_ISSET(exec_fd, &read_fds)) {
+            shell_exec_collect();
+        }
+        if (ready == 0 && !emptying) {
+            const int flushed = channels_flush(stream, channels, &turn, client_fd, 1);
+            if (flushed == -1) {
+                log_event("Failed to write to client_fd %d: %s\n", client_fd, strerror(errno));
                 break;
             }
-            if (nbytes == 0) {
-                log_event("master_fd %d closed the connection.\n", master_fd);
-                break;
+            if (flushed == 1) {
+                trace_echo_sent(stats);
             }
-            if (write(client_fd, buffer, nbytes) != nbytes) {
+            output_uncork(&cork);
+            continue;
+        }
+
+        // data from server to client, queued first
+        for (int i = 0; i < CHANNEL_MAX; i++) {
+            Channel *channel = &channels[i];
+            if (channel->master_fd == -1 ||
+                !(FD_ISSET(channel->master_fd, &read_fds) || (channel == shell && emptying))) {
+                continue;
+            }
+            nbytes = channel_read(channel);
+            if (nbytes > 0) {
+                log_relay(stats, client_fd, RELAY_TO_CLIENT, channel->output->data + channel->output->length - nbytes, nbytes);
+                output_cork_chunk(&cork, nbytes);
+                bulk |= nbytes >= server_config.cork_threshold;
+                FD_SET(client_fd, &write_fds);  // the socket usually takes it at once
+            } else if (nbytes == 0 || errno != EAGAIN || (channel == shell && shell_gone)) {
+                /* EIO once the shell has exited, or nothing left after it; its last output still goes out */
+                if (nbytes == 0) {
+                    log_event("master_fd %d closed the connection.\n", channel->master_fd);
+                } else {
+                    log_event("Failed to read from master_fd %d: %s\n", channel->master_fd, strerror(errno));
+                }
+                channel->exited = 1;
+                channel->input.length = 0;
+            }
+        }
+
+        if (FD_ISSET(client_fd, &write_fds)) {
+            const int flushed = channels_flush(stream, channels, &turn, client_fd, !bulk);
+            if (flushed == -1) {
                 perror("write to client_fd");
                 log_event("Failed to write to client_fd %d: %s\n", client_fd, strerror(errno));
                 break;
             }
-            buffer[nbytes] = '\0';
-            log_event("Sent to client_fd %d: %s\n", client_fd, buffer);
+            if (flushed == 1) {
+                trace_echo_sent(stats);
+            }
         }
 
         // Data from client to server
         if (FD_ISSET(client_fd, &read_fds)) {
-            nbytes = read(client_fd, buffer, sizeof(buffer));
-            if (nbytes < 0) {
+            nbytes = stream_read_input(stream, client_fd, shell->input.data);
+            if (nbytes < 0 && errno != EAGAIN && errno != EINTR) {
                 perror("read from client_fd");
                 log_event("Failed to read from client_fd %d: %s\n", client_fd, strerror(errno));
                 break;
@@ -345,25 +1240,45 @@ void relay_data(const int master_fd, const int client_fd) {
                 log_event("client_fd %d closed the connection.\n", client_fd);
                 break;
             }
-            if (write(master_fd, buffer, nbytes) != nbytes) {
-                perror("write to master_fd");
-                log_event("Failed to write to master_fd %d: %s\n", master_fd, strerror(errno));
-                break;
+            if (nbytes > 0 && stream->framed) {
+                stream->input_length += nbytes;
+                if (take_client_input(stream, channels, client_fd, stats) == -1) {
+                    break;
+                }
+            } else if (nbytes > 0) {
+                shell->input.length = nbytes;
+                shell->input.offset = 0;
+                log_relay(stats, client_fd, RELAY_FROM_CLIENT, shell->input.data, nbytes);
+            }
+        }
+
+        /* fresh input is written at once: the PTY almost always takes it */
+        for (int i = 0; i < CHANNEL_MAX; i++) {
+            Channel *channel = &channels[i];
+            if (channel->input.length == 0) {
+                continue;
             }
-            buffer[nbytes] = '\0';
-            log_event("Received from client_fd %d: %s\n", client_fd, buffer);
+            const int written = flush_pending(channel->master_fd, &channel->input);
+            if (written == 1) {
+                trace_echo_written(stats);
+            }
+            if (written != -1) {
+                continue;
+            }
+            perror("write to master_fd");
+            log_event("Failed to write to master_fd %d: %s\n", channel->master_fd, strerror(errno));
+            channel->exited = 1;
+            channel->input.length = 0;
         }
     }
-}
+    output_uncork(&cork);
 
-/**
- * @brief Signal handler to reap zombie child processes.
- *
- * @param sig The signal number.
- */
-void reap_zombie_processes(const int sig) {
-    (void)sig;
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+    /* the other channels end with the connection */
+    for (int i = 1; i < CHANNEL_MAX; i++) {
+        channel_close(&channels[i]);
+    }
+    fcntl(master_fd, F_SETFL, master_flags);
+    fcntl(client_fd, F_SETFL, client_flags);
 }
 
 /**
@@ -372,15 +1287,6 @@ void reap_zombie_processes(const int sig) {
 void setup_signal_handlers() {
     struct sigaction sa;
 
-    /* zombie child process cleanup */
-    sa.sa_handler = reap_zombie_processes;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-        perror("sigaction SIGCHLD");
-        exit(EXIT_FAILURE);
-    }
-
     /* ignoring SIGPIPE to stop server from dying when accidentally writing to a closed socket */
     sa.sa_handler = SIG_IGN;
     sigemptyset(&sa.sa_mask);
@@ -394,94 +1300,252 @@ void setup_signal_handlers() {
 /**
  * @brief Logs events to both stdout and server.log with timestamps.
  *
+ * The record is formatted here and queued for the logger's writer thread,
+ * so the caller never waits on the log file.
+ *
  * @param format The format string (printf-style).
  * @param ... accepts any number of arguments to be formatted, stored in va_list args.
  */
 void log_event(const char *format, ...) {
     va_list args;
+    char log_message[LOG_RECORD_SIZE];
+
+    int length = snprintf(log_message, sizeof(log_message), "[%s] ", logger_timestamp());
+
     va_start(args, format);
+    const int formatted = vsnprintf(log_message + length, sizeof(log_message) - length, format, args);
+    va_end(args);
 
-    // current time
-    const time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    if (tm_info == NULL) {
-        perror("localtime");
-        va_end(args);
+    if (formatted < 0) {
         return;
     }
-
-    char time_buffer[26];
-    if (strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d %H:%M:%S", tm_info) == 0) {
-        fprintf(stderr, "strftime returned 0");
-        va_end(args);
-        return;
+    length += formatted;
+    if ((size_t)length >= sizeof(log_message)) {
+        length = sizeof(log_message) - 1;
     }
 
-    char log_message[1024];
-    snprintf(log_message, sizeof(log_message), "[%s] ", time_buffer);
-    vsnprintf(log_message + strlen(log_message), sizeof(log_message) - strlen(log_message), format, args);
+    logger_append(log_message, length);
+}
 
-    va_end(args);
+/**
+ * @brief Starts the traffic totals of a session that has just begun relaying.
+ *
+ * @param stats The totals to reset.
+ * @param username Who logged in, which names the recording.
+ */
+void relay_stats_start(RelayStats *stats, const char *username) {
+    clock_gettime(CLOCK_MONOTONIC, &stats->started);
+    stats->bytes_to_client = 0;
+    stats->bytes_from_client = 0;
+    echo_trace_start(&stats->echo, server_config.echo_trace != NULL);
+    scrollback_start(&stats->scrollback);
+    stats->recorder = server_config.recordings != NULL ? recorder_open(server_config.recordings, username) : NULL;
+    stats->timeouts.wheel = NULL;
+    metrics_add(METRIC_SESSIONS_STARTED, 1);
+}
 
-    printf("%s", log_message);
-    fflush(stdout);
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
 
-    const int log_fd = open("server.log", O_WRONLY | O_CREAT | O_APPEND, 0644);
-    if (log_fd == -1) {
-        perror("open log file");
-        return;
+/**
+ * @brief Accounts for one relayed chunk and logs it as the log level asks.
+ *
+ * At the default level this only adds to the totals, output to the
+ * scrollback, and both ways to the recording. data may be NULL when the
+ * relay never saw the bytes (splice), which is only allowed below
+ * LOG_LEVEL_PAYLOAD and without recording.
+ *
+ * @param stats Totals of the session.
+ * @param client_fd The session's client socket.
+ * @param direction Which way the chunk went.
+ * @param data The relayed bytes.
+ * @param length Number of relayed bytes.
+ */
+void log_relay(RelayStats *stats, const int client_fd, const RelayDirection direction, const char *data, const size_t length) {
+    if (direction == RELAY_TO_CLIENT) {
+        stats->bytes_to_client += length;
+        echo_trace_answered(&stats->echo);
+        if (data != NULL) {
+            scrollback_append(&stats->scrollback, data, length);
+        }
+    } else {
+        stats->bytes_from_client += length;
+        echo_trace_input(&stats->echo);
+        timeouts_input(&stats->timeouts);
+    }
+    if (data != NULL) {
+        recorder_frame(stats->recorder, direction == RELAY_TO_CLIENT ? RECORDING_OUTPUT : RECORDING_INPUT, data, length);
     }
+    metrics_add(direction == RELAY_TO_CLIENT ? METRIC_BYTES_TO_CLIENT : METRIC_BYTES_FROM_CLIENT, length);
+    metrics_observe(METRIC_CHUNK_SIZE, length);
+
+    if (server_config.log_level == LOG_LEVEL_META) {
+        log_event("client_fd %d: %zu bytes %s at +%.6fs\n", client_fd, length,
+                  direction == RELAY_TO_CLIENT ? "to client" : "from client", seconds_since(&stats->started));
+    } else if (server_config.log_level == LOG_LEVEL_PAYLOAD && data != NULL) {
+        struct timespec now;
+        unsigned char header[BINLOG_HEADER_SIZE];
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        BinlogRecord record;
+        record.time_us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+        record.pid = (uint32_t)getpid();
+        record.fd = client_fd;
+        record.direction = direction == RELAY_TO_CLIENT ? BINLOG_TO_CLIENT : BINLOG_FROM_CLIENT;
+
+        /* a record holds BUFFER_SIZE bytes, so a replayed backlog goes in as several */
+        size_t offset = 0;
+        do {
+            const size_t part = length - offset < BUFFER_SIZE ? length - offset : BUFFER_SIZE;
+            record.payload_length = (uint32_t)part;
+            binlog_encode_header(&record, header);
+            logger_write(payload_log, header, sizeof(header), data + offset, part);
+            offset += part;
+        } while (offset < length);
+    }
+}
 
-    if (flock(log_fd, LOCK_EX) == -1) {
-        perror("flock");
-        close(log_fd);
-        return;
+/**
+ * @brief Marks client input as written to the PTY in full, for the echo trace.
+ *
+ * @param stats Totals of the session.
+ */
+void trace_echo_written(RelayStats *stats) {
+    echo_trace_forwarded(&stats->echo);
+}
+
+/**
+ * @brief Marks the output queue as written to the client in full; completes an echo being traced.
+ *
+ * @param stats Totals of the session.
+ */
+void trace_echo_sent(RelayStats *stats) {
+    uint64_t stages[ECHO_STAGES];
+    if (echo_trace_delivered(&stats->echo, stages)) {
+        metrics_observe(METRIC_ECHO_INBOUND, stages[ECHO_STAGE_INBOUND]);
+        metrics_observe(METRIC_ECHO_SHELL, stages[ECHO_STAGE_TURNAROUND]);
+        metrics_observe(METRIC_ECHO_OUTBOUND, stages[ECHO_STAGE_OUTBOUND]);
+        metrics_observe(METRIC_ECHO_SERVER, stages[ECHO_STAGE_TOTAL]);
     }
+}
 
-    const ssize_t bytes_written = write(log_fd, log_message, strlen(log_message));
-    if (bytes_written == -1) {
-        perror("write to log file");
+/**
+ * @brief Logs the duration and traffic totals of a finished session, and exports its echo trace.
+ *
+ * @param stats Totals of the session.
+ * @param client_fd The session's client socket.
+ * @param token The session's token, empty if it had none; its start names the session in the trace.
+ */
+void log_session_end(const RelayStats *stats, const int client_fd, const char *token) {
+    metrics_add(METRIC_SESSIONS_ENDED, 1);
+    metrics_observe(METRIC_SESSION_LIFETIME, (uint64_t)(seconds_since(&stats->started) * 1e9));
+    log_event("Session for client_fd %d ended after %.1fs: %llu bytes to client, %llu bytes from client.\n",
+              client_fd, seconds_since(&stats->started), stats->bytes_to_client, stats->bytes_from_client);
+
+    CgroupUsage usage;
+    if (cgroup_usage(&stats->cgroup, &usage) == 0) {
+        char memory[48] = "memory not accounted";
+        if (usage.memory_peak > 0) {
+            snprintf(memory, sizeof(memory), "%.1f MiB of memory at peak", (double)usage.memory_peak / (1 << 20));
+        }
+        log_event("Shells of client_fd %d used %.3fs CPU and %s in cgroup %s.\n", client_fd,
+                  (double)usage.cpu_usec / 1e6, memory, stats->cgroup.name);
     }
 
-    if (flock(log_fd, LOCK_UN) == -1) {
-        perror("flock unlock");
+    if (stats->echo.enabled) {
+        const EchoTrace *echo = &stats->echo;
+        log_event("Echoes of client_fd %d: %llu traced, %llu unanswered; p50/p99 in us: queued %llu/%llu, shell %llu/%llu, "
+                  "sending %llu/%llu, server %llu/%llu.\n", client_fd,
+                  (unsigned long long)echo->echoes, (unsigned long long)echo->unanswered,
+                  (unsigned long long)echo_trace_percentile(echo, ECHO_STAGE_INBOUND, 0.5),
+                  (unsigned long long)echo_trace_percentile(echo, ECHO_STAGE_INBOUND, 0.99),
+                  (unsigned long long)echo_trace_percentile(echo, ECHO_STAGE_TURNAROUND, 0.5),
+                  (unsigned long long)echo_trace_percentile(echo, ECHO_STAGE_TURNAROUND, 0.99),
+                  (unsigned long long)echo_trace_percentile(echo, ECHO_STAGE_OUTBOUND, 0.5),
+                  (unsigned long long)echo_trace_percentile(echo, ECHO_STAGE_OUTBOUND, 0.99),
+                  (unsigned long long)echo_trace_percentile(echo, ECHO_STAGE_TOTAL, 0.5),
+                  (unsigned long long)echo_trace_percentile(echo, ECHO_STAGE_TOTAL, 0.99));
+        if (echo_trace_export(echo, server_config.echo_trace, "server", token) == -1) {
+            log_event("Failed to write the echo trace of client_fd %d to %s.\n", client_fd, server_config.echo_trace);
+        }
     }
-    close(log_fd);
 }
 
-// Load users from file
+/**
+ * @brief Loads the users file named in the configuration.
+ *
+ * @return 1 on success, 0 if the file could not be loaded.
+ */
 int load_users() {
-    FILE *file = fopen(USER_FILE, "r");
-    if (!file) {
-        perror("Could not open user file");
+    const int count = users_load(server_config.users_file);
+    if (count < 0) {
         return 0;
     }
+    log_event("Loaded %d users from %s.\n", count, server_config.users_file);
+    return 1;
+}
+
+/**
+ * @brief Reloads the users file after the watch reports a change.
+ *
+ * A file that fails to load leaves the previous users in place.
+ *
+ * @param watch_fd Descriptor returned by users_watch().
+ */
+void reload_users(const int watch_fd) {
+    const int count = users_handle_change(watch_fd);
+    if (count > 0) {
+        log_event("Reloaded %d users from %s.\n", count, server_config.users_file);
+    } else if (count < 0) {
+        log_event("Failed to reload %s, keeping %u users.\n", server_config.users_file, users_count());
+    }
+}
 
-    while (fscanf(file, "%49[^:]:%49s\n", users[user_count].username, users[user_count].password) == 2) {
-        user_count++;
-        if (user_count >= MAX_USERS) {
-            fprintf(stderr, "Max user limit reached in user file.\n");
-            break;
-        }
+/**
+ * @brief Gives a shell the terminal size a pipelined login came with, before the client sees its first prompt.
+ *
+ * The shell keeps the TERM it was started with: a pooled shell was started
+ * before anyone logged in, so the client's TERM is only logged.
+ */
+void apply_login_terminal(const int master_fd, const AuthRequest *login) {
+    if (login->rows == 0 || login->columns == 0) {
+        return;
+    }
+    /* as for a WINDOW_SIZE frame, the kernel sends SIGWINCH to the shell's foreground job */
+    struct winsize size = { .ws_row = login->rows, .ws_col = login->columns };
+    if (ioctl(master_fd, TIOCSWINSZ, &size) == -1) {
+        log_event("Failed to resize the PTY of master_fd %d: %s\n", master_fd, strerror(errno));
     }
-    fclose(file);
-    return 1;
+}
+
+/**
+ * @brief Copies a username or password out of a handshake message.
+ *
+ * @param msg The received message.
+ * @param out Destination buffer.
+ * @param out_size Size of the destination buffer.
+ */
+void read_credential(const Message *msg, char *out, const size_t out_size) {
+    const size_t length = strnlen(msg->content, out_size - 1);
+    memcpy(out, msg->content, length);
+    out[length] = '\0';
+    out[strcspn(out, "\r\n")] = '\0';  // Remove trailing newline or spaces
 }
 
 // Authenticate user
 int authenticate_user(const char *username, const char *password) {
-    for (int i = 0; i < user_count; i++) {
-        if (strcmp(users[i].username, username) == 0 &&
-            strcmp(users[i].password, password) == 0) {
-            return 1;  // Match found
-            }
-    }
-    return 0;  // No match
+    const int ok = users_authenticate(username, password);
+    metrics_add(ok ? METRIC_AUTH_SUCCESS : METRIC_AUTH_FAILURE, 1);
+    return ok;
 }
 
 void send_response(int client_fd, ResponseCode response_code, const char *message) {
     Message msg;
     msg.status_code = response_code;
+    msg.control_code = ESCAPE_CODE_NONE;
 
     // Set default messages based on response code if no custom message is provided
     const char *default_msg;
@@ -494,6 +1558,8 @@ void send_response(int client_fd, ResponseCode response_code, const char *messag
     case COMMAND_FAIL: default_msg = "Command execution failed.\n"; break;
     case RESPONSE_OK: default_msg = "Operation completed successfully.\n"; break;
     case RESPONSE_FAIL: default_msg = "Operation failed.\n"; break;
+    case SESSION_RESUMED: default_msg = "Session resumed.\n"; break;
+    case SESSION_RESUME_FAIL: default_msg = "No session to resume.\n"; break;
     default: default_msg = "Unknown response code.\n"; break;
     }
 
@@ -506,6 +1572,7 @@ void send_response(int client_fd, ResponseCode response_code, const char *messag
     if (send_message(client_fd, &msg) < 0) {
         log_event("Failed to send response to client_fd %d\n", client_fd);
     } else {
-        log_event("Sent to client_fd %d: %s", client_fd, msg.content);
+        /* a session token is as good as a password, keep it out of the log */
+        log_event("Sent to client_fd %d: %s", client_fd, response_code == SESSION_TOKEN ? "(session token)\n" : msg.content);
     }
 }
\ No newline at end of file
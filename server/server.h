@@ -14,26 +14,133 @@
 #define SERVER_H
 
 #include "../protocol.h"
+#include "../echo_trace.h"
+#include "detach.h"
+#include "scrollback.h"
+#include "recorder.h"
+#include "timeouts.h"
+#include "client_stream.h"
+#include "admission.h"
+#include "cgroups.h"
+
+#include <time.h>
 
 /* Constants */
 #define DEFAULT_PORT 40210
-#define BACKLOG 10          // Number of pending connections queue will hold
+#define BACKLOG 128         // Default number of pending connections queue will hold
 #define BUFFER_SIZE 4096    // Buffer size for data relay
+#define OUTPUT_QUEUE 65536  // Default bytes of shell output queued per session for a slow client
+#define MAX_USERNAME_LENGTH 50
+#define MAX_PASSWORD_LENGTH 50
+#define SHELL_PATH "../shell/egg_shell"
 
 #define RESET           "\033[0m"
 #define LIGHT_GREEN     "\033[38;5;118m"
 #define RED             "\033[31m"
 
 
+/* How accepted connections are served */
+typedef enum {
+    SERVER_MODE_FORK,   // one relay process per connection (original behaviour)
+    SERVER_MODE_EPOLL,  // a single process multiplexes every session with epoll
+    SERVER_MODE_WORKERS,// pre-forked epoll workers sharing the port with SO_REUSEPORT
+} ServerMode;
+
+/* How a per-connection relay process moves bytes between the PTY and the client */
+typedef enum {
+    RELAY_ENGINE_SELECT,    // select() then read()/write() per chunk
+    RELAY_ENGINE_URING,     // io_uring with batched submissions, falls back to select
+    RELAY_ENGINE_SPLICE,    // zero-copy splice() through a pipe, unavailable at LOG_LEVEL_PAYLOAD
+} RelayEngine;
+
+/* TCP options applied to client sockets */
+typedef enum {
+    SOCKET_PROFILE_KERNEL,  // leave the kernel defaults, Nagle included
+    SOCKET_PROFILE_NODELAY, // TCP_NODELAY so keystrokes and echoes leave at once
+    SOCKET_PROFILE_CORK,    // TCP_NODELAY, and bulk output corked into full segments (default)
+} SocketProfile;
+
+/* How much of the relayed traffic is logged */
+typedef enum {
+    LOG_LEVEL_EVENTS,   // connections, logins and session ends only (default)
+    LOG_LEVEL_META,     // plus a line per relayed chunk with its size and time
+    LOG_LEVEL_PAYLOAD,  // plus every relayed chunk as a binary record in BINLOG_FILE
+} LogLevel;
+
+/* Direction of a relayed chunk */
+typedef enum {
+    RELAY_TO_CLIENT,    // PTY output going to the client
+    RELAY_FROM_CLIENT,  // client input going to the PTY
+} RelayDirection;
+
+/* Per-session traffic totals, kept at every log level */
+typedef struct {
+    struct timespec started;
+    unsigned long long bytes_to_client;
+    unsigned long long bytes_from_client;
+    EchoTrace echo;     // keystroke-to-echo latency, when tracing
+    Scrollback scrollback;  // the latest output to the client, replayed to a client that resumes and asks
+    Recorder *recorder;     // the session's recording, NULL when not recording
+    SessionTimeouts timeouts;   // idle and session length timeouts, started by the serving loop
+    SessionCgroup cgroup;       // the cgroup the session's shells run in, created before the first of them
+} RelayStats;
+
+/* Runtime configuration, filled in from the command line */
+typedef struct {
+    int port;
+    ServerMode mode;
+    int backlog;        // listen() backlog
+    int workers;        // worker processes in SERVER_MODE_WORKERS, one per core by default
+    RelayEngine relay_engine;   // relay used by SERVER_MODE_FORK connections
+    LogLevel log_level;
+    const char *users_file;     // users file or compiled database, reloaded when it changes
+    const char *metrics_address;// port or Unix socket for the metrics endpoint, NULL for none
+    int shell_pool;             // shells kept started ahead of logins, per serving process
+    int detach_grace;           // seconds a disconnected session can be resumed, 0 disables
+    int detach_backlog;         // bytes of output kept for a detached session
+    SocketProfile socket_profile;
+    int cork_threshold;         // PTY chunks of at least this many bytes are corked as bulk output
+    int output_queue;           // bytes of shell output queued per session before the PTY is left unread
+    int compression;            // compress the output of clients that ask for it
+    int max_sessions;           // sessions with a shell, detached ones included; 0 for no cap
+    int max_preauth;            // connections not logged in yet; 0 for no cap
+    RateLimit source_limit;     // connections per second from one address
+    RateLimit user_limit;       // failed logins per second for one username
+    const char *echo_trace;     // file each session's echo latency histograms are appended to, NULL when not tracing
+    int scrollback;             // bytes of recent output kept per session, 0 for none
+    size_t scrollback_budget;   // bytes of scrollback kept by the whole server
+    const char *recordings;     // directory each session is recorded into, NULL when not recording
+    int login_timeout;          // seconds a connection has to log in, 0 for no limit
+    int idle_timeout;           // seconds a session can go without input, 0 for no limit
+    int session_limit;          // seconds a session can last, 0 for no limit
+    int upgrade_sessions;       // an upgrade passes the epoll server's live sessions to the new server too
+    CgroupScope cgroup_scope;   // whether shells are confined per session or per user
+    const char *cgroup_root;    // cgroup v2 directory their groups are created in
+    CgroupLimits cgroup_limits; // limits of each group
+} ServerConfig;
+
+extern ServerConfig server_config;
+
 /* Function Declarations */
-void setup_server(int *server_fd, const int port);
-void handle_client(const int client_fd);
-void relay_data(const int master_fd, const int client_fd);
-void reap_zombie_processes(const int sig);
+void parse_arguments(int argc, char *argv[], ServerConfig *config);
+void setup_server(int *server_fd, const int port, const int reuse_port);
+void handle_client(const int client_fd, Admission *admission);
+void run_relay(const int master_fd, const int exit_fd, const int client_fd, RelayStats *stats, OutputBacklog *output,
+               ClientStream *stream);
+void relay_data(const int master_fd, const int exit_fd, const int client_fd, RelayStats *stats, OutputBacklog *output,
+                ClientStream *stream);
 void setup_signal_handlers();
 void log_event(const char *format, ...);
+void relay_stats_start(RelayStats *stats, const char *username);
+void log_relay(RelayStats *stats, int client_fd, RelayDirection direction, const char *data, size_t length);
+void trace_echo_written(RelayStats *stats);
+void trace_echo_sent(RelayStats *stats);
+void log_session_end(const RelayStats *stats, int client_fd, const char *token);
 int load_users();
+void reload_users(int watch_fd);
 int authenticate_user(const char *username, const char *password);
+void read_credential(const Message *msg, char *out, size_t out_size);
+void apply_login_terminal(int master_fd, const AuthRequest *login);
 void send_response(int client_fd, ResponseCode response_code, const char *message);
 
 #endif //SERVER_H
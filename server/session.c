@@ -0,0 +1,300 @@
+/**
+ * @file session.c
+ * @brief Session lifecycle and shell spawning
+ *
+ * This file contains the pieces of a client session that do not depend on
+ * how the server multiplexes its connections.
+ */
+
+#define _GNU_SOURCE     // pipe2
+
+#include "session.h"
+#include "server.h"
+#include "metrics.h"
+#include "children.h"
+
+#include <pty.h>
+#include <termios.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+
+/* A shell on its way to exec: its pipe reaches EOF once the exec has closed it */
+typedef struct PendingExec {
+    int fd;
+    pid_t pid;
+    uint64_t forked;            // metrics_now() right after the fork
+    struct PendingExec *next;
+} PendingExec;
+
+/* What a shell process that failed before its exec writes to the exec pipe */
+typedef struct {
+    int error;                  // errno of the failed step
+    char step[28];
+} ExecFailure;
+
+static int exec_fd = -1;
+static pid_t exec_owner = 0;    // the process exec_fd was created for
+static PendingExec *pending_execs = NULL;
+
+Session *session_create(const int client_fd) {
+    Session *session = calloc(1, sizeof(Session));
+    if (session == NULL) {
+        return NULL;
+    }
+
+    session->client_fd = client_fd;
+    output_cork_init(&session->cork, client_fd);
+    session->master_fd = -1;
+    session->shell_pid = -1;
+    session->shell_pidfd = -1;
+    session->state = SESSION_AUTH_USERNAME;
+    session->client_source.kind = EVENT_CLIENT;
+    session->client_source.session = session;
+    session->pty_source.kind = EVENT_PTY;
+    session->pty_source.session = session;
+    return session;
+}
+
+void session_destroy(Session *session) {
+    if (session->shell_pid > 0) {
+        children_disown(session->shell_pid);
+        children_signal(session->shell_pid, session->shell_pidfd, SIGKILL);  // a child is reaped with the others
+    }
+    if (session->shell_pidfd != -1) {
+        close(session->shell_pidfd);
+    }
+    cgroup_remove(&session->stats.cgroup);
+    if (session->master_fd != -1) {
+        close(session->master_fd);
+    }
+    stream_end(&session->stream, session->client_fd);
+    if (session->client_fd != -1) {
+        close(session->client_fd);
+    }
+    backlog_free(&session->to_client);
+    backlog_free(&session->backlog);
+    scrollback_free(&session->stats.scrollback);
+    recorder_close(session->stats.recorder);
+    admission_release(&session->admission);
+    free(session);
+}
+
+/**
+ * @brief Ends a shell process whose way to its exec failed, with async-signal-safe calls only.
+ *
+ * The server has threads, and a child from a raw clone3() ran no fork
+ * handlers, so the child cannot log or use stdio. The failed step goes to
+ * stderr, and with errno to the parent through the exec pipe, which logs it.
+ *
+ * @param exec_pipe_fd The exec pipe's write end, -1 if there is none.
+ * @param step The call that failed.
+ */
+static void shell_failed(const int exec_pipe_fd, const char *step) {
+    static const char suffix[] = " failed in the shell process\n";
+    ExecFailure failure = { .error = errno };
+    size_t length = 0;
+    ssize_t ignored;
+
+    while (step[length] != '\0' && length < sizeof(failure.step) - 1) {
+        failure.step[length] = step[length];
+        length++;
+    }
+    failure.step[length] = '\0';
+    ignored = write(STDERR_FILENO, failure.step, length);
+    ignored = write(STDERR_FILENO, suffix, sizeof(suffix) - 1);
+    if (exec_pipe_fd != -1) {
+        /* also tells the parent not to record a failed exec */
+        ignored = write(exec_pipe_fd, &failure, sizeof(failure));
+    }
+    (void)ignored;
+    _exit(EXIT_FAILURE);
+}
+
+int spawn_shell(int *master_fd, pid_t *shell_pid, const int cgroup_fd) {
+    int slave_fd;
+    struct termios termp;
+    struct winsize winp;
+    const int have_termios = tcgetattr(STDIN_FILENO, &termp) == 0;
+    const int have_winsize = ioctl(STDIN_FILENO, TIOCGWINSZ, &winp) == 0;
+    int exec_pipe[2];
+
+    uint64_t started = metrics_now();
+    if (openpty(master_fd, &slave_fd, NULL,
+                have_termios ? &termp : NULL, have_winsize ? &winp : NULL) == -1) {
+        perror("openpty");
+        log_event("openpty failed: %s\n", strerror(errno));
+        return -1;
+    }
+    fcntl(*master_fd, F_SETFD, FD_CLOEXEC);
+    metrics_observe(METRIC_OPENPTY_DURATION, metrics_now() - started);
+
+    /* closed by a successful exec, so its EOF times the child's way into the shell */
+    if (shell_exec_fd() == -1 || pipe2(exec_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        exec_pipe[0] = exec_pipe[1] = -1;
+    }
+
+    /* set here rather than in the child, which after a raw clone3() must not allocate */
+    setenv("TERM", "xterm-256color", 1);
+
+    /* create the shell, straight into the session's cgroup when it has one */
+    started = metrics_now();
+    *shell_pid = cgroup_fd != -1 ? cgroup_fork(cgroup_fd) : fork();
+    if (*shell_pid < 0) {
+        perror("fork");
+        log_event("Failed to fork shell process: %s\n", strerror(errno));
+        close(*master_fd);
+        close(slave_fd);
+        if (exec_pipe[0] != -1) {
+            close(exec_pipe[0]);
+            close(exec_pipe[1]);
+        }
+        return -1;
+    }
+
+    if (*shell_pid == 0) {
+        /* execute Shell */
+        close(*master_fd);
+        if (exec_pipe[0] != -1) close(exec_pipe[0]);
+
+        /* slave PTY as the controlling terminal */
+        if (setsid() == -1) {
+            shell_failed(exec_pipe[1], "setsid");
+        }
+        if (ioctl(slave_fd, TIOCSCTTY, NULL) == -1) {
+            shell_failed(exec_pipe[1], "ioctl TIOCSCTTY");
+        }
+
+        /* slave_fd to standard streams */
+        if (dup2(slave_fd, STDIN_FILENO) == -1) {
+            shell_failed(exec_pipe[1], "dup2 STDIN");
+        }
+        if (dup2(slave_fd, STDOUT_FILENO) == -1) {
+            shell_failed(exec_pipe[1], "dup2 STDOUT");
+        }
+        if (dup2(slave_fd, STDERR_FILENO) == -1) {
+            shell_failed(exec_pipe[1], "dup2 STDERR");
+        }
+
+        if (slave_fd > STDERR_FILENO) {
+            close(slave_fd);
+        }
+
+        /* the server's handlers must not leak into the shell */
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+
+        /* Execute the egg_shell */
+        execl(SHELL_PATH, "egg_shell", (char *)NULL);
+        shell_failed(exec_pipe[1], "execl");
+    }
+
+    /* parent process */
+    const uint64_t forked = metrics_now();
+    metrics_observe(METRIC_FORK_DURATION, forked - started);
+    log_event("Forked process (PID %d) to execute shell %s.\n", (int)*shell_pid, SHELL_PATH);
+    close(slave_fd);
+    children_watch(*shell_pid, NULL, NULL);
+
+    if (exec_pipe[0] != -1) {
+        close(exec_pipe[1]);
+        PendingExec *pending = malloc(sizeof(PendingExec));
+        struct epoll_event event = { .events = EPOLLIN };
+        event.data.ptr = pending;
+        if (pending == NULL || epoll_ctl(exec_fd, EPOLL_CTL_ADD, exec_pipe[0], &event) == -1) {
+            free(pending);
+            close(exec_pipe[0]);
+            return 0;
+        }
+        pending->fd = exec_pipe[0];
+        pending->pid = *shell_pid;
+        pending->forked = forked;
+        pending->next = pending_execs;
+        pending_execs = pending;
+    }
+    return 0;
+}
+
+int shell_exec_fd() {
+    if (exec_fd != -1 && exec_owner == getpid()) {
+        return exec_fd;
+    }
+    if (exec_fd != -1) {
+        /* inherited from the parent, whose shells they are */
+        close(exec_fd);
+        while (pending_execs != NULL) {
+            PendingExec *pending = pending_execs;
+            pending_execs = pending->next;
+            close(pending->fd);
+            free(pending);
+        }
+    }
+    exec_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (exec_fd == -1) {
+        perror("epoll_create1 exec");
+        return -1;
+    }
+    exec_owner = getpid();
+    return exec_fd;
+}
+
+void shell_exec_collect() {
+    struct epoll_event events[16];
+    int ready;
+
+    if (!shell_exec_pending()) {
+        return;
+    }
+    while ((ready = epoll_wait(exec_fd, events, 16, 0)) > 0) {
+        const uint64_t now = metrics_now();
+        for (int i = 0; i < ready; i++) {
+            PendingExec *done = events[i].data.ptr;
+            ExecFailure failure;
+            /* an ExecFailure instead of EOF: the exec failed and is not timed */
+            const ssize_t nbytes = read(done->fd, &failure, sizeof(failure));
+            if (nbytes == 0) {
+                metrics_observe(METRIC_EXEC_DURATION, now - done->forked);
+            } else if (nbytes == sizeof(failure)) {
+                failure.step[sizeof(failure.step) - 1] = '\0';
+                log_event("%s failed in shell process (PID %d): %s\n", failure.step, (int)done->pid,
+                          strerror(failure.error));
+            }
+            epoll_ctl(exec_fd, EPOLL_CTL_DEL, done->fd, NULL);
+            close(done->fd);
+            PendingExec **link = &pending_execs;
+            while (*link != done) {
+                link = &(*link)->next;
+            }
+            *link = done->next;
+            free(done);
+        }
+    }
+}
+
+int shell_exec_pending() {
+    return pending_execs != NULL && exec_owner == getpid();
+}
+
+int flush_pending(const int fd, PendingWrite *pending) {
+    while (pending->offset < pending->length) {
+        const ssize_t written = write(fd, pending->data + pending->offset, pending->length - pending->offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        pending->offset += written;
+    }
+    pending->length = 0;
+    pending->offset = 0;
+    return 1;
+}
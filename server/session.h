@@ -0,0 +1,157 @@
+/**
+ * @file session.h
+ * @brief Per-client session state and shell spawning
+ *
+ * A Session holds everything the epoll server needs to drive one client
+ * connection: the client socket, the PTY master, the shell pid, the
+ * handshake progress and any relay bytes that could not be written yet.
+ * spawn_shell() is shared with the fork-per-connection mode.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "server.h"
+#include "detach.h"
+#include "socket_tuning.h"
+#include "client_stream.h"
+
+#include <sys/types.h>
+#include <time.h>
+
+/* Where a session is in its lifetime */
+typedef enum {
+    SESSION_AUTH_USERNAME,  // waiting for the username message
+    SESSION_AUTH_PASSWORD,  // waiting for the password message
+    SESSION_RELAY,          // authenticated, relaying between client and PTY
+    SESSION_DETACHED,       // client gone, shell kept until resumed or the grace period ends
+} SessionState;
+
+/* Which of a session's descriptors an epoll event belongs to */
+typedef enum {
+    EVENT_LISTEN,
+    EVENT_CLIENT,
+    EVENT_PTY,
+    EVENT_USERS,    // the users file changed
+    EVENT_HANDOFF,  // another process passed on a resuming client
+    EVENT_UPGRADE,  // SIGUSR2 asked for an upgrade
+    EVENT_ADOPT,    // the server this one replaces passed on a live session
+    EVENT_CHILD,    // a child process exited
+    EVENT_CGROUP,   // the cgroup of a closed session may have emptied
+    EVENT_EXEC,     // a shell started by spawn_shell() has exec'd, or failed to
+} EventKind;
+
+typedef struct Session Session;
+
+/* Registered as epoll_event.data.ptr so an event can be routed back to its session */
+typedef struct {
+    EventKind kind;
+    Session *session;
+} EventSource;
+
+/* A chunk read from one side that the other side has not accepted yet */
+typedef struct {
+    char data[BUFFER_SIZE];
+    size_t length;
+    size_t offset;
+} PendingWrite;
+
+struct Session {
+    int client_fd;
+    int master_fd;
+    pid_t shell_pid;
+    int shell_pidfd;                        // of an adopted shell, which is not this process's child; else -1
+    SessionState state;
+    int closing;                            // closed during this batch, freed afterwards
+    int handed_over;                        // passed to the server that replaces this one, its shell lives on
+    char username[MAX_USERNAME_LENGTH];
+
+    char handshake[MESSAGE_MAX_WIRE_SIZE];  // partially received handshake message
+    size_t handshake_length;
+
+    OutputBacklog to_client;                // PTY output queued for the client, server_config.output_queue bytes
+    PendingWrite to_pty;                    // client input waiting for the PTY
+    int shell_exited;                       // PTY hung up, the session closes once to_client is sent
+    uint32_t client_events;                 // epoll interest currently registered
+    uint32_t pty_events;
+    OutputCork cork;                        // whether the client socket is held for a bulk burst
+    int cork_fed;                           // a bulk chunk went to the client in this batch
+    int requests;                           // what the client asked for before logging in, see stream_negotiate()
+    ClientStream stream;                               // the client connection's output stream
+    Admission admission;                    // what the connection holds against the admission limits
+
+    RelayStats stats;
+
+    char token[SESSION_TOKEN_LENGTH + 1];   // empty if the session cannot be resumed
+    OutputBacklog backlog;                  // output kept while detached, sent first on resume
+    Timer deadline;                         // the login timeout until logged in, the grace period while detached
+
+    EventSource client_source;
+    EventSource pty_source;
+    Session *next_closed;
+    Session *next_corked;                   // sessions holding back bulk output: corked, or deflated unflushed
+    int cork_listed;
+    Session *relay_prev;                    // sessions that have a shell, for resuming by token
+    Session *relay_next;
+};
+
+/**
+ * @brief Allocates a session for a freshly accepted client.
+ * @param client_fd The accepted client socket.
+ * @return The new session, or NULL if allocation failed.
+ */
+Session *session_create(int client_fd);
+
+/**
+ * @brief Kills the session's shell, closes its descriptors and frees it.
+ * @param session The session to destroy.
+ */
+void session_destroy(Session *session);
+
+/**
+ * @brief Opens a PTY and starts the shell on its slave side.
+ *
+ * The terminal settings and window size are copied from the server's own
+ * terminal when it has one, as the fork mode always did.
+ *
+ * Returns once the shell is forked. How long its exec takes is measured by
+ * the serving loop, which watches shell_exec_fd().
+ *
+ * @param master_fd Receives the PTY master descriptor.
+ * @param shell_pid Receives the pid of the shell process.
+ * @param cgroup_fd The cgroup the shell starts in, -1 for the server's own.
+ * @return 0 on success, -1 on failure.
+ */
+int spawn_shell(int *master_fd, pid_t *shell_pid, int cgroup_fd);
+
+/**
+ * @brief Returns this process's descriptor that becomes readable when a shell it started has exec'd.
+ *
+ * Created on first use, so each serving process has its own.
+ *
+ * @return The descriptor, or -1 if it could not be created.
+ */
+int shell_exec_fd();
+
+/**
+ * @brief Records the exec time of every shell that has exec'd since the last call.
+ */
+void shell_exec_collect();
+
+/**
+ * @brief Checks whether shells this process started are still on their way to exec.
+ */
+int shell_exec_pending();
+
+/**
+ * @brief Writes as much of a pending chunk as the descriptor accepts.
+ * @param fd Destination descriptor (non-blocking).
+ * @param pending The chunk to flush; emptied once fully written.
+ * @return 1 when the chunk is fully written, 0 if bytes remain, -1 on error.
+ */
+int flush_pending(int fd, PendingWrite *pending);
+
+#endif // SESSION_H
@@ -0,0 +1,277 @@
+/**
+ * @file shell_pool.c
+ * @brief Warm pool of shells already started on their own PTYs
+ *
+ * The pool is a small stack of started shells. Taking the most recently
+ * started one keeps the oldest at the bottom, where it is the first to be
+ * discarded if the pool is ever shrunk.
+ *
+ * A shell lent to a fork-mode child stays the listener's child: the
+ * listener reaps it, and the borrower only sees its PTY hang up.
+ */
+
+#define _GNU_SOURCE     // MSG_CMSG_CLOEXEC
+
+#include "shell_pool.h"
+#include "session.h"
+#include "server.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+static PooledShell *pool = NULL;
+static int pool_size = 0;       // shells the pool tries to keep
+static int pool_capacity = 0;
+static int pool_count = 0;
+static int pool_enabled = 0;    // stays set in a fork-mode child, which borrows from the listener
+
+static TimerWheel *pool_wheel = NULL;
+static Timer retry;             // armed while starting shells is paused
+static uint64_t backoff_ms = 0; // the current pause, 0 after a shell started
+
+static int lend_fds[2] = { -1, -1 };    // the listener's end, then its children's
+
+/**
+ * @brief The pause is over; shell_pool_missing() counts the missing shells again.
+ */
+static void retry_refill(void *owner) {
+    (void)owner;
+}
+
+int shell_pool_init(const int size, TimerWheel *wheel) {
+    shell_pool_shutdown();
+    free(pool);
+    pool = NULL;
+    pool_size = pool_capacity = 0;
+    pool_enabled = 0;
+    if (pool_wheel != NULL) {
+        timer_cancel(pool_wheel, &retry);
+    }
+    timer_init(&retry, retry_refill, NULL);
+    pool_wheel = wheel;
+    backoff_ms = 0;
+
+    if (size <= 0) {
+        return 0;
+    }
+    pool = malloc(sizeof(PooledShell) * size);
+    if (pool == NULL) {
+        perror("malloc shell pool");
+        return -1;
+    }
+    pool_size = pool_capacity = size;
+    pool_enabled = 1;
+    return 0;
+}
+
+int shell_pool_missing() {
+    if (timer_armed(&retry)) {
+        return 0;
+    }
+    return pool_count < pool_size ? pool_size - pool_count : 0;
+}
+
+int shell_pool_refill(const int max_spawns) {
+    int started = 0;
+
+    while (started < max_spawns && pool_count < pool_size && !timer_armed(&retry)) {
+        PooledShell shell;
+        if (spawn_shell(&shell.master_fd, &shell.shell_pid, -1) == -1) {
+            backoff_ms = backoff_ms == 0 ? SHELL_POOL_BACKOFF_MS : backoff_ms * 2;
+            if (backoff_ms > SHELL_POOL_BACKOFF_MAX_MS) {
+                backoff_ms = SHELL_POOL_BACKOFF_MAX_MS;
+            }
+            log_event("Could not start a pooled shell, trying again in %llums.\n", (unsigned long long)backoff_ms);
+            timer_arm(pool_wheel, &retry, backoff_ms);
+            break;
+        }
+        backoff_ms = 0;
+        pool[pool_count++] = shell;
+        started++;
+    }
+    return started;
+}
+
+static void discard(const PooledShell *shell) {
+    kill(shell->shell_pid, SIGKILL);    // reaped with the other children, see children_reap()
+    close(shell->master_fd);
+}
+
+/**
+ * @brief Asks the listener for one of its pooled shells.
+ * @return 0 on success, -1 if it has none or did not answer in time.
+ */
+static int borrow(PooledShell *shell) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == -1) {
+        perror("socketpair shell pool");
+        return -1;
+    }
+
+    /* the request is the end the listener answers on */
+    char request = 0;
+    struct iovec part = { &request, 1 };
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr message = { 0 };
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &pair[1], sizeof(int));
+
+    const ssize_t sent = sendmsg(lend_fds[1], &message, MSG_NOSIGNAL);
+    close(pair[1]);
+    struct pollfd answer = { .fd = pair[0], .events = POLLIN };
+    if (sent == -1 || poll(&answer, 1, SHELL_POOL_LEND_MS) != 1) {
+        close(pair[0]);     // a listener that has gone, after an upgrade, lends nothing
+        return -1;
+    }
+
+    /* the answer is the shell's pid with its PTY, or nothing when the pool is empty */
+    pid_t pid;
+    part.iov_base = &pid;
+    part.iov_len = sizeof(pid);
+    message.msg_controllen = sizeof(control.space);
+    const ssize_t received = recvmsg(pair[0], &message, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    close(pair[0]);
+    header = received == sizeof(pid) ? CMSG_FIRSTHDR(&message) : NULL;
+    if (header == NULL || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    memcpy(&shell->master_fd, CMSG_DATA(header), sizeof(int));
+    shell->shell_pid = pid;
+    return 0;
+}
+
+int shell_pool_take(PooledShell *shell) {
+    /* a child has only the children's end, the listener has both */
+    if (pool_count == 0 && lend_fds[0] == -1 && lend_fds[1] != -1) {
+        return borrow(shell);
+    }
+    while (pool_count > 0) {
+        *shell = pool[--pool_count];
+
+        /* a shell that exited hangs up its PTY */
+        struct pollfd check = { .fd = shell->master_fd, .events = POLLIN };
+        if (poll(&check, 1, 0) == 1 && (check.revents & (POLLHUP | POLLERR | POLLNVAL))) {
+            log_event("Discarding pooled shell (PID %d), it exited while waiting.\n", shell->shell_pid);
+            discard(shell);
+            continue;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+void shell_pool_forget() {
+    for (int i = 0; i < pool_count; i++) {
+        close(pool[i].master_fd);
+    }
+    pool_count = 0;
+    pool_size = 0;
+    if (lend_fds[0] != -1) {
+        close(lend_fds[0]);
+        lend_fds[0] = -1;
+    }
+}
+
+int shell_pool_lender() {
+    if (lend_fds[0] == -1 && socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, lend_fds) == -1) {
+        perror("socketpair shell pool");
+        lend_fds[0] = lend_fds[1] = -1;
+    }
+    return lend_fds[0];
+}
+
+void shell_pool_lend() {
+    char request;
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    while (1) {
+        struct iovec part = { &request, 1 };
+        struct msghdr message = { 0 };
+        message.msg_iov = &part;
+        message.msg_iovlen = 1;
+        message.msg_control = control.space;
+        message.msg_controllen = sizeof(control.space);
+        if (recvmsg(lend_fds[0], &message, MSG_DONTWAIT | MSG_CMSG_CLOEXEC) <= 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        const struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        if (header == NULL || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int answer_fd;
+        memcpy(&answer_fd, CMSG_DATA(header), sizeof(int));
+
+        /* closing the answer socket without a shell tells the child to start its own */
+        PooledShell shell;
+        if (shell_pool_take(&shell) == 0) {
+            struct iovec pid_part = { &shell.shell_pid, sizeof(shell.shell_pid) };
+            message.msg_iov = &pid_part;
+            message.msg_controllen = sizeof(control.space);
+            struct cmsghdr *fd_header = CMSG_FIRSTHDR(&message);
+            fd_header->cmsg_level = SOL_SOCKET;
+            fd_header->cmsg_type = SCM_RIGHTS;
+            fd_header->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(fd_header), &shell.master_fd, sizeof(int));
+            if (sendmsg(answer_fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+                discard(&shell);    // the child gave up waiting
+            } else {
+                close(shell.master_fd);
+            }
+        }
+        close(answer_fd);
+    }
+}
+
+void shell_pool_shutdown() {
+    while (pool_count > 0) {
+        discard(&pool[--pool_count]);
+    }
+}
+
+int acquire_shell(int *master_fd, pid_t *shell_pid, const int cgroup_fd) {
+    PooledShell shell;
+
+    if (shell_pool_take(&shell) == 0) {
+        metrics_add(METRIC_SHELL_POOL_HITS, 1);
+        *master_fd = shell.master_fd;
+        *shell_pid = shell.shell_pid;
+
+        /* the shell started before anyone logged in, so give it the current terminal size now */
+        struct winsize size;
+        if (ioctl(STDIN_FILENO, TIOCGWINSZ, &size) == 0) {
+            ioctl(*master_fd, TIOCSWINSZ, &size);
+        }
+        if (cgroup_fd != -1) {
+            cgroup_move(cgroup_fd, *shell_pid);
+        }
+        log_event("Attached pooled shell (PID %d).\n", *shell_pid);
+        return 0;
+    }
+
+    if (pool_enabled) {
+        metrics_add(METRIC_SHELL_POOL_MISSES, 1);
+    }
+    return spawn_shell(master_fd, shell_pid, cgroup_fd);
+}
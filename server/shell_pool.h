@@ -0,0 +1,117 @@
+/**
+ * @file shell_pool.h
+ * @brief Warm pool of shells already started on their own PTYs
+ *
+ * Starting a shell costs an openpty(), a fork() and an execl(), and then the
+ * shell has to print its banner before the user sees a prompt. The pool does
+ * that work ahead of time, so a login only has to pick a shell that is
+ * already sitting at its prompt. The pool is refilled between events, off
+ * the login path.
+ *
+ * Each process that serves sessions keeps its own pool: the fork-mode
+ * listener, the epoll process, or each worker. A fork-mode connection child
+ * borrows a shell from the listener's pool once its user has logged in: it
+ * sends one end of a fresh socket pair over shell_pool_lender(), and the
+ * listener answers on it with a shell's PTY as SCM_RIGHTS and its pid.
+ *
+ * When a shell cannot be started the pool stops trying for a while, twice
+ * as long after each failure in a row, so a fork or PTY shortage does not
+ * turn the serving loop into a busy one.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef SHELL_POOL_H
+#define SHELL_POOL_H
+
+#include "timer_wheel.h"
+
+#include <sys/types.h>
+
+#define SHELL_POOL_BACKOFF_MS 100           // first pause after a shell failed to start
+#define SHELL_POOL_BACKOFF_MAX_MS 30000     // longest pause
+#define SHELL_POOL_LEND_MS 1000             // how long a connection child waits for the listener's shell
+
+/* A started shell waiting for a session */
+typedef struct {
+    int master_fd;
+    pid_t shell_pid;
+} PooledShell;
+
+/**
+ * @brief Sets how many shells the pool keeps ready. Zero disables the pool.
+ *
+ * The pool is filled by later calls to shell_pool_refill().
+ *
+ * @param size Number of shells to keep started.
+ * @param wheel The serving loop's timer wheel, which times the pause after a failed start.
+ * @return 0 on success, -1 if the pool could not be allocated.
+ */
+int shell_pool_init(int size, TimerWheel *wheel);
+
+/**
+ * @brief Returns how many shells are missing from a full pool, 0 while starting them is paused.
+ */
+int shell_pool_missing();
+
+/**
+ * @brief Starts up to max_spawns shells to top the pool up.
+ * @return The number of shells started.
+ */
+int shell_pool_refill(int max_spawns);
+
+/**
+ * @brief Takes a live shell out of the pool.
+ *
+ * Shells that exited while they waited are discarded along the way. In a
+ * fork-mode child, whose own pool is empty, one is borrowed from the
+ * listener's.
+ *
+ * @param shell Receives the shell.
+ * @return 0 on success, -1 if the pool is empty.
+ */
+int shell_pool_take(PooledShell *shell);
+
+/**
+ * @brief Closes this process's copies of the pooled shells without killing them.
+ *
+ * Called in a forked child so the shells stay owned by the parent's pool,
+ * which shell_pool_take() then borrows from if the parent lends its shells.
+ */
+void shell_pool_forget();
+
+/**
+ * @brief Returns the socket on which the fork-mode listener receives its children's requests for a shell.
+ *
+ * Created on first use, before the children that borrow are forked.
+ *
+ * @return The socket, or -1 if it could not be created.
+ */
+int shell_pool_lender();
+
+/**
+ * @brief Answers the requests waiting on shell_pool_lender(), with a pooled shell where there is one.
+ */
+void shell_pool_lend();
+
+/**
+ * @brief Kills and closes every shell still in the pool.
+ */
+void shell_pool_shutdown();
+
+/**
+ * @brief Gets a shell for a session that just logged in.
+ *
+ * Takes one from the pool, or starts one if the pool is empty, then applies
+ * the session's terminal size to it. A pooled shell started before the
+ * session had a cgroup, so it is moved into it.
+ *
+ * @param master_fd Receives the PTY master descriptor.
+ * @param shell_pid Receives the pid of the shell process.
+ * @param cgroup_fd The session's cgroup, -1 for none.
+ * @return 0 on success, -1 on failure.
+ */
+int acquire_shell(int *master_fd, pid_t *shell_pid, int cgroup_fd);
+
+#endif // SHELL_POOL_H
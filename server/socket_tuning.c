@@ -0,0 +1,74 @@
+/**
+ * @file socket_tuning.c
+ * @brief TCP options for client connections: no Nagle for keystrokes, corked bulk output
+ *
+ * TCP_CORK takes precedence over TCP_NODELAY while it is set, so corking a
+ * socket that already has TCP_NODELAY holds back partial segments, and
+ * clearing the cork sends them at once. The kernel also sends a corked
+ * partial segment by itself after 200 ms, which bounds the delay if a
+ * relay misses the end of a burst.
+ */
+
+#include "socket_tuning.h"
+#include "server.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static void set_cork(OutputCork *cork, const int on) {
+    /* the state follows the request even on failure, so a dead socket is not retried per chunk */
+    cork->corked = on;
+    if (setsockopt(cork->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == -1) {
+        log_event("Failed to %s client_fd %d: %s\n", on ? "cork" : "uncork", cork->fd, strerror(errno));
+    }
+}
+
+void tune_client_socket(const int client_fd) {
+    const int yes = 1;
+    if (server_config.socket_profile != SOCKET_PROFILE_KERNEL &&
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1) {
+        perror("setsockopt TCP_NODELAY");
+    }
+}
+
+void output_cork_init(OutputCork *cork, const int client_fd) {
+    cork->fd = client_fd;
+    cork->corked = 0;
+}
+
+void output_cork_chunk(OutputCork *cork, const size_t length) {
+    if (server_config.socket_profile != SOCKET_PROFILE_CORK) {
+        return;
+    }
+    if (length >= (size_t)server_config.cork_threshold) {
+        if (!cork->corked) {
+            set_cork(cork, 1);
+            metrics_add(METRIC_CORKED_BURSTS, 1);
+        }
+        metrics_add(METRIC_CORKED_BYTES, length);
+    } else if (cork->corked) {
+        set_cork(cork, 0);
+    }
+}
+
+void output_uncork(OutputCork *cork) {
+    if (cork->corked) {
+        set_cork(cork, 0);
+    }
+}
+
+const char *socket_profile_name() {
+    switch (server_config.socket_profile) {
+    case SOCKET_PROFILE_KERNEL:
+        return "kernel";
+    case SOCKET_PROFILE_NODELAY:
+        return "nodelay";
+    default:
+        return "cork";
+    }
+}
@@ -0,0 +1,60 @@
+/**
+ * @file socket_tuning.h
+ * @brief TCP options for client connections: no Nagle for keystrokes, corked bulk output
+ *
+ * Interactive traffic is many tiny writes that each want to leave at once,
+ * so client sockets get TCP_NODELAY and an echo never waits behind Nagle and
+ * the peer's delayed ACK. Bulk output (a cat, a build log) reads from the PTY
+ * in large chunks; while those keep coming the socket is corked so the kernel
+ * sends full segments, and it is uncorked as soon as the output pauses or a
+ * small chunk arrives, which pushes out the partial tail.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef SOCKET_TUNING_H
+#define SOCKET_TUNING_H
+
+#include <stddef.h>
+
+#define CORK_THRESHOLD 1024     // default size of a PTY chunk that counts as bulk output
+
+/* Cork state of one client socket's output */
+typedef struct {
+    int fd;
+    int corked;
+} OutputCork;
+
+/**
+ * @brief Applies the configured socket profile to an accepted client socket.
+ * @param client_fd The client socket.
+ */
+void tune_client_socket(int client_fd);
+
+/**
+ * @brief Starts tracking the output of a client socket, uncorked.
+ */
+void output_cork_init(OutputCork *cork, int client_fd);
+
+/**
+ * @brief Corks the socket before a bulk chunk is written, uncorks it before a small one.
+ *
+ * Does nothing unless the profile is SOCKET_PROFILE_CORK.
+ *
+ * @param cork The socket's cork state.
+ * @param length Size of the chunk about to be written.
+ */
+void output_cork_chunk(OutputCork *cork, size_t length);
+
+/**
+ * @brief Uncorks the socket, sending any partial segment; call when the output pauses.
+ */
+void output_uncork(OutputCork *cork);
+
+/**
+ * @brief Returns the name of the configured profile, as given to -t.
+ */
+const char *socket_profile_name();
+
+#endif // SOCKET_TUNING_H
@@ -0,0 +1,134 @@
+/**
+ * @file timeouts.c
+ * @brief Idle and session length timeouts of a logged in session
+ */
+
+#include "timeouts.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * @brief Writes a duration the way the user is told it, in its largest whole unit.
+ */
+static void describe(char *out, const size_t size, const uint64_t ms) {
+    const unsigned long long seconds = (ms + 500) / 1000;
+    if (seconds >= 3600 && seconds % 3600 == 0) {
+        snprintf(out, size, "%llu hour%s", seconds / 3600, seconds == 3600 ? "" : "s");
+    } else if (seconds >= 60 && seconds % 60 == 0) {
+        snprintf(out, size, "%llu minute%s", seconds / 60, seconds == 60 ? "" : "s");
+    } else {
+        snprintf(out, size, "%llu second%s", seconds, seconds == 1 ? "" : "s");
+    }
+}
+
+/**
+ * @brief How long before a timeout the client is warned.
+ */
+static uint64_t warning_lead(const uint64_t timeout_ms) {
+    return timeout_ms / 2 < TIMEOUT_WARNING_MS ? timeout_ms / 2 : TIMEOUT_WARNING_MS;
+}
+
+static void expire(SessionTimeouts *timeouts, const char *notice) {
+    timeouts->expired = 1;
+    timer_cancel(timeouts->wheel, &timeouts->idle);
+    timer_cancel(timeouts->wheel, &timeouts->limit);
+    timeouts->handler(timeouts->owner, notice, 1);
+}
+
+/**
+ * @brief Fires at the earliest time the idle timeout could warn or expire, and moves on if input came since.
+ */
+static void idle_due(void *owner) {
+    SessionTimeouts *timeouts = owner;
+    char notice[TIMEOUT_NOTICE_MAX];
+    char idle[32], left[32];
+
+    const uint64_t quiet = timer_wheel_now(timeouts->wheel) - timeouts->last_input;
+    const uint64_t lead = warning_lead(timeouts->idle_ms);
+    if (quiet < timeouts->idle_ms - lead) {
+        timeouts->idle_warned = 0;
+        timer_arm(timeouts->wheel, &timeouts->idle, timeouts->idle_ms - lead - quiet);
+        return;
+    }
+
+    if (quiet < timeouts->idle_ms) {
+        if (!timeouts->idle_warned) {
+            timeouts->idle_warned = 1;
+            describe(idle, sizeof(idle), quiet);
+            describe(left, sizeof(left), timeouts->idle_ms - quiet);
+            snprintf(notice, sizeof(notice), "No input for %s: the session closes in %s unless you type something.",
+                     idle, left);
+            timeouts->handler(timeouts->owner, notice, 0);
+        }
+        timer_arm(timeouts->wheel, &timeouts->idle, timeouts->idle_ms - quiet);
+        return;
+    }
+
+    metrics_add(METRIC_TIMEOUTS_IDLE, 1);
+    describe(idle, sizeof(idle), timeouts->idle_ms);
+    snprintf(notice, sizeof(notice), "Session closed after %s without input.", idle);
+    expire(timeouts, notice);
+}
+
+/**
+ * @brief Warns of the session length limit the first time it fires, ends the session the second.
+ */
+static void limit_due(void *owner) {
+    SessionTimeouts *timeouts = owner;
+    char notice[TIMEOUT_NOTICE_MAX];
+    char limit[32], left[32];
+
+    describe(limit, sizeof(limit), timeouts->limit_ms);
+    if (!timeouts->limit_warned) {
+        const uint64_t lead = warning_lead(timeouts->limit_ms);
+        timeouts->limit_warned = 1;
+        describe(left, sizeof(left), lead);
+        snprintf(notice, sizeof(notice), "Sessions last at most %s: this one closes in %s.", limit, left);
+        timeouts->handler(timeouts->owner, notice, 0);
+        timer_arm(timeouts->wheel, &timeouts->limit, lead);
+        return;
+    }
+
+    metrics_add(METRIC_TIMEOUTS_LIMIT, 1);
+    snprintf(notice, sizeof(notice), "Session closed at its limit of %s.", limit);
+    expire(timeouts, notice);
+}
+
+void timeouts_start(SessionTimeouts *timeouts, TimerWheel *wheel, const int idle_seconds, const int limit_seconds,
+                    const TimeoutHandler handler, void *owner) {
+    memset(timeouts, 0, sizeof(*timeouts));
+    if (idle_seconds <= 0 && limit_seconds <= 0) {
+        return;
+    }
+
+    timeouts->wheel = wheel;
+    timeouts->handler = handler;
+    timeouts->owner = owner;
+    timeouts->idle_ms = idle_seconds > 0 ? (uint64_t)idle_seconds * 1000 : 0;
+    timeouts->limit_ms = limit_seconds > 0 ? (uint64_t)limit_seconds * 1000 : 0;
+    timeouts->last_input = timer_wheel_now(wheel);
+    timer_init(&timeouts->idle, idle_due, timeouts);
+    timer_init(&timeouts->limit, limit_due, timeouts);
+    if (timeouts->idle_ms > 0) {
+        timer_arm(wheel, &timeouts->idle, timeouts->idle_ms - warning_lead(timeouts->idle_ms));
+    }
+    if (timeouts->limit_ms > 0) {
+        timer_arm(wheel, &timeouts->limit, timeouts->limit_ms - warning_lead(timeouts->limit_ms));
+    }
+}
+
+void timeouts_input(SessionTimeouts *timeouts) {
+    if (timeouts->wheel != NULL) {
+        timeouts->last_input = timer_wheel_now(timeouts->wheel);
+    }
+}
+
+void timeouts_stop(SessionTimeouts *timeouts) {
+    if (timeouts->wheel != NULL) {
+        timer_cancel(timeouts->wheel, &timeouts->idle);
+        timer_cancel(timeouts->wheel, &timeouts->limit);
+        timeouts->wheel = NULL;
+    }
+}
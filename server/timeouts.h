@@ -0,0 +1,80 @@
+/**
+ * @file timeouts.h
+ * @brief Idle and session length timeouts of a logged in session
+ *
+ * With -i a session that gets no input from its client for that long is
+ * closed, and with -T every session is closed once it has lasted that long.
+ * Either way the client is warned TIMEOUT_WARNING_MS ahead, or half the
+ * timeout ahead when that is shorter, with a notice it shows the user.
+ *
+ * Each timeout is one timer on the serving process's timer wheel. Input
+ * only notes the wheel's time; the idle timer, when it fires, moves itself
+ * on by the input that came in the meantime, so a busy session costs a
+ * store per chunk and no timer operations.
+ *
+ * The login timeout, which ends connections that do not log in in time, is
+ * kept by the serving loops themselves.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef TIMEOUTS_H
+#define TIMEOUTS_H
+
+#include "timer_wheel.h"
+
+#include <stdint.h>
+
+#define TIMEOUT_LOGIN 30            // default seconds a connection has to log in
+#define TIMEOUT_WARNING_MS 60000    // how long before a timeout the client is warned
+#define TIMEOUT_NOTICE_MAX 128      // longest notice, terminator included
+
+/**
+ * @brief Gives the client a notice about a timeout, and ends the session when it has expired.
+ * @param owner What was passed to timeouts_start().
+ * @param notice Text for the user.
+ * @param expired Nonzero when the session is to close, after the notice is sent.
+ */
+typedef void (*TimeoutHandler)(void *owner, const char *notice, int expired);
+
+/* The timeouts of one session */
+typedef struct {
+    TimerWheel *wheel;      // NULL while neither timeout is on
+    Timer idle;
+    Timer limit;
+    uint64_t idle_ms;       // 0 for no idle timeout
+    uint64_t limit_ms;      // 0 for no session length limit
+    uint64_t last_input;    // wheel time of the client's latest input
+    int idle_warned;
+    int limit_warned;
+    int expired;            // a timeout ended the session
+    TimeoutHandler handler;
+    void *owner;
+} SessionTimeouts;
+
+/**
+ * @brief Starts the timeouts of a session that has just logged in.
+ *
+ * Does nothing but clear them when both are 0.
+ *
+ * @param wheel The serving process's timer wheel.
+ * @param idle_seconds Seconds without input before the session closes, 0 for no limit.
+ * @param limit_seconds Seconds the session can last, 0 for no limit.
+ * @param handler Sends the notices and ends the session.
+ * @param owner Passed to the handler.
+ */
+void timeouts_start(SessionTimeouts *timeouts, TimerWheel *wheel, int idle_seconds, int limit_seconds,
+                    TimeoutHandler handler, void *owner);
+
+/**
+ * @brief Notes input from the client, which puts off the idle timeout.
+ */
+void timeouts_input(SessionTimeouts *timeouts);
+
+/**
+ * @brief Disarms the session's timeouts.
+ */
+void timeouts_stop(SessionTimeouts *timeouts);
+
+#endif // TIMEOUTS_H
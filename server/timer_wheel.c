@@ -0,0 +1,175 @@
+/**
+ * @file timer_wheel.c
+ * @brief Hierarchical timer wheel for the deadlines of many sessions
+ */
+
+#include "timer_wheel.h"
+
+#include <string.h>
+#include <time.h>
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define LONGEST_DELAY ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)   // in ticks
+
+static uint64_t monotonic_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+static uint64_t current_tick(const TimerWheel *wheel) {
+    const uint64_t now = monotonic_ms();
+    return now > wheel->started_ms ? (now - wheel->started_ms) / TIMER_TICK_MS : 0;
+}
+
+/**
+ * @brief Puts a timer in the slot for its tick, on the finest level that reaches that far.
+ */
+static void place(TimerWheel *wheel, Timer *timer) {
+    if (timer->expires - wheel->tick > LONGEST_DELAY) {
+        timer->expires = wheel->tick + LONGEST_DELAY;
+    }
+    const uint64_t delta = timer->expires - wheel->tick;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >> (TIMER_WHEEL_BITS * (level + 1)) != 0) {
+        level++;
+    }
+
+    const unsigned index = (unsigned)(timer->expires >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+    Timer **head = &wheel->slots[level][index];
+    timer->next = *head;
+    if (*head != NULL) (*head)->link = &timer->next;
+    *head = timer;
+    timer->link = head;
+    timer->slot = (unsigned)level * TIMER_WHEEL_SLOTS + index;
+    wheel->occupied[level] |= 1ULL << index;
+}
+
+static void unlink_timer(TimerWheel *wheel, Timer *timer) {
+    *timer->link = timer->next;
+    if (timer->next != NULL) timer->next->link = timer->link;
+
+    const unsigned level = timer->slot / TIMER_WHEEL_SLOTS;
+    const unsigned index = timer->slot % TIMER_WHEEL_SLOTS;
+    if (wheel->slots[level][index] == NULL) {
+        wheel->occupied[level] &= ~(1ULL << index);
+    }
+    timer->next = NULL;
+    timer->link = NULL;
+}
+
+/**
+ * @brief Moves the timers of a slot on a coarser level down to the levels below, now that they are close.
+ */
+static void cascade(TimerWheel *wheel, const int level, const unsigned index) {
+    Timer *timer = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    wheel->occupied[level] &= ~(1ULL << index);
+    while (timer != NULL) {
+        Timer *next = timer->next;
+        place(wheel, timer);
+        timer = next;
+    }
+}
+
+void timer_wheel_init(TimerWheel *wheel) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->started_ms = monotonic_ms();
+}
+
+void timer_init(Timer *timer, const TimerCallback callback, void *owner) {
+    timer->next = NULL;
+    timer->link = NULL;
+    timer->expires = 0;
+    timer->slot = 0;
+    timer->callback = callback;
+    timer->owner = owner;
+}
+
+void timer_arm(TimerWheel *wheel, Timer *timer, const uint64_t delay_ms) {
+    timer_cancel(wheel, timer);
+
+    /* counted from the clock, not the last tick run, in case the wheel has not run for a while */
+    const uint64_t ticks = (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    timer->expires = current_tick(wheel) + (ticks > 0 ? ticks : 1);
+    if (timer->expires <= wheel->tick) {
+        timer->expires = wheel->tick + 1;
+    }
+    place(wheel, timer);
+    wheel->armed++;
+}
+
+void timer_cancel(TimerWheel *wheel, Timer *timer) {
+    if (timer->link != NULL) {
+        unlink_timer(wheel, timer);
+        wheel->armed--;
+    }
+}
+
+int timer_armed(const Timer *timer) {
+    return timer->link != NULL;
+}
+
+int timer_wheel_run(TimerWheel *wheel) {
+    const uint64_t now = current_tick(wheel);
+    int fired = 0;
+
+    while (wheel->tick < now) {
+        if (wheel->armed == 0) {
+            wheel->tick = now;
+            break;
+        }
+        /* with the first level empty nothing fires before its next turn */
+        if (wheel->occupied[0] == 0) {
+            const uint64_t turn_end = wheel->tick | SLOT_MASK;
+            if (turn_end >= now) {
+                wheel->tick = now;
+                break;
+            }
+            wheel->tick = turn_end;
+        }
+        wheel->tick++;
+
+        /* each level below has come full circle: the next slot of this level moves down */
+        unsigned index = (unsigned)wheel->tick & SLOT_MASK;
+        for (int level = 1; index == 0 && level < TIMER_WHEEL_LEVELS; level++) {
+            index = (unsigned)(wheel->tick >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+            cascade(wheel, level, index);
+        }
+
+        Timer *timer;
+        const unsigned slot = (unsigned)wheel->tick & SLOT_MASK;
+        while ((timer = wheel->slots[0][slot]) != NULL) {
+            unlink_timer(wheel, timer);
+            wheel->armed--;
+            timer->callback(timer->owner);
+            fired++;
+        }
+    }
+    return fired;
+}
+
+int timer_wheel_timeout(const TimerWheel *wheel) {
+    if (wheel->armed == 0) {
+        return -1;
+    }
+
+    /* at the latest at the next turn, where the coarser levels move down */
+    uint64_t ticks = TIMER_WHEEL_SLOTS - (wheel->tick & SLOT_MASK);
+    const uint64_t occupied = wheel->occupied[0];
+    if (occupied != 0) {
+        /* bit n of the rotated bitmap is the slot n + 1 ticks ahead */
+        const unsigned shift = (unsigned)(wheel->tick + 1) & SLOT_MASK;
+        const uint64_t rotated = shift == 0 ? occupied : (occupied >> shift) | (occupied << (TIMER_WHEEL_SLOTS - shift));
+        const uint64_t next = (uint64_t)__builtin_ctzll(rotated) + 1;
+        if (next < ticks) ticks = next;
+    }
+
+    const uint64_t due = wheel->started_ms + (wheel->tick + ticks) * TIMER_TICK_MS;
+    const uint64_t now = monotonic_ms();
+    return due > now ? (int)(due - now) : 0;
+}
+
+uint64_t timer_wheel_now(const TimerWheel *wheel) {
+    return wheel->tick * TIMER_TICK_MS;
+}
@@ -0,0 +1,99 @@
+/**
+ * @file timer_wheel.h
+ * @brief Hierarchical timer wheel for the deadlines of many sessions
+ *
+ * Time moves in ticks of TIMER_TICK_MS. A timer due within
+ * TIMER_WHEEL_SLOTS ticks sits in the slot of its tick on the first level;
+ * one due later sits on a coarser level, whose slots each cover a whole
+ * turn of the level below, and moves down a level each time the wheel
+ * below comes round to it. Arming and cancelling are O(1), and so is
+ * running a tick, apart from the timers that fire or move down in it.
+ *
+ * The wheel runs inside a poll loop: timer_wheel_timeout() says how long the
+ * loop can wait, and timer_wheel_run() fires what has come due when it wakes.
+ * A bitmap per level lets both skip empty slots without looking at them.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TIMER_TICK_MS 100
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 5    // 64^5 ticks, about three years; longer delays are cut to that
+
+typedef void (*TimerCallback)(void *owner);
+
+typedef struct Timer Timer;
+
+/* A deadline, usually embedded in what it belongs to */
+struct Timer {
+    Timer *next;            // the next timer in the same slot
+    Timer **link;           // the pointer to this timer in its slot, NULL while not armed
+    uint64_t expires;       // tick it fires on
+    unsigned slot;          // level * TIMER_WHEEL_SLOTS + slot it sits in
+    TimerCallback callback;
+    void *owner;            // passed to the callback
+};
+
+typedef struct {
+    uint64_t tick;                  // the last tick run
+    uint64_t started_ms;            // CLOCK_MONOTONIC time of tick 0
+    Timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t occupied[TIMER_WHEEL_LEVELS];  // a bit for each slot that holds a timer
+    size_t armed;
+} TimerWheel;
+
+/**
+ * @brief Starts an empty wheel at the current time.
+ */
+void timer_wheel_init(TimerWheel *wheel);
+
+/**
+ * @brief Sets up a timer that is not armed.
+ * @param callback Called with owner when the timer fires; it may arm or cancel any timer.
+ */
+void timer_init(Timer *timer, TimerCallback callback, void *owner);
+
+/**
+ * @brief Arms a timer, or moves it if it is armed already.
+ * @param delay_ms How long from now it fires, rounded up to whole ticks.
+ */
+void timer_arm(TimerWheel *wheel, Timer *timer, uint64_t delay_ms);
+
+/**
+ * @brief Disarms a timer; nothing happens if it is not armed.
+ */
+void timer_cancel(TimerWheel *wheel, Timer *timer);
+
+/**
+ * @brief Checks whether a timer is armed.
+ */
+int timer_armed(const Timer *timer);
+
+/**
+ * @brief Runs every tick up to the current time, firing the timers due in them.
+ * @return Number of timers fired.
+ */
+int timer_wheel_run(TimerWheel *wheel);
+
+/**
+ * @brief Milliseconds the poll loop can wait before the wheel has work.
+ * @return The timeout for poll() or epoll_wait(), -1 when no timer is armed.
+ */
+int timer_wheel_timeout(const TimerWheel *wheel);
+
+/**
+ * @brief The wheel's time: milliseconds from its start to the last tick run.
+ *
+ * Costs no clock read, so it can be taken for every relayed chunk.
+ */
+uint64_t timer_wheel_now(const TimerWheel *wheel);
+
+#endif // TIMER_WHEEL_H
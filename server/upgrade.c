@@ -0,0 +1,418 @@
+/**
+ * @file upgrade.c
+ * @brief Hot restart: handing the port, and with -H live sessions, to a freshly started server binary
+ *
+ * The upgrade socket is a SOCK_SEQPACKET pair, so every message arrives
+ * whole with its descriptors. The old server first sends
+ * "EGGSHELL-UPGRADE <version> <listener> <metrics>", the last two saying
+ * which of the two descriptors attached to it come along. The new server
+ * answers with a single 'R' once it accepts. Each session after that is
+ * "<shell pid>\0<requests>\0<framed>\0<username>\0<token>\0<cgroup>\0" with
+ * the client socket and the PTY master attached, and the old server closing
+ * its end says there are no more. A server from before cgroups sends no
+ * cgroup field.
+ */
+
+#define _GNU_SOURCE     // execvpe, close_range, MSG_CMSG_CLOEXEC
+
+#include "upgrade.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+
+#define UPGRADE_FD 3    // where the new server finds its end of the upgrade socket
+#define UPGRADE_HELLO "EGGSHELL-UPGRADE"
+
+extern char **environ;
+
+static char **server_argv = NULL;
+static char binary[PATH_MAX];
+static int signal_fd = -1;
+static int inherited_fd = -1;   // the upgrade socket of a server started by an upgrade
+
+void upgrade_init(char *argv[]) {
+    server_argv = argv;
+
+    /* the binary is looked up again at upgrade time, so a deploy that replaced it is picked up */
+    if (strchr(argv[0], '/') == NULL || realpath(argv[0], binary) == NULL) {
+        snprintf(binary, sizeof(binary), "%s", argv[0]);
+    }
+
+    sigset_t upgrade;
+    sigemptyset(&upgrade);
+    sigaddset(&upgrade, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &upgrade, NULL);
+}
+
+int upgrade_signal_fd() {
+    if (signal_fd != -1) {
+        return signal_fd;
+    }
+    sigset_t upgrade;
+    sigemptyset(&upgrade);
+    sigaddset(&upgrade, SIGUSR2);
+    signal_fd = signalfd(-1, &upgrade, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        perror("signalfd");
+    }
+    return signal_fd;
+}
+
+int upgrade_requested() {
+    struct signalfd_siginfo info;
+    int requested = 0;
+
+    while (signal_fd != -1 && read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGUSR2) {
+            log_event("Upgrade asked for by PID %u.\n", info.ssi_pid);
+            requested = 1;
+        }
+    }
+    return requested;
+}
+
+/**
+ * @brief Sends one message with descriptors attached.
+ * @return 0 on success, -1 on failure.
+ */
+static int send_with_fds(const int fd, const char *data, const size_t length, const int *fds, const int count) {
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof(int))];
+    } control;
+    struct iovec part = { (void *)data, length };
+    struct msghdr message = { 0 };
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    if (count > 0) {
+        message.msg_control = control.space;
+        message.msg_controllen = CMSG_SPACE(count * sizeof(int));
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(header), fds, count * sizeof(int));
+    }
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+    return sent == (ssize_t)length ? 0 : -1;
+}
+
+/**
+ * @brief Receives one message and the descriptors attached to it, up to UPGRADE_MAX_FDS.
+ * @param fds Receives the descriptors, -1 for each that did not come.
+ * @return Bytes received, 0 at end of file, -1 on error (errno set).
+ */
+static ssize_t receive_with_fds(const int fd, char *data, const size_t size, int fds[UPGRADE_MAX_FDS], const int flags) {
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof(int))];
+    } control;
+    struct iovec part = { data, size };
+    struct msghdr message = { 0 };
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof(control.space);
+    for (int i = 0; i < UPGRADE_MAX_FDS; i++) {
+        fds[i] = -1;
+    }
+
+    ssize_t received;
+    do {
+        received = recvmsg(fd, &message, flags | MSG_CMSG_CLOEXEC);
+    } while (received == -1 && errno == EINTR);
+    if (received == -1) {
+        return -1;
+    }
+
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        const size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int passed;
+            memcpy(&passed, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+            if (i < UPGRADE_MAX_FDS) {
+                fds[i] = passed;
+            } else {
+                close(passed);
+            }
+        }
+    }
+    return received;
+}
+
+/**
+ * @brief Closes the descriptors receive_with_fds() received.
+ */
+static void close_fds(const int fds[UPGRADE_MAX_FDS]) {
+    for (int i = 0; i < UPGRADE_MAX_FDS; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+}
+
+/**
+ * @brief The server's environment with the upgrade socket named in it, for the new server.
+ * @return A NULL-terminated array to free(), or NULL if allocation failed.
+ */
+static char **upgrade_environment(char *entry) {
+    size_t count = 0;
+    while (environ[count] != NULL) {
+        count++;
+    }
+    char **environment = malloc((count + 2) * sizeof(char *));
+    if (environment == NULL) {
+        perror("malloc environment");
+        return NULL;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(environ[i], UPGRADE_ENV "=", strlen(UPGRADE_ENV) + 1) != 0) {
+            environment[kept++] = environ[i];
+        }
+    }
+    environment[kept++] = entry;
+    environment[kept] = NULL;
+    return environment;
+}
+
+/**
+ * @brief Waits for the new server to say it accepts.
+ * @return 0 once it has, -1 if it exited or did not within UPGRADE_TIMEOUT.
+ */
+static int wait_until_ready(const int upgrade_fd, const pid_t pid) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const time_t deadline = now.tv_sec + UPGRADE_TIMEOUT;
+
+    while (1) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec >= deadline) {
+            log_event("New server PID %d did not get ready within %ds.\n", pid, UPGRADE_TIMEOUT);
+            return -1;
+        }
+        struct pollfd ready = { .fd = upgrade_fd, .events = POLLIN };
+        const int polled = poll(&ready, 1, (int)(deadline - now.tv_sec) * 1000);
+        if (polled == -1 && errno != EINTR) {
+            perror("poll upgrade");
+            return -1;
+        }
+        if (polled <= 0) {
+            continue;
+        }
+
+        char answer;
+        const ssize_t received = recv(upgrade_fd, &answer, 1, 0);
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (received == 1 && answer == 'R') {
+            return 0;
+        }
+        log_event("New server PID %d exited before it was ready.\n", pid);
+        return -1;
+    }
+}
+
+int upgrade_start(const int server_fd) {
+    int pair[2];
+    char entry[64];
+    char hello[64];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == -1) {
+        perror("socketpair upgrade");
+        log_event("Cannot upgrade: %s\n", strerror(errno));
+        return -1;
+    }
+    snprintf(entry, sizeof(entry), "%s=%d", UPGRADE_ENV, UPGRADE_FD);
+    char **environment = upgrade_environment(entry);
+    if (environment == NULL) {
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+
+    log_event("Upgrading: starting %s.\n", binary);
+    const pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork upgrade");
+        log_event("Cannot upgrade: %s\n", strerror(errno));
+        free(environment);
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        /* only async-signal-safe calls here: the logger thread may hold any lock */
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        if (pair[1] != UPGRADE_FD && dup2(pair[1], UPGRADE_FD) == -1) {
+            _exit(127);
+        }
+        fcntl(UPGRADE_FD, F_SETFD, 0);
+        /* the new server gets the descriptors it needs over the socket, and no others */
+        close_range(UPGRADE_FD + 1, ~0U, 0);
+        execvpe(binary, server_argv, environment);
+        _exit(127);
+    }
+
+    free(environment);
+    close(pair[1]);
+    const struct timeval timeout = { UPGRADE_TIMEOUT, 0 };
+    setsockopt(pair[0], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    int fds[2];
+    int count = 0;
+    const int metrics_fd = metrics_endpoint();
+    if (server_fd != -1) fds[count++] = server_fd;
+    if (metrics_fd != -1) fds[count++] = metrics_fd;
+    snprintf(hello, sizeof(hello), "%s %d %d %d", UPGRADE_HELLO, UPGRADE_VERSION, server_fd != -1, metrics_fd != -1);
+
+    if (send_with_fds(pair[0], hello, strlen(hello), fds, count) == -1 || wait_until_ready(pair[0], pid) == -1) {
+        kill(pid, SIGKILL);
+        close(pair[0]);
+        log_event("Upgrade failed, carrying on with this server.\n");
+        return -1;
+    }
+
+    /* from here on scrapes are the new server's */
+    metrics_stop();
+    log_event("Server PID %d has taken over port %d.\n", pid, server_config.port);
+    return pair[0];
+}
+
+int upgrade_send_session(const int upgrade_fd, const UpgradeSession *session, const int client_fd, const int master_fd,
+                         const int shell_pidfd) {
+    char record[64 + MAX_USERNAME_LENGTH + SESSION_TOKEN_LENGTH + CGROUP_NAME_LENGTH];
+    const int fds[UPGRADE_MAX_FDS] = { client_fd, master_fd, shell_pidfd };
+
+    const int length = snprintf(record, sizeof(record), "%d%c%d%c%d%c%s%c%s%c%s", (int)session->shell_pid, '\0',
+                                session->requests, '\0', session->framed, '\0', session->username, '\0', session->token,
+                                '\0', session->cgroup);
+    if (length < 0 || (size_t)length >= sizeof(record)) {
+        return -1;
+    }
+    return send_with_fds(upgrade_fd, record, (size_t)length + 1, fds, shell_pidfd != -1 ? 3 : 2);
+}
+
+int upgrade_take_over(int *server_fd, int *metrics_fd) {
+    char hello[64];
+    int fds[UPGRADE_MAX_FDS];
+    int version, listener, metrics;
+
+    *server_fd = *metrics_fd = -1;
+    const char *value = getenv(UPGRADE_ENV);
+    if (value == NULL) {
+        return 0;
+    }
+    inherited_fd = atoi(value);
+    unsetenv(UPGRADE_ENV);  // not for the shells
+    fcntl(inherited_fd, F_SETFD, FD_CLOEXEC);
+
+    const ssize_t received = receive_with_fds(inherited_fd, hello, sizeof(hello) - 1, fds, 0);
+    if (received <= 0) {
+        perror("recvmsg upgrade");
+        return -1;
+    }
+    hello[received] = '\0';
+    const int expected = sscanf(hello, UPGRADE_HELLO " %d %d %d", &version, &listener, &metrics) == 3 ?
+                         (listener != 0) + (metrics != 0) : -1;
+    const int attached = (fds[0] != -1) + (fds[1] != -1);
+    if (expected != attached || fds[2] != -1 || version != UPGRADE_VERSION) {
+        fprintf(stderr, "Cannot take over from the running server: it sent '%s' with %d descriptors.\n", hello, attached);
+        close_fds(fds);
+        return -1;
+    }
+
+    int next = 0;
+    if (listener) *server_fd = fds[next++];
+    if (metrics) *metrics_fd = fds[next];
+    return 1;
+}
+
+void upgrade_ready(const int sessions) {
+    if (inherited_fd == -1) {
+        return;
+    }
+    if (send(inherited_fd, "R", 1, MSG_NOSIGNAL) != 1) {
+        perror("send upgrade");
+    }
+    if (!sessions) {
+        close(inherited_fd);
+        inherited_fd = -1;
+    }
+}
+
+void upgrade_forget() {
+    if (inherited_fd != -1) {
+        close(inherited_fd);
+        inherited_fd = -1;
+    }
+}
+
+int upgrade_channel() {
+    return inherited_fd;
+}
+
+int upgrade_receive_session(UpgradeSession *session, int *client_fd, int *master_fd, int *shell_pidfd) {
+    char record[64 + MAX_USERNAME_LENGTH + SESSION_TOKEN_LENGTH + CGROUP_NAME_LENGTH];
+    const char *fields[6];
+    int fds[UPGRADE_MAX_FDS];
+
+    while (inherited_fd != -1) {
+        const ssize_t received = receive_with_fds(inherited_fd, record, sizeof(record) - 1, fds, MSG_DONTWAIT);
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (received <= 0) {
+            close(inherited_fd);
+            inherited_fd = -1;
+            break;
+        }
+
+        record[received] = '\0';
+        size_t count = 0;
+        for (size_t at = 0; count < 6 && at < (size_t)received; at += strlen(record + at) + 1) {
+            fields[count++] = record + at;
+        }
+        if (count < 5 || fds[0] == -1 || fds[1] == -1 || strlen(fields[3]) >= sizeof(session->username) ||
+            strlen(fields[4]) >= sizeof(session->token) || (count == 6 && strlen(fields[5]) >= sizeof(session->cgroup))) {
+            log_event("Dropped a malformed session from the server being replaced.\n");
+            close_fds(fds);
+            continue;
+        }
+
+        session->shell_pid = (pid_t)atoi(fields[0]);
+        session->requests = atoi(fields[1]);
+        session->framed = atoi(fields[2]);
+        strcpy(session->username, fields[3]);
+        strcpy(session->token, fields[4]);
+        strcpy(session->cgroup, count == 6 ? fields[5] : "");
+        *client_fd = fds[0];
+        *master_fd = fds[1];
+        *shell_pidfd = fds[2];     // -1 from a server that does not send one
+        return 1;
+    }
+    return -1;
+}
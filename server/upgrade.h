@@ -0,0 +1,129 @@
+/**
+ * @file upgrade.h
+ * @brief Hot restart: handing the port, and with -H live sessions, to a freshly started server binary
+ *
+ * SIGUSR2 asks a running server to upgrade. It starts the binary it was
+ * started from again, with the same arguments, and passes it the listening
+ * socket and the metrics endpoint with SCM_RIGHTS over a Unix socket pair
+ * whose end the new process finds in UPGRADE_ENV. Once the new server has
+ * loaded its users and is ready to accept, it says so with one byte, and
+ * only then does the old server stop accepting. If the new server fails to
+ * start, exits, or stays silent for UPGRADE_TIMEOUT seconds, it is killed
+ * and the old server carries on as if nothing had happened.
+ *
+ * After the handover the old server drains: fork mode exits at once, since
+ * every connection already has a relay process of its own; the epoll server
+ * and the workers keep serving their sessions until the last one has ended.
+ * With -H the epoll server first passes its live sessions on, client socket
+ * and PTY master together, so they end up in the new binary too.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include "server.h"
+
+#include <sys/types.h>
+
+#define UPGRADE_ENV "EGGSHELL_UPGRADE_FD"   // names the new server's end of the upgrade socket
+#define UPGRADE_VERSION 1                   // of the messages on the upgrade socket; a new server refuses others
+#define UPGRADE_TIMEOUT 10                  // seconds the new server has to get ready
+#define UPGRADE_MAX_FDS 3                   // descriptors one message carries: client, PTY master and shell pidfd
+
+/* A live session as it passes to the new server, besides its client socket, PTY master and shell pidfd */
+typedef struct {
+    pid_t shell_pid;
+    int requests;       // what the client asked for, see stream_negotiate()
+    int framed;         // the client's stream is framed
+    char username[MAX_USERNAME_LENGTH];
+    char token[SESSION_TOKEN_LENGTH + 1];
+    char cgroup[CGROUP_NAME_LENGTH];    // the session's cgroup under the root, empty for none
+} UpgradeSession;
+
+/**
+ * @brief Remembers how the server was started, for starting it again, and blocks SIGUSR2.
+ *
+ * Must be called before any thread is started, so every thread keeps
+ * SIGUSR2 blocked and only upgrade_signal_fd() sees it.
+ *
+ * @param argv The server's argument vector, kept as it is.
+ */
+void upgrade_init(char *argv[]);
+
+/**
+ * @brief Returns this process's descriptor that becomes readable on SIGUSR2.
+ *
+ * Created on first use; a forked process that inherits it reads its own signals from it.
+ *
+ * @return The descriptor, or -1 if it could not be created.
+ */
+int upgrade_signal_fd();
+
+/**
+ * @brief Consumes the signals waiting on upgrade_signal_fd().
+ * @return 1 if an upgrade was asked for, 0 otherwise.
+ */
+int upgrade_requested();
+
+/**
+ * @brief Starts the new server and waits until it is ready to accept.
+ *
+ * @param server_fd The listening socket to pass on, -1 in workers mode, where the new workers bind their own.
+ * @return The upgrade socket, for passing sessions on and then closing, or -1 if
+ *         the new server did not start; the old server then carries on.
+ */
+int upgrade_start(int server_fd);
+
+/**
+ * @brief Passes one live session to the new server.
+ *
+ * The caller still closes its own copies of the descriptors, and must not
+ * kill the shell. The shell's pidfd lets the new server, which is not its
+ * parent, signal it without racing the reuse of its pid.
+ *
+ * @param shell_pidfd A pidfd of the shell, or -1 where pidfds are not supported.
+ * @return 0 if the new server received it, -1 if the session stays here.
+ */
+int upgrade_send_session(int upgrade_fd, const UpgradeSession *session, int client_fd, int master_fd, int shell_pidfd);
+
+/**
+ * @brief In a server started by an upgrade, receives the listening socket and metrics endpoint.
+ *
+ * @param server_fd Receives the listening socket, -1 if none came.
+ * @param metrics_fd Receives the metrics endpoint, -1 if none came.
+ * @return 1 if the server was started by an upgrade, 0 if not, -1 if the handover failed.
+ */
+int upgrade_take_over(int *server_fd, int *metrics_fd);
+
+/**
+ * @brief Tells the old server this one accepts now; nothing happens if this one was not started by an upgrade.
+ * @param sessions Whether sessions will be received with upgrade_receive_session(); the upgrade socket is closed otherwise.
+ */
+void upgrade_ready(int sessions);
+
+/**
+ * @brief Closes this process's copy of the upgrade socket, for a child forked before upgrade_ready().
+ */
+void upgrade_forget();
+
+/**
+ * @brief The upgrade socket sessions arrive on, -1 when none can.
+ */
+int upgrade_channel();
+
+/**
+ * @brief Receives one session from the old server, without waiting.
+ *
+ * @param session Receives the session.
+ * @param client_fd Receives its client socket.
+ * @param master_fd Receives its PTY master.
+ * @param shell_pidfd Receives a pidfd of its shell, -1 if none came.
+ * @return 1 if a session was received, 0 if none is waiting, -1 once the old
+ *         server is done; the upgrade socket is then closed.
+ */
+int upgrade_receive_session(UpgradeSession *session, int *client_fd, int *master_fd, int *shell_pidfd);
+
+#endif // UPGRADE_H
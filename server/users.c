@@ -0,0 +1,345 @@
+/**
+ * @file users.c
+ * @brief Credential store: a hash table of users, loaded once and swapped on change
+ *
+ * A table built from the text file is a single malloc'd block with exactly
+ * the layout of a compiled database (UsersHeader, then the slots, then the
+ * string pool), so one lookup routine serves both.
+ */
+
+#include "users.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+typedef struct {
+    char *block;            // header, slots and strings
+    size_t size;
+    int mapped;             // block is an mmapped database rather than malloc'd
+    const UsersHeader *header;
+    const UserSlot *slots;
+    const char *strings;
+} UserTable;
+
+static UserTable *active_table = NULL;
+static char watched_path[4096];
+static char watched_name[256];
+
+/* FNV-1a */
+static uint32_t hash_username(const char *username) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)username; *p != '\0'; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void free_table(UserTable *table) {
+    if (table == NULL) {
+        return;
+    }
+    if (table->mapped) {
+        munmap(table->block, table->size);
+    } else {
+        free(table->block);
+    }
+    free(table);
+}
+
+static const UserSlot *find_slot(const UserTable *table, const char *username) {
+    const uint32_t mask = table->header->capacity - 1;
+    const uint32_t hash = hash_username(username);
+
+    for (uint32_t i = hash & mask, probes = 0; probes <= mask; i = (i + 1) & mask, probes++) {
+        const UserSlot *slot = &table->slots[i];
+        if (slot->username == 0) {
+            return NULL;
+        }
+        if (slot->hash == hash && slot->username < table->header->strings_size &&
+            strcmp(table->strings + slot->username, username) == 0) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reads "username:password" lines into a string pool.
+ * @return The number of users, or -1 on failure.
+ */
+static long read_user_file(const char *path, char **pool, size_t *pool_size) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("Could not open user file");
+        return -1;
+    }
+
+    size_t capacity = 4096, used = 1;   // offset 0 is reserved for "no user"
+    long count = 0;
+    char *strings = malloc(capacity);
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+
+    if (strings == NULL) {
+        fclose(file);
+        return -1;
+    }
+    strings[0] = '\0';
+
+    while ((length = getline(&line, &line_capacity, file)) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *separator = strchr(line, ':');
+        if (separator == NULL || separator == line) {
+            continue;
+        }
+        *separator = '\0';
+        char *password = separator + 1;
+        password[strcspn(password, " \t")] = '\0';   // the password is one token, as fscanf("%s") read it
+
+        const size_t needed = strlen(line) + strlen(password) + 2;
+        if (used + needed > capacity) {
+            while (used + needed > capacity) capacity *= 2;
+            char *grown = realloc(strings, capacity);
+            if (grown == NULL) {
+                free(strings);
+                free(line);
+                fclose(file);
+                return -1;
+            }
+            strings = grown;
+        }
+        strcpy(strings + used, line);
+        used += strlen(line) + 1;
+        strcpy(strings + used, password);
+        used += strlen(password) + 1;
+        count++;
+    }
+
+    free(line);
+    fclose(file);
+    *pool = strings;
+    *pool_size = used;
+    return count;
+}
+
+/**
+ * @brief Builds a hash table block from a string pool of username/password pairs.
+ */
+static UserTable *build_table(const char *pool, const size_t pool_size, const long count) {
+    uint32_t capacity = 16;
+    while (capacity < (uint64_t)count * 2) capacity *= 2;   // load factor at most 0.5
+
+    const size_t slots_size = capacity * sizeof(UserSlot);
+    const size_t size = sizeof(UsersHeader) + slots_size + pool_size;
+    UserTable *table = calloc(1, sizeof(UserTable));
+    char *block = calloc(1, size);
+    if (table == NULL || block == NULL) {
+        free(table);
+        free(block);
+        return NULL;
+    }
+
+    UsersHeader *header = (UsersHeader *)block;
+    UserSlot *slots = (UserSlot *)(block + sizeof(UsersHeader));
+    char *strings = block + sizeof(UsersHeader) + slots_size;
+    memcpy(header->magic, USERS_DB_MAGIC, sizeof(header->magic));
+    header->capacity = capacity;
+    header->strings_size = (uint32_t)pool_size;
+    memcpy(strings, pool, pool_size);
+
+    table->block = block;
+    table->size = size;
+    table->header = header;
+    table->slots = slots;
+    table->strings = strings;
+
+    for (size_t offset = 1; offset < pool_size;) {
+        const char *username = strings + offset;
+        const size_t password = offset + strlen(username) + 1;
+        offset = password + strlen(strings + password) + 1;
+
+        /* the first entry for a username wins, as with the old linear scan */
+        if (find_slot(table, username) != NULL) {
+            continue;
+        }
+        const uint32_t hash = hash_username(username);
+        uint32_t i = hash & (capacity - 1);
+        while (slots[i].username != 0) {
+            i = (i + 1) & (capacity - 1);
+        }
+        slots[i].hash = hash;
+        slots[i].username = (uint32_t)(username - strings);
+        slots[i].password = (uint32_t)password;
+        header->count++;
+    }
+    return table;
+}
+
+static UserTable *load_text(const char *path) {
+    char *pool;
+    size_t pool_size;
+    const long count = read_user_file(path, &pool, &pool_size);
+    if (count < 0) {
+        return NULL;
+    }
+    UserTable *table = build_table(pool, pool_size, count);
+    free(pool);
+    return table;
+}
+
+static UserTable *map_database(const int fd, const size_t size) {
+    UserTable *table = calloc(1, sizeof(UserTable));
+    if (table == NULL) {
+        return NULL;
+    }
+
+    table->block = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (table->block == MAP_FAILED) {
+        perror("mmap user database");
+        free(table);
+        return NULL;
+    }
+    table->size = size;
+    table->mapped = 1;
+    table->header = (const UsersHeader *)table->block;
+    table->slots = (const UserSlot *)(table->block + sizeof(UsersHeader));
+
+    /* reject anything whose sizes do not add up, so lookups stay inside the mapping */
+    const UsersHeader *header = table->header;
+    const uint64_t expected = sizeof(UsersHeader) + (uint64_t)header->capacity * sizeof(UserSlot) + header->strings_size;
+    if (header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0 ||
+        header->strings_size == 0 || expected != size) {
+        fprintf(stderr, "User database is corrupt.\n");
+        free_table(table);
+        return NULL;
+    }
+    table->strings = table->block + sizeof(UsersHeader) + header->capacity * sizeof(UserSlot);
+    if (table->strings[header->strings_size - 1] != '\0') {
+        fprintf(stderr, "User database is corrupt.\n");
+        free_table(table);
+        return NULL;
+    }
+    return table;
+}
+
+int users_load(const char *path) {
+    UserTable *table = NULL;
+    char magic[sizeof(((UsersHeader *)0)->magic)] = { 0 };
+    struct stat info;
+
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("Could not open user file");
+        return -1;
+    }
+    if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(UsersHeader) &&
+        read(fd, magic, sizeof(magic)) == sizeof(magic) && memcmp(magic, USERS_DB_MAGIC, sizeof(magic)) == 0) {
+        table = map_database(fd, info.st_size);
+    } else {
+        table = load_text(path);
+    }
+    close(fd);
+
+    if (table == NULL) {
+        return -1;
+    }
+
+    /* sessions are served from one thread, so nothing can be looking at the old table */
+    UserTable *previous = active_table;
+    active_table = table;
+    free_table(previous);
+    return (int)table->header->count;
+}
+
+int users_authenticate(const char *username, const char *password) {
+    if (active_table == NULL) {
+        return 0;
+    }
+    const UserSlot *slot = find_slot(active_table, username);
+    return slot != NULL && slot->password < active_table->header->strings_size &&
+           strcmp(active_table->strings + slot->password, password) == 0;
+}
+
+uint32_t users_count() {
+    return active_table == NULL ? 0 : active_table->header->count;
+}
+
+int users_watch(const char *path) {
+    char directory[sizeof(watched_path)], name[sizeof(watched_path)];
+
+    /* dirname() and basename() may modify their argument, so each gets its own copy */
+    strncpy(watched_path, path, sizeof(watched_path) - 1);
+    strcpy(directory, watched_path);
+    strcpy(name, watched_path);
+    strncpy(watched_name, basename(name), sizeof(watched_name) - 1);
+
+    const int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1) {
+        perror("inotify_init1");
+        return -1;
+    }
+    if (inotify_add_watch(fd, dirname(directory), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) == -1) {
+        perror("inotify_add_watch");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int users_handle_change(const int watch_fd) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t length;
+
+    while ((length = read(watch_fd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + length;) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            if (event->len > 0 && strcmp(event->name, watched_name) == 0 && !(event->mask & IN_CREATE)) {
+                changed = 1;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    return changed ? users_load(watched_path) : 0;
+}
+
+int users_compile(const char *text_path, const char *db_path) {
+    UserTable *table = load_text(text_path);
+    if (table == NULL) {
+        return -1;
+    }
+
+    /* write next to the target and rename, so a watching server only ever sees a complete file */
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", db_path);
+    const int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        perror("open user database");
+        free_table(table);
+        return -1;
+    }
+
+    const ssize_t written = write(fd, table->block, table->size);
+    const int count = (int)table->header->count;
+    const int ok = written == (ssize_t)table->size && fsync(fd) == 0;
+    close(fd);
+    free_table(table);
+
+    if (!ok || rename(temporary, db_path) == -1) {
+        perror("write user database");
+        unlink(temporary);
+        return -1;
+    }
+    return count;
+}
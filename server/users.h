@@ -0,0 +1,88 @@
+/**
+ * @file users.h
+ * @brief Credential store: a hash table of users, loaded once and swapped on change
+ *
+ * Users are kept in an open-addressing hash table keyed by username, so a
+ * login costs one hash and a probe or two however many users there are.
+ * The table is read either from the plain "username:password" users file
+ * or from a compiled database (see usersdb) that is mmapped as is. When
+ * the file changes, a new table is built and swapped in whole, so a lookup
+ * never sees a half-loaded user list.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef USERS_H
+#define USERS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define USER_FILE "users.txt"
+#define USERS_DB_MAGIC "EGGUSR1"    // first bytes of a compiled database, NUL included
+
+/* Layout shared by the in-memory table and the compiled file, native byte order */
+typedef struct {
+    char magic[8];
+    uint32_t capacity;      // slots, a power of two
+    uint32_t count;         // users in the table
+    uint32_t strings_size;  // bytes of NUL-terminated strings after the slots
+    uint32_t reserved;
+} UsersHeader;
+
+/* One hash table slot; offsets point into the string pool, username 0 marks an empty slot */
+typedef struct {
+    uint32_t hash;
+    uint32_t username;
+    uint32_t password;
+} UserSlot;
+
+/**
+ * @brief Loads a users file or compiled database and makes it the active table.
+ *
+ * On failure the previously active table, if any, stays in use.
+ *
+ * @param path The file to load.
+ * @return The number of users loaded, or -1 on failure.
+ */
+int users_load(const char *path);
+
+/**
+ * @brief Checks a username and password against the active table.
+ * @return 1 if they match, 0 otherwise.
+ */
+int users_authenticate(const char *username, const char *password);
+
+/**
+ * @brief Returns the number of users in the active table.
+ */
+uint32_t users_count();
+
+/**
+ * @brief Starts watching a users file for changes.
+ *
+ * The directory is watched, not the file, so editors that replace the file
+ * by renaming a new one over it are noticed too.
+ *
+ * @param path The file given to users_load().
+ * @return A non-blocking inotify descriptor to poll for input, or -1.
+ */
+int users_watch(const char *path);
+
+/**
+ * @brief Drains pending inotify events and reloads the table if the file changed.
+ * @param watch_fd The descriptor returned by users_watch().
+ * @return The number of users after a reload, 0 if nothing changed, -1 if the reload failed.
+ */
+int users_handle_change(int watch_fd);
+
+/**
+ * @brief Compiles a users file into a database that users_load() can mmap.
+ * @param text_path The "username:password" users file.
+ * @param db_path The database to write.
+ * @return The number of users written, or -1 on failure.
+ */
+int users_compile(const char *text_path, const char *db_path);
+
+#endif // USERS_H
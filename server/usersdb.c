@@ -0,0 +1,26 @@
+/**
+ * @file usersdb.c
+ * @brief Compiles the users file into a database the server can mmap
+ *
+ * Usage: usersdb [users.txt] [users.db]
+ * Start the server with "-u users.db" to use the result. Recompiling while
+ * the server runs swaps the new table in, as editing users.txt does.
+ */
+
+#include "users.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char *argv[]) {
+    const char *text_path = argc > 1 ? argv[1] : USER_FILE;
+    const char *db_path = argc > 2 ? argv[2] : "users.db";
+
+    const int count = users_compile(text_path, db_path);
+    if (count < 0) {
+        fprintf(stderr, "Failed to compile %s into %s\n", text_path, db_path);
+        return EXIT_FAILURE;
+    }
+    printf("Compiled %d users from %s into %s\n", count, text_path, db_path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,185 @@
+/**
+ * @file workers.c
+ * @brief Pre-forked worker mode
+ *
+ * The supervisor keeps no listening socket of its own. It only forks the
+ * workers, waits for them and replaces any that exit.
+ *
+ * On SIGUSR2 it starts the new server, whose workers bind the port next to
+ * these, then tells its own workers to drain and waits for them to exit.
+ * Connections still queued on a worker's socket when it closes are reset
+ * by the kernel, a limit of SO_REUSEPORT.
+ */
+
+#include "server.h"
+#include "workers.h"
+#include "event_loop.h"
+#include "upgrade.h"
+#include "scrollback.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/wait.h>
+
+static volatile sig_atomic_t stopping = 0;
+static volatile sig_atomic_t upgrading = 0;
+
+static void request_stop(const int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+static void request_upgrade(const int sig) {
+    (void)sig;
+    upgrading = 1;
+}
+
+/**
+ * @brief Blocks or unblocks SIGUSR2 in the calling thread.
+ */
+static void mask_upgrade_signal(const int how) {
+    sigset_t upgrade;
+    sigemptyset(&upgrade);
+    sigaddset(&upgrade, SIGUSR2);
+    pthread_sigmask(how, &upgrade, NULL);
+}
+
+/**
+ * @brief Counts the workers still running.
+ */
+static int running_workers(const pid_t *pids, const int workers) {
+    int running = 0;
+    for (int i = 0; i < workers; i++) {
+        if (pids[i] > 0) running++;
+    }
+    return running;
+}
+
+/**
+ * @brief Forks one worker that binds its own SO_REUSEPORT socket and serves it.
+ * @return The worker's pid, or -1 if it could not be forked.
+ */
+static pid_t start_worker(const ServerConfig *config, const int index) {
+    const pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork worker");
+        log_event("Failed to fork worker %d: %s\n", index, strerror(errno));
+        return -1;
+    }
+
+    if (pid == 0) {
+        int server_fd;
+
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGUSR2, SIG_DFL);
+        mask_upgrade_signal(SIG_BLOCK);     // left to the event loop's upgrade_signal_fd()
+        upgrade_forget();                   // the supervisor tells the old server when the workers are up
+        setup_signal_handlers();
+        setup_server(&server_fd, config->port, 1);
+        log_event("Worker %d (PID %d) listening on port %d.\n", index, getpid(), config->port);
+
+        if (run_event_loop(server_fd) == 0) {
+            exit(EXIT_SUCCESS);
+        }
+        close(server_fd);
+        exit(EXIT_FAILURE);
+    }
+
+    return pid;
+}
+
+void run_workers(const ServerConfig *config) {
+    pid_t *pids = calloc(config->workers, sizeof(pid_t));
+    time_t *started = calloc(config->workers, sizeof(time_t));
+    if (pids == NULL || started == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    /* blocked in every other thread since upgrade_init(), so it interrupts the wait below */
+    sa.sa_handler = request_upgrade;
+    sigaction(SIGUSR2, &sa, NULL);
+    mask_upgrade_signal(SIG_UNBLOCK);
+
+    for (int i = 0; i < config->workers; i++) {
+        pids[i] = start_worker(config, i);
+        started[i] = time(NULL);
+    }
+    log_event("Started %d workers on port %d (backlog %d).\n", config->workers, config->port, config->backlog);
+    upgrade_ready(0);
+
+    int draining = 0;
+    while (!stopping && (!draining || running_workers(pids, config->workers) > 0)) {
+        if (upgrading) {
+            upgrading = 0;
+            log_event("Upgrade asked for.\n");
+            const int upgrade_fd = draining ? -1 : upgrade_start(-1);
+            if (upgrade_fd != -1) {
+                close(upgrade_fd);
+                draining = 1;
+                log_event("Draining %d workers.\n", running_workers(pids, config->workers));
+                for (int i = 0; i < config->workers; i++) {
+                    if (pids[i] > 0) kill(pids[i], SIGUSR2);
+                }
+            }
+        }
+
+        int status;
+        const pid_t pid = waitpid(-1, &status, 0);
+        if (pid == -1) {
+            if (errno == EINTR) continue;
+            perror("waitpid");
+            break;
+        }
+
+        scrollback_reclaim(pid);    // what a worker that died mid-chunk was writing
+        for (int i = 0; i < config->workers; i++) {
+            if (pids[i] != pid) continue;
+
+            if (WIFSIGNALED(status)) {
+                log_event("Worker %d (PID %d) killed by signal %d.\n", i, pid, WTERMSIG(status));
+            } else {
+                log_event("Worker %d (PID %d) exited with status %d.\n", i, pid, WEXITSTATUS(status));
+            }
+            if (stopping || draining) {
+                pids[i] = 0;
+                break;
+            }
+
+            /* a worker that cannot even start (e.g. bind fails) must not spin the supervisor */
+            if (time(NULL) - started[i] < WORKER_RESTART_DELAY) {
+                sleep(WORKER_RESTART_DELAY);
+            }
+            pids[i] = start_worker(config, i);
+            started[i] = time(NULL);
+            break;
+        }
+    }
+
+    if (stopping) {
+        log_event("Stopping %d workers.\n", running_workers(pids, config->workers));
+        for (int i = 0; i < config->workers; i++) {
+            if (pids[i] > 0) kill(pids[i], SIGTERM);
+        }
+    }
+    /* waited for one by one: after an upgrade the new server is a child of this one too */
+    for (int i = 0; i < config->workers; i++) {
+        while (pids[i] > 0 && waitpid(pids[i], NULL, 0) == -1 && errno == EINTR);
+    }
+
+    free(pids);
+    free(started);
+}
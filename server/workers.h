@@ -0,0 +1,31 @@
+/**
+ * @file workers.h
+ * @brief Pre-forked worker mode
+ *
+ * The supervisor starts a fixed set of long-lived workers. Each worker binds
+ * its own SO_REUSEPORT listening socket and runs the epoll event loop, so
+ * the kernel balances new connections across workers and nothing forks on
+ * the connect path. Workers that die are restarted.
+ *
+ * @author Shaun Matthews & Louise Barjaktarevic
+ * @date 18/10/26
+ */
+
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include "server.h"
+
+#define WORKER_RESTART_DELAY 1  // seconds to wait before restarting a worker that died at startup
+
+/**
+ * @brief Starts and supervises the configured number of workers.
+ *
+ * Returns once the supervisor is asked to stop (SIGINT or SIGTERM) and every
+ * worker has exited.
+ *
+ * @param config Port, backlog and worker count for the workers.
+ */
+void run_workers(const ServerConfig *config);
+
+#endif // WORKERS_H
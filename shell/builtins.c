@@ -14,6 +14,7 @@
 #include "definitions.h"
 #include "terminal.h"
 #include "../protocol.h"
+#include "../echo_trace.h"
 
 /* System Includes */
 #include <stdio.h>
@@ -26,11 +27,414 @@
 #include <sys/select.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <zlib.h>
 /* End Includes */
 
 #define MAX_PASSWORD_LENGTH  32
 #define MAX_USERNAME_LENGTH  32
 #define BUFFER_SIZE  4096
+#define RESUME_ATTEMPTS 5           // reconnects tried after the connection to the server drops
+#define RESUME_INTERVAL 1           // seconds between them
+#define COMPRESS_CODECS "deflate"   // codecs offered in COMPRESS_REQUEST
+#define KEEPALIVE_INTERVAL 15       // seconds of silence before a keepalive; as long again without a reply and the link is dead
+#define ECHO_TRACE_VARIABLE "EGG_ECHO_TRACE"    // names the file the echo trace of a relay is appended to
+
+/* What is needed to resume the current remote session after a dropped connection */
+static char session_host[256];
+static int session_port;
+static char session_token[64];      // empty if the server cannot resume the session
+static int session_asked;           // RELAY_ASK_FRAMED and RELAY_ASK_COMPRESSED, asked again on resuming
+
+/* Output from the server arrives deflated while this is set, until its stream ends */
+static z_stream inflater;
+static int inflating;
+
+/* The relay is framed while this is set: keystrokes go out as RELAY_DATA, signals and resizes as RELAY_CONTROL */
+static int framed;
+static char frames[FRAME_MAX_WIRE_SIZE];    // server output of a frame not complete yet
+static size_t frames_length;
+
+/* Keystroke-to-echo latency of the relay, when ECHO_TRACE_VARIABLE is set */
+static EchoTrace echo_trace;
+
+/* Set by the relay's signal handlers, sent as control frames by relay_data() */
+static volatile sig_atomic_t pending_control;
+static volatile sig_atomic_t window_changed;
+
+/* Channels, when the server offers them: more remote shells on the connection, one shown at a time */
+#define CHANNEL_KEY 0x1d            // CTRL-], then c opens a channel, 0-7 or n switches, CTRL-] types itself
+static int channels;
+static int channel_opened[CHANNEL_MAX];
+static int channel_opening[CHANNEL_MAX];    // CHANNEL_OPEN sent, no answer yet
+static int shown_channel;           // the channel on screen, which gets the keystrokes
+static int input_channel;           // the channel the server takes our frames for
+static int output_channel;          // the channel of the server's data frames
+static char held[CHANNEL_MAX][CHANNEL_WINDOW_SIZE];     // output of channels not shown; the window keeps it from overflowing
+static size_t held_length[CHANNEL_MAX];
+static size_t credit_due[CHANNEL_MAX];      // output shown since the channel's window was last widened
+static int key_prefix;              // CHANNEL_KEY was the last key typed
+
+/**
+ * @brief Asks for a framed relay; sent in reply to the username prompt, ahead of everything else.
+ */
+static void request_framing(const int socket_fd) {
+    Message msg;
+    msg.status_code = RELAY_FRAMED;
+    msg.control_code = ESCAPE_CODE_NONE;
+    strcpy(msg.content, RELAY_CHANNELS);
+    msg.content_length = strlen(msg.content);
+    send_message(socket_fd, &msg);
+}
+
+/**
+ * @brief Reads the server's RELAY_FRAMED confirmation, which comes ahead of COMPRESS_START, if framing was asked for.
+ *
+ * A new connection has only channel 0, the login shell: the others end with
+ * the connection they were opened on.
+ */
+static void start_framing(const int socket_fd) {
+    Message msg;
+    framed = (session_asked & RELAY_ASK_FRAMED) && receive_message(socket_fd, &msg) > 0 &&
+             msg.status_code == RELAY_FRAMED;
+    channels = framed && strcmp(msg.content, RELAY_CHANNELS) == 0;
+    frames_length = 0;
+
+    if (shown_channel != 0) {
+        printf("\r\n[channel 0]\r\n");
+        fflush(stdout);
+    }
+    memset(channel_opened, 0, sizeof(channel_opened));
+    memset(channel_opening, 0, sizeof(channel_opening));
+    memset(held_length, 0, sizeof(held_length));
+    memset(credit_due, 0, sizeof(credit_due));
+    channel_opened[0] = 1;
+    shown_channel = input_channel = output_channel = 0;
+    key_prefix = 0;
+}
+
+/**
+ * @brief Sends one frame with a single write.
+ * @return 0 on success, -1 on error.
+ */
+static int send_frame(const int socket_fd, const ResponseCode type, const ControlCode control_code,
+                      const char *payload, const size_t length) {
+    char wire[FRAME_MAX_WIRE_SIZE];
+    encode_frame_header(wire, type, control_code, length);
+    memcpy(wire + MESSAGE_HEADER_SIZE, payload, length);
+    const ssize_t size = MESSAGE_HEADER_SIZE + length;
+    return write(socket_fd, wire, size) == size ? 0 : -1;
+}
+
+/**
+ * @brief Sends a data or control frame for the channel on screen, selecting it first if need be.
+ * @return 0 on success, -1 on error.
+ */
+static int send_to_shown_channel(const int socket_fd, const ResponseCode type, const ControlCode control_code,
+                                 const char *payload, const size_t length) {
+    if (channels && input_channel != shown_channel) {
+        if (send_frame(socket_fd, CHANNEL_SELECT, (ControlCode)shown_channel, NULL, 0) == -1) {
+            return -1;
+        }
+        input_channel = shown_channel;
+    }
+    return send_frame(socket_fd, type, control_code, payload, length);
+}
+
+/**
+ * @brief Tells the server the size of the local terminal, for the remote PTY.
+ * @return 0 on success or if stdin is not a terminal, -1 if sending failed.
+ */
+static int send_window_size(const int socket_fd) {
+    struct winsize size;
+    char content[WINDOW_SIZE_LENGTH];
+    if (ioctl(STDIN_FILENO, TIOCGWINSZ, &size) == -1) {
+        return 0;
+    }
+    encode_window_size(content, size.ws_row, size.ws_col);
+    return send_to_shown_channel(socket_fd, RELAY_CONTROL, ESCAPE_CODE_WINDOW_SIZE, content, sizeof(content));
+}
+
+/**
+ * @brief Widens the window of every channel by the output shown since it was last widened.
+ *
+ * Credit goes out a quarter window at a time, so a channel streaming output
+ * costs one small frame per 16 KiB.
+ *
+ * @return 0 on success, -1 if sending failed.
+ */
+static int send_credit(const int socket_fd) {
+    char content[CHANNEL_CREDIT_LENGTH];
+    for (int i = 0; channels && i < CHANNEL_MAX; i++) {
+        if (credit_due[i] < CHANNEL_WINDOW_SIZE / 4) {
+            continue;
+        }
+        encode_channel_credit(content, credit_due[i]);
+        if (send_frame(socket_fd, CHANNEL_WINDOW, (ControlCode)i, content, sizeof(content)) == -1) {
+            return -1;
+        }
+        credit_due[i] = 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief Puts a channel on screen, with the output it produced while hidden.
+ * @return 0 on success, -1 if writing to stdout failed.
+ */
+static int show_channel(const int channel) {
+    printf("\r\n[channel %d]\r\n", channel);
+    fflush(stdout);
+    shown_channel = channel;
+    window_changed = 1;     // a new shell, or one resized while hidden
+    if (write(STDOUT_FILENO, held[channel], held_length[channel]) != (ssize_t)held_length[channel]) {
+        return -1;
+    }
+    credit_due[channel] += held_length[channel];
+    held_length[channel] = 0;
+    return 0;
+}
+
+/**
+ * @brief Acts on the key typed after CHANNEL_KEY.
+ * @return 0 on success, -1 on error.
+ */
+static int channel_command(const int socket_fd, const char key) {
+    if (key == CHANNEL_KEY) {
+        return send_to_shown_channel(socket_fd, RELAY_DATA, ESCAPE_CODE_NONE, &key, 1);
+    }
+    if (key == 'c') {
+        /* an id is free again once the server's CHANNEL_CLOSE for it has arrived */
+        for (int i = 1; i < CHANNEL_MAX; i++) {
+            if (!channel_opened[i] && !channel_opening[i]) {
+                channel_opening[i] = 1;
+                return send_frame(socket_fd, CHANNEL_OPEN, (ControlCode)i, NULL, 0);
+            }
+        }
+        printf("\r\n[all %d channels are open]\r\n", CHANNEL_MAX);
+        fflush(stdout);
+        return 0;
+    }
+    int channel = -1;
+    if (key >= '0' && key < '0' + CHANNEL_MAX) {
+        channel = key - '0';
+    } else if (key == 'n') {
+        channel = (shown_channel + 1) % CHANNEL_MAX;
+        while (!channel_opened[channel]) {
+            channel = (channel + 1) % CHANNEL_MAX;
+        }
+    }
+    return (channel >= 0 && channel_opened[channel]) ? show_channel(channel) : 0;
+}
+
+/**
+ * @brief Sends typed keys to the channel on screen, acting on channel commands among them.
+ *
+ * The terminal is line-buffered, so a command is typed as its own line; the
+ * newline after it is not sent.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int send_keys(const int socket_fd, const char *keys, const int length) {
+    int start = 0;  // first key not sent yet
+
+    for (int i = 0; channels && i < length; i++) {
+        if (!key_prefix && keys[i] != CHANNEL_KEY) {
+            continue;
+        }
+        if (i > start && send_to_shown_channel(socket_fd, RELAY_DATA, ESCAPE_CODE_NONE, keys + start, i - start) == -1) {
+            return -1;
+        }
+        key_prefix = !key_prefix;
+        if (!key_prefix) {
+            if (channel_command(socket_fd, keys[i]) == -1) {
+                return -1;
+            }
+            if (i + 1 < length && keys[i + 1] == '\n') {
+                i++;
+            }
+        }
+        start = i + 1;
+    }
+    if (length > start) {
+        return send_to_shown_channel(socket_fd, RELAY_DATA, ESCAPE_CODE_NONE, keys + start, length - start);
+    }
+    return 0;
+}
+
+/**
+ * @brief Shows a data frame's payload, or holds it while its channel is not on screen.
+ * @return 0 on success, -1 on error.
+ */
+static int show_data(const Frame *frame) {
+    if (!channels) {
+        return write(STDOUT_FILENO, frame->payload, frame->length) == (ssize_t)frame->length ? 0 : -1;
+    }
+    if (output_channel != shown_channel) {
+        const size_t room = sizeof(held[0]) - held_length[output_channel];
+        const size_t kept = frame->length < room ? frame->length : room;
+        memcpy(held[output_channel] + held_length[output_channel], frame->payload, kept);
+        held_length[output_channel] += kept;
+        return 0;
+    }
+    credit_due[output_channel] += frame->length;
+    return write(STDOUT_FILENO, frame->payload, frame->length) == (ssize_t)frame->length ? 0 : -1;
+}
+
+/**
+ * @brief Follows the server's channel frames: which channel the output is from, and channels opening and closing.
+ * @return 0 on success, -1 on error.
+ */
+static int follow_channel(const Frame *frame) {
+    const int channel = frame->control_code;
+    if (channel >= CHANNEL_MAX) {
+        return -1;
+    }
+    switch (frame->type) {
+    case CHANNEL_SELECT:
+        output_channel = channel;
+        return 0;
+    case CHANNEL_OPEN:
+        channel_opening[channel] = 0;
+        channel_opened[channel] = 1;
+        return show_channel(channel);
+    case CHANNEL_CLOSE:
+        channel_opening[channel] = channel_opened[channel] = 0;
+        held_length[channel] = credit_due[channel] = 0;
+        printf("\r\n[channel %d closed]\r\n", channel);
+        fflush(stdout);
+        return shown_channel == channel ? show_channel(0) : 0;
+    default:
+        return 0;
+    }
+}
+
+static void catch_relay_signal(const int sig) {
+    if (sig == SIGWINCH) {
+        window_changed = 1;
+    } else {
+        pending_control = sig == SIGINT ? ESCAPE_CODE_CTRL_C : ESCAPE_CODE_CTRL_Z;
+    }
+}
+
+/**
+ * @brief Shows server output that has been inflated, taking the frames apart on a framed relay.
+ * @return 0 on success, -1 on error.
+ */
+static int show_output(const char *data, size_t length) {
+    Frame frame;
+    int consumed;
+
+    if (!framed) {
+        return write(STDOUT_FILENO, data, length) == (ssize_t)length ? 0 : -1;
+    }
+    while (length > 0) {
+        const size_t room = sizeof(frames) - frames_length;
+        const size_t copied = length < room ? length : room;
+        memcpy(frames + frames_length, data, copied);
+        frames_length += copied;
+        data += copied;
+        length -= copied;
+
+        size_t offset = 0;
+        while ((consumed = decode_frame(frames + offset, frames_length - offset, &frame)) > 0) {
+            if (frame.type == RELAY_DATA && show_data(&frame) == -1) {
+                return -1;
+            }
+            if (frame.type >= CHANNEL_OPEN && frame.type <= CHANNEL_CLOSE && follow_channel(&frame) == -1) {
+                fprintf(stderr, "\nMalformed channel frame from the server.\n");
+                return -1;
+            }
+            if (frame.type < RELAY_DATA) {
+                printf("\n%.*s\n", (int)frame.length, frame.payload);     // the server's last words
+                fflush(stdout);
+            }
+            if (frame.type == RELAY_CONTROL && frame.control_code == ESCAPE_CODE_NOTICE) {
+                printf("\r\n[%.*s]\r\n", (int)frame.length, frame.payload);   // e.g. a timeout warning
+                fflush(stdout);
+            }
+            offset += consumed;     // other control frames from the server are keepalive replies
+        }
+        if (consumed < 0) {
+            fprintf(stderr, "\nMalformed frame from the server.\n");
+            return -1;
+        }
+        frames_length -= offset;
+        memmove(frames, frames + offset, frames_length);
+    }
+    return 0;
+}
+
+/**
+ * @brief Offers compressed output; sent in reply to the username prompt, ahead of the answer.
+ */
+static void request_compression(const int socket_fd) {
+    Message msg;
+    msg.status_code = COMPRESS_REQUEST;
+    msg.control_code = ESCAPE_CODE_NONE;
+    strcpy(msg.content, COMPRESS_CODECS);
+    msg.content_length = strlen(msg.content);
+    send_message(socket_fd, &msg);
+}
+
+/**
+ * @brief Reads the server's COMPRESS_START, if compression was asked for, and sets up decompression of what follows.
+ */
+static void start_decompression(const int socket_fd) {
+    Message msg;
+
+    if (inflating) {
+        inflateEnd(&inflater);  // a stream cut off by a dropped connection
+        inflating = 0;
+    }
+    if (!(session_asked & RELAY_ASK_COMPRESSED) || receive_message(socket_fd, &msg) <= 0 || msg.status_code != COMPRESS_START ||
+        strcmp(msg.content, "deflate") != 0) {
+        return;
+    }
+    memset(&inflater, 0, sizeof(inflater));
+    inflating = inflateInit2(&inflater, -MAX_WBITS) == Z_OK;
+}
+
+/**
+ * @brief Writes server output to stdout, inflating it while the stream lasts.
+ * @return 0 on success, -1 on error.
+ */
+static int write_output(const char *data, const int length) {
+    char plain[BUFFER_SIZE * 4];
+
+    if (!inflating) {
+        return show_output(data, length);
+    }
+    inflater.next_in = (Bytef *)data;
+    inflater.avail_in = length;
+    int status = Z_OK;
+    while (status == Z_OK && (inflater.avail_in > 0 || inflater.avail_out == 0)) {
+        inflater.next_out = (Bytef *)plain;
+        inflater.avail_out = sizeof(plain);
+        status = inflate(&inflater, Z_SYNC_FLUSH);
+        const int produced = sizeof(plain) - inflater.avail_out;
+        if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+            fprintf(stderr, "\nCorrupt compressed output: %s\n", inflater.msg ? inflater.msg : "unknown error");
+            return -1;
+        }
+        if (show_output(plain, produced) == -1) {
+            return -1;
+        }
+    }
+    if (status == Z_STREAM_END) {
+        /* the server ended the stream, the rest is plain */
+        const int rest = inflater.avail_in;
+        const char *plain_rest = (const char *)inflater.next_in;
+        inflateEnd(&inflater);
+        inflating = 0;
+        return rest > 0 ? write_output(plain_rest, rest) : 0;
+    }
+    return 0;
+}
 
 void change_directory(const char *path) {
     if (chdir(path) < 0) {
@@ -159,45 +563,105 @@ void error(const char *msg) {
     exit(EXIT_FAILURE);
 }
 
-void connect_to_server(char *hostname, const int port) {
+/**
+ * @brief Asks for a line on the terminal, without its newline.
+ */
+static void read_login_field(const char *prompt, char *field, const size_t size) {
+    printf("%s ", prompt);
+    fflush(stdout);
+    if (fgets(field, size, stdin) == NULL) {
+        field[0] = '\0';
+    }
+    field[strcspn(field, "\n")] = '\0';
+}
+
+/**
+ * @brief Sends the whole login in one write: the relay and compression requests asked for, then an AUTH_REQUEST.
+ *
+ * The server answers with AUTH_SUCCESS without prompting, so logging in
+ * takes one round trip instead of three. A server that does not know
+ * AUTH_REQUEST takes it for the username and prompts for the password.
+ * @return 0 on success, -1 if the login does not fit or sending failed.
+ */
+static int send_login(const int socket_fd, const AuthRequest *login) {
+    char wire[3 * MESSAGE_MAX_WIRE_SIZE];
+    Message msg = { .control_code = ESCAPE_CODE_NONE };
+    int length = 0;
+
+    if (session_asked & RELAY_ASK_FRAMED) {
+        msg.status_code = RELAY_FRAMED;
+        strcpy(msg.content, RELAY_CHANNELS);
+        msg.content_length = strlen(msg.content);
+        length += encode_message(&msg, wire + length, sizeof(wire) - length);
+    }
+    if (session_asked & RELAY_ASK_COMPRESSED) {
+        msg.status_code = COMPRESS_REQUEST;
+        strcpy(msg.content, COMPRESS_CODECS);
+        msg.content_length = strlen(msg.content);
+        length += encode_message(&msg, wire + length, sizeof(wire) - length);
+    }
+
+    int encoded;
+    if (encode_auth_request(login, &msg) == -1 ||
+        (encoded = encode_message(&msg, wire + length, sizeof(wire) - length)) == -1) {
+        return -1;
+    }
+    length += encoded;
+    return write(socket_fd, wire, length) == length ? 0 : -1;
+}
+
+void connect_to_server(char *hostname, const int port, const int asked) {
+    AuthRequest login = { 0 };
+    struct winsize size;
+
+    session_asked = asked;
+
+    // The login goes out with the connection, so ask for it first
+    read_login_field("Username:", login.username, sizeof(login.username));
+    read_login_field("Password:", login.password, sizeof(login.password));
+    if (ioctl(STDIN_FILENO, TIOCGWINSZ, &size) == 0) {
+        login.rows = size.ws_row;
+        login.columns = size.ws_col;
+    }
+    const char *term = getenv("TERM");
+    if (term != NULL && strlen(term) < sizeof(login.term)) {
+        strcpy(login.term, term);
+    }
+
     int socket_fd = create_and_connect_socket(hostname, port);
     if (socket_fd == -1) {
         fprintf(stderr, "Failed to establish connection to %s:%d\n", hostname, port);
         return;
     }
+    if (send_login(socket_fd, &login) == -1) {
+        fprintf(stderr, "Failed to send the login to %s:%d\n", hostname, port);
+        close(socket_fd);
+        return;
+    }
 
     Message msg;
-    char buffer[BUFFER_SIZE];
 
-    // Handle username prompt
-    if (receive_message(socket_fd, &msg) > 0 && strstr(msg.content, "Username:")) {
-        printf("%s", msg.content);
-        fgets(buffer, sizeof(buffer), stdin);
-        buffer[strcspn(buffer, "\n")] = '\0';
-        strncpy(msg.content, buffer, sizeof(msg.content) - 1);
-        msg.content_length = strlen(msg.content);
-        send_message(socket_fd, &msg);
+    // The username prompt is already answered; a busy server turns the connection away instead
+    int received = receive_message(socket_fd, &msg) > 0;
+    if (received && msg.status_code == RESPONSE_OK && strstr(msg.content, "Username:")) {
+        received = receive_message(socket_fd, &msg) > 0;
     }
-
-    if (receive_message(socket_fd, &msg) > 0 && strstr(msg.content, "Password:")) {
-        printf("%s", msg.content);
-        fgets(buffer, sizeof(buffer), stdin);
-        buffer[strcspn(buffer, "\n")] = '\0';  // Remove newline character from input
-
-        // Log the password being sent (for debugging purposes only)
-        printf("Sending password: '%s'\n", buffer);
-
-        // Populate the message structure with the password
-        strncpy(msg.content, buffer, sizeof(msg.content) - 1);
-        msg.content[sizeof(msg.content) - 1] = '\0';
+    if (received && msg.status_code == CONNECTION_FAILURE) {
+        printf("%s\n", msg.content);
+        close(socket_fd);
+        return;
+    }
+    if (received && msg.status_code == RESPONSE_OK && strstr(msg.content, "Password:")) {
+        // An older server took the login for a username
+        msg.control_code = ESCAPE_CODE_NONE;
+        strcpy(msg.content, login.password);
         msg.content_length = strlen(msg.content);
-
-        // Send the password message to the server
         send_message(socket_fd, &msg);
+        received = receive_message(socket_fd, &msg) > 0;
     }
 
     // Authentication response
-    if (receive_message(socket_fd, &msg) > 0) {
+    if (received) {
         printf("%s", msg.content);
         if (msg.status_code != AUTH_SUCCESS) {
             close(socket_fd);
@@ -205,29 +669,185 @@ void connect_to_server(char *hostname, const int port) {
         }
     }
 
+    // Token for resuming the session if the connection drops
+    session_token[0] = '\0';
+    if (receive_message(socket_fd, &msg) > 0 && msg.status_code == SESSION_TOKEN) {
+        strncpy(session_token, msg.content, sizeof(session_token) - 1);
+        session_token[sizeof(session_token) - 1] = '\0';
+    }
+    start_framing(socket_fd);
+    start_decompression(socket_fd);
+    strncpy(session_host, hostname, sizeof(session_host) - 1);
+    session_host[sizeof(session_host) - 1] = '\0';
+    session_port = port;
+
+    relay_data(socket_fd);
+    printf("Connection closed.\n");
+}
+
+/**
+ * @brief Reconnects and presents the session token, so the remote shell carries on.
+ * @param attempts How many times to try.
+ * @param replay Ask for the session's scrollback, for a terminal that has not shown its output.
+ * @return The new socket, or -1 if the session could not be resumed.
+ */
+static int resume_session(const int attempts, const int replay) {
+    Message msg;
+
+    if (session_token[0] == '\0') {
+        return -1;
+    }
+
+    for (int attempt = 0; attempt < attempts; attempt++) {
+        if (attempt > 0) {
+            sleep(RESUME_INTERVAL);
+        }
+        const int socket_fd = create_and_connect_socket(session_host, session_port);
+        if (socket_fd == -1) {
+            continue;   // the link may still be down
+        }
+
+        // The server prompts for a username, the token goes in its place
+        if (receive_message(socket_fd, &msg) > 0) {
+            if (session_asked & RELAY_ASK_FRAMED) {
+                request_framing(socket_fd);
+            }
+            if (session_asked & RELAY_ASK_COMPRESSED) {
+                request_compression(socket_fd);
+            }
+            if (replay) {
+                msg.status_code = SCROLLBACK_REQUEST;
+                msg.control_code = ESCAPE_CODE_NONE;
+                msg.content_length = 0;
+                send_message(socket_fd, &msg);
+            }
+            msg.status_code = SESSION_RESUME;
+            msg.control_code = ESCAPE_CODE_NONE;
+            strncpy(msg.content, session_token, sizeof(msg.content) - 1);
+            msg.content[sizeof(msg.content) - 1] = '\0';
+            msg.content_length = strlen(msg.content);
+            if (send_message(socket_fd, &msg) >= 0 && receive_message(socket_fd, &msg) > 0 &&
+                msg.status_code == SESSION_RESUMED) {
+                start_framing(socket_fd);
+                start_decompression(socket_fd);
+                return socket_fd;
+            }
+        }
+        close(socket_fd);
+
+        if (msg.status_code == SESSION_RESUME_FAIL) {
+            break;  // the session has ended, retrying will not bring it back
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Tells the user how to get back to a session the link dropped, which the server keeps for a while.
+ */
+static void print_attach_hint() {
+    if (session_token[0] != '\0') {
+        printf("If the server still has the session, attach to it with: attach %s%s %d %s\n",
+               session_asked == 0 ? "-r " : "", session_host, session_port, session_token);
+    }
+}
+
+void attach_session(char *hostname, const int port, const char *token, const int asked) {
+    session_asked = asked;
+    strncpy(session_host, hostname, sizeof(session_host) - 1);
+    session_host[sizeof(session_host) - 1] = '\0';
+    session_port = port;
+    strncpy(session_token, token, sizeof(session_token) - 1);
+    session_token[sizeof(session_token) - 1] = '\0';
+
+    const int socket_fd = resume_session(1, 1);
+    if (socket_fd == -1) {
+        fprintf(stderr, "No session to attach to on %s:%d with that token\n", hostname, port);
+        return;
+    }
     relay_data(socket_fd);
     printf("Connection closed.\n");
 }
 
-void relay_data(const int socket) {
+/**
+ * @brief Summarises the relay's echo trace and appends it to the trace file.
+ */
+static void report_echo_trace(const char *path) {
+    fprintf(stderr, "Echo latency: %llu traced, %llu unanswered; p50/p99 in us: round trip %llu/%llu, "
+            "network and server %llu/%llu\n",
+            (unsigned long long)echo_trace.echoes, (unsigned long long)echo_trace.unanswered,
+            (unsigned long long)echo_trace_percentile(&echo_trace, ECHO_STAGE_TOTAL, 0.5),
+            (unsigned long long)echo_trace_percentile(&echo_trace, ECHO_STAGE_TOTAL, 0.99),
+            (unsigned long long)echo_trace_percentile(&echo_trace, ECHO_STAGE_TURNAROUND, 0.5),
+            (unsigned long long)echo_trace_percentile(&echo_trace, ECHO_STAGE_TURNAROUND, 0.99));
+    if (echo_trace_export(&echo_trace, path, "client", session_token) == -1) {
+        fprintf(stderr, "Could not write the echo trace to %s\n", path);
+    }
+}
+
+void relay_data(int socket) {
     fd_set read_fds;
-    const int max_fd = (socket > STDIN_FILENO) ? socket : STDIN_FILENO;
+    int max_fd = (socket > STDIN_FILENO) ? socket : STDIN_FILENO;
     int n;
+    int keepalive_sent = 0;
+    struct sigaction relay_action, saved_int, saved_tstp, saved_winch;
+    const int catching = framed;
+    const char *trace_path = getenv(ECHO_TRACE_VARIABLE);
+
+    echo_trace_start(&echo_trace, trace_path != NULL && *trace_path != '\0');
+
+    /* on a framed relay CTRL-C, CTRL-Z and resizes are meant for the remote shell */
+    if (catching) {
+        memset(&relay_action, 0, sizeof(relay_action));
+        relay_action.sa_handler = catch_relay_signal;
+        sigemptyset(&relay_action.sa_mask);
+        relay_action.sa_flags = 0;     // no SA_RESTART: select() returns so the frame goes out at once
+        sigaction(SIGINT, &relay_action, &saved_int);
+        sigaction(SIGTSTP, &relay_action, &saved_tstp);
+        sigaction(SIGWINCH, &relay_action, &saved_winch);
+        pending_control = 0;
+        window_changed = 1;
+    }
 
     while (1) {
         char buffer[BUFFER_SIZE];
-        FD_ZERO(&read_fds);
-        FD_SET(STDIN_FILENO, &read_fds);
-        FD_SET(socket, &read_fds);
-
-        // wait for data on either stdin or socket
-        if (select(max_fd + 1, &read_fds, NULL, NULL, NULL) == -1) {
-            perror("select");
-            break;
+        int lost = 0;
+
+        if (framed && window_changed) {
+            window_changed = 0;
+            lost = send_window_size(socket) == -1;
+        }
+        if (framed && pending_control && !lost) {
+            const ControlCode control_code = pending_control;
+            pending_control = 0;
+            lost = send_to_shown_channel(socket, RELAY_CONTROL, control_code, NULL, 0) == -1;
+        }
+
+        if (!lost) {
+            FD_ZERO(&read_fds);
+            FD_SET(STDIN_FILENO, &read_fds);
+            FD_SET(socket, &read_fds);
+
+            // wait for data on either stdin or socket
+            struct timeval timeout = { KEEPALIVE_INTERVAL, 0 };
+            const int ready = select(max_fd + 1, &read_fds, NULL, NULL, framed ? &timeout : NULL);
+            if (ready == -1 && errno == EINTR) {
+                continue;   // a signal for the remote shell
+            }
+            if (ready == -1) {
+                perror("select");
+                break;
+            }
+            if (ready == 0) {
+                /* the server answers a keepalive at once, a second silent interval means the link is gone */
+                lost = keepalive_sent || send_frame(socket, RELAY_CONTROL, ESCAPE_CODE_KEEPALIVE, NULL, 0) == -1;
+                keepalive_sent = 1;
+                FD_ZERO(&read_fds);
+            }
         }
 
         // poll data on stdin
-        if (FD_ISSET(STDIN_FILENO, &read_fds)) {
+        if (!lost && FD_ISSET(STDIN_FILENO, &read_fds)) {
             n = read(STDIN_FILENO, buffer, sizeof(buffer));
             if (n < 0) {
                 perror("read from stdin");
@@ -239,33 +859,78 @@ void relay_data(const int socket) {
             }
 
             // end data to server
-            if (write(socket, buffer, n) != n) {
+            echo_trace_input(&echo_trace);
+            const int sent = framed ? send_keys(socket, buffer, n) == 0 : write(socket, buffer, n) == n;
+            if (!sent) {
                 perror("write to socket");
+                lost = 1;   // the keystrokes are lost, the shell carries on
+            }
+            echo_trace_forwarded(&echo_trace);
+        }
+
+        if (lost) {
+            close(socket);
+            printf("\nConnection lost, resuming session...\n");
+            if ((socket = resume_session(RESUME_ATTEMPTS, 0)) == -1) {
+                printf("Could not resume the session.\n");
+                print_attach_hint();
                 break;
             }
+            max_fd = (socket > STDIN_FILENO) ? socket : STDIN_FILENO;
+            keepalive_sent = 0;
+            window_changed = 1;     // the terminal may have been resized meanwhile
+            continue;
         }
 
         // poll data on socket
         if (FD_ISSET(socket, &read_fds)) {
             n = read(socket, buffer, sizeof(buffer));
-            if (n < 0) {
-                perror("read from socket");
-                break;
-            } else if (n == 0) {
-                printf("\nServer closed the connection.\n");
-                break;
+            if (n <= 0) {
+                /* a reset link is worth several tries; a clean close usually means the shell exited */
+                if (n < 0) {
+                    perror("read from socket");
+                    printf("\nConnection lost, resuming session...\n");
+                }
+                close(socket);
+                if ((socket = resume_session(n < 0 ? RESUME_ATTEMPTS : 1, 0)) == -1) {
+                    printf("\nServer closed the connection.\n");
+                    if (n < 0) {
+                        print_attach_hint();
+                    }
+                    break;
+                }
+                max_fd = (socket > STDIN_FILENO) ? socket : STDIN_FILENO;
+                keepalive_sent = 0;
+                window_changed = 1;
+                continue;
             }
+            keepalive_sent = 0;
 
             // data to stdout
-            if (write(STDOUT_FILENO, buffer, n) != n) {
+            echo_trace_answered(&echo_trace);
+            if (write_output(buffer, n) == -1) {
                 perror("write to stdout");
                 break;
             }
+            echo_trace_delivered(&echo_trace, NULL);
+            if (send_credit(socket) == -1) {
+                perror("write to socket");  // the next read finds the connection lost
+            }
         }
     }
 
     // Cleanup
-    close(socket);
+    if (catching) {
+        sigaction(SIGINT, &saved_int, NULL);
+        sigaction(SIGTSTP, &saved_tstp, NULL);
+        sigaction(SIGWINCH, &saved_winch, NULL);
+    }
+    if (socket != -1) {
+        close(socket);
+    }
+    if (echo_trace.enabled) {
+        report_echo_trace(trace_path);
+    }
 }
 
 int create_and_connect_socket(const char *hostname, const int port) {
@@ -309,6 +974,13 @@ int create_and_connect_socket(const char *hostname, const int port) {
         return -1;
     }
 
+    // Keystrokes go out at once instead of waiting behind Nagle for the previous echo
+    const int yes = 1;
+    if ((p->ai_family == AF_INET || p->ai_family == AF_INET6) &&
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) == -1) {
+        perror("setsockopt TCP_NODELAY");
+    }
+
     freeaddrinfo(servinfo); // All done with this structure
 
     return sockfd;
@@ -12,6 +12,10 @@
 #ifndef BUILTINS_H
 #define BUILTINS_H
 
+/* What connect and attach ask for, both unless -r; a relay asking for neither can run on the zero-copy engines */
+#define RELAY_ASK_FRAMED 0x01       // signals, resizes and keepalives as control frames, and channels
+#define RELAY_ASK_COMPRESSED 0x02   // deflated output
+
 /* Function Declarations */
 /**
  * @brief Changes the current working directory to the specified path
@@ -35,12 +39,39 @@ void pwd();
  *
  * @param hostname The server's hostname or IP address.
  * @param port The server's port number.
+ * @param asked RELAY_ASK_FRAMED and RELAY_ASK_COMPRESSED, kept for resuming the session.
  */
-void connect_to_server(char *hostname, const int port);
+void connect_to_server(char *hostname, const int port, const int asked);
+
+/**
+ * Attaches to a session left detached on a server, e.g. by another terminal.
+ *
+ * The server replays the session's recent output first, so the screen
+ * shows where the shell is.
+ *
+ * @param hostname The server's hostname or IP address.
+ * @param port The server's port number.
+ * @param token The session token, printed when a session could not be resumed.
+ * @param asked RELAY_ASK_FRAMED and RELAY_ASK_COMPRESSED.
+ */
+void attach_session(char *hostname, const int port, const char *token, const int asked);
 
 /**
  * Relays data between stdin and the connected socket.
  *
+ * If the connection drops, the session is resumed on a new connection
+ * when the server issued a token for it. On a framed relay CTRL-C, CTRL-Z
+ * and terminal resizes are passed to the remote shell as control frames,
+ * and a keepalive after a silent interval detects a link that died quietly.
+ *
+ * When the server offers channels, a line of CTRL-] c opens another remote
+ * shell, CTRL-] 0-7 or CTRL-] n switch between them and CTRL-] CTRL-] types
+ * a CTRL-]. Output of the shells not on screen is held until they are shown.
+ *
+ * With EGG_ECHO_TRACE set to a file, each line typed is timed to the first
+ * output back; the histograms are summarised when the relay ends and
+ * appended to the file as JSON, to set against the server's -e trace.
+ *
  * @param socket The connected socket file descriptor.
  */
 void relay_data(int socket);
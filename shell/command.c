@@ -350,17 +350,56 @@ int handle_builtin_commands(Command *cmd) {
     } else if (strcmp(cmd->command_name, "connect") == 0) {
         handle_connect_command(cmd);
         return 1;
+    } else if (strcmp(cmd->command_name, "attach") == 0) {
+        handle_attach_command(cmd);
+        return 1;
     }
     return 0;
 }
 
+/**
+ * @brief Reads the -r option of connect and attach.
+ * @param first Receives the index of the first argument after it.
+ * @return RELAY_ASK_FRAMED and RELAY_ASK_COMPRESSED unless -r asked for neither, or -1 for an unknown option.
+ */
+static int relay_options(const Command *cmd, int *first) {
+    int asked = RELAY_ASK_FRAMED | RELAY_ASK_COMPRESSED;
+    for (*first = 1; *first < cmd->arg_count && cmd->args[*first][0] == '-'; (*first)++) {
+        for (const char *option = cmd->args[*first] + 1; *option != '\0'; option++) {
+            if (*option == 'r') {
+                asked = 0;
+            } else {
+                return -1;
+            }
+        }
+    }
+    return asked;
+}
+
 void handle_connect_command(Command *cmd) {
-    if (cmd->arg_count == 3) {
-        connect_to_server(cmd->args[1], atoi(cmd->args[2]));
-    } else if (cmd->arg_count == 2) {
-        connect_to_server(cmd->args[1], 40210);
+    int first;
+    const int asked = relay_options(cmd, &first);
+    const int left = cmd->arg_count - first;
+
+    if (asked != -1 && left == 2) {
+        connect_to_server(cmd->args[first], atoi(cmd->args[first + 1]), asked);
+    } else if (asked != -1 && left == 1) {
+        connect_to_server(cmd->args[first], 40210, asked);
+    } else {
+        fprintf(stderr, "Usage: connect [-r] <hostname> || connect [-r] <hostname> <port>\n"
+                        "  -r  raw relay: no control frames, keepalives, channels or compression, so the server\n"
+                        "      can relay on its zero-copy engines; CTRL-C, CTRL-Z and resizes stay local\n");
+    }
+}
+
+void handle_attach_command(Command *cmd) {
+    int first;
+    const int asked = relay_options(cmd, &first);
+
+    if (asked != -1 && cmd->arg_count - first == 3) {
+        attach_session(cmd->args[first], atoi(cmd->args[first + 1]), cmd->args[first + 2], asked);
     } else {
-        fprintf(stderr, "Usage: connect <hostname> || connect <hostname> <port>\n");
+        fprintf(stderr, "Usage: attach [-r] <hostname> <port> <token>\n");
     }
 }
 
@@ -91,6 +91,12 @@ int handle_builtin_commands(Command *cmd);
  */
 void handle_connect_command(Command *cmd);
 
+/**
+ * @brief Handles attaching to a detached session on the specified server.
+ * @param cmd Command structure containing the hostname, port and session token
+ */
+void handle_attach_command(Command *cmd);
+
 /**
  * @brief Waits for all child processes
  * @param is_background Flag indicating if the command should run in the background